@@ -166,6 +166,23 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             if (params.n_threads_batch <= 0) {
                 params.n_threads_batch = std::thread::hardware_concurrency();
             }
+        } else if (arg == "--wait-policy") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "default") { params.wait_policy = GGML_WAIT_POLICY_DEFAULT; }
+            else if (value == "spin")    { params.wait_policy = GGML_WAIT_POLICY_SPIN; }
+            else if (value == "yield")   { params.wait_policy = GGML_WAIT_POLICY_YIELD; }
+            else if (value == "sleep")   { params.wait_policy = GGML_WAIT_POLICY_SLEEP; }
+            else { invalid_param = true; break; }
+        } else if (arg == "--wait-spin") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.wait_n_spin = std::stoi(argv[i]);
         } else if (arg == "-p" || arg == "--prompt") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -279,6 +296,10 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             params.yarn_beta_slow = std::stof(argv[i]);
         } else if (arg == "--memory-f32") {
             params.memory_f16 = false;
+        } else if (arg == "--flash-attn" || arg == "-fa") {
+            params.flash_attn = true;
+        } else if (arg == "--prefix-cache") {
+            params.prefix_cache = true;
         } else if (arg == "--top-p") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -487,6 +508,24 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             params.interactive = true;
         } else if (arg == "--embedding") {
             params.embedding = true;
+        } else if (arg == "--pooling") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "none") { params.pooling_type = LLAMA_POOLING_NONE; }
+            else if (value == "mean") { params.pooling_type = LLAMA_POOLING_MEAN; }
+            else if (value == "cls")  { params.pooling_type = LLAMA_POOLING_CLS; }
+            else if (value == "last") { params.pooling_type = LLAMA_POOLING_LAST; }
+            else { invalid_param = true; break; }
+        } else if (arg == "--embd-separator") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.embd_sep = argv[i];
+            process_escapes(params.embd_sep);
         } else if (arg == "--interactive-first") {
             params.interactive_first = true;
         } else if (arg == "-ins" || arg == "--instruct") {
@@ -567,6 +606,18 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
 #endif // GGML_USE_CUBLAS
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--repack") {
+            params.repack = true;
+        } else if (arg == "--huge-pages") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            std::string value(argv[i]);
+            /**/ if (value == "none")    { params.huge_pages = LLAMA_HUGE_PAGES_NONE; }
+            else if (value == "thp")     { params.huge_pages = LLAMA_HUGE_PAGES_THP; }
+            else if (value == "hugetlb") { params.huge_pages = LLAMA_HUGE_PAGES_HUGETLB; }
+            else { invalid_param = true; break; }
         } else if (arg == "--numa") {
             params.numa = true;
         } else if (arg == "--verbose-prompt") {
@@ -587,6 +638,12 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
             if (params.logdir.back() != DIRECTORY_SEPARATOR) {
                 params.logdir += DIRECTORY_SEPARATOR;
             }
+        } else if (arg == "--trace") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.trace_file = argv[i];
         } else if (arg == "--perplexity" || arg == "--all-logits") {
             params.logits_all = true;
         } else if (arg == "--ppl-stride") {
@@ -706,6 +763,10 @@ bool gpt_params_parse_ex(int argc, char ** argv, gpt_params & params) {
         throw std::invalid_argument("error: --prompt-cache-all not supported in interactive mode yet\n");
     }
 
+    if (!params.model_draft.empty() && sparams.cfg_scale > 1.0f) {
+        throw std::invalid_argument("error: --model-draft not supported with --cfg-scale yet\n");
+    }
+
     if (params.escape) {
         process_escapes(params.prompt);
         process_escapes(params.input_prefix);
@@ -739,6 +800,10 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  -t N, --threads N     number of threads to use during generation (default: %d)\n", params.n_threads);
     printf("  -tb N, --threads-batch N\n");
     printf("                        number of threads to use during batch and prompt processing (default: same as --threads)\n");
+    printf("  --wait-policy {default,spin,yield,sleep}\n");
+    printf("                        how compute threads wait for each other: spin keeps the cores busy for the lowest latency,\n");
+    printf("                        yield and sleep give up the core after --wait-spin polls (default: spin, or yield with BLAS)\n");
+    printf("  --wait-spin N         number of polls before a waiting thread yields or sleeps (default: 0 = built-in)\n");
     printf("  -p PROMPT, --prompt PROMPT\n");
     printf("                        prompt to start generation with (default: empty)\n");
     printf("  -e, --escape          process prompt escapes sequences (\\n, \\r, \\t, \\', \\\", \\\\)\n");
@@ -794,6 +859,8 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --no-penalize-nl      do not penalize newline token\n");
     printf("  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
     printf("                        not recommended: doubles context memory required and no measurable increase in quality\n");
+    printf("  -fa, --flash-attn     compute attention with the fused CPU kernel instead of separate KQ and softmax ops (default: disabled)\n");
+    printf("  --prefix-cache        keep the KV cache of the prompts to reuse their longest common prefix (default: disabled)\n");
     printf("  --temp N              temperature (default: %.1f)\n", (double)sparams.temp);
     printf("  --logits-all          return logits for all tokens in the batch (default: disabled)\n");
     printf("  --hellaswag           compute HellaSwag score over random tasks from datafile supplied with -f\n");
@@ -814,6 +881,14 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     if (llama_mmap_supported()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --repack              interleave the rows of Q4_0/Q8_0 weights at load time for faster CPU inference (implies --no-mmap)\n");
+    printf("  --huge-pages {none,thp,hugetlb}\n");
+    printf("                        back the weights, KV cache and compute buffer with huge pages (default: none, implies --no-mmap)\n");
+    printf("                        thp: transparent huge pages, hugetlb: pages reserved with vm.nr_hugepages\n");
+    printf("  --pooling {none,mean,cls,last}\n");
+    printf("                        pooling of the embeddings of the tokens of each sequence in embedding mode (default: depends on the program)\n");
+    printf("  --embd-separator STRING\n");
+    printf("                        split the prompt into inputs embedded separately, escapes are processed, e.g. \"\\n\" (default: the whole prompt is one input)\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
@@ -842,6 +917,7 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("                        draft model for speculative decoding (default: %s)\n", params.model.c_str());
     printf("  -ld LOGDIR, --logdir LOGDIR\n");
     printf("                        path under which to save YAML logs (no logging if unset)\n");
+    printf("  --trace FNAME         save a trace of the CPU graph computations to FNAME (Chrome trace event format)\n");
     printf("\n");
 #ifndef LOG_DISABLE_LOGS
     log_print_usage();
@@ -892,6 +968,8 @@ struct llama_model_params llama_model_params_from_gpt_params(const gpt_params &
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
     mparams.use_mlock       = params.use_mlock;
+    mparams.repack          = params.repack;
+    mparams.huge_pages      = params.huge_pages;
 
     return mparams;
 }
@@ -903,11 +981,19 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     cparams.n_batch           = params.n_batch;
     cparams.n_threads         = params.n_threads;
     cparams.n_threads_batch   = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+    cparams.wait_policy       = params.wait_policy;
+    cparams.wait_n_spin       = params.wait_n_spin;
+    cparams.huge_pages        = params.huge_pages;
     cparams.mul_mat_q         = params.mul_mat_q;
     cparams.seed              = params.seed;
     cparams.f16_kv            = params.memory_f16;
     cparams.logits_all        = params.logits_all;
     cparams.embedding         = params.embedding;
+    if (params.pooling_type >= 0) {
+        cparams.pooling_type  = params.pooling_type;
+    }
+    cparams.flash_attn        = params.flash_attn;
+    cparams.prefix_cache      = params.prefix_cache;
     cparams.rope_scaling_type = params.rope_scaling_type;
     cparams.rope_freq_base    = params.rope_freq_base;
     cparams.rope_freq_scale   = params.rope_freq_scale;
@@ -990,6 +1076,10 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
         llama_reset_timings(lctx);
     }
 
+    if (!params.trace_file.empty()) {
+        llama_set_trace(lctx, 1 << 20);
+    }
+
     return std::make_tuple(model, lctx);
 }
 
@@ -1283,11 +1373,13 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "grammar-file: # never logged, see grammar instead. Can still be specified for input.\n");
     fprintf(stream, "hellaswag: %s # default: false\n", params.hellaswag ? "true" : "false");
     fprintf(stream, "hellaswag_tasks: %zu # default: 400\n", params.hellaswag_tasks);
+    fprintf(stream, "huge_pages: %d # default: 0\n", params.huge_pages);
 
     const auto logit_bias_eos = sparams.logit_bias.find(llama_token_eos(llama_get_model(lctx)));
     const bool ignore_eos = logit_bias_eos != sparams.logit_bias.end() && logit_bias_eos->second == -INFINITY;
     fprintf(stream, "ignore_eos: %s # default: false\n", ignore_eos ? "true" : "false");
 
+    dump_string_yaml_multiline(stream, "embd_separator", params.embd_sep.c_str());
     dump_string_yaml_multiline(stream, "in_prefix", params.input_prefix.c_str());
     fprintf(stream, "in_prefix_bos: %s # default: false\n", params.input_prefix_bos ? "true" : "false");
     dump_string_yaml_multiline(stream, "in_suffix", params.input_prefix.c_str());
@@ -1332,12 +1424,15 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "n_gpu_layers: %d # default: -1\n", params.n_gpu_layers);
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", sparams.n_probs);
+    fprintf(stream, "flash_attn: %s # default: false\n", params.flash_attn ? "true" : "false");
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
     fprintf(stream, "no_mul_mat_q: %s # default: false\n", !params.mul_mat_q ? "true" : "false");
     fprintf(stream, "no_penalize_nl: %s # default: false\n", !sparams.penalize_nl ? "true" : "false");
     fprintf(stream, "numa: %s # default: false\n", params.numa ? "true" : "false");
+    fprintf(stream, "pooling_type: %d # default: -1\n", params.pooling_type);
     fprintf(stream, "ppl_output_type: %d # default: 0\n", params.ppl_output_type);
     fprintf(stream, "ppl_stride: %d # default: 0\n", params.ppl_stride);
+    fprintf(stream, "prefix_cache: %s # default: false\n", params.prefix_cache ? "true" : "false");
     fprintf(stream, "presence_penalty: %f # default: 0.0\n", sparams.penalty_present);
     dump_string_yaml_multiline(stream, "prompt", params.prompt.c_str());
     fprintf(stream, "prompt_cache: %s\n", params.path_prompt_cache.c_str());
@@ -1346,6 +1441,7 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     dump_vector_int_yaml(stream, "prompt_tokens", prompt_tokens);
     fprintf(stream, "random_prompt: %s # default: false\n", params.random_prompt ? "true" : "false");
     fprintf(stream, "repeat_penalty: %f # default: 1.1\n", sparams.penalty_repeat);
+    fprintf(stream, "repack: %s # default: false\n", params.repack ? "true" : "false");
 
     fprintf(stream, "reverse_prompt:\n");
     for (std::string ap : params.antiprompt) {
@@ -1372,7 +1468,10 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "threads: %d # default: %d\n", params.n_threads, std::thread::hardware_concurrency());
     fprintf(stream, "top_k: %d # default: 40\n", sparams.top_k);
     fprintf(stream, "top_p: %f # default: 0.95\n", sparams.top_p);
+    fprintf(stream, "trace: %s # default: unset (no tracing)\n", params.trace_file.c_str());
     fprintf(stream, "min_p: %f # default: 0.0\n", sparams.min_p);
     fprintf(stream, "typical_p: %f # default: 1.0\n", sparams.typical_p);
     fprintf(stream, "verbose_prompt: %s # default: false\n", params.verbose_prompt ? "true" : "false");
+    fprintf(stream, "wait_policy: %d # default: 0\n", params.wait_policy);
+    fprintf(stream, "wait_n_spin: %d # default: 0\n", params.wait_n_spin);
 }
@@ -47,6 +47,10 @@ struct gpt_params {
 
     int32_t n_threads                       = get_num_physical_cores();
     int32_t n_threads_batch                 = -1;    // number of threads to use for batch processing (-1 = use n_threads)
+    int32_t wait_policy                     = 0;     // how idle compute threads wait (enum ggml_wait_policy)
+    int32_t huge_pages                      = 0;     // huge pages for the weights and buffers (enum llama_huge_pages)
+    int32_t pooling_type                    = -1;    // pooled embeddings of each sequence (enum llama_pooling_type, -1 = program default)
+    int32_t wait_n_spin                     = 0;     // polls before an idle compute thread yields or sleeps (0 = default)
     int32_t n_predict                       = -1;    // new tokens to predict
     int32_t n_ctx                           = 512;   // context size
     int32_t n_batch                         = 512;   // batch size for prompt processing (must be >=32 to use BLAS)
@@ -83,8 +87,10 @@ struct gpt_params {
     std::string path_prompt_cache = "";  // path to file for saving/loading prompt eval state
     std::string input_prefix      = "";  // string to prefix user inputs with
     std::string input_suffix      = "";  // string to suffix user inputs with
+    std::string embd_sep          = "";  // separator of the inputs embedded separately (empty = the whole prompt is one input)
     std::vector<std::string> antiprompt; // string upon seeing which more user input is prompted
     std::string logdir            = "";  // directory in which to save YAML log files
+    std::string trace_file        = "";  // file in which to save the trace of the graph computations
 
     // TODO: avoid tuple, use struct
     std::vector<std::tuple<std::string, float>> lora_adapter; // lora adapter path with user defined scale
@@ -99,6 +105,8 @@ struct gpt_params {
 
     bool mul_mat_q         = true;  // if true, use mul_mat_q kernels instead of cuBLAS
     bool memory_f16        = true;  // use f16 instead of f32 for memory kv
+    bool flash_attn        = false; // use the fused attention kernel on the CPU
+    bool prefix_cache      = false; // share the KV cells of the prompts with the same prefix between sequences
     bool random_prompt     = false; // do not randomize prompt if none provided
     bool use_color         = false; // use color to distinguish generations and inputs
     bool interactive       = false; // interactive mode
@@ -118,6 +126,7 @@ struct gpt_params {
     bool logits_all        = false; // return logits for all tokens in the batch
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool repack            = false; // interleave the rows of the weights at load time (disables mmap)
     bool numa              = false; // attempt optimizations that help on some NUMA systems
     bool verbose_prompt    = false; // print prompt tokens before generation
     bool infill            = false; // use infill mode
@@ -212,6 +212,9 @@ llama_token llama_sampling_sample(
         }
     }
 
+    // keep only the candidates that were left by the samplers
+    cur.resize(cur_p.size);
+
     return id;
 }
 
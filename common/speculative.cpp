@@ -0,0 +1,436 @@
+#include "speculative.h"
+
+#include "common.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define SPEC_VOCAB_MAX_SIZE_DIFFERENCE  100
+#define SPEC_VOCAB_CHECK_START_TOKEN_ID 5
+
+bool llama_speculative_are_compatible(
+        const struct llama_context * ctx_tgt,
+        const struct llama_context * ctx_dft) {
+    const struct llama_model * model_tgt = llama_get_model(ctx_tgt);
+    const struct llama_model * model_dft = llama_get_model(ctx_dft);
+
+    const int n_vocab_tgt = llama_n_vocab(model_tgt);
+    const int n_vocab_dft = llama_n_vocab(model_dft);
+
+    const int vocab_diff = std::abs(n_vocab_tgt - n_vocab_dft);
+
+    if (vocab_diff > SPEC_VOCAB_MAX_SIZE_DIFFERENCE) {
+        fprintf(stderr, "%s: draft model vocab must closely match target model to use speculation but ", __func__);
+        fprintf(stderr, "target vocab size %d does not match draft vocab size %d - difference %d, max allowed %d\n",
+                n_vocab_tgt, n_vocab_dft, vocab_diff, SPEC_VOCAB_MAX_SIZE_DIFFERENCE);
+        return false;
+    }
+
+    for (int i = SPEC_VOCAB_CHECK_START_TOKEN_ID; i < std::min(n_vocab_tgt, n_vocab_dft); ++i) {
+        const char * token_text_tgt = llama_token_get_text(model_tgt, i);
+        const char * token_text_dft = llama_token_get_text(model_dft, i);
+        if (std::strcmp(token_text_tgt, token_text_dft) != 0) {
+            fprintf(stderr, "%s: draft model vocab must match target model to use speculation but ", __func__);
+            fprintf(stderr, "token %d content differs - target '%s', draft '%s'\n", i, token_text_tgt, token_text_dft);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct llama_speculative * llama_speculative_init(
+        struct llama_context * ctx_tgt,
+        struct llama_context * ctx_dft,
+        const struct llama_speculative_params & params) {
+    struct llama_speculative * result = new llama_speculative();
+
+    result->params  = params;
+    result->ctx_tgt = ctx_tgt;
+    result->ctx_dft = ctx_dft;
+
+    result->ctx_sampling_dft = llama_sampling_init(llama_sampling_params());
+
+    result->batch_dft = llama_batch_init(std::max(params.n_batch, 1), 0, 1);
+    result->batch_tgt = llama_batch_init(params.n_draft + 1, 0, 1);
+
+    result->rng = std::mt19937(params.seed);
+
+    return result;
+}
+
+void llama_speculative_free(struct llama_speculative * spec) {
+    llama_sampling_free(spec->ctx_sampling_dft);
+
+    if (spec->ctx_sampling_step) {
+        llama_sampling_free(spec->ctx_sampling_step);
+    }
+
+    llama_batch_free(spec->batch_dft);
+    llama_batch_free(spec->batch_tgt);
+
+    delete spec;
+}
+
+// probability of a token in the candidates of the last sampled token, 0 if it was removed by the samplers
+static float llama_speculative_p(const std::vector<llama_token_data> & cur, llama_token id) {
+    for (const auto & c : cur) {
+        if (c.id == id) {
+            return c.p;
+        }
+    }
+
+    return 0.0f;
+}
+
+const std::vector<llama_token> & llama_speculative_draft(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<llama_token> & prompt,
+        llama_token id_last,
+        int n_draft) {
+    const int64_t t_start_us = ggml_time_us();
+
+    llama_context * ctx_dft = spec->ctx_dft;
+
+    const llama_seq_id seq_id = spec->params.seq_id;
+
+    auto & prompt_dft = spec->prompt_dft;
+    auto & batch      = spec->batch_dft;
+
+    spec->draft.clear();
+    spec->draft_cur.clear();
+
+    // reuse the part of the sequence that is already in the KV cache of the draft model
+    size_t n_keep = 0;
+    while (n_keep < prompt_dft.size() && n_keep < prompt.size() && prompt_dft[n_keep] == prompt[n_keep]) {
+        n_keep++;
+    }
+
+    llama_kv_cache_seq_rm(ctx_dft, seq_id, n_keep, -1);
+    prompt_dft.resize(n_keep);
+
+    prompt_dft.insert(prompt_dft.end(), prompt.begin() + n_keep, prompt.end());
+    prompt_dft.push_back(id_last);
+
+    spec->n_past_dft = prompt_dft.size();
+
+    // evaluate the rest of the sequence, the logits are needed only for id_last
+    for (size_t i = n_keep; i < prompt_dft.size(); i += batch.n_tokens) {
+        llama_batch_clear(batch);
+
+        for (size_t j = i; j < prompt_dft.size() && batch.n_tokens < spec->params.n_batch; ++j) {
+            llama_batch_add(batch, prompt_dft[j], j, { seq_id }, j == prompt_dft.size() - 1);
+        }
+
+        if (llama_decode(ctx_dft, batch) != 0) {
+            fprintf(stderr, "%s: failed to evaluate the sequence with the draft model\n", __func__);
+
+            // keep the tokens evaluated so far
+            llama_kv_cache_seq_rm(ctx_dft, seq_id, i, -1);
+            prompt_dft.resize(i);
+            spec->n_past_dft = i;
+
+            return spec->draft;
+        }
+    }
+
+    // the draft model samples like the target model, greedy sampling computes the probabilities too
+    llama_sampling_context * ctx_sampling_dft = spec->ctx_sampling_dft;
+
+    ctx_sampling_dft->params = ctx_sampling->params;
+    if (ctx_sampling_dft->params.temp <= 0.0f) {
+        ctx_sampling_dft->params.temp = -1.0f;
+    }
+    ctx_sampling_dft->mirostat_mu = ctx_sampling->mirostat_mu;
+
+    llama_sampling_cp(ctx_sampling, ctx_sampling_dft);
+
+    int32_t idx = batch.n_tokens - 1;
+
+    for (int i = 0; i < n_draft; ++i) {
+        const llama_token id = llama_sampling_sample(ctx_sampling_dft, ctx_dft, NULL, idx);
+
+        const float p = llama_speculative_p(ctx_sampling_dft->cur, id);
+
+        LOG("draft %d: token %6d (%.3f) '%s'\n", i, id, p, llama_token_to_piece(ctx_dft, id).c_str());
+
+        if (p < spec->params.p_min) {
+            break;
+        }
+
+        spec->draft.push_back(id);
+
+        // the distribution of the draft model is needed only for the acceptance tests of non-greedy sampling
+        if (ctx_sampling->params.temp > 0.0f) {
+            spec->draft_cur.push_back(ctx_sampling_dft->cur);
+        }
+
+        if (id == llama_token_eos(llama_get_model(ctx_dft)) || i == n_draft - 1) {
+            break;
+        }
+
+        llama_sampling_accept(ctx_sampling_dft, ctx_dft, id, true);
+
+        llama_batch_clear(batch);
+        llama_batch_add(batch, id, prompt_dft.size(), { seq_id }, true);
+
+        if (llama_decode(ctx_dft, batch) != 0) {
+            break;
+        }
+
+        prompt_dft.push_back(id);
+
+        idx = 0;
+    }
+
+    spec->t_draft_us += ggml_time_us() - t_start_us;
+
+    return spec->draft;
+}
+
+void llama_speculative_discard(
+        struct llama_speculative * spec,
+        int32_t p0,
+        int32_t p1) {
+    auto & prompt_dft = spec->prompt_dft;
+
+    const int32_t n = prompt_dft.size();
+    if (p0 >= n) {
+        return;
+    }
+
+    p1 = std::min(p1, n);
+
+    llama_kv_cache_seq_rm   (spec->ctx_dft, spec->params.seq_id, p0, p1);
+    llama_kv_cache_seq_shift(spec->ctx_dft, spec->params.seq_id, p1, n, p0 - p1);
+
+    prompt_dft.erase(prompt_dft.begin() + p0, prompt_dft.begin() + p1);
+}
+
+std::vector<llama_token> llama_speculative_verify(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<int32_t> & idxs) {
+    llama_context * ctx_tgt = spec->ctx_tgt;
+
+    const auto & draft = spec->draft;
+
+    GGML_ASSERT(idxs.size() == draft.size() + 1);
+
+    const bool greedy = ctx_sampling->params.temp <= 0.0f;
+
+    std::vector<llama_token> result;
+
+    for (size_t i = 0; i <= draft.size(); ++i) {
+        llama_token id = llama_sampling_sample(ctx_sampling, ctx_tgt, NULL, idxs[i]);
+
+        if (i < draft.size()) {
+            bool accept = id == draft[i];
+
+            if (!greedy) {
+                // accept with probability min(1, p/q), otherwise sample from max(0, p - q)
+                const auto & cur_tgt = ctx_sampling->cur;
+                const auto & cur_dft = spec->draft_cur[i];
+
+                const float p = llama_speculative_p(cur_tgt, draft[i]);
+                const float q = llama_speculative_p(cur_dft, draft[i]);
+
+                accept = std::uniform_real_distribution<float>(0.0f, 1.0f)(spec->rng)*q < p;
+
+                if (!accept) {
+                    std::vector<float> q_all(llama_n_vocab(llama_get_model(ctx_tgt)), 0.0f);
+                    for (const auto & c : cur_dft) {
+                        q_all[c.id] = c.p;
+                    }
+
+                    std::vector<float> residual(cur_tgt.size());
+                    float sum = 0.0f;
+
+                    for (size_t j = 0; j < cur_tgt.size(); ++j) {
+                        residual[j] = std::max(0.0f, cur_tgt[j].p - q_all[cur_tgt[j].id]);
+                        sum += residual[j];
+                    }
+
+                    // p == q up to rounding: id is a sample of p
+                    if (sum > 0.0f) {
+                        std::discrete_distribution<> dist(residual.begin(), residual.end());
+                        id = cur_tgt[dist(spec->rng)].id;
+                    }
+                }
+            }
+
+            if (accept) {
+                id = draft[i];
+            }
+
+            LOG("verify %zu: draft %6d, target %6d - %s\n", i, draft[i], id, accept ? "accepted" : "rejected");
+
+            llama_sampling_accept(ctx_sampling, ctx_tgt, id, true);
+            result.push_back(id);
+
+            if (!accept) {
+                break;
+            }
+
+            spec->n_accept++;
+        } else {
+            llama_sampling_accept(ctx_sampling, ctx_tgt, id, true);
+            result.push_back(id);
+        }
+    }
+
+    // the draft model keeps id_last and the accepted tokens, the next draft continues from there
+    const size_t n_keep = std::min(spec->prompt_dft.size(), spec->n_past_dft + result.size() - 1);
+
+    llama_kv_cache_seq_rm(spec->ctx_dft, spec->params.seq_id, n_keep, -1);
+    spec->prompt_dft.resize(n_keep);
+
+    spec->n_step    += 1;
+    spec->n_drafted += draft.size();
+    spec->n_gen     += result.size();
+
+    return result;
+}
+
+std::vector<llama_token> llama_speculative_gen(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<llama_token> & prompt,
+        llama_token id_last) {
+    const int64_t t_start_us = ggml_time_us();
+
+    llama_context * ctx_tgt = spec->ctx_tgt;
+
+    const llama_seq_id seq_id = spec->params.seq_id;
+    const int          n_past = prompt.size();
+
+    // keep the draft within the context and the batch of the target model
+    const int n_draft = std::min({ spec->params.n_draft, llama_n_ctx(ctx_tgt) - n_past - 1, spec->params.n_batch - 1 });
+
+    const auto & draft = llama_speculative_draft(spec, ctx_sampling, prompt, id_last, n_draft);
+
+    auto & batch = spec->batch_tgt;
+
+    llama_batch_clear(batch);
+    llama_batch_add(batch, id_last, n_past, { seq_id }, true);
+
+    std::vector<int32_t> idxs(1, 0);
+
+    for (size_t i = 0; i < draft.size(); ++i) {
+        idxs.push_back(batch.n_tokens);
+        llama_batch_add(batch, draft[i], n_past + 1 + i, { seq_id }, true);
+    }
+
+    if (llama_decode(ctx_tgt, batch) != 0) {
+        fprintf(stderr, "%s: failed to evaluate the draft with the target model\n", __func__);
+        return {};
+    }
+
+    std::vector<llama_token> result = llama_speculative_verify(spec, ctx_sampling, idxs);
+
+    // id_last and the accepted tokens stay in the KV cache
+    llama_kv_cache_seq_rm(ctx_tgt, seq_id, n_past + result.size(), -1);
+
+    spec->t_gen_us += ggml_time_us() - t_start_us;
+
+    return result;
+}
+
+bool llama_speculative_eval(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<llama_token> & prompt,
+        const std::vector<llama_token> & tokens,
+        bool sample_next) {
+    const int n_past = prompt.size();
+
+    if (spec->queue_in_kv) {
+        GGML_ASSERT(tokens.size() == 1);
+
+        // evaluated with the draft of the last step
+        spec->queue_in_kv = false;
+        spec->n_past      = n_past + 1;
+        spec->i_logits   += 1;
+
+        return true;
+    }
+
+    if (sample_next && tokens.size() == 1) {
+        if (!spec->ctx_sampling_step) {
+            spec->ctx_sampling_step = llama_sampling_init(ctx_sampling->params);
+        }
+
+        llama_sampling_cp(ctx_sampling, spec->ctx_sampling_step);
+
+        spec->queue = llama_speculative_gen(spec, ctx_sampling, prompt, tokens[0]);
+        if (spec->queue.empty()) {
+            return false;
+        }
+
+        llama_sampling_cp(spec->ctx_sampling_step, ctx_sampling);
+
+        spec->n_past   = n_past + 1;
+        spec->i_logits = 0;
+
+        return true;
+    }
+
+    for (size_t i = 0; i < tokens.size(); i += spec->params.n_batch) {
+        const int n_eval = std::min<int>(tokens.size() - i, spec->params.n_batch);
+
+        if (llama_decode(spec->ctx_tgt, llama_batch_get_one(const_cast<llama_token *>(&tokens[i]), n_eval, n_past + i, spec->params.seq_id)) != 0) {
+            fprintf(stderr, "%s: failed to evaluate the tokens with the target model\n", __func__);
+            return false;
+        }
+    }
+
+    spec->n_past   = n_past + tokens.size();
+    spec->i_logits = 0;
+
+    return true;
+}
+
+llama_token llama_speculative_sample(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling) {
+    if (spec->queue.empty()) {
+        return llama_sampling_sample(ctx_sampling, spec->ctx_tgt, NULL, spec->i_logits);
+    }
+
+    const llama_token id = spec->queue.front();
+    spec->queue.erase(spec->queue.begin());
+
+    spec->queue_in_kv = !spec->queue.empty();
+
+    return id;
+}
+
+void llama_speculative_clear(struct llama_speculative * spec) {
+    if (spec->queue.empty()) {
+        return;
+    }
+
+    llama_kv_cache_seq_rm(spec->ctx_tgt, spec->params.seq_id, spec->n_past + (spec->queue_in_kv ? 1 : 0), -1);
+
+    spec->queue.clear();
+}
+
+std::string llama_speculative_print_stats(const struct llama_speculative * spec) {
+    char result[512];
+
+    snprintf(result, sizeof(result),
+            "drafted = %d, accepted = %d, acceptance rate = %.3f%%, %.3f tokens per target evaluation, draft time = %.2f ms",
+            spec->n_drafted, spec->n_accept, 100.0*spec->n_accept/std::max(spec->n_drafted, 1),
+            (double) spec->n_gen/std::max(spec->n_step, 1), spec->t_draft_us/1e3);
+
+    std::string res = result;
+
+    if (spec->t_gen_us > 0) {
+        snprintf(result, sizeof(result), ", %d tokens generated at %.2f tokens per second",
+                spec->n_gen, 1e6*spec->n_gen/spec->t_gen_us);
+        res += result;
+    }
+
+    return res;
+}
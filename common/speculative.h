@@ -0,0 +1,147 @@
+#pragma once
+
+#include "llama.h"
+
+#include "sampling.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+// speculative decoding: a small draft model proposes the next tokens of a sequence, the target model evaluates
+// them in a single batch and keeps the longest prefix that agrees with its own sampling distribution
+//
+// with greedy sampling (temp <= 0), a drafted token is accepted if it is the token the target model would pick
+// otherwise, a drafted token x is accepted with probability min(1, p(x)/q(x)), where p and q are the distributions
+// of the target and the draft model after the samplers - when it is rejected, the next token is sampled from
+// max(0, p - q), so that the generated tokens follow the distribution of the target model
+
+// speculative decoding parameters
+typedef struct llama_speculative_params {
+    int32_t      n_draft = 16;                 // maximum number of tokens to draft per step
+    int32_t      n_batch = 512;                // batch size of the contexts, llama_speculative_gen drafts at most n_batch - 1 tokens
+    float        p_min   = 0.5f;               // stop drafting when the draft model samples a less probable token
+    llama_seq_id seq_id  = 0;                  // sequence of the draft and target contexts
+    uint32_t     seed    = LLAMA_DEFAULT_SEED; // seed of the acceptance tests
+} llama_speculative_params;
+
+struct llama_speculative {
+    llama_speculative_params params;
+
+    llama_context * ctx_tgt;
+    llama_context * ctx_dft;
+
+    // follows the sampling context of the target model
+    llama_sampling_context * ctx_sampling_dft;
+
+    llama_batch batch_dft;
+    llama_batch batch_tgt; // used by llama_speculative_gen
+
+    // tokens in the KV cache of the draft model
+    std::vector<llama_token> prompt_dft;
+
+    // number of tokens of prompt_dft up to id_last, the drafted tokens follow
+    size_t n_past_dft = 0;
+
+    // the drafted tokens and the candidates of the draft model that they were sampled from
+    std::vector<llama_token>                   draft;
+    std::vector<std::vector<llama_token_data>> draft_cur;
+
+    std::mt19937 rng;
+
+    // llama_speculative_eval and llama_speculative_sample: the tokens generated by the last step that are not
+    // sampled yet, all but the last one are in the KV cache of the target context
+    std::vector<llama_token> queue;
+
+    bool    queue_in_kv = false; // the last sampled token is in the KV cache of the target context already
+    int32_t n_past      = 0;     // number of evaluated tokens of the sequence in the target context
+    int32_t i_logits    = 0;     // index of the logits of the last evaluated token in the last batch
+
+    // the sampling context before the verification, the generated tokens are accepted again when they are sampled
+    llama_sampling_context * ctx_sampling_step = nullptr;
+
+    // stats
+    int32_t n_step    = 0; // number of verified drafts
+    int32_t n_drafted = 0; // number of drafted tokens
+    int32_t n_accept  = 0; // number of accepted drafted tokens
+    int32_t n_gen     = 0; // number of generated tokens, the accepted ones and one from the target model per step
+
+    int64_t t_draft_us = 0;
+    int64_t t_gen_us   = 0; // time spent in llama_speculative_gen
+};
+
+// check that the two models have the same vocabulary
+bool llama_speculative_are_compatible(
+        const struct llama_context * ctx_tgt,
+        const struct llama_context * ctx_dft);
+
+struct llama_speculative * llama_speculative_init(
+        struct llama_context * ctx_tgt,
+        struct llama_context * ctx_dft,
+        const struct llama_speculative_params & params);
+
+void llama_speculative_free(struct llama_speculative * spec);
+
+// draft up to n_draft tokens that follow id_last
+// prompt are the tokens of the sequence before id_last, the draft context is synced with them (the tokens that
+// are already in its KV cache are reused)
+// ctx_sampling is the sampling context of the target model, id_last must have been accepted in it
+const std::vector<llama_token> & llama_speculative_draft(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<llama_token> & prompt,
+        llama_token id_last,
+        int n_draft);
+
+// the tokens [p0, p1) of the sequence were removed and the next ones shifted in the target context (context shift)
+// do the same in the draft context, so that it does not evaluate the rest of the sequence again
+void llama_speculative_discard(
+        struct llama_speculative * spec,
+        int32_t p0,
+        int32_t p1);
+
+// sample the next tokens of the target model after the last draft
+// idxs[i] is the index of the logits of the i-th token of [id_last, draft...] in the last batch of the target context
+// returns the accepted drafted tokens, followed by one token sampled from the target model
+// all the returned tokens are accepted in ctx_sampling
+// the rejected tokens are removed from the KV cache of the draft context, the caller has to remove them from the
+// KV cache of the target context
+std::vector<llama_token> llama_speculative_verify(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<int32_t> & idxs);
+
+// one step with a single sequence: draft, evaluate id_last and the draft with the target model at position
+// prompt.size(), verify and remove the rejected tokens from the KV cache of the target context
+// returns the generated tokens, the last one is not evaluated yet (it is the id_last of the next step)
+// returns an empty vector if the target context failed to evaluate the batch
+std::vector<llama_token> llama_speculative_gen(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<llama_token> & prompt,
+        llama_token id_last);
+
+// evaluate the tokens that follow prompt in the target context, in batches of n_batch tokens
+// when the next token is sampled (sample_next) and tokens is the last sampled token, one step drafts the next tokens
+// and verifies them in the same batch: llama_speculative_sample returns the generated tokens one by one, and the ones
+// that are in the KV cache already are not evaluated again
+// returns false if the target context failed to evaluate a batch
+bool llama_speculative_eval(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling,
+        const std::vector<llama_token> & prompt,
+        const std::vector<llama_token> & tokens,
+        bool sample_next);
+
+// the next token: the next token generated by the last step, otherwise sampled from the logits of the last evaluated
+// token - the caller accepts it in ctx_sampling
+llama_token llama_speculative_sample(
+        struct llama_speculative * spec,
+        struct llama_sampling_context * ctx_sampling);
+
+// drop the generated tokens that are not sampled yet and remove them from the KV cache of the target context
+// (the last sampled token stays in it, it is not evaluated again)
+void llama_speculative_clear(struct llama_speculative * spec);
+
+// acceptance rate and effective speed
+std::string llama_speculative_print_stats(const struct llama_speculative * spec);
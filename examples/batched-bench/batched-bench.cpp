@@ -158,6 +158,14 @@ int main(int argc, char ** argv) {
     LOG_TEE("%s: n_kv_max = %d, is_pp_shared = %d, n_gpu_layers = %d, mmq = %d\n", __func__, n_kv_max, is_pp_shared, n_gpu_layers, mmq);
     LOG_TEE("\n");
 
+    // time of the KV cache sequence operations on the cache left by each run
+    struct seq_ops_timings {
+        int pp, tg, pl, n_kv;
+        float t_cp, t_shift, t_rm, t_keep; // ms
+    };
+
+    std::vector<seq_ops_timings> seq_ops;
+
     LOG_TEE("|%6s | %6s | %4s | %6s | %8s | %8s | %8s | %8s | %8s | %8s |\n", "PP",     "TG",     "B",    "N_KV",     "T_PP s",   "S_PP t/s", "T_TG s",   "S_TG t/s", "T s",      "S t/s");
     LOG_TEE("|%6s-|-%6s-|-%4s-|-%6s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|-%8s-|\n", "------", "------", "----", "------", "--------", "--------", "--------", "--------", "--------", "--------");
 
@@ -228,10 +236,45 @@ int main(int argc, char ** argv) {
                 const float speed    = n_kv / t;
 
                 LOG_TEE("|%6d | %6d | %4d | %6d | %8.3f | %8.2f | %8.3f | %8.2f | %8.3f | %8.2f |\n", pp, tg, pl, n_kv, t_pp, speed_pp, t_tg, speed_tg, t, speed);
+
+                // copy each sequence to a new one, shift and remove the generated tokens, keep the first sequence
+                seq_ops_timings ops = { pp, tg, pl, n_kv, 0.0f, 0.0f, 0.0f, 0.0f };
+
+                const auto t_cp_start = ggml_time_us();
+                for (int j = 0; j < pl && pl + j < LLAMA_MAX_SEQ; ++j) {
+                    llama_kv_cache_seq_cp(ctx, j, pl + j, -1, -1);
+                }
+                ops.t_cp = (ggml_time_us() - t_cp_start) / 1000.0f;
+
+                const auto t_shift_start = ggml_time_us();
+                for (int j = 0; j < pl; ++j) {
+                    llama_kv_cache_seq_shift(ctx, j, pp, -1, 1);
+                }
+                ops.t_shift = (ggml_time_us() - t_shift_start) / 1000.0f;
+
+                const auto t_rm_start = ggml_time_us();
+                for (int j = 0; j < pl; ++j) {
+                    llama_kv_cache_seq_rm(ctx, j, pp, -1);
+                }
+                ops.t_rm = (ggml_time_us() - t_rm_start) / 1000.0f;
+
+                const auto t_keep_start = ggml_time_us();
+                llama_kv_cache_seq_keep(ctx, 0);
+                ops.t_keep = (ggml_time_us() - t_keep_start) / 1000.0f;
+
+                seq_ops.push_back(ops);
             }
         }
     }
 
+    LOG_TEE("\n");
+    LOG_TEE("|%6s | %6s | %4s | %6s | %8s | %8s | %8s | %8s |\n", "PP",     "TG",     "B",    "N_KV",     "T_CP ms",  "T_SH ms",  "T_RM ms",  "T_KP ms");
+    LOG_TEE("|%6s-|-%6s-|-%4s-|-%6s-|-%8s-|-%8s-|-%8s-|-%8s-|\n", "------", "------", "----", "------", "--------", "--------", "--------", "--------");
+
+    for (const auto & ops : seq_ops) {
+        LOG_TEE("|%6d | %6d | %4d | %6d | %8.3f | %8.3f | %8.3f | %8.3f |\n", ops.pp, ops.tg, ops.pl, ops.n_kv, ops.t_cp, ops.t_shift, ops.t_rm, ops.t_keep);
+    }
+
     llama_print_timings(ctx);
 
     llama_batch_free(batch);
@@ -6,6 +6,7 @@
 #include <math.h>
 #include <cstring>
 #include <cstdio>
+#include <ctime>
 #include <cinttypes>
 #include <unordered_map>
 #include <queue>
@@ -20,9 +21,17 @@
 #pragma warning(disable: 4244 4267) // possible loss of data
 #endif
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+static void ggml_graph_compute_helper(
+        std::vector<uint8_t> & buf,
+                 ggml_cgraph * graph,
+                         int   n_threads,
+            ggml_threadpool  * threadpool  = nullptr,
+       enum ggml_wait_policy   wait_policy = GGML_WAIT_POLICY_DEFAULT) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
 
+    plan.threadpool  = threadpool;
+    plan.wait_policy = wait_policy;
+
     if (plan.work_size > 0) {
         buf.resize(plan.work_size);
         plan.work_data = buf.data();
@@ -271,4 +280,62 @@ int main(int argc, char ** argv)  {
     printf("\n");
     printf("Average%78.2f\n",gflops_sum/((double)benchmark_params.n_iterations));
     printf("=====================================================================================\n");
+
+    printf("\n------ Test 3 - Graph dispatch overhead: new threads vs thread pool\n");
+
+    // a single-token sized graph, where the cost of starting the threads is comparable to the compute
+    struct ggml_tensor * v2 = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, sizex, 1);
+    ggml_set_f32(v2, 2.0f);
+
+    struct ggml_tensor * q11xv2 = ggml_mul_mat(ctx, q11, v2);
+    struct ggml_cgraph gfv = ggml_build_forward(q11xv2);
+
+    const int n_graphs = 32*benchmark_params.n_iterations;
+
+    ggml_threadpool * threadpool = ggml_threadpool_new(benchmark_params.n_threads);
+
+    // warm up
+    ggml_graph_compute_helper(work_buffer, &gfv, benchmark_params.n_threads);
+    ggml_graph_compute_helper(work_buffer, &gfv, benchmark_params.n_threads, threadpool);
+
+    long long int t_spawn = ggml_time_us();
+    for (int i = 0; i < n_graphs; i++) {
+        ggml_graph_compute_helper(work_buffer, &gfv, benchmark_params.n_threads);
+    }
+    t_spawn = ggml_time_us() - t_spawn;
+
+    long long int t_pool = ggml_time_us();
+    for (int i = 0; i < n_graphs; i++) {
+        ggml_graph_compute_helper(work_buffer, &gfv, benchmark_params.n_threads, threadpool);
+    }
+    t_pool = ggml_time_us() - t_pool;
+
+    printf("Graphs;NThreads; Spawn_u_Seconds/graph; Pool_u_Seconds/graph; Saved_u_Seconds/graph\n");
+    printf("=====================================================================================\n");
+    printf("%6i;%8i;%22.2f;%21.2f;%22.2f\n",
+        n_graphs, benchmark_params.n_threads,
+        (double) t_spawn/n_graphs, (double) t_pool/n_graphs, (double) (t_spawn - t_pool)/n_graphs);
+
+    printf("\n------ Test 4 - Wait policy: latency vs CPU time\n");
+
+    const struct { enum ggml_wait_policy policy; const char * name; } policies[] = {
+        { GGML_WAIT_POLICY_SPIN,  "spin"  },
+        { GGML_WAIT_POLICY_YIELD, "yield" },
+        { GGML_WAIT_POLICY_SLEEP, "sleep" },
+    };
+
+    printf("Policy;NThreads; Wall_u_Seconds/graph; CPU_u_Seconds/graph\n");
+    printf("=====================================================================================\n");
+    for (const auto & p : policies) {
+        const long long int t_wall = ggml_time_us();
+        const std::clock_t  t_cpu  = std::clock();
+        for (int i = 0; i < n_graphs; i++) {
+            ggml_graph_compute_helper(work_buffer, &gfv, benchmark_params.n_threads, threadpool, p.policy);
+        }
+        const double wall_us = (double) (ggml_time_us() - t_wall);
+        const double cpu_us  = 1e6*(std::clock() - t_cpu)/CLOCKS_PER_SEC;
+        printf("%6s;%8i;%21.2f;%20.2f\n", p.name, benchmark_params.n_threads, wall_us/n_graphs, cpu_us/n_graphs);
+    }
+
+    ggml_threadpool_free(threadpool);
 }
@@ -16,6 +16,11 @@ int main(int argc, char ** argv) {
 
     params.embedding = true;
 
+    // the embedding of a prompt is the one of its last token unless asked otherwise
+    if (params.pooling_type < 0) {
+        params.pooling_type = LLAMA_POOLING_LAST;
+    }
+
     print_build_info();
 
     if (params.seed == LLAMA_DEFAULT_SEED) {
@@ -55,44 +60,113 @@ int main(int argc, char ** argv) {
         fprintf(stderr, "%s\n", get_system_info(params).c_str());
     }
 
-    int n_past = 0;
-
-    // tokenize the prompt
-    auto embd_inp = ::llama_tokenize(ctx, params.prompt, true);
-
-    if (params.verbose_prompt) {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
-        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
-        for (int i = 0; i < (int) embd_inp.size(); i++) {
-            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_piece(ctx, embd_inp[i]).c_str());
+    // the whole prompt is one input unless a separator splits it into several
+    std::vector<std::string> prompts;
+    if (params.embd_sep.empty()) {
+        prompts.push_back(params.prompt);
+    } else {
+        size_t pos = 0;
+        while (pos <= params.prompt.size()) {
+            size_t end = params.prompt.find(params.embd_sep, pos);
+            if (end == std::string::npos) {
+                end = params.prompt.size();
+            }
+            if (end > pos) {
+                prompts.push_back(params.prompt.substr(pos, end - pos));
+            }
+            pos = end + params.embd_sep.size();
         }
-        fprintf(stderr, "\n");
     }
 
-    if (embd_inp.size() > (size_t)n_ctx) {
-        fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
-                __func__, embd_inp.size(), n_ctx);
-        return 1;
-    }
+    // tokenize the prompts
+    std::vector<std::vector<llama_token>> inputs;
+    for (const auto & prompt : prompts) {
+        auto inp = ::llama_tokenize(ctx, prompt, true);
+
+        if (params.verbose_prompt) {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "%s: prompt: '%s'\n", __func__, prompt.c_str());
+            fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, inp.size());
+            for (int i = 0; i < (int) inp.size(); i++) {
+                fprintf(stderr, "%6d -> '%s'\n", inp[i], llama_token_to_piece(ctx, inp[i]).c_str());
+            }
+            fprintf(stderr, "\n");
+        }
 
-    while (!embd_inp.empty()) {
-        int n_tokens = std::min(params.n_batch, (int) embd_inp.size());
-        if (llama_decode(ctx, llama_batch_get_one(embd_inp.data(), n_tokens, n_past, 0))) {
-            fprintf(stderr, "%s : failed to eval\n", __func__);
+        if (inp.empty()) {
+            continue;
+        }
+
+        if (inp.size() > (size_t) n_ctx) {
+            fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
+                    __func__, inp.size(), n_ctx);
             return 1;
         }
-        n_past += n_tokens;
-        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_tokens);
+
+        inputs.push_back(std::move(inp));
     }
 
     const int n_embd = llama_n_embd(model);
-    const auto * embeddings = llama_get_embeddings(ctx);
 
-    for (int i = 0; i < n_embd; i++) {
-        printf("%f ", embeddings[i]);
+    std::vector<std::vector<float>> embeddings(inputs.size());
+
+    // the inputs that fit in the context are evaluated together, each one in its own sequence,
+    // in chunks of n_batch tokens - the pooled embeddings accumulate across the chunks
+    const int n_batch = std::min(params.n_batch, n_ctx);
+
+    llama_batch batch = llama_batch_init(n_batch, 0, 1);
+
+    for (size_t i0 = 0; i0 < inputs.size(); ) {
+        size_t i1      = i0;
+        size_t n_group = 0;
+        for (; i1 < inputs.size() && i1 - i0 < LLAMA_MAX_SEQ && n_group + inputs[i1].size() <= (size_t) n_ctx; ++i1) {
+            n_group += inputs[i1].size();
+        }
+
+        llama_kv_cache_clear(ctx);
+
+        size_t i = i0; // input of the next token
+        size_t j = 0;  // position of the next token in its input
+
+        while (i < i1) {
+            llama_batch_clear(batch);
+
+            size_t i_first = i; // first input with a token in the batch
+            while (i < i1 && batch.n_tokens < n_batch) {
+                llama_batch_add(batch, inputs[i][j], j, { (llama_seq_id) (i - i0) }, false);
+                if (++j == inputs[i].size()) {
+                    ++i;
+                    j = 0;
+                }
+            }
+
+            if (llama_decode(ctx, batch)) {
+                fprintf(stderr, "%s : failed to eval\n", __func__);
+                return 1;
+            }
+
+            // the inputs whose last token was in the batch are complete
+            for (size_t k = i_first; k < i; ++k) {
+                const float * embd = llama_get_embeddings_seq(ctx, k - i0);
+                if (embd == nullptr) {
+                    fprintf(stderr, "%s : failed to get the embedding of input %zu\n", __func__, k);
+                    return 1;
+                }
+                embeddings[k].assign(embd, embd + n_embd);
+            }
+        }
+
+        i0 = i1;
+    }
+
+    llama_batch_free(batch);
+
+    for (const auto & embd : embeddings) {
+        for (int i = 0; i < n_embd; i++) {
+            printf("%f ", embd[i]);
+        }
+        printf("\n");
     }
-    printf("\n");
 
     llama_print_timings(ctx);
     llama_free(ctx);
@@ -2,6 +2,7 @@
 
 #include "console.h"
 #include "llama.h"
+#include "speculative.h"
 
 #include <cassert>
 #include <cinttypes>
@@ -188,6 +189,27 @@ int main(int argc, char ** argv) {
         return 1;
     }
 
+    // load the draft model for speculative decoding, if any
+    llama_model * model_dft = NULL;
+    llama_context * ctx_dft = NULL;
+
+    if (!params.model_draft.empty()) {
+        gpt_params params_dft = params;
+        params_dft.model        = params.model_draft;
+        params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+        params_dft.lora_adapter.clear();
+
+        std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params_dft);
+        if (model_dft == NULL) {
+            LOG_TEE("%s: error: unable to load draft model\n", __func__);
+            return 1;
+        }
+
+        if (!llama_speculative_are_compatible(ctx, ctx_dft)) {
+            return 1;
+        }
+    }
+
     const int n_ctx_train = llama_n_ctx_train(model);
     const int n_ctx = llama_n_ctx(ctx);
     LOG("n_ctx: %d\n", n_ctx);
@@ -459,6 +481,22 @@ int main(int argc, char ** argv) {
 
     struct llama_sampling_context * ctx_sampling = llama_sampling_init(sparams);
 
+    // speculative decoding: the token before a sampled one is evaluated together with a draft, the verified tokens
+    // are then sampled one by one, all but the last one are already in the KV cache
+    struct llama_speculative * spec = NULL;
+
+    std::vector<llama_token> spec_past; // tokens in the KV cache, the draft model is synced with them
+
+    if (ctx_dft) {
+        llama_speculative_params spec_params;
+        spec_params.n_draft = params.n_draft;
+        spec_params.n_batch = params.n_batch;
+        spec_params.p_min   = params.p_accept;
+        spec_params.seed    = params.seed;
+
+        spec = llama_speculative_init(ctx, ctx_dft, spec_params);
+    }
+
     while ((n_remain != 0 && !is_antiprompt) || params.interactive) {
         // predict
         if (!embd.empty()) {
@@ -496,6 +534,11 @@ int main(int argc, char ** argv) {
                 llama_kv_cache_seq_rm   (ctx, 0, params.n_keep + 1            , params.n_keep + n_discard + 1);
                 llama_kv_cache_seq_shift(ctx, 0, params.n_keep + 1 + n_discard, n_past, -n_discard);
 
+                if (spec) {
+                    spec_past.erase(spec_past.begin() + params.n_keep + 1, spec_past.begin() + params.n_keep + 1 + n_discard);
+                    llama_speculative_discard(spec, params.n_keep + 1, params.n_keep + 1 + n_discard);
+                }
+
                 n_past -= n_discard;
 
                 if (ctx_guidance) {
@@ -528,6 +571,9 @@ int main(int argc, char ** argv) {
                     }
                 }
                 if (i > 0) {
+                    if (spec) {
+                        spec_past.insert(spec_past.end(), embd.begin(), embd.begin() + i);
+                    }
                     embd.erase(embd.begin(), embd.begin() + i);
                 }
             }
@@ -572,28 +618,46 @@ int main(int argc, char ** argv) {
                 }
             }
 
-            for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
-                int n_eval = (int) embd.size() - i;
-                if (n_eval > params.n_batch) {
-                    n_eval = params.n_batch;
-                }
-
+            if (spec) {
+                // when the next token is sampled, embd is evaluated with a draft
                 LOG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd).c_str());
 
-                if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0))) {
+                if (!llama_speculative_eval(spec, ctx_sampling, spec_past, embd, (int) embd_inp.size() <= n_consumed && !is_interacting)) {
                     LOG_TEE("%s : failed to eval\n", __func__);
                     return 1;
                 }
 
-                n_past += n_eval;
+                n_past += embd.size();
+
+                LOG("n_past = %d, verified: %s\n", n_past, LOG_TOKENS_TOSTR_PRETTY(ctx, spec->queue).c_str());
+            } else {
+                for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
+                    int n_eval = (int) embd.size() - i;
+                    if (n_eval > params.n_batch) {
+                        n_eval = params.n_batch;
+                    }
 
-                LOG("n_past = %d\n", n_past);
+                    LOG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd).c_str());
+
+                    if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0))) {
+                        LOG_TEE("%s : failed to eval\n", __func__);
+                        return 1;
+                    }
+
+                    n_past += n_eval;
+
+                    LOG("n_past = %d\n", n_past);
+                }
             }
 
             if (!embd.empty() && !path_session.empty()) {
                 session_tokens.insert(session_tokens.end(), embd.begin(), embd.end());
                 n_session_consumed = session_tokens.size();
             }
+
+            if (spec) {
+                spec_past.insert(spec_past.end(), embd.begin(), embd.end());
+            }
         }
 
         embd.clear();
@@ -608,7 +672,7 @@ int main(int argc, char ** argv) {
                 LOG("saved session to %s\n", path_session.c_str());
             }
 
-            const llama_token id = llama_sampling_sample(ctx_sampling, ctx, ctx_guidance);
+            const llama_token id = spec ? llama_speculative_sample(spec, ctx_sampling) : llama_sampling_sample(ctx_sampling, ctx, ctx_guidance);
 
             llama_sampling_accept(ctx_sampling, ctx, id, true);
 
@@ -713,6 +777,11 @@ int main(int argc, char ** argv) {
             if (n_past > 0 && is_interacting) {
                 LOG("waiting for user input\n");
 
+                // the verified tokens that are not sampled leave the KV cache
+                if (spec) {
+                    llama_speculative_clear(spec);
+                }
+
                 if (params.instruct) {
                     printf("\n> ");
                 }
@@ -816,15 +885,35 @@ int main(int argc, char ** argv) {
         }
     }
 
+    // the KV cache holds the evaluated tokens only
+    if (spec) {
+        llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+    }
+
     if (!path_session.empty() && params.prompt_cache_all && !params.prompt_cache_ro) {
         LOG_TEE("\n%s: saving final output to session file '%s'\n", __func__, path_session.c_str());
         llama_save_session_file(ctx, path_session.c_str(), session_tokens.data(), session_tokens.size());
     }
 
     llama_print_timings(ctx);
+    if (spec) {
+        LOG_TEE("\n%s: speculative decoding: %s\n", __func__, llama_speculative_print_stats(spec).c_str());
+    }
     write_logfile(ctx, params, model, input_tokens, output_ss.str(), output_tokens);
 
+    if (!params.trace_file.empty()) {
+        llama_trace_print(ctx);
+        if (llama_trace_export(ctx, params.trace_file.c_str())) {
+            LOG_TEE("%s: saved the trace to '%s'\n", __func__, params.trace_file.c_str());
+        }
+    }
+
     if (ctx_guidance) { llama_free(ctx_guidance); }
+    if (spec) {
+        llama_speculative_free(spec);
+        llama_free(ctx_dft);
+        llama_free_model(model_dft);
+    }
     llama_free(ctx);
     llama_free_model(model);
 
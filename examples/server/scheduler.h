@@ -0,0 +1,85 @@
+#pragma once
+
+// the token budget of a step of the server: which slots put tokens in the batch of the step, and how many
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// a slot that evaluates its prompt in chunks
+struct sched_prefill
+{
+    int     id;
+    int64_t t_start; // arrival of the request, the oldest prompts get their chunks first
+    int32_t n_left;  // tokens of the prompt that are not evaluated yet
+};
+
+struct sched_callbacks
+{
+    // puts the sampled token of the slot in the batch, followed by up to n_draft drafted tokens
+    // returns the number of drafted tokens
+    std::function<int32_t(int id, int32_t n_draft)> add_sampled;
+
+    // puts the next n tokens of the prompt of the slot in the batch
+    std::function<void(int id, int32_t n)> add_prompt;
+};
+
+// fills the batch of a step with at most n_budget tokens:
+// - each slot that is generating gets one token, plus its drafted tokens from what the other slots leave of the budget
+// - the slots that are evaluating their prompt share the rest of the budget, in the order of arrival
+// the generating slots go first, unless prefill_priority is set: then the prompt chunks go first and only as many
+// generating slots as tokens left in the budget get their token
+// returns the tokens left in the budget, negative if the generating slots alone exceeded it
+static int32_t sched_step(
+        int32_t                            n_budget,
+        bool                               prefill_priority,
+        const std::vector<int>           & slots_gen,
+        std::vector<sched_prefill>         slots_prefill,
+        const sched_callbacks            & cb)
+{
+    auto add_sampled = [&](size_t n_max)
+    {
+        const size_t n_gen = std::min(n_max, slots_gen.size());
+
+        for (size_t i = 0; i < n_gen; ++i)
+        {
+            n_budget -= 1;
+
+            // the drafted tokens do not take the tokens of the next slots
+            const int32_t n_draft = std::max(n_budget - (int32_t) (n_gen - i - 1), 0);
+
+            n_budget -= cb.add_sampled(slots_gen[i], n_draft);
+        }
+    };
+
+    if (!prefill_priority)
+    {
+        add_sampled(slots_gen.size());
+    }
+
+    std::stable_sort(slots_prefill.begin(), slots_prefill.end(), [](const sched_prefill & a, const sched_prefill & b)
+    {
+        return a.t_start < b.t_start;
+    });
+
+    for (const sched_prefill & slot : slots_prefill)
+    {
+        const int32_t n_chunk = std::min(n_budget, slot.n_left);
+        if (n_chunk <= 0)
+        {
+            break;
+        }
+
+        cb.add_prompt(slot.id, n_chunk);
+
+        n_budget -= n_chunk;
+    }
+
+    if (prefill_priority)
+    {
+        add_sampled(std::max(n_budget, 0));
+    }
+
+    return n_budget;
+}
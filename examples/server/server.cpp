@@ -1,6 +1,8 @@
 #include "common.h"
 #include "llama.h"
 #include "grammar-parser.h"
+#include "speculative.h"
+#include "scheduler.h"
 
 #include "../llava/clip.h"
 
@@ -361,6 +363,7 @@ struct llama_client_slot
     int32_t i_batch     = -1;
 
     int32_t num_prompt_tokens           = 0;
+    bool    prefilling                  = false; // the prompt is evaluated in chunks, up to num_prompt_tokens
     int32_t num_prompt_tokens_processed = 0;
     int32_t multibyte_pending           = 0;
 
@@ -384,6 +387,9 @@ struct llama_client_slot
     struct llama_sampling_params sparams;
     llama_sampling_context *ctx_sampling = nullptr;
 
+    // speculative decoding with the draft model of the server (nullptr without a draft model)
+    llama_speculative *spec = nullptr;
+
     // multimodal
     std::vector<slot_image> images;
 
@@ -397,6 +403,9 @@ struct llama_client_slot
     double t_prompt_processing; // ms
     double t_token_generation; // ms
 
+    int32_t n_drafted        = 0;
+    int32_t n_draft_accepted = 0;
+
     void reset() {
         num_prompt_tokens      = 0;
         generated_text         = "";
@@ -410,6 +419,8 @@ struct llama_client_slot
         sent_count             = 0;
         sent_token_probs_index = 0;
         infill                 = false;
+        n_drafted              = 0;
+        n_draft_accepted       = 0;
 
         generated_token_probs.clear();
 
@@ -450,7 +461,6 @@ struct llama_client_slot
         {
             return;
         }
-        cache_tokens.push_back(token.tok);
         generated_token_probs.push_back(token);
     }
 
@@ -463,7 +473,7 @@ struct llama_client_slot
     }
 
     json get_formated_timings() {
-        return json
+        json timings =
         {
             {"prompt_n",               num_prompt_tokens_processed},
             {"prompt_ms",              t_prompt_processing},
@@ -475,6 +485,14 @@ struct llama_client_slot
             {"predicted_per_token_ms", t_token_generation / n_decoded},
             {"predicted_per_second",   1e3 / t_token_generation * n_decoded},
         };
+
+        if (spec)
+        {
+            timings["draft_n"]          = n_drafted;
+            timings["draft_n_accepted"] = n_draft_accepted;
+        }
+
+        return timings;
     }
 
     void print_timings() {
@@ -483,6 +501,11 @@ struct llama_client_slot
             __func__, t_prompt_processing, num_prompt_tokens_processed, t_prompt_processing / num_prompt_tokens_processed, 1e3 / t_prompt_processing * num_prompt_tokens_processed);
         LOG_TEE("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, t_token_generation, n_decoded,t_token_generation / n_decoded, 1e3 / t_token_generation * n_decoded);
+        if (spec)
+        {
+            LOG_TEE("%s:   draft acceptance = %5d / %5d drafted tokens (%6.2f%%)\n",
+                __func__, n_draft_accepted, n_drafted, 100.0 * n_draft_accepted / std::max(n_drafted, 1));
+        }
         LOG_TEE("%s:       total time = %10.2f ms\n", __func__, t_prompt_processing + t_token_generation);
     }
 };
@@ -492,6 +515,10 @@ struct llama_server_context
     llama_model *model = nullptr;
     llama_context *ctx = nullptr;
 
+    // draft model for speculative decoding, the sequence of each slot has the id of the slot in both contexts
+    llama_model *model_dft = nullptr;
+    llama_context *ctx_dft = nullptr;
+
     clip_ctx *clp_ctx = nullptr;
 
     gpt_params params;
@@ -510,6 +537,7 @@ struct llama_server_context
 
     std::string              system_prompt;
     std::vector<llama_token> system_tokens;
+    llama_seq_id             system_seq_id = 0; // sequence of the system prompt, after the ones of the slots
 
     std::string name_user;      // this should be the antiprompt
     std::string name_assistant;
@@ -517,6 +545,11 @@ struct llama_server_context
     // slots / clients
     std::vector<llama_client_slot> slots;
 
+    // scheduler: maximum number of tokens evaluated per step (0 = n_batch), the prompt chunks are
+    // put in the batch before the tokens of the slots that are generating when prefill_priority is set
+    int32_t n_step_tokens    = 0;
+    bool    prefill_priority = false;
+
     std::vector<task_server> queue_tasks;
     std::vector<task_result> queue_results;
     std::mutex mutex_tasks;
@@ -524,6 +557,24 @@ struct llama_server_context
 
     ~llama_server_context()
     {
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.spec)
+            {
+                llama_speculative_free(slot.spec);
+                slot.spec = nullptr;
+            }
+        }
+        if (ctx_dft)
+        {
+            llama_free(ctx_dft);
+            ctx_dft = nullptr;
+        }
+        if (model_dft)
+        {
+            llama_free_model(model_dft);
+            model_dft = nullptr;
+        }
         if (ctx)
         {
             llama_free(ctx);
@@ -553,6 +604,12 @@ struct llama_server_context
             }
         }
 
+        // the embedding of each slot is the one of the last token of its sequence
+        if (params.embedding && params.pooling_type < 0)
+        {
+            params.pooling_type = LLAMA_POOLING_LAST;
+        }
+
         std::tie(model, ctx) = llama_init_from_gpt_params(params);
         if (model == nullptr)
         {
@@ -571,6 +628,29 @@ struct llama_server_context
             }
         }
 
+        if (!params.model_draft.empty())
+        {
+            gpt_params params_dft = params;
+            params_dft.model        = params.model_draft;
+            params_dft.n_gpu_layers = params.n_gpu_layers_draft;
+            params_dft.lora_adapter.clear();
+            params_dft.embedding    = false;
+            params_dft.pooling_type = -1;
+            params_dft.prefix_cache = false;
+
+            std::tie(model_dft, ctx_dft) = llama_init_from_gpt_params(params_dft);
+            if (model_dft == nullptr)
+            {
+                LOG_ERROR("unable to load draft model", {{"model", params.model_draft}});
+                return false;
+            }
+
+            if (!llama_speculative_are_compatible(ctx, ctx_dft))
+            {
+                return false;
+            }
+        }
+
         n_ctx = llama_n_ctx(ctx);
 
         return true;
@@ -593,13 +673,26 @@ struct llama_server_context
             slot.n_ctx = n_ctx_slot;
             slot.reset();
 
+            if (ctx_dft)
+            {
+                llama_speculative_params spec_params;
+                spec_params.n_draft = params.n_draft;
+                spec_params.n_batch = params.n_batch;
+                spec_params.p_min   = params.p_accept;
+                spec_params.seq_id  = slot.id;
+                spec_params.seed    = params.seed;
+
+                slot.spec = llama_speculative_init(ctx, ctx_dft, spec_params);
+            }
+
             LOG_TEE(" -> Slot %i - max context: %i\n", slot.id, n_ctx_slot);
             slots.push_back(slot);
         }
 
         batch = llama_batch_init(n_ctx, 0, params.n_parallel);
 
-        // empty system prompt
+        // empty system prompt, kept in its own sequence so that the slots can drop theirs
+        system_seq_id = params.n_parallel;
         system_prompt = "";
         system_tokens.clear();
     }
@@ -871,7 +964,7 @@ struct llama_server_context
 
         for (int i = 0; i < (int) system_tokens.size(); ++i)
         {
-            llama_batch_add(batch, system_tokens[i], i, { 0 }, false);
+            llama_batch_add(batch, system_tokens[i], i, { system_seq_id }, false);
         }
 
         if (llama_decode(ctx, batch) != 0)
@@ -881,9 +974,9 @@ struct llama_server_context
         }
 
         // assign the system KV cache to all parallel sequences
-        for (int32_t i = 1; i < params.n_parallel; ++i)
+        for (int32_t i = 0; i < params.n_parallel; ++i)
         {
-            llama_kv_cache_seq_cp(ctx, 0, i, 0, system_tokens.size());
+            llama_kv_cache_seq_cp(ctx, system_seq_id, i, 0, system_tokens.size());
         }
 
         LOG_TEE("system prompt updated\n");
@@ -950,6 +1043,12 @@ struct llama_server_context
         const std::string token_str = llama_token_to_piece(ctx, result.tok);
         slot.sampled = result.tok;
 
+        // the tokens of an incomplete multibyte character are in the KV cache too
+        if (slot.command != RELEASE)
+        {
+            slot.cache_tokens.push_back(result.tok);
+        }
+
         // search stop word and delete it
         slot.generated_text += token_str;
         slot.has_next_token = true;
@@ -1216,6 +1315,13 @@ struct llama_server_context
 
     void send_embedding(llama_client_slot &slot)
     {
+        const float *data = params.embedding ? llama_get_embeddings_seq(ctx, slot.id) : nullptr;
+        if (params.embedding && data == nullptr)
+        {
+            send_error(slot.task_id, "no embedding was computed for the prompt of the slot");
+            return;
+        }
+
         std::lock_guard<std::mutex> lock(mutex_results);
         task_result res;
         res.id = slot.task_id;
@@ -1235,11 +1341,9 @@ struct llama_server_context
         }
         else
         {
-            const float *data = llama_get_embeddings(ctx);
-            std::vector<float> embedding(data, data + n_embd);
             res.result_json = json
             {
-                {"embedding", embedding },
+                {"embedding", std::vector<float>(data, data + n_embd) },
             };
         }
         queue_results.push_back(res);
@@ -1440,7 +1544,7 @@ struct llama_server_context
 
         for (llama_client_slot &slot : slots)
         {
-            if (slot.is_processing() && slot.cache_tokens.size() >= (size_t) slot.n_ctx)
+            if (slot.is_processing() && !slot.prefilling && slot.cache_tokens.size() >= (size_t) slot.n_ctx)
             {
                 // Shift context
                 const int n_left    = slot.n_past - slot.params.n_keep - 1;
@@ -1450,6 +1554,12 @@ struct llama_server_context
                 llama_kv_cache_seq_rm   (ctx, slot.id, slot.params.n_keep + 1            , slot.params.n_keep + n_discard + 1);
                 llama_kv_cache_seq_shift(ctx, slot.id, slot.params.n_keep + 1 + n_discard, slot.n_past, -n_discard);
 
+                if (slot.spec)
+                {
+                    const int32_t p0 = system_tokens.size() + slot.params.n_keep + 1;
+                    llama_speculative_discard(slot.spec, p0, p0 + n_discard);
+                }
+
                 for (size_t i = slot.params.n_keep + 1 + n_discard; i < slot.cache_tokens.size(); i++)
                 {
                     slot.cache_tokens[i - n_discard] = slot.cache_tokens[i];
@@ -1469,12 +1579,23 @@ struct llama_server_context
             }
         }
 
-        // decode any currently ongoing sequences
+        bool any_processing = false;
+
+        // the slots that are generating
+        std::vector<int> slots_gen;
+
         for (auto & slot : slots)
         {
             // release the slot
             if (slot.command == RELEASE)
             {
+                // only the evaluated part of the prompt is in the KV cache
+                if (slot.prefilling)
+                {
+                    slot.cache_tokens.resize(slot.n_past);
+                    slot.prefilling = false;
+                }
+
                 slot.state = IDLE;
                 slot.command = NONE;
                 slot.t_last_used = ggml_time_us();
@@ -1489,19 +1610,19 @@ struct llama_server_context
                 continue;
             }
 
-            slot.i_batch = batch.n_tokens;
+            any_processing = true;
 
-            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot.n_past, { slot.id }, true);
-
-            slot.n_decoded += 1;
-            slot.n_past += 1;
+            if (!slot.prefilling)
+            {
+                slots_gen.push_back(slot.id);
+            }
         }
 
         // process in chunks of params.n_batch
         int32_t n_batch = params.n_batch;
 
         // assign workload to the slots
-        if (params.cont_batching || batch.n_tokens == 0)
+        if (params.cont_batching || !any_processing)
         {
             for (auto & slot : slots)
             {
@@ -1605,6 +1726,26 @@ struct llama_server_context
                         LOG_TEE("slot %d : in cache: %i tokens | to process: %i tokens\n", slot.id, slot.n_past, slot.num_prompt_tokens_processed);
                     }
 
+                    // reuse the longest prefix of the prompt in the KV cache, whichever slot computed it
+                    if (params.prefix_cache && slot.images.empty())
+                    {
+                        std::vector<llama_token> tokens = system_tokens;
+                        tokens.insert(tokens.end(), prompt_tokens.begin(), prompt_tokens.end());
+
+                        // keep the last token to evaluate it for the logits
+                        const int n_cached = llama_kv_cache_seq_prefix(ctx, slot.id, tokens.data(), tokens.size() - 1) - (int) system_tokens.size();
+                        if (n_cached < 0)
+                        {
+                            llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                            llama_kv_cache_seq_cp(ctx, system_seq_id, slot.id, 0, system_tokens.size());
+                        }
+
+                        slot.n_past = std::max(n_cached, 0);
+                        slot.num_prompt_tokens_processed = slot.num_prompt_tokens - slot.n_past;
+
+                        LOG_TEE("slot %d : in prefix cache: %i tokens | to process: %i tokens\n", slot.id, slot.n_past, slot.num_prompt_tokens_processed);
+                    }
+
                     LOG_TEE("slot %d : kv cache rm - [%d, end)\n", slot.id, (int) system_tokens.size() + slot.n_past);
 
                     llama_kv_cache_seq_rm(ctx, slot.id, system_tokens.size() + slot.n_past, -1);
@@ -1624,16 +1765,24 @@ struct llama_server_context
                                                     {"to_eval", tokens_to_str(ctx, slot.cache_tokens.cbegin() + slot.n_past, slot.cache_tokens.cend())},
                                                 });
 
-                    const bool has_images = process_images(slot);
+                    slot.n_decoded = 0;
+                    slot.i_batch   = -1;
+
+                    // the text prompts are evaluated in chunks below
+                    if (!process_images(slot))
+                    {
+                        slot.prefilling = true;
+                        continue;
+                    }
 
                     // process the prefix of first image
-                    std::vector<llama_token> prefix_tokens = has_images ? tokenize(slot.images[0].prefix_prompt, true) : prompt_tokens;
+                    std::vector<llama_token> prefix_tokens = tokenize(slot.images[0].prefix_prompt, true);
                     for (; slot.n_past < (int) prefix_tokens.size(); ++slot.n_past)
                     {
                        llama_batch_add(batch, prefix_tokens[slot.n_past], system_tokens.size() + slot.n_past, { slot.id }, false);
                     }
 
-                    if (has_images && !ingest_images(slot, n_batch))
+                    if (!ingest_images(slot, n_batch))
                     {
                         LOG_TEE("failed processing images\n");
                         return false;
@@ -1645,12 +1794,97 @@ struct llama_server_context
                         batch.logits[batch.n_tokens - 1] = true;
                     }
 
-                    slot.n_decoded = 0;
-                    slot.i_batch   = batch.n_tokens - 1;
+                    slot.i_batch = batch.n_tokens - 1;
                 }
             }
         }
 
+        // the slots with drafted tokens in the batch
+        std::vector<llama_client_slot *> slots_draft;
+
+        // decode any currently ongoing sequences
+        auto add_sampled = [&](int id, int32_t n_budget_draft) -> int32_t
+        {
+            llama_client_slot & slot = slots[id];
+
+            slot.i_batch = batch.n_tokens;
+
+            llama_batch_add(batch, slot.sampled, system_tokens.size() + slot.n_past, { slot.id }, true);
+
+            slot.n_decoded += 1;
+            slot.n_past += 1;
+
+            // the drafted tokens follow the sampled token in the same view of n_batch tokens, they are verified
+            // when the slot samples (the probabilities of the tokens are computed only without speculation)
+            if (!slot.spec || !slot.images.empty() || slot.sparams.n_probs != 0 || (int) slot.cache_tokens.size() != slot.n_past)
+            {
+                return 0;
+            }
+
+            const int32_t n_draft = std::min({
+                slot.spec->params.n_draft,
+                n_budget_draft,
+                slot.n_ctx - slot.n_past - 1,
+                (params.n_batch - batch.n_tokens % params.n_batch) % params.n_batch,
+            });
+
+            if (n_draft <= 0)
+            {
+                return 0;
+            }
+
+            std::vector<llama_token> prompt = system_tokens;
+            prompt.insert(prompt.end(), slot.cache_tokens.begin(), slot.cache_tokens.end() - 1);
+
+            const std::vector<llama_token> & draft = llama_speculative_draft(slot.spec, slot.ctx_sampling, prompt, slot.sampled, n_draft);
+
+            for (size_t j = 0; j < draft.size(); ++j)
+            {
+                llama_batch_add(batch, draft[j], system_tokens.size() + slot.n_past + j, { slot.id }, true);
+            }
+
+            if (!draft.empty())
+            {
+                slots_draft.push_back(&slot);
+            }
+
+            return draft.size();
+        };
+
+        // the prompts are evaluated in chunks, in the order of arrival of the requests
+        std::vector<sched_prefill> slots_prefill;
+
+        for (auto & slot : slots)
+        {
+            if (slot.prefilling)
+            {
+                slots_prefill.push_back({ slot.id, slot.t_start_process_prompt, slot.num_prompt_tokens - slot.n_past });
+            }
+        }
+
+        auto add_prompt = [&](int id, int32_t n_chunk)
+        {
+            llama_client_slot & slot = slots[id];
+
+            for (int32_t i = 0; i < n_chunk; ++i, ++slot.n_past)
+            {
+                llama_batch_add(batch, slot.cache_tokens[slot.n_past], system_tokens.size() + slot.n_past, { slot.id }, false);
+            }
+
+            if (slot.n_past == slot.num_prompt_tokens)
+            {
+                // extract the logits only for the last token
+                batch.logits[batch.n_tokens - 1] = true;
+
+                slot.i_batch    = batch.n_tokens - 1;
+                slot.prefilling = false;
+            }
+        };
+
+        // the slots that are generating get one token per step, the slots that are evaluating their prompt
+        // get the rest of the token budget of the step: a long prompt does not stall the other slots
+        sched_step(n_step_tokens > 0 ? n_step_tokens : params.n_batch, prefill_priority, slots_gen, slots_prefill, { add_sampled, add_prompt });
+
         if (batch.n_tokens == 0)
         {
             all_slots_are_idle = true;
@@ -1703,45 +1937,90 @@ struct llama_server_context
                     send_embedding(slot);
                     slot.release();
                     slot.i_batch = -1;
-                    return true;
+                    continue;
                 }
 
-                completion_token_output result;
-                const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
-
-                llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+                // the accepted drafted tokens and the token sampled after them
+                std::vector<llama_token> ids;
 
-                if (slot.n_decoded == 1)
+                if (slot.spec && !slot.spec->draft.empty())
                 {
-                    slot.t_start_genereration = ggml_time_us();
-                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
-                }
+                    // the drafted tokens after the end of the view are rejected
+                    std::vector<llama_token> & draft = slot.spec->draft;
+                    draft.resize(std::min(draft.size(), (size_t) (i + n_tokens - slot.i_batch - 1)));
+
+                    std::vector<int32_t> idxs;
+                    for (size_t j = 0; j <= draft.size(); ++j)
+                    {
+                        idxs.push_back(slot.i_batch - i + j);
+                    }
 
-                llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
-                result.tok = id;
+                    ids = llama_speculative_verify(slot.spec, slot.ctx_sampling, idxs);
 
-                const int32_t n_probs = slot.sparams.n_probs;
-                if (slot.sparams.temp <= 0 && n_probs > 0)
+                    slot.n_drafted        += draft.size();
+                    slot.n_draft_accepted += ids.size() - 1;
+                }
+                else
                 {
-                    // for llama_sample_token_greedy we need to sort candidates
-                    llama_sample_softmax(ctx, &cur_p);
+                    const llama_token id = llama_sampling_sample(slot.ctx_sampling, ctx, NULL, slot.i_batch - i);
+
+                    llama_sampling_accept(slot.ctx_sampling, ctx, id, true);
+
+                    ids.push_back(id);
                 }
 
-                for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+                if (slot.n_decoded == 1)
                 {
-                    result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                    slot.t_start_genereration = ggml_time_us();
+                    slot.t_prompt_processing = (slot.t_start_genereration - slot.t_start_process_prompt) / 1e3;
                 }
 
-                if (!process_token(result, slot))
+                for (size_t j = 0; j < ids.size(); ++j)
                 {
-                    slot.release();
-                    slot.print_timings();
-                    send_final_response(slot);
+                    // the previous token was evaluated as a drafted token
+                    if (j > 0)
+                    {
+                        slot.n_decoded += 1;
+                        slot.n_past += 1;
+                    }
+
+                    completion_token_output result;
+
+                    llama_token_data_array cur_p = { slot.ctx_sampling->cur.data(), slot.ctx_sampling->cur.size(), false };
+                    result.tok = ids[j];
+
+                    const int32_t n_probs = slot.sparams.n_probs;
+                    if (slot.sparams.temp <= 0 && n_probs > 0)
+                    {
+                        // for llama_sample_token_greedy we need to sort candidates
+                        llama_sample_softmax(ctx, &cur_p);
+                    }
+
+                    for (size_t i = 0; i < std::min(cur_p.size, (size_t)n_probs); ++i)
+                    {
+                        result.probs.push_back({cur_p.data[i].id, cur_p.data[i].p});
+                    }
+
+                    if (!process_token(result, slot))
+                    {
+                        slot.release();
+                        slot.print_timings();
+                        send_final_response(slot);
+                        break;
+                    }
                 }
 
                 slot.i_batch = -1;
             }
         }
+
+        // remove the rejected drafted tokens from the KV cache
+        for (llama_client_slot * slot : slots_draft)
+        {
+            llama_kv_cache_seq_rm(ctx, slot->id, system_tokens.size() + slot->n_past, -1);
+            slot->spec->draft.clear();
+        }
+
         return true;
     }
 };
@@ -1776,6 +2055,7 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --repack              interleave the rows of Q4_0/Q8_0 weights at load time for faster CPU inference (implies --no-mmap)\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
     printf("  -ngl N, --n-gpu-layers N\n");
@@ -1798,8 +2078,16 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --path PUBLIC_PATH    path from which to serve static files (default %s)\n", sparams.public_path.c_str());
     printf("  -to N, --timeout N    server read/write timeout in seconds (default: %d)\n", sparams.read_timeout);
     printf("  --embedding           enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
+    printf("  -fa, --flash-attn     compute attention with the fused CPU kernel (default: %s)\n", params.flash_attn ? "enabled" : "disabled");
+    printf("  --prefix-cache        reuse the longest prefix of the prompt in the KV cache of any slot (default: %s)\n", params.prefix_cache ? "enabled" : "disabled");
     printf("  -np N, --parallel N   number of slots for process requests (default: %d)\n", params.n_parallel);
     printf("  -cb, --cont-batching  enable continuous batching (a.k.a dynamic batching) (default: disabled)\n");
+    printf("  --step-tokens N       maximum number of tokens evaluated per step, the prompts are evaluated in chunks (default: batch size)\n");
+    printf("  --prefill-priority    fill the steps with prompt chunks before the tokens of the slots that are generating (default: disabled)\n");
+    printf("  -md FNAME, --model-draft FNAME\n");
+    printf("                        draft model for speculative decoding (default: unused)\n");
+    printf("  --draft N             maximum number of tokens to draft per step for speculative decoding (default: %d)\n", params.n_draft);
+    printf("  -pa N, --p-accept N   stop drafting when the draft model samples a token with a lower probability (default: %.1f)\n", (double)params.p_accept);
     printf("    -spf FNAME, --system-prompt-file FNAME\n");
     printf("                        Set a file to load a system prompt (initial prompt of all slots), this is useful for chat applications.\n");
     printf("  --mmproj MMPROJ_FILE  path to a multimodal projector file for LLaVA.\n");
@@ -2099,6 +2387,10 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             params.use_mmap = false;
         }
+        else if (arg == "--repack")
+        {
+            params.repack = true;
+        }
         else if (arg == "--numa")
         {
             params.numa = true;
@@ -2107,10 +2399,58 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             params.embedding = true;
         }
+        else if (arg == "-fa" || arg == "--flash-attn")
+        {
+            params.flash_attn = true;
+        }
+        else if (arg == "--prefix-cache")
+        {
+            params.prefix_cache = true;
+        }
         else if (arg == "-cb" || arg == "--cont-batching")
         {
             params.cont_batching = true;
         }
+        else if (arg == "--step-tokens")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            llama.n_step_tokens = std::stoi(argv[i]);
+        }
+        else if (arg == "--prefill-priority")
+        {
+            llama.prefill_priority = true;
+        }
+        else if (arg == "-md" || arg == "--model-draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.model_draft = argv[i];
+        }
+        else if (arg == "--draft")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_draft = std::stoi(argv[i]);
+        }
+        else if (arg == "-pa" || arg == "--p-accept")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.p_accept = std::stof(argv[i]);
+        }
         else if (arg == "-np" || arg == "--parallel")
         {
             if (++i >= argc)
@@ -2119,6 +2459,13 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
                 break;
             }
             params.n_parallel = std::stoi(argv[i]);
+            // the last sequence holds the system prompt
+            if (params.n_parallel < 1 || params.n_parallel > LLAMA_MAX_SEQ - 1)
+            {
+                fprintf(stderr, "error: the number of slots must be in [1, %d]\n", LLAMA_MAX_SEQ - 1);
+                invalid_param = true;
+                break;
+            }
         } else if (arg == "-n" || arg == "--n-predict")
         {
             if (++i >= argc)
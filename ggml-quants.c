@@ -59,6 +59,11 @@ inline static int32_t vaddvq_s32(int32x4_t v) {
 #include <riscv_vector.h>
 #endif
 
+// the 256-bit VNNI instructions (vpdpbusd, vpdpwssd) are provided both by AVX-VNNI and by AVX512-VNNI together with AVX512VL
+#if defined(__AVXVNNI__) || (defined(__AVX512VNNI__) && defined(__AVX512VL__))
+#define GGML_AVX_VNNI
+#endif
+
 #undef MIN
 #undef MAX
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -138,7 +143,7 @@ static inline __m256 sum_i16_pairs_float(const __m256i x) {
 }
 
 static inline __m256 mul_sum_us8_pairs_float(const __m256i ax, const __m256i sy) {
-#if __AVXVNNI__
+#if defined(GGML_AVX_VNNI)
     const __m256i zero = _mm256_setzero_si256();
     const __m256i summed_pairs = _mm256_dpbusd_epi32(zero, ax, sy);
     return _mm256_cvtepi32_ps(summed_pairs);
@@ -164,6 +169,15 @@ static inline __m256 mul_sum_i8_pairs_float(const __m256i x, const __m256i y) {
 #endif
 }
 
+// multiply int16_t pairwise and add the results to the int32_t vector acc
+static inline __m256i mul_add_i16_pairs(const __m256i acc, const __m256i x, const __m256i y) {
+#if defined(GGML_AVX_VNNI)
+    return _mm256_dpwssd_epi32(acc, x, y);
+#else
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(x, y));
+#endif
+}
+
 static inline __m128i packNibbles( __m256i bytes )
 {
     // Move bits within 16-bit lanes from 0000_abcd_0000_efgh into 0000_0000_abcd_efgh
@@ -3684,12 +3698,10 @@ void ggml_vec_dot_q2_K_q8_K(const int n, float * restrict s, const void * restri
             __m256i p3 = _mm256_maddubs_epi16(q2_3, q8_3);
 
             p0 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(0)), p0);
-            p1 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(1)), p1);
             p2 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(2)), p2);
-            p3 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(3)), p3);
 
-            p0 = _mm256_add_epi32(p0, p1);
-            p2 = _mm256_add_epi32(p2, p3);
+            p0 = mul_add_i16_pairs(p0, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(1)), p1);
+            p2 = mul_add_i16_pairs(p2, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(3)), p3);
 
             sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p0, p2));
         }
@@ -4424,15 +4436,11 @@ void ggml_vec_dot_q3_K_q8_K(const int n, float * restrict s, const void * restri
             p16_2 = _mm256_sub_epi16(p16_2, q8s_2);
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
-            // multiply with scales
+            // multiply with scales and accumulate
             p16_0 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 0)), p16_0);
-            p16_1 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 1)), p16_1);
             p16_2 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 2)), p16_2);
-            p16_3 = _mm256_madd_epi16(_mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 3)), p16_3);
-
-            // accumulate
-            p16_0 = _mm256_add_epi32(p16_0, p16_1);
-            p16_2 = _mm256_add_epi32(p16_2, p16_3);
+            p16_0 = mul_add_i16_pairs(p16_0, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 1)), p16_1);
+            p16_2 = mul_add_i16_pairs(p16_2, _mm256_shuffle_epi8(scales[j], get_scale_shuffle_q3k(is + 3)), p16_3);
             sumi  = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_2));
 
         }
@@ -5264,8 +5272,7 @@ void ggml_vec_dot_q4_K_q8_K(const int n, float * restrict s, const void * restri
 
             const __m256i q8h = _mm256_loadu_si256((const __m256i*)q8); q8 += 32;
             __m256i p16h = _mm256_maddubs_epi16(q4h, q8h);
-            p16h = _mm256_madd_epi16(scale_h, p16h);
-            const __m256i sumj = _mm256_add_epi32(p16l, p16h);
+            const __m256i sumj = mul_add_i16_pairs(p16l, scale_h, p16h);
 
             sumi = _mm256_add_epi32(sumi, sumj);
         }
@@ -5936,9 +5943,9 @@ void ggml_vec_dot_q5_K_q8_K(const int n, float * restrict s, const void * restri
             __m256i p16_1 = _mm256_maddubs_epi16(q5_1, q8_1);
 
             p16_0 = _mm256_madd_epi16(scale_0, p16_0);
-            p16_1 = _mm256_madd_epi16(scale_1, p16_1);
+            p16_0 = mul_add_i16_pairs(p16_0, scale_1, p16_1);
 
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
+            sumi = _mm256_add_epi32(sumi, p16_0);
 
         }
 
@@ -6703,12 +6710,11 @@ void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restri
             p16_3 = _mm256_sub_epi16(p16_3, q8s_3);
 
             p16_0 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_0), p16_0);
-            p16_1 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_1), p16_1);
             p16_2 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_2), p16_2);
-            p16_3 = _mm256_madd_epi16(_mm256_cvtepi8_epi16(scale_3), p16_3);
+            p16_0 = mul_add_i16_pairs(p16_0, _mm256_cvtepi8_epi16(scale_1), p16_1);
+            p16_2 = mul_add_i16_pairs(p16_2, _mm256_cvtepi8_epi16(scale_3), p16_3);
 
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_1));
-            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_2, p16_3));
+            sumi = _mm256_add_epi32(sumi, _mm256_add_epi32(p16_0, p16_2));
 
         }
 
@@ -7280,3 +7286,1003 @@ void ggml_vec_dot_q6_K_q8_K(const int n, float * restrict s, const void * restri
 }
 
 #endif
+
+//===================================== GEMM tiles ===================================
+
+// the ggml_gemm_* functions compute a tile of GGML_GEMM_TILE x GGML_GEMM_TILE dot products
+// each block of x is unpacked once and used for all the rows of y, and each block of y is used for all the rows of x
+// the partial sums of the tile stay in registers until the end of the rows
+
+#define NT GGML_GEMM_TILE
+
+static inline void gemm_generic(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by,
+        void (*vec_dot)(const int, float * restrict, const void * restrict, const void * restrict)) {
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            vec_dot(n, s + j*bs + i, (const char *) vx + i*bx, (const char *) vy + j*by);
+        }
+    }
+}
+
+#if defined(__AVX2__)
+// acc[j][i] += dx[i]*dy[j]*(x_i . y_j) for one block of 32 int8 values per row
+static inline void gemm_acc_i8(__m256 acc[NT][NT], const __m256i qx[NT], const float dx[NT], const block_q8_0 * const yb[NT]) {
+    __m256i ax[NT];
+    for (int i = 0; i < NT; ++i) {
+        ax[i] = _mm256_sign_epi8(qx[i], qx[i]);
+    }
+
+    for (int j = 0; j < NT; ++j) {
+        const __m256i qy = _mm256_loadu_si256((const __m256i *) yb[j]->qs);
+        const float   dy = GGML_FP16_TO_FP32(yb[j]->d);
+
+        for (int i = 0; i < NT; ++i) {
+            const __m256 q = mul_sum_us8_pairs_float(ax[i], _mm256_sign_epi8(qy, qx[i]));
+            acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(dx[i]*dy), q, acc[j][i]);
+        }
+    }
+}
+
+static inline void gemm_store(float * restrict s, size_t bs, __m256 acc[NT][NT]) {
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            s[j*bs + i] = hsum_float_8(acc[j][i]);
+        }
+    }
+}
+#endif
+
+void ggml_gemm_q4_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+#if defined(__AVX2__)
+    const __m256i off = _mm256_set1_epi8(8);
+
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i qx[NT];
+        float   dx[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            const block_q4_0 * restrict xb = (const block_q4_0 *) ((const char *) vx + i*bx) + ib;
+
+            qx[i] = _mm256_sub_epi8(bytes_from_nibbles_32(xb->qs), off);
+            dx[i] = GGML_FP16_TO_FP32(xb->d);
+        }
+
+        const block_q8_0 * yb[NT];
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_0 *) ((const char *) vy + j*by) + ib;
+        }
+
+        gemm_acc_i8(acc, qx, dx, yb);
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q4_0_q8_0);
+#endif
+}
+
+void ggml_gemm_q8_0_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+#if defined(__AVX2__)
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i qx[NT];
+        float   dx[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            const block_q8_0 * restrict xb = (const block_q8_0 *) ((const char *) vx + i*bx) + ib;
+
+            qx[i] = _mm256_loadu_si256((const __m256i *) xb->qs);
+            dx[i] = GGML_FP16_TO_FP32(xb->d);
+        }
+
+        const block_q8_0 * yb[NT];
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_0 *) ((const char *) vy + j*by) + ib;
+        }
+
+        gemm_acc_i8(acc, qx, dx, yb);
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q8_0_q8_0);
+#endif
+}
+
+void ggml_gemm_q2_K_q8_K(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const int nb = n / QK_K;
+
+#if defined(__AVX2__) && QK_K == 256
+    const __m256i m3 = _mm256_set1_epi8(3);
+    const __m128i m4 = _mm_set1_epi8(0xF);
+
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const block_q2_K * xb[NT];
+        const block_q8_K * yb[NT];
+
+        __m128i scales[NT];
+        __m256i mins[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            xb[i] = (const block_q2_K *) ((const char *) vx + i*bx) + ib;
+
+            const __m128i mins_and_scales = _mm_loadu_si128((const __m128i *) xb[i]->scales);
+            scales[i] = _mm_and_si128(mins_and_scales, m4);
+            mins[i]   = _mm256_cvtepi8_epi16(_mm_and_si128(_mm_srli_epi16(mins_and_scales, 4), m4));
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_K *) ((const char *) vy + j*by) + ib;
+        }
+
+        __m256i sumi[NT][NT];
+        for (int j = 0; j < NT; ++j) {
+            for (int i = 0; i < NT; ++i) {
+                sumi[j][i] = _mm256_setzero_si256();
+            }
+        }
+
+        for (int k = 0; k < QK_K/128; ++k) {
+            for (int i = 0; i < NT; ++i) {
+                const __m256i scale_0 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 0)));
+                const __m256i scale_1 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 1)));
+                const __m256i scale_2 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 2)));
+                const __m256i scale_3 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 3)));
+
+                const __m256i q2bits = _mm256_loadu_si256((const __m256i *) (xb[i]->qs + 32*k));
+
+                const __m256i q2_0 = _mm256_and_si256(q2bits, m3);
+                const __m256i q2_1 = _mm256_and_si256(_mm256_srli_epi16(q2bits, 2), m3);
+                const __m256i q2_2 = _mm256_and_si256(_mm256_srli_epi16(q2bits, 4), m3);
+                const __m256i q2_3 = _mm256_and_si256(_mm256_srli_epi16(q2bits, 6), m3);
+
+                for (int j = 0; j < NT; ++j) {
+                    const int8_t * restrict q8 = yb[j]->qs + 128*k;
+
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_0, _mm256_maddubs_epi16(q2_0, _mm256_loadu_si256((const __m256i *) (q8 +  0))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_1, _mm256_maddubs_epi16(q2_1, _mm256_loadu_si256((const __m256i *) (q8 + 32))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_2, _mm256_maddubs_epi16(q2_2, _mm256_loadu_si256((const __m256i *) (q8 + 64))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_3, _mm256_maddubs_epi16(q2_3, _mm256_loadu_si256((const __m256i *) (q8 + 96))));
+                }
+            }
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i *) yb[j]->bsums);
+
+            for (int i = 0; i < NT; ++i) {
+                const float d    =  yb[j]->d * GGML_FP16_TO_FP32(xb[i]->d);
+                const float dmin = -yb[j]->d * GGML_FP16_TO_FP32(xb[i]->dmin);
+
+                const __m256i prod = _mm256_madd_epi16(mins[i], q8sums);
+
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(d),    _mm256_cvtepi32_ps(sumi[j][i]), acc[j][i]);
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(dmin), _mm256_cvtepi32_ps(prod),       acc[j][i]);
+            }
+        }
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q2_K_q8_K);
+#endif
+}
+
+void ggml_gemm_q3_K_q8_K(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const int nb = n / QK_K;
+
+#if defined(__AVX2__) && QK_K == 256
+    static const uint32_t kmask1 = 0x03030303;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+
+    const __m256i m3   = _mm256_set1_epi8(3);
+    const __m256i mone = _mm256_set1_epi8(1);
+    const __m128i m32  = _mm_set1_epi8(32);
+
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const block_q3_K * xb[NT];
+        const block_q8_K * yb[NT];
+
+        __m128i scales[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            xb[i] = (const block_q3_K *) ((const char *) vx + i*bx) + ib;
+
+            uint32_t aux[3];
+            memcpy(aux, xb[i]->scales, 12);
+            const __m128i scales128 = _mm_set_epi32(
+                    ((aux[1] >> 4) & kmask2) | (((aux[2] >> 6) & kmask1) << 4),
+                    ((aux[0] >> 4) & kmask2) | (((aux[2] >> 4) & kmask1) << 4),
+                    (aux[1] & kmask2) | (((aux[2] >> 2) & kmask1) << 4),
+                    (aux[0] & kmask2) | (((aux[2] >> 0) & kmask1) << 4));
+            scales[i] = _mm_sub_epi8(scales128, m32);
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_K *) ((const char *) vy + j*by) + ib;
+        }
+
+        // the quants are used as unsigned 3-bit values and the -4 offset is applied once per block
+        // using the sums of y over groups of 16
+        __m256i sumi[NT][NT];
+        for (int j = 0; j < NT; ++j) {
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i *) yb[j]->bsums);
+
+            for (int i = 0; i < NT; ++i) {
+                sumi[j][i] = _mm256_slli_epi32(_mm256_madd_epi16(_mm256_cvtepi8_epi16(scales[i]), q8sums), 2);
+                sumi[j][i] = _mm256_sub_epi32(_mm256_setzero_si256(), sumi[j][i]);
+            }
+        }
+
+        for (int k = 0; k < QK_K/128; ++k) {
+            for (int i = 0; i < NT; ++i) {
+                const __m256i scale_0 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 0)));
+                const __m256i scale_1 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 1)));
+                const __m256i scale_2 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 2)));
+                const __m256i scale_3 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 3)));
+
+                const __m256i q3bits = _mm256_loadu_si256((const __m256i *) (xb[i]->qs + 32*k));
+                const __m256i hbits  = _mm256_loadu_si256((const __m256i *) xb[i]->hmask);
+
+                const __m256i q3h_0 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 4*k + 0), mone), 2);
+                const __m256i q3h_1 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 4*k + 1), mone), 2);
+                const __m256i q3h_2 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 4*k + 2), mone), 2);
+                const __m256i q3h_3 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 4*k + 3), mone), 2);
+
+                const __m256i q3_0 = _mm256_or_si256(_mm256_and_si256(q3bits, m3), q3h_0);
+                const __m256i q3_1 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q3bits, 2), m3), q3h_1);
+                const __m256i q3_2 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q3bits, 4), m3), q3h_2);
+                const __m256i q3_3 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q3bits, 6), m3), q3h_3);
+
+                for (int j = 0; j < NT; ++j) {
+                    const int8_t * restrict q8 = yb[j]->qs + 128*k;
+
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_0, _mm256_maddubs_epi16(q3_0, _mm256_loadu_si256((const __m256i *) (q8 +  0))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_1, _mm256_maddubs_epi16(q3_1, _mm256_loadu_si256((const __m256i *) (q8 + 32))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_2, _mm256_maddubs_epi16(q3_2, _mm256_loadu_si256((const __m256i *) (q8 + 64))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_3, _mm256_maddubs_epi16(q3_3, _mm256_loadu_si256((const __m256i *) (q8 + 96))));
+                }
+            }
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            for (int i = 0; i < NT; ++i) {
+                const float d = yb[j]->d * GGML_FP16_TO_FP32(xb[i]->d);
+
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi[j][i]), acc[j][i]);
+            }
+        }
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q3_K_q8_K);
+#endif
+}
+
+void ggml_gemm_q4_K_q8_K(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const int nb = n / QK_K;
+
+#if defined(__AVX2__) && QK_K == 256
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const block_q4_K * xb[NT];
+        const block_q8_K * yb[NT];
+
+        __m256i scales[NT];
+        __m128i mins[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            xb[i] = (const block_q4_K *) ((const char *) vx + i*bx) + ib;
+
+            uint32_t utmp[4];
+            memcpy(utmp, xb[i]->scales, 12);
+            utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+            const uint32_t uaux = utmp[1] & kmask1;
+            utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+            utmp[2] = uaux;
+            utmp[0] &= kmask1;
+
+            const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+            const __m128i sc128 = _mm256_extracti128_si256(mins_and_scales, 0);
+            scales[i] = MM256_SET_M128I(sc128, sc128);
+            mins[i]   = _mm256_extracti128_si256(mins_and_scales, 1);
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_K *) ((const char *) vy + j*by) + ib;
+        }
+
+        __m256i sumi[NT][NT];
+        for (int j = 0; j < NT; ++j) {
+            for (int i = 0; i < NT; ++i) {
+                sumi[j][i] = _mm256_setzero_si256();
+            }
+        }
+
+        for (int k = 0; k < QK_K/64; ++k) {
+            for (int i = 0; i < NT; ++i) {
+                const __m256i scale_l = _mm256_shuffle_epi8(scales[i], get_scale_shuffle_k4(2*k+0));
+                const __m256i scale_h = _mm256_shuffle_epi8(scales[i], get_scale_shuffle_k4(2*k+1));
+
+                const __m256i q4bits = _mm256_loadu_si256((const __m256i *) (xb[i]->qs + 32*k));
+                const __m256i q4l = _mm256_and_si256(q4bits, m4);
+                const __m256i q4h = _mm256_and_si256(_mm256_srli_epi16(q4bits, 4), m4);
+
+                for (int j = 0; j < NT; ++j) {
+                    const __m256i q8l = _mm256_loadu_si256((const __m256i *) (yb[j]->qs + 64*k +  0));
+                    const __m256i q8h = _mm256_loadu_si256((const __m256i *) (yb[j]->qs + 64*k + 32));
+
+                    // the tile has enough independent accumulators to chain the products into them
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_l, _mm256_maddubs_epi16(q4l, q8l));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_h, _mm256_maddubs_epi16(q4h, q8h));
+                }
+            }
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i *) yb[j]->bsums);
+            const __m128i q8s    = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+
+            for (int i = 0; i < NT; ++i) {
+                const float d    =  yb[j]->d * GGML_FP16_TO_FP32(xb[i]->d);
+                const float dmin = -yb[j]->d * GGML_FP16_TO_FP32(xb[i]->dmin);
+
+                const __m256i prod = _mm256_inserti128_si256(_mm256_setzero_si256(), _mm_madd_epi16(mins[i], q8s), 0);
+
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(d),    _mm256_cvtepi32_ps(sumi[j][i]), acc[j][i]);
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(dmin), _mm256_cvtepi32_ps(prod),       acc[j][i]);
+            }
+        }
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q4_K_q8_K);
+#endif
+}
+
+void ggml_gemm_q5_K_q8_K(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const int nb = n / QK_K;
+
+#if defined(__AVX2__) && QK_K == 256
+    static const uint32_t kmask1 = 0x3f3f3f3f;
+    static const uint32_t kmask2 = 0x0f0f0f0f;
+    static const uint32_t kmask3 = 0x03030303;
+
+    const __m256i m4   = _mm256_set1_epi8(0xF);
+    const __m256i mone = _mm256_set1_epi8(1);
+
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const block_q5_K * xb[NT];
+        const block_q8_K * yb[NT];
+
+        __m256i scales[NT];
+        __m128i mins[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            xb[i] = (const block_q5_K *) ((const char *) vx + i*bx) + ib;
+
+            uint32_t utmp[4];
+            memcpy(utmp, xb[i]->scales, 12);
+            utmp[3] = ((utmp[2] >> 4) & kmask2) | (((utmp[1] >> 6) & kmask3) << 4);
+            const uint32_t uaux = utmp[1] & kmask1;
+            utmp[1] = (utmp[2] & kmask2) | (((utmp[0] >> 6) & kmask3) << 4);
+            utmp[2] = uaux;
+            utmp[0] &= kmask1;
+
+            const __m256i mins_and_scales = _mm256_cvtepu8_epi16(_mm_set_epi32(utmp[3], utmp[2], utmp[1], utmp[0]));
+
+            const __m128i sc128 = _mm256_extracti128_si256(mins_and_scales, 0);
+            scales[i] = MM256_SET_M128I(sc128, sc128);
+            mins[i]   = _mm256_extracti128_si256(mins_and_scales, 1);
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_K *) ((const char *) vy + j*by) + ib;
+        }
+
+        __m256i sumi[NT][NT];
+        for (int j = 0; j < NT; ++j) {
+            for (int i = 0; i < NT; ++i) {
+                sumi[j][i] = _mm256_setzero_si256();
+            }
+        }
+
+        for (int k = 0; k < QK_K/64; ++k) {
+            for (int i = 0; i < NT; ++i) {
+                const __m256i scale_l = _mm256_shuffle_epi8(scales[i], get_scale_shuffle_k4(2*k+0));
+                const __m256i scale_h = _mm256_shuffle_epi8(scales[i], get_scale_shuffle_k4(2*k+1));
+
+                const __m256i q5bits = _mm256_loadu_si256((const __m256i *) (xb[i]->qs + 32*k));
+                const __m256i hbits  = _mm256_loadu_si256((const __m256i *) xb[i]->qh);
+
+                const __m256i q5h_l = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 2*k + 0), mone), 4);
+                const __m256i q5h_h = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(hbits, 2*k + 1), mone), 4);
+
+                const __m256i q5l = _mm256_or_si256(_mm256_and_si256(q5bits, m4), q5h_l);
+                const __m256i q5h = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q5bits, 4), m4), q5h_h);
+
+                for (int j = 0; j < NT; ++j) {
+                    const __m256i q8l = _mm256_loadu_si256((const __m256i *) (yb[j]->qs + 64*k +  0));
+                    const __m256i q8h = _mm256_loadu_si256((const __m256i *) (yb[j]->qs + 64*k + 32));
+
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_l, _mm256_maddubs_epi16(q5l, q8l));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_h, _mm256_maddubs_epi16(q5h, q8h));
+                }
+            }
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i *) yb[j]->bsums);
+            const __m128i q8s    = _mm_hadd_epi16(_mm256_extracti128_si256(q8sums, 0), _mm256_extracti128_si256(q8sums, 1));
+
+            for (int i = 0; i < NT; ++i) {
+                const float d    =  yb[j]->d * GGML_FP16_TO_FP32(xb[i]->d);
+                const float dmin = -yb[j]->d * GGML_FP16_TO_FP32(xb[i]->dmin);
+
+                const __m256i prod = _mm256_inserti128_si256(_mm256_setzero_si256(), _mm_madd_epi16(mins[i], q8s), 0);
+
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(d),    _mm256_cvtepi32_ps(sumi[j][i]), acc[j][i]);
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(dmin), _mm256_cvtepi32_ps(prod),       acc[j][i]);
+            }
+        }
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q5_K_q8_K);
+#endif
+}
+
+void ggml_gemm_q6_K_q8_K(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    assert(n % QK_K == 0);
+
+    const int nb = n / QK_K;
+
+#if defined(__AVX2__) && QK_K == 256
+    const __m256i m4 = _mm256_set1_epi8(0xF);
+    const __m256i m2 = _mm256_set1_epi8(3);
+
+    __m256 acc[NT][NT];
+    for (int j = 0; j < NT; ++j) {
+        for (int i = 0; i < NT; ++i) {
+            acc[j][i] = _mm256_setzero_ps();
+        }
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        const block_q6_K * xb[NT];
+        const block_q8_K * yb[NT];
+
+        __m128i scales[NT];
+
+        for (int i = 0; i < NT; ++i) {
+            xb[i] = (const block_q6_K *) ((const char *) vx + i*bx) + ib;
+            scales[i] = _mm_loadu_si128((const __m128i *) xb[i]->scales);
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            yb[j] = (const block_q8_K *) ((const char *) vy + j*by) + ib;
+        }
+
+        // the -32 offset of the quants is applied once per block using the sums of y over groups of 16
+        __m256i sumi[NT][NT];
+        for (int j = 0; j < NT; ++j) {
+            const __m256i q8sums = _mm256_loadu_si256((const __m256i *) yb[j]->bsums);
+
+            for (int i = 0; i < NT; ++i) {
+                sumi[j][i] = _mm256_slli_epi32(_mm256_madd_epi16(_mm256_cvtepi8_epi16(scales[i]), q8sums), 5);
+                sumi[j][i] = _mm256_sub_epi32(_mm256_setzero_si256(), sumi[j][i]);
+            }
+        }
+
+        for (int k = 0; k < QK_K/128; ++k) {
+            for (int i = 0; i < NT; ++i) {
+                const __m256i scale_0 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 0)));
+                const __m256i scale_1 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 1)));
+                const __m256i scale_2 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 2)));
+                const __m256i scale_3 = _mm256_cvtepi8_epi16(_mm_shuffle_epi8(scales[i], get_scale_shuffle(4*k + 3)));
+
+                const __m256i q4bits1 = _mm256_loadu_si256((const __m256i *) (xb[i]->ql + 64*k +  0));
+                const __m256i q4bits2 = _mm256_loadu_si256((const __m256i *) (xb[i]->ql + 64*k + 32));
+                const __m256i q4bitsH = _mm256_loadu_si256((const __m256i *) (xb[i]->qh + 32*k));
+
+                const __m256i q4h_0 = _mm256_slli_epi16(_mm256_and_si256(q4bitsH, m2), 4);
+                const __m256i q4h_1 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 2), m2), 4);
+                const __m256i q4h_2 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 4), m2), 4);
+                const __m256i q4h_3 = _mm256_slli_epi16(_mm256_and_si256(_mm256_srli_epi16(q4bitsH, 6), m2), 4);
+
+                const __m256i q4_0 = _mm256_or_si256(_mm256_and_si256(q4bits1, m4), q4h_0);
+                const __m256i q4_1 = _mm256_or_si256(_mm256_and_si256(q4bits2, m4), q4h_1);
+                const __m256i q4_2 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits1, 4), m4), q4h_2);
+                const __m256i q4_3 = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(q4bits2, 4), m4), q4h_3);
+
+                for (int j = 0; j < NT; ++j) {
+                    const int8_t * restrict q8 = yb[j]->qs + 128*k;
+
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_0, _mm256_maddubs_epi16(q4_0, _mm256_loadu_si256((const __m256i *) (q8 +  0))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_1, _mm256_maddubs_epi16(q4_1, _mm256_loadu_si256((const __m256i *) (q8 + 32))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_2, _mm256_maddubs_epi16(q4_2, _mm256_loadu_si256((const __m256i *) (q8 + 64))));
+                    sumi[j][i] = mul_add_i16_pairs(sumi[j][i], scale_3, _mm256_maddubs_epi16(q4_3, _mm256_loadu_si256((const __m256i *) (q8 + 96))));
+                }
+            }
+        }
+
+        for (int j = 0; j < NT; ++j) {
+            for (int i = 0; i < NT; ++i) {
+                const float d = yb[j]->d * GGML_FP16_TO_FP32(xb[i]->d);
+
+                acc[j][i] = _mm256_fmadd_ps(_mm256_set1_ps(d), _mm256_cvtepi32_ps(sumi[j][i]), acc[j][i]);
+            }
+        }
+    }
+
+    gemm_store(s, bs, acc);
+#else
+    GGML_UNUSED(nb);
+    gemm_generic(n, s, bs, vx, bx, vy, by, ggml_vec_dot_q6_K_q8_K);
+#endif
+}
+
+#undef NT
+
+//===================================== Interleaved rows =============================
+
+// the repacked types store 4 rows block by block, so one load of y is used for 4 rows and the weights are read
+// as a single stream; the scales of the 4 rows are loaded and applied as one vector
+
+void ggml_repack_q4_0x4(const block_q4_0 * restrict x, block_q4_0x4 * restrict y, int nb) {
+    for (int ib = 0; ib < nb; ++ib) {
+        for (int r = 0; r < 4; ++r) {
+            y[ib].d[r] = x[r*nb + ib].d;
+            memcpy(y[ib].qs + r*QK4_0/2, x[r*nb + ib].qs, QK4_0/2);
+        }
+    }
+}
+
+void ggml_repack_q8_0x4(const block_q8_0 * restrict x, block_q8_0x4 * restrict y, int nb) {
+    for (int ib = 0; ib < nb; ++ib) {
+        for (int r = 0; r < 4; ++r) {
+            y[ib].d[r] = x[r*nb + ib].d;
+            memcpy(y[ib].qs + r*QK8_0, x[r*nb + ib].qs, QK8_0);
+        }
+    }
+}
+
+#if defined(__AVX2__)
+// multiply unsigned int8_t with signed int8_t, add results pairwise twice and return as int32_t vector
+static inline __m256i mul_sum_us8_pairs_i32(const __m256i ax, const __m256i sy) {
+#if defined(GGML_AVX_VNNI)
+    return _mm256_dpbusd_epi32(_mm256_setzero_si256(), ax, sy);
+#else
+    return _mm256_madd_epi16(_mm256_set1_epi16(1), _mm256_maddubs_epi16(ax, sy));
+#endif
+}
+
+// horizontally add 8 int32_t of 4 vectors, one result per vector
+static inline __m128i hsum_i32_8_x4(const __m256i p[4]) {
+    const __m256i p01 = _mm256_hadd_epi32(p[0], p[1]);
+    const __m256i p23 = _mm256_hadd_epi32(p[2], p[3]);
+    const __m256i sum = _mm256_hadd_epi32(p01, p23);
+    return _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+}
+
+static inline __m128 load_fp16_x4(const ggml_fp16_t * x) {
+#if defined(__F16C__)
+    return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) x));
+#else
+    return _mm_set_ps(GGML_FP16_TO_FP32(x[3]), GGML_FP16_TO_FP32(x[2]), GGML_FP16_TO_FP32(x[1]), GGML_FP16_TO_FP32(x[0]));
+#endif
+}
+
+// acc[j] += dx*dy[j]*(x_r . y_j) for one block of 32 int8 values in each of the 4 rows of x and nc rows of y
+static inline void gemm_acc_i8_x4(__m128 * acc, const __m256i qx[4], const __m128 dx, const block_q8_0 * const * yb, int nc) {
+    __m256i ax[4];
+    for (int r = 0; r < 4; ++r) {
+        ax[r] = _mm256_sign_epi8(qx[r], qx[r]);
+    }
+
+    for (int j = 0; j < nc; ++j) {
+        const __m256i qy = _mm256_loadu_si256((const __m256i *) yb[j]->qs);
+
+        __m256i p[4];
+        for (int r = 0; r < 4; ++r) {
+            p[r] = mul_sum_us8_pairs_i32(ax[r], _mm256_sign_epi8(qy, qx[r]));
+        }
+
+        const __m128 d = _mm_mul_ps(dx, _mm_set1_ps(GGML_FP16_TO_FP32(yb[j]->d)));
+
+        acc[j] = _mm_fmadd_ps(d, _mm_cvtepi32_ps(hsum_i32_8_x4(p)), acc[j]);
+    }
+}
+
+static inline void unpack_q4_0x4(__m256i qx[4], const block_q4_0x4 * restrict xb) {
+    const __m256i off = _mm256_set1_epi8(8);
+    for (int r = 0; r < 4; ++r) {
+        qx[r] = _mm256_sub_epi8(bytes_from_nibbles_32(xb->qs + r*QK4_0/2), off);
+    }
+}
+
+static inline void unpack_q8_0x4(__m256i qx[4], const block_q8_0x4 * restrict xb) {
+    for (int r = 0; r < 4; ++r) {
+        qx[r] = _mm256_loadu_si256((const __m256i *) (xb->qs + r*QK8_0));
+    }
+}
+#endif
+
+void ggml_vec_dot_q4_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q4_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m128 acc = _mm_setzero_ps();
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i qx[4];
+        unpack_q4_0x4(qx, &x[ib]);
+
+        const block_q8_0 * yb = &y[ib];
+        gemm_acc_i8_x4(&acc, qx, load_fp16_x4(x[ib].d), &yb, 1);
+    }
+
+    _mm_storeu_ps(s, acc);
+#else
+    for (int r = 0; r < 4; ++r) {
+        float sumf = 0.0;
+
+        for (int ib = 0; ib < nb; ++ib) {
+            const uint8_t * restrict qs = x[ib].qs + r*qk/2;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk/2; ++j) {
+                const int v0 = (qs[j] & 0x0F) - 8;
+                const int v1 = (qs[j] >>   4) - 8;
+
+                sumi += (v0 * y[ib].qs[j]) + (v1 * y[ib].qs[j + qk/2]);
+            }
+
+            sumf += sumi*GGML_FP16_TO_FP32(x[ib].d[r])*GGML_FP16_TO_FP32(y[ib].d);
+        }
+
+        s[r] = sumf;
+    }
+#endif
+}
+
+void ggml_vec_dot_q8_0x4_q8_0(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+
+    const block_q8_0x4 * restrict x = vx;
+    const block_q8_0   * restrict y = vy;
+
+#if defined(__AVX2__)
+    __m128 acc = _mm_setzero_ps();
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i qx[4];
+        unpack_q8_0x4(qx, &x[ib]);
+
+        const block_q8_0 * yb = &y[ib];
+        gemm_acc_i8_x4(&acc, qx, load_fp16_x4(x[ib].d), &yb, 1);
+    }
+
+    _mm_storeu_ps(s, acc);
+#else
+    for (int r = 0; r < 4; ++r) {
+        float sumf = 0.0;
+
+        for (int ib = 0; ib < nb; ++ib) {
+            const int8_t * restrict qs = x[ib].qs + r*qk;
+
+            int sumi = 0;
+
+            for (int j = 0; j < qk; ++j) {
+                sumi += qs[j]*y[ib].qs[j];
+            }
+
+            sumf += sumi*GGML_FP16_TO_FP32(x[ib].d[r])*GGML_FP16_TO_FP32(y[ib].d);
+        }
+
+        s[r] = sumf;
+    }
+#endif
+}
+
+// the 4 rows of x are interleaved, bx is not used
+void ggml_gemm_q4_0x4_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    GGML_UNUSED(bx);
+
+#if defined(__AVX2__)
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    static_assert(GGML_GEMM_TILE == 4, "the interleaved rows must match the tile size");
+
+    const block_q4_0x4 * restrict x = vx;
+
+    __m128 acc[4];
+    for (int j = 0; j < 4; ++j) {
+        acc[j] = _mm_setzero_ps();
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i qx[4];
+        unpack_q4_0x4(qx, &x[ib]);
+
+        const block_q8_0 * yb[4];
+        for (int j = 0; j < 4; ++j) {
+            yb[j] = (const block_q8_0 *) ((const char *) vy + j*by) + ib;
+        }
+
+        gemm_acc_i8_x4(acc, qx, load_fp16_x4(x[ib].d), yb, 4);
+    }
+
+    for (int j = 0; j < 4; ++j) {
+        _mm_storeu_ps(s + j*bs, acc[j]);
+    }
+#else
+    for (int j = 0; j < GGML_GEMM_TILE; ++j) {
+        ggml_vec_dot_q4_0x4_q8_0(n, s + j*bs, vx, (const char *) vy + j*by);
+    }
+#endif
+}
+
+void ggml_gemm_q8_0x4_q8_0(const int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by) {
+    GGML_UNUSED(bx);
+
+#if defined(__AVX2__)
+    const int qk = QK8_0;
+    const int nb = n / qk;
+
+    assert(n % qk == 0);
+    static_assert(GGML_GEMM_TILE == 4, "the interleaved rows must match the tile size");
+
+    const block_q8_0x4 * restrict x = vx;
+
+    __m128 acc[4];
+    for (int j = 0; j < 4; ++j) {
+        acc[j] = _mm_setzero_ps();
+    }
+
+    for (int ib = 0; ib < nb; ++ib) {
+        __m256i qx[4];
+        unpack_q8_0x4(qx, &x[ib]);
+
+        const block_q8_0 * yb[4];
+        for (int j = 0; j < 4; ++j) {
+            yb[j] = (const block_q8_0 *) ((const char *) vy + j*by) + ib;
+        }
+
+        gemm_acc_i8_x4(acc, qx, load_fp16_x4(x[ib].d), yb, 4);
+    }
+
+    for (int j = 0; j < 4; ++j) {
+        _mm_storeu_ps(s + j*bs, acc[j]);
+    }
+#else
+    for (int j = 0; j < GGML_GEMM_TILE; ++j) {
+        ggml_vec_dot_q8_0x4_q8_0(n, s + j*bs, vx, (const char *) vy + j*by);
+    }
+#endif
+}
+
+#ifdef GGML_CPU_VARIANT
+//===================================== CPU variants =================================
+
+// the f32/f16 kernels of the type traits, for the variants that have the vector instructions they need
+// the rest of the vector ops of ggml.c (activations, norms, f16 unrolled dot) keep the instruction set of the build
+
+#if defined(__AVX__)
+static void ggml_vec_dot_f32_variant(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const float * restrict x = vx;
+    const float * restrict y = vy;
+
+    __m256 sum[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            const __m256 ax = _mm256_loadu_ps(x + i + 8*j);
+            const __m256 ay = _mm256_loadu_ps(y + i + 8*j);
+#if defined(__FMA__)
+            sum[j] = _mm256_fmadd_ps(ax, ay, sum[j]);
+#else
+            sum[j] = _mm256_add_ps(_mm256_mul_ps(ax, ay), sum[j]);
+#endif
+        }
+    }
+
+    float sumf = hsum_float_8(_mm256_add_ps(_mm256_add_ps(sum[0], sum[1]), _mm256_add_ps(sum[2], sum[3])));
+
+    // leftovers
+    for (; i < n; ++i) {
+        sumf += x[i]*y[i];
+    }
+
+    *s = sumf;
+}
+#endif
+
+#if defined(__AVX__) && defined(__F16C__)
+static void ggml_vec_dot_f16_variant(const int n, float * restrict s, const void * restrict vx, const void * restrict vy) {
+    const ggml_fp16_t * restrict x = vx;
+    const ggml_fp16_t * restrict y = vy;
+
+    __m256 sum[4] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+    int i = 0;
+    for (; i + 31 < n; i += 32) {
+        for (int j = 0; j < 4; ++j) {
+            const __m256 ax = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (x + i + 8*j)));
+            const __m256 ay = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (y + i + 8*j)));
+#if defined(__FMA__)
+            sum[j] = _mm256_fmadd_ps(ax, ay, sum[j]);
+#else
+            sum[j] = _mm256_add_ps(_mm256_mul_ps(ax, ay), sum[j]);
+#endif
+        }
+    }
+
+    double sumf = hsum_float_8(_mm256_add_ps(_mm256_add_ps(sum[0], sum[1]), _mm256_add_ps(sum[2], sum[3])));
+
+    // leftovers
+    for (; i < n; ++i) {
+        sumf += (double)(GGML_FP16_TO_FP32(x[i])*GGML_FP16_TO_FP32(y[i]));
+    }
+
+    *s = sumf;
+}
+
+static void ggml_fp16_to_fp32_row_variant(const void * restrict vx, float * restrict y, int n) {
+    const ggml_fp16_t * restrict x = vx;
+
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (x + i))));
+    }
+    for (; i < n; ++i) {
+        y[i] = GGML_FP16_TO_FP32(x[i]);
+    }
+}
+
+static void ggml_fp32_to_fp16_row_variant(const float * restrict x, void * restrict vy, int n) {
+    ggml_fp16_t * restrict y = vy;
+
+    int i = 0;
+    for (; i + 7 < n; i += 8) {
+        _mm_storeu_si128((__m128i *) (y + i), _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT));
+    }
+    for (; i < n; ++i) {
+        y[i] = GGML_FP32_TO_FP16(x[i]);
+    }
+}
+#endif
+
+void ggml_quants_set_kernels(ggml_type_traits_t * traits) {
+#define SET_KERNELS(type, name, dot) \
+    traits[type].to_float   = (ggml_to_float_t) dequantize_row_ ## name; \
+    traits[type].from_float = quantize_row_ ## name; \
+    traits[type].vec_dot    = ggml_vec_dot_ ## name ## _ ## dot
+
+    SET_KERNELS(GGML_TYPE_Q4_0, q4_0, q8_0);
+    SET_KERNELS(GGML_TYPE_Q4_1, q4_1, q8_1);
+    SET_KERNELS(GGML_TYPE_Q5_0, q5_0, q8_0);
+    SET_KERNELS(GGML_TYPE_Q5_1, q5_1, q8_1);
+    SET_KERNELS(GGML_TYPE_Q8_0, q8_0, q8_0);
+    SET_KERNELS(GGML_TYPE_Q2_K, q2_K, q8_K);
+    SET_KERNELS(GGML_TYPE_Q3_K, q3_K, q8_K);
+    SET_KERNELS(GGML_TYPE_Q4_K, q4_K, q8_K);
+    SET_KERNELS(GGML_TYPE_Q5_K, q5_K, q8_K);
+    SET_KERNELS(GGML_TYPE_Q6_K, q6_K, q8_K);
+
+#undef SET_KERNELS
+
+    // the types that are only used for src1 of mul_mat
+    traits[GGML_TYPE_Q8_1].from_float = quantize_row_q8_1;
+    traits[GGML_TYPE_Q8_K].from_float = quantize_row_q8_K;
+
+    traits[GGML_TYPE_Q4_0X4].vec_dot = ggml_vec_dot_q4_0x4_q8_0;
+    traits[GGML_TYPE_Q8_0X4].vec_dot = ggml_vec_dot_q8_0x4_q8_0;
+
+    traits[GGML_TYPE_Q4_0  ].gemm = ggml_gemm_q4_0_q8_0;
+    traits[GGML_TYPE_Q8_0  ].gemm = ggml_gemm_q8_0_q8_0;
+    traits[GGML_TYPE_Q2_K  ].gemm = ggml_gemm_q2_K_q8_K;
+    traits[GGML_TYPE_Q3_K  ].gemm = ggml_gemm_q3_K_q8_K;
+    traits[GGML_TYPE_Q4_K  ].gemm = ggml_gemm_q4_K_q8_K;
+    traits[GGML_TYPE_Q5_K  ].gemm = ggml_gemm_q5_K_q8_K;
+    traits[GGML_TYPE_Q6_K  ].gemm = ggml_gemm_q6_K_q8_K;
+    traits[GGML_TYPE_Q4_0X4].gemm = ggml_gemm_q4_0x4_q8_0;
+    traits[GGML_TYPE_Q8_0X4].gemm = ggml_gemm_q8_0x4_q8_0;
+
+#if defined(__AVX__)
+    traits[GGML_TYPE_F32].vec_dot = ggml_vec_dot_f32_variant;
+#endif
+#if defined(__AVX__) && defined(__F16C__)
+    traits[GGML_TYPE_F16].vec_dot    = ggml_vec_dot_f16_variant;
+    traits[GGML_TYPE_F16].to_float   = ggml_fp16_to_fp32_row_variant;
+    traits[GGML_TYPE_F16].from_float = ggml_fp32_to_fp16_row_variant;
+#endif
+}
+#endif
@@ -1,5 +1,78 @@
 #pragma once
 
+// with LLAMA_CPU_VARIANTS, ggml-quants.c is compiled once more for each instruction set with GGML_CPU_VARIANT defined
+// to the name of the set - the functions of these copies get the name as suffix, ggml.c selects one of them at ggml_init
+// (before including ggml.h, so that its declarations of the ggml-quants.c functions are renamed too)
+#ifdef GGML_CPU_VARIANT
+#define GGML_CPU_VARIANT_NAME_(name, variant) name ## _ ## variant
+#define GGML_CPU_VARIANT_NAME(name, variant)  GGML_CPU_VARIANT_NAME_(name, variant)
+
+#define dequantize_row_q2_K                 GGML_CPU_VARIANT_NAME(dequantize_row_q2_K, GGML_CPU_VARIANT)
+#define dequantize_row_q3_K                 GGML_CPU_VARIANT_NAME(dequantize_row_q3_K, GGML_CPU_VARIANT)
+#define dequantize_row_q4_0                 GGML_CPU_VARIANT_NAME(dequantize_row_q4_0, GGML_CPU_VARIANT)
+#define dequantize_row_q4_1                 GGML_CPU_VARIANT_NAME(dequantize_row_q4_1, GGML_CPU_VARIANT)
+#define dequantize_row_q4_K                 GGML_CPU_VARIANT_NAME(dequantize_row_q4_K, GGML_CPU_VARIANT)
+#define dequantize_row_q5_0                 GGML_CPU_VARIANT_NAME(dequantize_row_q5_0, GGML_CPU_VARIANT)
+#define dequantize_row_q5_1                 GGML_CPU_VARIANT_NAME(dequantize_row_q5_1, GGML_CPU_VARIANT)
+#define dequantize_row_q5_K                 GGML_CPU_VARIANT_NAME(dequantize_row_q5_K, GGML_CPU_VARIANT)
+#define dequantize_row_q6_K                 GGML_CPU_VARIANT_NAME(dequantize_row_q6_K, GGML_CPU_VARIANT)
+#define dequantize_row_q8_0                 GGML_CPU_VARIANT_NAME(dequantize_row_q8_0, GGML_CPU_VARIANT)
+#define dequantize_row_q8_K                 GGML_CPU_VARIANT_NAME(dequantize_row_q8_K, GGML_CPU_VARIANT)
+#define ggml_gemm_q4_0_q8_0                 GGML_CPU_VARIANT_NAME(ggml_gemm_q4_0_q8_0, GGML_CPU_VARIANT)
+#define ggml_gemm_q4_0x4_q8_0               GGML_CPU_VARIANT_NAME(ggml_gemm_q4_0x4_q8_0, GGML_CPU_VARIANT)
+#define ggml_gemm_q2_K_q8_K                 GGML_CPU_VARIANT_NAME(ggml_gemm_q2_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_gemm_q3_K_q8_K                 GGML_CPU_VARIANT_NAME(ggml_gemm_q3_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_gemm_q4_K_q8_K                 GGML_CPU_VARIANT_NAME(ggml_gemm_q4_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_gemm_q5_K_q8_K                 GGML_CPU_VARIANT_NAME(ggml_gemm_q5_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_gemm_q6_K_q8_K                 GGML_CPU_VARIANT_NAME(ggml_gemm_q6_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_gemm_q8_0_q8_0                 GGML_CPU_VARIANT_NAME(ggml_gemm_q8_0_q8_0, GGML_CPU_VARIANT)
+#define ggml_gemm_q8_0x4_q8_0               GGML_CPU_VARIANT_NAME(ggml_gemm_q8_0x4_q8_0, GGML_CPU_VARIANT)
+#define ggml_quantize_q2_K                  GGML_CPU_VARIANT_NAME(ggml_quantize_q2_K, GGML_CPU_VARIANT)
+#define ggml_quantize_q3_K                  GGML_CPU_VARIANT_NAME(ggml_quantize_q3_K, GGML_CPU_VARIANT)
+#define ggml_quantize_q4_K                  GGML_CPU_VARIANT_NAME(ggml_quantize_q4_K, GGML_CPU_VARIANT)
+#define ggml_quantize_q5_K                  GGML_CPU_VARIANT_NAME(ggml_quantize_q5_K, GGML_CPU_VARIANT)
+#define ggml_quantize_q6_K                  GGML_CPU_VARIANT_NAME(ggml_quantize_q6_K, GGML_CPU_VARIANT)
+#define ggml_repack_q4_0x4                  GGML_CPU_VARIANT_NAME(ggml_repack_q4_0x4, GGML_CPU_VARIANT)
+#define ggml_repack_q8_0x4                  GGML_CPU_VARIANT_NAME(ggml_repack_q8_0x4, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q2_K_q8_K              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q2_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q3_K_q8_K              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q3_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q4_0_q8_0              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q4_0_q8_0, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q4_0x4_q8_0            GGML_CPU_VARIANT_NAME(ggml_vec_dot_q4_0x4_q8_0, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q4_1_q8_1              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q4_1_q8_1, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q4_K_q8_K              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q4_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q5_0_q8_0              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q5_0_q8_0, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q5_1_q8_1              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q5_1_q8_1, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q5_K_q8_K              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q5_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q6_K_q8_K              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q6_K_q8_K, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q8_0_q8_0              GGML_CPU_VARIANT_NAME(ggml_vec_dot_q8_0_q8_0, GGML_CPU_VARIANT)
+#define ggml_vec_dot_q8_0x4_q8_0            GGML_CPU_VARIANT_NAME(ggml_vec_dot_q8_0x4_q8_0, GGML_CPU_VARIANT)
+#define quantize_row_q2_K                   GGML_CPU_VARIANT_NAME(quantize_row_q2_K, GGML_CPU_VARIANT)
+#define quantize_row_q2_K_reference         GGML_CPU_VARIANT_NAME(quantize_row_q2_K_reference, GGML_CPU_VARIANT)
+#define quantize_row_q3_K                   GGML_CPU_VARIANT_NAME(quantize_row_q3_K, GGML_CPU_VARIANT)
+#define quantize_row_q3_K_reference         GGML_CPU_VARIANT_NAME(quantize_row_q3_K_reference, GGML_CPU_VARIANT)
+#define quantize_row_q4_0                   GGML_CPU_VARIANT_NAME(quantize_row_q4_0, GGML_CPU_VARIANT)
+#define quantize_row_q4_0_reference         GGML_CPU_VARIANT_NAME(quantize_row_q4_0_reference, GGML_CPU_VARIANT)
+#define quantize_row_q4_1                   GGML_CPU_VARIANT_NAME(quantize_row_q4_1, GGML_CPU_VARIANT)
+#define quantize_row_q4_1_reference         GGML_CPU_VARIANT_NAME(quantize_row_q4_1_reference, GGML_CPU_VARIANT)
+#define quantize_row_q4_K                   GGML_CPU_VARIANT_NAME(quantize_row_q4_K, GGML_CPU_VARIANT)
+#define quantize_row_q4_K_reference         GGML_CPU_VARIANT_NAME(quantize_row_q4_K_reference, GGML_CPU_VARIANT)
+#define quantize_row_q5_0                   GGML_CPU_VARIANT_NAME(quantize_row_q5_0, GGML_CPU_VARIANT)
+#define quantize_row_q5_0_reference         GGML_CPU_VARIANT_NAME(quantize_row_q5_0_reference, GGML_CPU_VARIANT)
+#define quantize_row_q5_1                   GGML_CPU_VARIANT_NAME(quantize_row_q5_1, GGML_CPU_VARIANT)
+#define quantize_row_q5_1_reference         GGML_CPU_VARIANT_NAME(quantize_row_q5_1_reference, GGML_CPU_VARIANT)
+#define quantize_row_q5_K                   GGML_CPU_VARIANT_NAME(quantize_row_q5_K, GGML_CPU_VARIANT)
+#define quantize_row_q5_K_reference         GGML_CPU_VARIANT_NAME(quantize_row_q5_K_reference, GGML_CPU_VARIANT)
+#define quantize_row_q6_K                   GGML_CPU_VARIANT_NAME(quantize_row_q6_K, GGML_CPU_VARIANT)
+#define quantize_row_q6_K_reference         GGML_CPU_VARIANT_NAME(quantize_row_q6_K_reference, GGML_CPU_VARIANT)
+#define quantize_row_q8_0                   GGML_CPU_VARIANT_NAME(quantize_row_q8_0, GGML_CPU_VARIANT)
+#define quantize_row_q8_0_reference         GGML_CPU_VARIANT_NAME(quantize_row_q8_0_reference, GGML_CPU_VARIANT)
+#define quantize_row_q8_1                   GGML_CPU_VARIANT_NAME(quantize_row_q8_1, GGML_CPU_VARIANT)
+#define quantize_row_q8_1_reference         GGML_CPU_VARIANT_NAME(quantize_row_q8_1_reference, GGML_CPU_VARIANT)
+#define quantize_row_q8_K                   GGML_CPU_VARIANT_NAME(quantize_row_q8_K, GGML_CPU_VARIANT)
+#define quantize_row_q8_K_reference         GGML_CPU_VARIANT_NAME(quantize_row_q8_K_reference, GGML_CPU_VARIANT)
+#define ggml_quants_set_kernels             GGML_CPU_VARIANT_NAME(ggml_quants_set_kernels, GGML_CPU_VARIANT)
+#endif
+
 #include "ggml-impl.h"
 
 // GGML internal header
@@ -54,6 +127,20 @@ typedef struct {
 } block_q8_1;
 static_assert(sizeof(block_q8_1) == 2*sizeof(float) + QK8_1, "wrong q8_1 block size/padding");
 
+// 4 rows of Q4_0 or Q8_0 interleaved block by block, created at load time by ggml_repack_tensor
+// the scales of the 4 rows are next to each other, followed by the quants of each row
+typedef struct {
+    ggml_fp16_t d[4];          // deltas
+    uint8_t qs[4 * QK4_0 / 2]; // nibbles / quants, 16 bytes per row
+} block_q4_0x4;
+static_assert(sizeof(block_q4_0x4) == 4 * sizeof(block_q4_0), "wrong q4_0x4 block size/padding");
+
+typedef struct {
+    ggml_fp16_t d[4];          // deltas
+    int8_t  qs[4 * QK8_0];     // quants, 32 bytes per row
+} block_q8_0x4;
+static_assert(sizeof(block_q8_0x4) == 4 * sizeof(block_q8_0), "wrong q8_0x4 block size/padding");
+
 //
 // Super-block quantization structures
 //
@@ -222,3 +309,27 @@ void ggml_vec_dot_q3_K_q8_K(int n, float * restrict s, const void * restrict vx,
 void ggml_vec_dot_q4_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q5_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
 void ggml_vec_dot_q6_K_q8_K(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+// Repacking of 4 rows of nb blocks
+void ggml_repack_q4_0x4(const block_q4_0 * restrict x, block_q4_0x4 * restrict y, int nb);
+void ggml_repack_q8_0x4(const block_q8_0 * restrict x, block_q8_0x4 * restrict y, int nb);
+
+// Dot products of 4 interleaved rows with one row of y - the results are stored in s[0..3]
+void ggml_vec_dot_q4_0x4_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+void ggml_vec_dot_q8_0x4_q8_0(int n, float * restrict s, const void * restrict vx, const void * restrict vy);
+
+// Tiles of GGML_GEMM_TILE x GGML_GEMM_TILE dot products
+void ggml_gemm_q4_0_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q8_0_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q2_K_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q3_K_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q4_K_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q5_K_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q6_K_q8_K(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q4_0x4_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+void ggml_gemm_q8_0x4_q8_0(int n, float * restrict s, size_t bs, const void * restrict vx, size_t bx, const void * restrict vy, size_t by);
+
+#ifdef GGML_CPU_VARIANT
+// Replace the kernels in the type traits with the ones of this copy of ggml-quants.c
+void ggml_quants_set_kernels(ggml_type_traits_t * traits);
+#endif
@@ -80,6 +80,45 @@ static int pthread_join(pthread_t thread, void * unused) {
     return ret;
 }
 
+typedef SRWLOCK            pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeSRWLock(mutex);
+    return 0;
+}
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    (void) mutex;
+    return 0;
+}
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    AcquireSRWLockExclusive(mutex);
+    return 0;
+}
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    ReleaseSRWLockExclusive(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+    return 0;
+}
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
+
 static int sched_yield (void) {
     Sleep (0);
     return 0;
@@ -94,6 +133,10 @@ typedef void * thread_ret_t;
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
 #endif
 
 #ifdef GGML_USE_CPU_HBM
@@ -363,7 +406,7 @@ static const size_t CACHE_LINE_SIZE_F32 = CACHE_LINE_SIZE/sizeof(float);
 static void ggml_vec_dot_f32(const int n, float * restrict s, const float * restrict x, const float * restrict y);
 static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * restrict x, ggml_fp16_t * restrict y);
 
-static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
+static ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
     [GGML_TYPE_I8] = {
         .type_name                = "i8",
         .blck_size                = 1,
@@ -411,6 +454,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_0_reference,
         .vec_dot                  = ggml_vec_dot_q4_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .gemm                     = ggml_gemm_q4_0_q8_0,
     },
     [GGML_TYPE_Q4_1] = {
         .type_name                = "q4_1",
@@ -477,6 +521,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q8_0_reference,
         .vec_dot                  = ggml_vec_dot_q8_0_q8_0,
         .vec_dot_type             = GGML_TYPE_Q8_0,
+        .gemm                     = ggml_gemm_q8_0_q8_0,
     },
     [GGML_TYPE_Q8_1] = {
         .type_name                = "q8_1",
@@ -497,6 +542,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q2_K_reference,
         .vec_dot                  = ggml_vec_dot_q2_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .gemm                     = ggml_gemm_q2_K_q8_K,
     },
     [GGML_TYPE_Q3_K] = {
         .type_name                = "q3_K",
@@ -508,6 +554,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q3_K_reference,
         .vec_dot                  = ggml_vec_dot_q3_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .gemm                     = ggml_gemm_q3_K_q8_K,
     },
     [GGML_TYPE_Q4_K] = {
         .type_name                = "q4_K",
@@ -519,6 +566,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q4_K_reference,
         .vec_dot                  = ggml_vec_dot_q4_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .gemm                     = ggml_gemm_q4_K_q8_K,
     },
     [GGML_TYPE_Q5_K] = {
         .type_name                = "q5_K",
@@ -530,6 +578,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q5_K_reference,
         .vec_dot                  = ggml_vec_dot_q5_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .gemm                     = ggml_gemm_q5_K_q8_K,
     },
     [GGML_TYPE_Q6_K] = {
         .type_name                = "q6_K",
@@ -541,6 +590,7 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .from_float_reference     = (ggml_from_float_t) quantize_row_q6_K_reference,
         .vec_dot                  = ggml_vec_dot_q6_K_q8_K,
         .vec_dot_type             = GGML_TYPE_Q8_K,
+        .gemm                     = ggml_gemm_q6_K_q8_K,
     },
     [GGML_TYPE_Q8_K] = {
         .type_name                = "q8_K",
@@ -548,9 +598,64 @@ static const ggml_type_traits_t type_traits[GGML_TYPE_COUNT] = {
         .type_size                = sizeof(block_q8_K),
         .is_quantized             = true,
         .from_float               = quantize_row_q8_K,
-    }
+    },
+    [GGML_TYPE_Q4_0X4] = {
+        .type_name                = "q4_0x4",
+        .blck_size                = QK4_0,
+        .type_size                = sizeof(block_q4_0),
+        .is_quantized             = true,
+        .vec_dot                  = ggml_vec_dot_q4_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .gemm                     = ggml_gemm_q4_0x4_q8_0,
+        .nrows                    = 4,
+    },
+    [GGML_TYPE_Q8_0X4] = {
+        .type_name                = "q8_0x4",
+        .blck_size                = QK8_0,
+        .type_size                = sizeof(block_q8_0),
+        .is_quantized             = true,
+        .vec_dot                  = ggml_vec_dot_q8_0x4_q8_0,
+        .vec_dot_type             = GGML_TYPE_Q8_0,
+        .gemm                     = ggml_gemm_q8_0x4_q8_0,
+        .nrows                    = 4,
+    },
 };
 
+#if defined(GGML_CPU_VARIANTS)
+// the copies of ggml-quants.c compiled for other instruction sets
+void ggml_quants_set_kernels_avx   (ggml_type_traits_t * traits);
+void ggml_quants_set_kernels_avx2  (ggml_type_traits_t * traits);
+void ggml_quants_set_kernels_avx512(ggml_type_traits_t * traits);
+#endif
+
+static const char * ggml_cpu_variant_name = NULL;
+
+// replace the kernels of the type traits with the copy for the best instruction set of the CPU
+// the rest of ggml.c keeps the instruction set of the build
+static void ggml_cpu_variant_init(void) {
+#if defined(GGML_CPU_VARIANTS)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")  && __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vnni")) {
+        ggml_quants_set_kernels_avx512(type_traits);
+        ggml_cpu_variant_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        ggml_quants_set_kernels_avx2(type_traits);
+        ggml_cpu_variant_name = "avx2";
+    } else if (__builtin_cpu_supports("avx")) {
+        ggml_quants_set_kernels_avx(type_traits);
+        ggml_cpu_variant_name = "avx";
+    } else {
+        ggml_cpu_variant_name = "base";
+    }
+#endif
+}
+
+const char * ggml_cpu_variant(void) {
+    return ggml_cpu_variant_name;
+}
+
 // For internal test use
 ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type) {
     GGML_ASSERT(type < GGML_TYPE_COUNT);
@@ -1172,6 +1277,12 @@ static void ggml_vec_dot_f16(const int n, float * restrict s, ggml_fp16_t * rest
     *s = sumf;
 }
 
+#if defined(GGML_CPU_VARIANTS)
+// the ops below call the f32/f16 dot products through the type traits, which hold the kernels of the selected CPU variant
+#define ggml_vec_dot_f32(n, s, x, y) type_traits[GGML_TYPE_F32].vec_dot(n, s, x, y)
+#define ggml_vec_dot_f16(n, s, x, y) type_traits[GGML_TYPE_F16].vec_dot(n, s, x, y)
+#endif
+
 // compute GGML_VEC_DOT_UNROLL dot products at once
 // xs - x row stride in bytes
 inline static void ggml_vec_dot_f16_unroll(const int n, const int xs, float * restrict s, void * restrict xv, ggml_fp16_t * restrict y) {
@@ -1357,8 +1468,101 @@ static const float GELU_COEF_A     = 0.044715f;
 static const float GELU_QUICK_COEF = -1.702f;
 static const float SQRT_2_OVER_PI  = 0.79788456080286535587989211986876f;
 
+// SIMD exp, SiLU and GELU
+// exp: range reduction to [-ln2/2, ln2/2] and a degree 6 polynomial (Cephes), max relative error ~2 ulp
+// the input is clamped to [-87.33, 88.0] - the result saturates at exp(88) and is 0 below the range (including -INFINITY)
+// GELU uses 0.5*x*(1 + tanh(u)) = x/(1 + exp(-2u))
+
+#define GGML_EXP_X_MAX  88.0f
+#define GGML_EXP_X_MIN -87.33654475f
+
+#if defined(__AVX512F__)
+
+#define GGML_SIMD_EXP 16
+
+inline static __m512 ggml_v_expf(__m512 x) {
+    const __m512 xc = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(GGML_EXP_X_MIN)), _mm512_set1_ps(GGML_EXP_X_MAX));
+
+    // x = n*ln2 + r
+    const __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(xc, _mm512_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), xc);
+    r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+
+    __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+    p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+    p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), r);
+    p = _mm512_add_ps(p, _mm512_set1_ps(1.0f));
+
+    // 2^n
+    const __m512i e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+
+    const __mmask16 under = _mm512_cmp_ps_mask(x, _mm512_set1_ps(GGML_EXP_X_MIN), _CMP_LT_OQ);
+
+    return _mm512_maskz_mul_ps(~under, p, _mm512_castsi512_ps(e));
+}
+
+inline static __m512 ggml_v_silu(__m512 x) {
+    const __m512 e = ggml_v_expf(_mm512_sub_ps(_mm512_setzero_ps(), x));
+    return _mm512_div_ps(x, _mm512_add_ps(_mm512_set1_ps(1.0f), e));
+}
+
+inline static __m512 ggml_v_gelu(__m512 x) {
+    // -2u = -2*sqrt(2/pi)*x*(1 + a*x^2)
+    const __m512 u = _mm512_mul_ps(_mm512_mul_ps(x, _mm512_set1_ps(-2.0f*SQRT_2_OVER_PI)),
+            _mm512_fmadd_ps(_mm512_mul_ps(x, x), _mm512_set1_ps(GELU_COEF_A), _mm512_set1_ps(1.0f)));
+    return _mm512_div_ps(x, _mm512_add_ps(_mm512_set1_ps(1.0f), ggml_v_expf(u)));
+}
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+#define GGML_SIMD_EXP 8
+
+inline static __m256 ggml_v_expf(__m256 x) {
+    const __m256 xc = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(GGML_EXP_X_MIN)), _mm256_set1_ps(GGML_EXP_X_MAX));
+
+    // x = n*ln2 + r
+    const __m256 n = _mm256_round_ps(_mm256_mul_ps(xc, _mm256_set1_ps(1.44269504088896341f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), xc);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r);
+    p = _mm256_add_ps(p, _mm256_set1_ps(1.0f));
+
+    // 2^n
+    const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+
+    const __m256 under = _mm256_cmp_ps(x, _mm256_set1_ps(GGML_EXP_X_MIN), _CMP_LT_OQ);
+
+    return _mm256_andnot_ps(under, _mm256_mul_ps(p, _mm256_castsi256_ps(e)));
+}
+
+inline static __m256 ggml_v_silu(__m256 x) {
+    const __m256 e = ggml_v_expf(_mm256_sub_ps(_mm256_setzero_ps(), x));
+    return _mm256_div_ps(x, _mm256_add_ps(_mm256_set1_ps(1.0f), e));
+}
+
+inline static __m256 ggml_v_gelu(__m256 x) {
+    // -2u = -2*sqrt(2/pi)*x*(1 + a*x^2)
+    const __m256 u = _mm256_mul_ps(_mm256_mul_ps(x, _mm256_set1_ps(-2.0f*SQRT_2_OVER_PI)),
+            _mm256_fmadd_ps(_mm256_mul_ps(x, x), _mm256_set1_ps(GELU_COEF_A), _mm256_set1_ps(1.0f)));
+    return _mm256_div_ps(x, _mm256_add_ps(_mm256_set1_ps(1.0f), ggml_v_expf(u)));
+}
+
+#endif
+
 inline static float ggml_gelu_f32(float x) {
-    return 0.5f*x*(1.0f + tanhf(SQRT_2_OVER_PI*x*(1.0f + GELU_COEF_A*x*x)));
+    // same as 0.5f*x*(1.0f + tanhf(SQRT_2_OVER_PI*x*(1.0f + GELU_COEF_A*x*x))) without the cancellation for x < 0
+    return x/(1.0f + expf(-2.0f*SQRT_2_OVER_PI*x*(1.0f + GELU_COEF_A*x*x)));
 }
 
 inline static void ggml_vec_gelu_f16(const int n, ggml_fp16_t * y, const ggml_fp16_t * x) {
@@ -1368,7 +1572,23 @@ inline static void ggml_vec_gelu_f16(const int n, ggml_fp16_t * y, const ggml_fp
     }
 }
 
-#ifdef GGML_GELU_FP16
+#if defined(GGML_SIMD_EXP)
+inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
+    int i = 0;
+#if defined(__AVX512F__)
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(y + i, ggml_v_gelu(_mm512_loadu_ps(x + i)));
+    }
+#else
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, ggml_v_gelu(_mm256_loadu_ps(x + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = ggml_gelu_f32(x[i]);
+    }
+}
+#elif defined(GGML_GELU_FP16)
 inline static void ggml_vec_gelu_f32(const int n, float * y, const float * x) {
     uint16_t t;
     for (int i = 0; i < n; ++i) {
@@ -1425,7 +1645,23 @@ inline static float ggml_silu_f32(float x) {
 //    }
 //}
 
-#ifdef GGML_SILU_FP16
+#if defined(GGML_SIMD_EXP)
+inline static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
+    int i = 0;
+#if defined(__AVX512F__)
+    for (; i + 15 < n; i += 16) {
+        _mm512_storeu_ps(y + i, ggml_v_silu(_mm512_loadu_ps(x + i)));
+    }
+#else
+    for (; i + 7 < n; i += 8) {
+        _mm256_storeu_ps(y + i, ggml_v_silu(_mm256_loadu_ps(x + i)));
+    }
+#endif
+    for (; i < n; ++i) {
+        y[i] = ggml_silu_f32(x[i]);
+    }
+}
+#elif defined(GGML_SILU_FP16)
 inline static void ggml_vec_silu_f32(const int n, float * y, const float * x) {
     uint16_t t;
     for (int i = 0; i < n; ++i) {
@@ -1447,7 +1683,7 @@ inline static float ggml_silu_backward_f32(float x, float dy) {
     return dy*s*(1.0f + x*(1.0f - s));
 }
 
-#ifdef GGML_SILU_FP16
+#if defined(GGML_SILU_FP16) && !defined(GGML_SIMD_EXP)
 inline static void ggml_vec_silu_backward_f32(const int n, float * dx, const float * x, const float * dy) {
     for (int i = 0; i < n; ++i) {
         // we did not use x[i] to compute forward silu but its f16 equivalent
@@ -1563,6 +1799,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "TRANSPOSE",
     "GET_ROWS",
     "GET_ROWS_BACK",
+    "SET_ROWS",
     "DIAG",
     "DIAG_MASK_INF",
     "DIAG_MASK_ZERO",
@@ -1585,6 +1822,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "UPSCALE",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -1609,7 +1847,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 73, "GGML_OP_COUNT != 73");
+static_assert(GGML_OP_COUNT == 75, "GGML_OP_COUNT != 75");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -1650,6 +1888,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "transpose(x)",
     "get_rows(x)",
     "get_rows_back(x)",
+    "set_rows(x)",
     "diag(x)",
     "diag_mask_inf(x)",
     "diag_mask_zero(x)",
@@ -1672,6 +1911,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "upscale(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -1696,7 +1936,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 73, "GGML_OP_COUNT != 73");
+static_assert(GGML_OP_COUNT == 75, "GGML_OP_COUNT != 75");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -1718,7 +1958,6 @@ static void ggml_setup_op_has_task_pass(void) {
         bool * p = GGML_OP_HAS_INIT;
 
         p[GGML_OP_ACC                    ] = true;
-        p[GGML_OP_MUL_MAT                ] = true;
         p[GGML_OP_OUT_PROD               ] = true;
         p[GGML_OP_SET                    ] = true;
         p[GGML_OP_GET_ROWS_BACK          ] = true;
@@ -1888,6 +2127,71 @@ bool ggml_is_numa(void) {
     return g_state.numa.n_nodes > 1;
 }
 
+// NUMA node of thread ith - the threads of a graph are split into contiguous groups, one per node
+static int ggml_numa_node_of_thread(int ith, int n_threads) {
+    return ith / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
+}
+
+// rows [*ir0, *ir1) of a matrix with nr rows that are placed on NUMA node n and computed by its threads
+// the slices start at a multiple of align rows
+static void ggml_numa_rows(int64_t nr, int64_t align, int n, int64_t * ir0, int64_t * ir1) {
+    const int n_nodes = g_state.numa.n_nodes;
+
+    *ir0 = MIN(nr, (nr*n/n_nodes + align - 1)/align*align);
+    *ir1 = n == n_nodes - 1 ? nr : MIN(nr, (nr*(n + 1)/n_nodes + align - 1)/align*align);
+}
+
+// mbind(2) constants, to avoid depending on libnuma
+#define GGML_MPOL_PREFERRED 1
+#define GGML_MPOL_MF_MOVE   (1 << 1)
+
+bool ggml_numa_place_tensor(struct ggml_tensor * tensor) {
+    if (!ggml_is_numa() || tensor->data == NULL || tensor->ne[2]*tensor->ne[3] != 1 || !ggml_is_contiguous(tensor)) {
+        return false;
+    }
+
+#if defined(__linux__) && defined(SYS_mbind)
+    const int       n_nodes   = g_state.numa.n_nodes;
+    const uintptr_t page_size = (uintptr_t) sysconf(_SC_PAGESIZE);
+
+    if (ggml_nbytes(tensor) < page_size*n_nodes) {
+        return false;
+    }
+
+    const uintptr_t begin = (uintptr_t) tensor->data;
+    const uintptr_t end   = begin + ggml_nbytes(tensor);
+
+    const int64_t align = MAX(1, type_traits[tensor->type].nrows);
+
+    bool ok = true;
+
+    for (int n = 0; n < n_nodes; ++n) {
+        int64_t ir0, ir1;
+        ggml_numa_rows(tensor->ne[1], align, n, &ir0, &ir1);
+
+        // the pages that contain rows of two nodes go to the second one
+        const uintptr_t p0 = n == 0           ? begin/page_size*page_size : (begin + ir0*tensor->nb[1] + page_size - 1)/page_size*page_size;
+        const uintptr_t p1 = n == n_nodes - 1 ? (end + page_size - 1)/page_size*page_size : (begin + ir1*tensor->nb[1] + page_size - 1)/page_size*page_size;
+
+        if (p1 <= p0) {
+            continue;
+        }
+
+        unsigned long mask[GGML_NUMA_MAX_NODES/(8*sizeof(unsigned long)) + 1] = { 0 };
+        mask[n/(8*sizeof(unsigned long))] |= 1UL << (n % (8*sizeof(unsigned long)));
+
+        // move the pages that are already allocated, the new pages follow the policy
+        if (syscall(SYS_mbind, (void *) p0, p1 - p0, GGML_MPOL_PREFERRED, mask, 8*sizeof(mask), GGML_MPOL_MF_MOVE) != 0) {
+            ok = false;
+        }
+    }
+
+    return ok;
+#else
+    return false;
+#endif
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 void ggml_print_object(const struct ggml_object * obj) {
@@ -2188,6 +2492,8 @@ struct ggml_context * ggml_init(struct ggml_init_params params) {
 
         ggml_setup_op_has_task_pass();
 
+        ggml_cpu_variant_init();
+
         is_first_call = false;
     }
 
@@ -4667,6 +4973,32 @@ struct ggml_tensor * ggml_get_rows_back(
     return result;
 }
 
+// ggml_set_rows
+
+struct ggml_tensor * ggml_set_rows(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        struct ggml_tensor  * c) {
+    GGML_ASSERT(ggml_is_matrix(a) && ggml_is_matrix(b) && ggml_is_vector(c) && c->type == GGML_TYPE_I32);
+    GGML_ASSERT(a->ne[0] == b->ne[0] && b->ne[1] == c->ne[0]);
+    GGML_ASSERT(b->type == GGML_TYPE_F32 && b->nb[0] == sizeof(float));
+
+    if (a->grad || b->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+    }
+
+    struct ggml_tensor * result = ggml_view_tensor(ctx, a);
+
+    result->op     = GGML_OP_SET_ROWS;
+    result->grad   = NULL;
+    result->src[0] = a;
+    result->src[1] = b;
+    result->src[2] = c;
+
+    return result;
+}
+
 // ggml_diag
 
 struct ggml_tensor * ggml_diag(
@@ -5542,6 +5874,66 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(k->type == GGML_TYPE_F16);
+    GGML_ASSERT(v->type == GGML_TYPE_F16);
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->ne[0] == q->ne[0]);
+    GGML_ASSERT(v->ne[1] == q->ne[0]);
+    GGML_ASSERT(v->ne[0] == k->ne[1]);
+    GGML_ASSERT(k->ne[2] == v->ne[2]);
+    GGML_ASSERT(q->ne[2] % k->ne[2] == 0);
+    GGML_ASSERT(q->ne[3] == k->ne[3] && q->ne[3] == v->ne[3]);
+
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(ggml_is_contiguous(mask));
+        GGML_ASSERT(mask->ne[0] >= k->ne[1]);
+        GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    // the result has the heads merged: [n_embd_head, n_head, n_tokens, ne3]
+    const int64_t ne[4] = { q->ne[0], q->ne[2], q->ne[1], q->ne[3] };
+    struct ggml_tensor * result = ggml_new_tensor(ctx, GGML_TYPE_F32, 4, ne);
+
+    float params[] = { scale };
+    ggml_set_op_params(result, params, sizeof(params));
+    ggml_set_op_params_i32(result, 1, 0);
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+
+    return result;
+}
+
+void ggml_flash_attn_ext_set_chunk(
+        struct ggml_tensor * a,
+        int32_t              n_chunk) {
+    GGML_ASSERT(a->op == GGML_OP_FLASH_ATTN_EXT);
+    GGML_ASSERT(n_chunk >= 0);
+
+    ggml_set_op_params_i32(a, 1, n_chunk);
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -6284,6 +6676,171 @@ void ggml_set_param(
     ggml_format_name(tensor->grad, "%s (grad)", tensor->name);
 }
 
+// max number of consecutive independent nodes that are computed without a barrier between them
+#define GGML_MAX_LEVEL_NODES 16
+
+struct ggml_compute_state_shared {
+    const struct ggml_cgraph * cgraph;
+    const struct ggml_cplan  * cplan;
+
+    int64_t perf_node_start_cycles;
+    int64_t perf_node_start_time_us;
+
+    const int n_threads;
+
+    // synchronization primitives
+    atomic_int n_active; // num active threads
+    atomic_int node_n;   // active graph node
+    atomic_int n_chunk;  // next chunk of work to be claimed by the threads of the active node
+
+    // next chunk to be claimed by the threads of each NUMA node, for ops that split the work by node
+    atomic_int n_chunk_numa[GGML_NUMA_MAX_NODES];
+
+    // barrier between the phases of an op (see ggml_barrier)
+    atomic_int n_barrier;
+    atomic_int n_barrier_passed;
+
+    // current level of nodes - written by the thread that distributes the work
+    int    n_level;
+    size_t level_work_offs[GGML_MAX_LEVEL_NODES];
+
+    bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
+    void * abort_callback_data;
+
+    // used by threads sleeping with GGML_WAIT_POLICY_SLEEP
+    atomic_int        n_sleeping;
+    pthread_mutex_t * mutex;
+    pthread_cond_t  * cond;
+
+    // tracing (see ggml_trace_new) - only used when cplan->trace is set
+    int       trace_graph;   // index of the graph in the trace
+    int64_t * trace_wait_us; // [n_threads] time spent in ggml_barrier() by each thread during the current node
+};
+
+// default number of polls before a waiting thread yields or goes to sleep
+#define GGML_WAIT_N_SPIN 16384
+
+// hint to the CPU that the thread is polling: the other hyperthread of the core gets the execution units
+#if defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_IX86))
+#define ggml_spin_pause() _mm_pause()
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ggml_spin_pause() __builtin_ia32_pause()
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+#define ggml_spin_pause() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define ggml_spin_pause() ((void) 0)
+#endif
+
+// the wait policy of the plan, with GGML_WAIT_POLICY_DEFAULT resolved, and the number of polls before yielding or sleeping
+static enum ggml_wait_policy ggml_wait_policy_get(const struct ggml_cplan * cplan, int * n_spin) {
+    enum ggml_wait_policy policy = cplan->wait_policy;
+
+    *n_spin = cplan->wait_n_spin > 0 ? cplan->wait_n_spin : GGML_WAIT_N_SPIN;
+
+    if (policy == GGML_WAIT_POLICY_DEFAULT) {
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        // the threads would spin while waiting for the BLAS calls
+        policy  = GGML_WAIT_POLICY_YIELD;
+        *n_spin = 0;
+#else
+        policy  = GGML_WAIT_POLICY_SPIN;
+#endif
+    }
+
+    return policy;
+}
+
+// wait until *value changes from last and return the new value, following the wait policy of the plan
+static int ggml_compute_wait(struct ggml_compute_state_shared * shared, atomic_int * value, int last) {
+    int n_spin;
+    const enum ggml_wait_policy policy = ggml_wait_policy_get(shared->cplan, &n_spin);
+
+    int cur;
+
+    if (policy == GGML_WAIT_POLICY_SPIN) {
+        while ((cur = atomic_load(value)) == last) {
+            ggml_spin_pause();
+        }
+        return cur;
+    }
+
+    for (int i = 0; i < n_spin; ++i) {
+        if ((cur = atomic_load(value)) != last) {
+            return cur;
+        }
+        ggml_spin_pause();
+    }
+
+    if (policy == GGML_WAIT_POLICY_YIELD) {
+        while ((cur = atomic_load(value)) == last) {
+            sched_yield();
+        }
+        return cur;
+    }
+
+    // GGML_WAIT_POLICY_SLEEP
+    // n_sleeping is incremented before checking the value, so the thread that changes it either
+    // sees this thread as sleeping and wakes it up, or this thread sees the new value
+    pthread_mutex_lock(shared->mutex);
+    atomic_fetch_add(&shared->n_sleeping, 1);
+    while ((cur = atomic_load(value)) == last) {
+        pthread_cond_wait(shared->cond, shared->mutex);
+    }
+    atomic_fetch_sub(&shared->n_sleeping, 1);
+    pthread_mutex_unlock(shared->mutex);
+
+    return cur;
+}
+
+// wake up the threads sleeping in ggml_compute_wait() - call after changing the value they wait for
+static void ggml_compute_wake(struct ggml_compute_state_shared * shared) {
+    if (atomic_load(&shared->n_sleeping) > 0) {
+        pthread_mutex_lock(shared->mutex);
+        pthread_cond_broadcast(shared->cond);
+        pthread_mutex_unlock(shared->mutex);
+    }
+}
+
+// wait until all params->nth threads computing the current op reach this point
+// allows ops to run several parallel phases within a single COMPUTE pass
+// the chunk counter is reset to nth while no thread can be claiming chunks, i.e. each thread
+// implicitly owns chunk ith after the barrier
+static void ggml_barrier(const struct ggml_compute_params * params) {
+    const int nth = params->nth;
+
+    struct ggml_compute_state_shared * shared = params->shared;
+
+    if (nth == 1) {
+        atomic_store(&shared->n_chunk, nth);
+        return;
+    }
+
+    const int n_passed = atomic_load(&shared->n_barrier_passed);
+
+    if (atomic_fetch_add(&shared->n_barrier, 1) == nth - 1) {
+        // last thread to arrive - release the others
+        atomic_store(&shared->n_chunk, nth);
+        if (ggml_is_numa()) {
+            const int n_per_node = (nth + g_state.numa.n_nodes - 1)/g_state.numa.n_nodes;
+            for (int n = 0; n < (int) g_state.numa.n_nodes; ++n) {
+                atomic_store(&shared->n_chunk_numa[n], MAX(0, MIN(n_per_node, nth - n*n_per_node)));
+            }
+        }
+        atomic_store(&shared->n_barrier, 0);
+        atomic_fetch_add(&shared->n_barrier_passed, 1);
+        ggml_compute_wake(shared);
+        return;
+    }
+
+    const int64_t t_start_us = shared->cplan->trace ? ggml_time_us() : 0;
+
+    ggml_compute_wait(shared, &shared->n_barrier_passed, n_passed);
+
+    if (shared->cplan->trace) {
+        shared->trace_wait_us[params->ith] += ggml_time_us() - t_start_us;
+    }
+}
+
 // ggml_compute_forward_dup
 
 static void ggml_compute_forward_dup_same_cont(
@@ -9393,8 +9950,10 @@ static bool ggml_compute_forward_mul_mat_use_blas(
     const int64_t ne1 = dst->ne[1];
 
     // TODO: find the optimal values for these
+    // the interleaved types cannot be converted to float
     if (ggml_is_contiguous(src0) &&
         ggml_is_contiguous(src1) &&
+        type_traits[src0->type].nrows <= 1 &&
         (ne0 >= 32 && ne1 >= 32 && ne10 >= 32)) {
 
         /*printf("BLAS: %d %d %d %d %d\n", ne0, ne1, ne10, ne00, ne01);*/
@@ -9405,24 +9964,143 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
-static void ggml_compute_forward_mul_mat(
+// compute the dst rows [ir010, ir011) x [ir110, ir111) of a (non-BLAS) matrix multiplication
+static void ggml_compute_forward_mul_mat_one_chunk(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
         const struct ggml_tensor * src1,
-              struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
-
+        const struct ggml_tensor * res,
+              struct ggml_tensor * dst,
+        const int64_t ir010, const int64_t ir011,
+        const int64_t ir110, const int64_t ir111) {
     GGML_TENSOR_BINARY_OP_LOCALS
 
-    const int ith = params->ith;
-    const int nth = params->nth;
+    // threads with no work simply yield (not sure if it helps)
+    if (ir010 >= ir011 || ir110 >= ir111) {
+        sched_yield();
+        return;
+    }
 
     const enum ggml_type type = src0->type;
 
     const bool src1_cont = ggml_is_contiguous(src1);
 
-    ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
+    ggml_vec_dot_t    const vec_dot      = type_traits[type].vec_dot;
+    ggml_gemm_t       const gemm         = type_traits[type].gemm;
+    enum ggml_type    const vec_dot_type = type_traits[type].vec_dot_type;
+    int64_t           const nrows        = MAX(1, type_traits[type].nrows);
+
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
+    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
+
+    assert(ne12 % ne02 == 0);
+    assert(ne13 % ne03 == 0);
+
+    // the src1 rows of a matrix are equally spaced, so several of them can be passed to gemm at once
+    const size_t row_stride = src1_cont || src1->type != vec_dot_type ? row_size : nb11;
+
+    // block-tiling attempt
+    const int64_t blck_0 = 16;
+    const int64_t blck_1 = 16;
+
+    // results of the block, stored by src1 row
+    // attempt to reduce false-sharing (does not seem to make a difference)
+    float tmp[16*16];
+
+    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+            const int64_t ir0_end = MIN(iir0 + blck_0, ir011);
+            const int64_t ir1_end = MIN(iir1 + blck_1, ir111);
+
+            for (int64_t ir1 = iir1; ir1 < ir1_end; ) {
+                const int64_t i13 = (ir1/(ne12*ne11));
+                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+                // broadcast src0 into src1
+                const int64_t i03 = i13/r3;
+                const int64_t i02 = i12/r2;
+
+                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+
+                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                //       the original src1 data pointer, so we should index using the indices directly
+                // TODO: this is a bit of a hack, we should probably have a better way to handle this
+                const char * src1_col = (const char *) wdata +
+                    (src1_cont || src1->type != vec_dot_type
+                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
+                     : (i11*nb11 + i12*nb12 + i13*nb13));
+
+                // number of src1 rows computed together - they must belong to the same matrix
+                const int64_t nc = gemm && ir1 + GGML_GEMM_TILE <= ir1_end && i11 + GGML_GEMM_TILE <= ne11 ? GGML_GEMM_TILE : 1;
+
+                float * tmp_col = tmp + (ir1 - iir1)*blck_0;
+
+                int64_t ir0 = iir0;
+
+                if (nc == GGML_GEMM_TILE) {
+                    for (; ir0 + GGML_GEMM_TILE <= ir0_end; ir0 += GGML_GEMM_TILE) {
+                        gemm(ne00, &tmp_col[ir0 - iir0], blck_0, src0_row + ir0*nb01, nb01, src1_col, row_stride);
+                    }
+                }
+
+                // leftover src0 rows - the interleaved types compute nrows of them with each call
+                for (int64_t i = 0; i < nc; ++i) {
+                    for (int64_t ir = ir0; ir < ir0_end; ir += nrows) {
+                        vec_dot(ne00, &tmp_col[i*blck_0 + ir - iir0], src0_row + ir*nb01, src1_col + i*row_stride);
+                    }
+                }
+
+                ir1 += nc;
+            }
+
+            for (int64_t ir1 = iir1; ir1 < ir1_end; ++ir1) {
+                const int64_t i13 = (ir1/(ne12*ne11));
+                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+                const int64_t i1 = i11;
+                const int64_t i2 = i12;
+                const int64_t i3 = i13;
+
+                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+
+                const float * tmp_col = tmp + (ir1 - iir1)*blck_0;
+
+                if (res) {
+                    // fused MUL_MAT->ADD: add the residual while the result is still in the cache
+                    const float * res_col = (const float *) ((const char *) res->data + (i1*res->nb[1] + i2*res->nb[2] + i3*res->nb[3]));
+                    ggml_vec_add_f32(ir0_end - iir0, &dst_col[iir0], tmp_col, &res_col[iir0]);
+                } else {
+                    memcpy(&dst_col[iir0], tmp_col, (ir0_end - iir0)*sizeof(float));
+                }
+            }
+        }
+    }
+}
+
+// res: optional tensor with the same shape as dst that is added to the result (fused MUL_MAT->ADD)
+static void ggml_compute_forward_mul_mat(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * res,
+              struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type = src0->type;
+
     enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
 
@@ -9441,15 +10119,12 @@ static void ggml_compute_forward_mul_mat(
     GGML_ASSERT(nb1 <= nb2);
     GGML_ASSERT(nb2 <= nb3);
 
-    // broadcast factors
-    const int64_t r2 = ne12/ne02;
-    const int64_t r3 = ne13/ne03;
-
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
 #if defined(GGML_USE_CLBLAST)
     if (ggml_cl_can_mul_mat(src0, src1, dst)) {
+        GGML_ASSERT(res == NULL);
         if (params->ith == 0 && params->type == GGML_TASK_COMPUTE) {
             ggml_cl_mul_mat(src0, src1, dst, params->wdata, params->wsize);
         }
@@ -9459,6 +10134,7 @@ static void ggml_compute_forward_mul_mat(
 
 #if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
     if (ggml_compute_forward_mul_mat_use_blas(src0, src1, dst)) {
+        GGML_ASSERT(res == NULL);
         if (params->ith != 0) {
             return;
         }
@@ -9471,6 +10147,10 @@ static void ggml_compute_forward_mul_mat(
             return;
         }
 
+        // broadcast factors
+        const int64_t r2 = ne12/ne02;
+        const int64_t r3 = ne13/ne03;
+
         for (int64_t i13 = 0; i13 < ne13; i13++) {
             for (int64_t i12 = 0; i12 < ne12; i12++) {
                 // broadcast src0 into src1 across 2nd,3rd dimension
@@ -9511,20 +10191,6 @@ static void ggml_compute_forward_mul_mat(
 #endif
 
     if (params->type == GGML_TASK_INIT) {
-        if (src1->type != vec_dot_type) {
-            char * wdata = params->wdata;
-            const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
-
-            for (int64_t i13 = 0; i13 < ne13; ++i13) {
-                for (int64_t i12 = 0; i12 < ne12; ++i12) {
-                    for (int64_t i11 = 0; i11 < ne11; ++i11) {
-                        from_float_to_vec_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11), (void *) wdata, ne10);
-                        wdata += row_size;
-                    }
-                }
-            }
-        }
-
         return;
     }
 
@@ -9532,87 +10198,94 @@ static void ggml_compute_forward_mul_mat(
         return;
     }
 
-    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-    const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
-
-    const int64_t nr0 = ne01;           // src0 rows
-    const int64_t nr1 = ne11*ne12*ne13; // src1 rows
+    // convert src1 to vec_dot_type - the rows are interleaved across all threads
+    if (src1->type != vec_dot_type) {
+        char * wdata = params->wdata;
+        const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
 
-    //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
+        for (int64_t i13 = 0; i13 < ne13; ++i13) {
+            for (int64_t i12 = 0; i12 < ne12; ++i12) {
+                for (int64_t i11 = ith; i11 < ne11; i11 += nth) {
+                    from_float_to_vec_dot((float *)((char *) src1->data + i13*nb13 + i12*nb12 + i11*nb11),
+                            (void *) (wdata + (i11 + i12*ne11 + i13*ne12*ne11)*row_size), ne10);
+                }
+            }
+        }
+    }
 
-    // distribute the thread work across the inner or outer loop based on which one is larger
+    // wait for src1 to be converted - this also resets the chunk counter
+    // (with several independent nodes in a level, other threads may still be claiming chunks of the previous node until then)
+    ggml_barrier(params);
 
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    int64_t       nr0 = ne01;           // src0 rows
+    const int64_t nr1 = ne11*ne12*ne13; // src1 rows
 
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
+    //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
+    // the chunks of the interleaved types must start at a group of nrows rows
+    const int64_t nrows = MAX(1, type_traits[type].nrows);
 
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+    // the threads that share the chunks below and the first src0 row of the chunks
+    int ith_chunk = ith;
+    int nth_chunk = nth;
+    int64_t ir0_base = 0;
+    atomic_int * n_chunk = &params->shared->n_chunk;
 
-    const int64_t ir110 = dr1*ith1;
-    const int64_t ir111 = MIN(ir110 + dr1, nr1);
+    // on NUMA systems the threads of each node compute the rows of src0 that are placed on that node
+    // (see ggml_numa_place_tensor), if all the nodes have threads
+    if (ggml_is_numa() && nth == params->shared->n_threads && ne02*ne03 == 1 && ne01 >= 64*(int64_t) g_state.numa.n_nodes &&
+        ggml_numa_node_of_thread(nth - 1, nth) == (int) g_state.numa.n_nodes - 1) {
+        const int node       = ggml_numa_node_of_thread(ith, nth);
+        const int n_per_node = (nth + g_state.numa.n_nodes - 1)/g_state.numa.n_nodes;
 
-    //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
+        int64_t ir0, ir1;
+        ggml_numa_rows(nr0, nrows, node, &ir0, &ir1);
 
-    // threads with no work simply yield (not sure if it helps)
-    if (ir010 >= ir011 || ir110 >= ir111) {
-        sched_yield();
-        return;
+        ith_chunk = ith - node*n_per_node;
+        nth_chunk = MIN(n_per_node, nth - node*n_per_node);
+        ir0_base  = ir0;
+        nr0       = ir1 - ir0;
+        n_chunk   = &params->shared->n_chunk_numa[node];
     }
 
-    assert(ne12 % ne02 == 0);
-    assert(ne13 % ne03 == 0);
-
-    // block-tiling attempt
-    const int64_t blck_0 = 16;
-    const int64_t blck_1 = 16;
+    // split the work into tiles of chunk_size x chunk_size rows that the threads claim dynamically,
+    // so that a slow thread does not hold up the others at the barrier after this node
+    // for matrix x vector (single token) the tiles are made longer since there is only one src1 row
+    const int64_t chunk_size = (nr0 == 1 || nr1 == 1) ? 64 : 16;
 
-    // attempt to reduce false-sharing (does not seem to make a difference)
-    float tmp[16];
+    int64_t nchunk0 = (nr0 + chunk_size - 1)/chunk_size;
+    int64_t nchunk1 = (nr1 + chunk_size - 1)/chunk_size;
 
-    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
-        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
-                const int64_t i13 = (ir1/(ne12*ne11));
-                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
-                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+    // if there are too few tiles to balance the load, fall back to one contiguous range per thread,
+    // distributed across the inner or outer loop based on which one is larger
+    if (nchunk0*nchunk1 < nth_chunk*4) {
+        nchunk0 = nr0 > nr1 ? nth_chunk : 1; // parallelize by src0 rows
+        nchunk1 = nr0 > nr1 ? 1 : nth_chunk; // parallelize by src1 rows
+    }
 
-                // broadcast src0 into src1
-                const int64_t i03 = i13/r3;
-                const int64_t i02 = i12/r2;
+    const int64_t dr0 = ((nr0 + nchunk0 - 1)/nchunk0 + nrows - 1)/nrows*nrows;
+    const int64_t dr1 = (nr1 + nchunk1 - 1)/nchunk1;
 
-                const int64_t i1 = i11;
-                const int64_t i2 = i12;
-                const int64_t i3 = i13;
+    // the first chunk of every thread is implied by its index, the rest are claimed from the shared counter
+    int64_t current_chunk = ith_chunk;
 
-                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+    while (current_chunk < nchunk0*nchunk1) {
+        const int64_t ith0 = current_chunk % nchunk0;
+        const int64_t ith1 = current_chunk / nchunk0;
 
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
-                     : (i11*nb11 + i12*nb12 + i13*nb13));
+        const int64_t ir010 = ir0_base + dr0*ith0;
+        const int64_t ir011 = MIN(ir010 + dr0, ir0_base + nr0);
 
-                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+        const int64_t ir110 = dr1*ith1;
+        const int64_t ir111 = MIN(ir110 + dr1, nr1);
 
-                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
-                //}
+        ggml_compute_forward_mul_mat_one_chunk(params, src0, src1, res, dst, ir010, ir011, ir110, ir111);
 
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
-                }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
-            }
+        if (nth_chunk >= nchunk0*nchunk1) {
+            break;
         }
+
+        current_chunk = atomic_fetch_add(n_chunk, 1);
     }
 }
 
@@ -10371,6 +11044,95 @@ static void ggml_compute_forward_get_rows_back(
     //}
 }
 
+// ggml_compute_forward_set_rows
+
+static void ggml_compute_forward_set_rows_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+              struct ggml_tensor * dst) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    // dst is a view of src0
+    (void) src0;
+
+    const int64_t nc = src1->ne[0];
+    const int64_t nr = ggml_nelements(src2);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const enum ggml_type type = dst->type;
+
+    const int32_t * idx = (const int32_t *) src2->data;
+
+    if (dst->nb[0] == ggml_type_size(type)) {
+        // contiguous rows - split the rows between the threads
+        GGML_ASSERT(nc % ggml_blck_size(type) == 0);
+
+        ggml_from_float_t const from_float = type_traits[type].from_float;
+        GGML_ASSERT(type == GGML_TYPE_F32 || from_float);
+
+        const int64_t dr  = (nr + nth - 1)/nth;
+        const int64_t ir0 = dr*ith;
+        const int64_t ir1 = MIN(ir0 + dr, nr);
+
+        for (int64_t i = ir0; i < ir1; ++i) {
+            const float * x = (const float *) ((const char *) src1->data + i*src1->nb[1]);
+                   void * y = (char *) dst->data + idx[i]*dst->nb[1];
+
+            if (type == GGML_TYPE_F32) {
+                memcpy(y, x, nc*sizeof(float));
+            } else {
+                from_float(x, y, nc);
+            }
+        }
+    } else {
+        // strided rows (e.g. the transposed V cache) - split the columns between the threads,
+        // so that each thread writes the consecutive rows of its columns
+        GGML_ASSERT(type == GGML_TYPE_F32 || type == GGML_TYPE_F16);
+
+        const int64_t dc  = (nc + nth - 1)/nth;
+        const int64_t ic0 = dc*ith;
+        const int64_t ic1 = MIN(ic0 + dc, nc);
+
+        for (int64_t j = ic0; j < ic1; ++j) {
+            char * y = (char *) dst->data + j*dst->nb[0];
+
+            for (int64_t i = 0; i < nr; ++i) {
+                const float x = *(const float *) ((const char *) src1->data + i*src1->nb[1] + j*sizeof(float));
+
+                if (type == GGML_TYPE_F32) {
+                    *(float *) (y + idx[i]*dst->nb[1]) = x;
+                } else {
+                    *(ggml_fp16_t *) (y + idx[i]*dst->nb[1]) = GGML_FP32_TO_FP16(x);
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_set_rows(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        const struct ggml_tensor * src2,
+        struct ggml_tensor * dst) {
+    switch (src1->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_set_rows_f32(params, src0, src1, src2, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
 // ggml_compute_forward_diag
 
 static void ggml_compute_forward_diag_f32(
@@ -10515,6 +11277,65 @@ static void ggml_compute_forward_diag_mask_zero(
 
 // ggml_compute_forward_soft_max
 
+// y = exp(x - max), returns the sum of y - y can be the same as x
+static ggml_float ggml_vec_soft_max_exp_f32(const int n, float * y, const float * x, float max) {
+    int i = 0;
+    ggml_float sum = 0.0;
+
+#if defined(GGML_SIMD_EXP) && defined(__AVX512F__)
+    __m512 vsum = _mm512_setzero_ps();
+    for (; i + 15 < n; i += 16) {
+        const __m512 val = ggml_v_expf(_mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_set1_ps(max)));
+        _mm512_storeu_ps(y + i, val);
+        vsum = _mm512_add_ps(vsum, val);
+    }
+    sum += (ggml_float) _mm512_reduce_add_ps(vsum);
+#elif defined(GGML_SIMD_EXP)
+    __m256 vsum = _mm256_setzero_ps();
+    for (; i + 7 < n; i += 8) {
+        const __m256 val = ggml_v_expf(_mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_set1_ps(max)));
+        _mm256_storeu_ps(y + i, val);
+        vsum = _mm256_add_ps(vsum, val);
+    }
+    const __m128 s4 = _mm_add_ps(_mm256_castps256_ps128(vsum), _mm256_extractf128_ps(vsum, 1));
+    const __m128 s2 = _mm_add_ps(s4, _mm_movehl_ps(s4, s4));
+    sum += (ggml_float) _mm_cvtss_f32(_mm_add_ss(s2, _mm_movehdup_ps(s2)));
+#else
+    uint16_t scvt;
+#endif
+
+    for (; i < n; i++) {
+        if (x[i] == -INFINITY) {
+            y[i] = 0.0f;
+        } else {
+#if defined(GGML_SIMD_EXP)
+            const float val = expf(x[i] - max);
+#else
+            ggml_fp16_t s = GGML_FP32_TO_FP16(x[i] - max);
+            memcpy(&scvt, &s, sizeof(scvt));
+            const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
+#endif
+            sum += (ggml_float)val;
+            y[i] = val;
+        }
+    }
+
+    return sum;
+}
+
+// y = soft_max(x), y can be the same as x
+static void ggml_vec_soft_max_f32(const int n, float * y, const float * x) {
+    float max = -INFINITY;
+    ggml_vec_max_f32(n, &max, x);
+
+    ggml_float sum = ggml_vec_soft_max_exp_f32(n, y, x, max);
+
+    assert(sum > 0.0);
+
+    sum = 1.0/sum;
+    ggml_vec_scale_f32(n, y, sum);
+}
+
 static void ggml_compute_forward_soft_max_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -10553,29 +11374,7 @@ static void ggml_compute_forward_soft_max_f32(
         }
 #endif
 
-        float max = -INFINITY;
-        ggml_vec_max_f32(nc, &max, sp);
-
-        ggml_float sum = 0.0;
-
-        uint16_t scvt;
-        for (int i = 0; i < nc; i++) {
-            if (sp[i] == -INFINITY) {
-                dp[i] = 0.0f;
-            } else {
-                // const float val = (sp[i] == -INFINITY) ? 0.0 : exp(sp[i] - max);
-                ggml_fp16_t s = GGML_FP32_TO_FP16(sp[i] - max);
-                memcpy(&scvt, &s, sizeof(scvt));
-                const float val = GGML_FP16_TO_FP32(ggml_table_exp_f16[scvt]);
-                sum += (ggml_float)val;
-                dp[i] = val;
-            }
-        }
-
-        assert(sum > 0.0);
-
-        sum = 1.0/sum;
-        ggml_vec_scale_f32(nc, dp, sum);
+        ggml_vec_soft_max_f32(nc, dp, sp);
 
 #ifndef NDEBUG
         for (int i = 0; i < nc; ++i) {
@@ -10848,6 +11647,8 @@ static void ggml_compute_forward_alibi(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0X4:
+        case GGML_TYPE_Q8_0X4:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -10922,6 +11723,8 @@ static void ggml_compute_forward_clamp(
         case GGML_TYPE_I8:
         case GGML_TYPE_I16:
         case GGML_TYPE_I32:
+        case GGML_TYPE_Q4_0X4:
+        case GGML_TYPE_Q8_0X4:
         case GGML_TYPE_COUNT:
             {
                 GGML_ASSERT(false);
@@ -13223,31 +14026,451 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
-// ggml_compute_forward_flash_ff
+// ggml_compute_forward_flash_attn_ext
 
-static void ggml_compute_forward_flash_ff_f16(
-        const struct ggml_compute_params * params,
-        const struct ggml_tensor * a,  // F16
-        const struct ggml_tensor * b0, // F16 fc_w
-        const struct ggml_tensor * b1, // F32 fc_b
-        const struct ggml_tensor * c0, // F16 proj_w
-        const struct ggml_tensor * c1, // F32 proj_b
-        struct ggml_tensor * dst) {
-    int64_t t0 = ggml_perf_time_us();
-    UNUSED(t0);
+// number of KV positions that are processed at once
+#define GGML_FLASH_ATTN_EXT_BLOCK 64
 
-    GGML_TENSOR_LOCALS(int64_t, nea,  a,   ne)
-    GGML_TENSOR_LOCALS(size_t,  nba,  a,   nb)
-    GGML_TENSOR_LOCALS(int64_t, neb0, b0,  ne)
-    GGML_TENSOR_LOCALS(size_t,  nbb0, b0,  nb)
-    GGML_TENSOR_LOCALS(int64_t, neb1, b1,  ne)
-    GGML_TENSOR_LOCALS(size_t,  nbb1, b1,  nb)
-    GGML_TENSOR_LOCALS(int64_t, nec0, c0,  ne)
-    GGML_TENSOR_LOCALS(size_t,  nbc0, c0,  nb)
-    GGML_TENSOR_LOCALS(int64_t, nec1, c1,  ne)
-    GGML_TENSOR_LOCALS(size_t,  nbc1, c1,  nb)
-    GGML_TENSOR_LOCALS(int64_t, ne,   dst, ne)
-    GGML_TENSOR_LOCALS(size_t,  nb,   dst, nb)
+// the blocks are made of chunks of KV positions that are skipped when they are all masked out
+// the size of the chunks is an op param (ggml_flash_attn_ext_set_chunk), by default the SIMD step,
+// so that the length of the V dot products stays a multiple of it
+#if defined(GGML_SIMD)
+#define GGML_FLASH_ATTN_EXT_CHUNK GGML_F16_STEP
+#else
+#define GGML_FLASH_ATTN_EXT_CHUNK 16
+#endif
+
+// number of q tokens of a head whose own blocks of KV positions (outside of the shared prefix) are processed
+// together: a block that several of them see is loaded once for the tile
+#define GGML_FLASH_ATTN_EXT_TILE 16
+
+// the size of the chunks of dst and the size of its blocks, rounded up to a multiple of the chunks
+static void ggml_flash_attn_ext_sizes(const struct ggml_tensor * dst, int64_t * B, int64_t * C) {
+    const int32_t n_chunk = ggml_get_op_params_i32(dst, 1);
+
+    *C = n_chunk > 0 ? n_chunk : GGML_FLASH_ATTN_EXT_CHUNK;
+    *B = (GGML_FLASH_ATTN_EXT_BLOCK + *C - 1)/(*C)*(*C);
+}
+
+// size in floats of the work buffer of a thread for N q tokens and KV positions
+static size_t ggml_flash_attn_ext_wsize(int64_t D, int64_t N, int64_t KV, int64_t B, int64_t C) {
+    const int64_t T   = GGML_FLASH_ATTN_EXT_TILE;
+    const int64_t nch = (KV + C - 1)/C;
+    const int64_t nbl = 2*(KV/C + 1);
+
+    size_t n = 0;
+
+    n += 2*N;                 // sum of the prefix (ggml_float)
+    n += 2*N;                 // group of tokens (int64_t)
+    n += N;                   // max of the prefix
+    n += N*D;                 // output accumulator of the prefix
+    n += T*D;                 // output accumulator of a tile
+    n += N*B;                 // scores of the current block
+    n += (N*D + 1)/2;         // q in F16
+    n += (N*B + 1)/2;         // probabilities in F16
+    n += (T + 1)*nbl;         // blocks of the tokens of a tile and of the prefix (int32_t)
+    n += ((N + 1)*nch + 3)/4; // visibility of the chunks (uint8_t)
+
+    return GGML_PAD(n, CACHE_LINE_SIZE_F32);
+}
+
+// the blocks of KV positions of a row of chunk visibilities: consecutive chunks that are seen and not skipped,
+// cut at the multiples of B so that the tokens that see the same positions get the same blocks
+static int32_t ggml_flash_attn_ext_blocks(const uint8_t * vis, const uint8_t * skip, int64_t KV, int64_t B, int64_t C, int32_t * blk) {
+    int32_t n_blk = 0;
+
+    for (int64_t c0 = 0; c0 < KV; c0 += C) {
+        const int64_t c1 = MIN(c0 + C, KV);
+        const int64_t ch = c0/C;
+
+        if (vis[ch] == 0 || (skip && skip[ch])) {
+            continue;
+        }
+
+        if (n_blk > 0 && blk[2*n_blk - 1] == c0 && c0 % B != 0) {
+            blk[2*n_blk - 1] = c1;
+        } else {
+            blk[2*n_blk + 0] = c0;
+            blk[2*n_blk + 1] = c1;
+            n_blk++;
+        }
+    }
+
+    return n_blk;
+}
+
+// the KV positions [ic0, ic1) for a group of q tokens: the K row and the V rows of each position are loaded once
+// for all the tokens of the group, each token updates its online softmax state (M is the maximum score so far,
+// acc and sum are relative to it)
+// the state of the token iq1_0 + grp[i] is at index grp[i] of Q16, M, sum and acc (and of the buffers S and P16)
+static void ggml_flash_attn_ext_block(
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        int64_t       ik2,
+        int64_t       ik3,
+        float         scale,
+        int64_t       B,
+        int64_t       ic0,
+        int64_t       ic1,
+        int64_t       iq1_0,
+        const int64_t * grp,
+        int64_t       n_grp,
+        ggml_fp16_t * Q16,
+        float       * S,
+        ggml_fp16_t * P16,
+        float       * M,
+        ggml_float  * sum,
+        float       * acc) {
+    const int64_t D  = k->ne[0];
+    const int64_t nc = ic1 - ic0;
+
+    // S = K*Q for the tokens of the group
+    for (int64_t ic = 0; ic < nc; ++ic) {
+        ggml_fp16_t * kp = (ggml_fp16_t *) ((char *) k->data + ((ic0 + ic)*k->nb[1] + ik2*k->nb[2] + ik3*k->nb[3]));
+
+        for (int64_t ig = 0; ig < n_grp; ++ig) {
+            const int64_t it = grp[ig];
+
+            const float mv = mask ? ((const float *) ((const char *) mask->data + (iq1_0 + it)*mask->nb[1]))[ic0 + ic] : 0.0f;
+
+            if (mv == -INFINITY) {
+                S[it*B + ic] = -INFINITY;
+                continue;
+            }
+
+            float s;
+            ggml_vec_dot_f16(D, &s, kp, Q16 + it*D);
+
+            S[it*B + ic] = s*scale + mv;
+        }
+    }
+
+    for (int64_t ig = 0; ig < n_grp; ++ig) {
+        const int64_t it = grp[ig];
+
+        float Mb = -INFINITY;
+        ggml_vec_max_f32(nc, &Mb, S + it*B);
+
+        if (Mb > M[it]) {
+            // rescale the accumulated values to the new maximum
+            const float ms = expf(M[it] - Mb);
+
+            ggml_vec_scale_f32(D, acc + it*D, ms);
+            sum[it] *= (ggml_float) ms;
+
+            M[it] = Mb;
+        }
+
+        sum[it] += ggml_vec_soft_max_exp_f32(nc, S + it*B, S + it*B, M[it]);
+        ggml_fp32_to_fp16_row(S + it*B, P16 + it*B, nc);
+    }
+
+    // acc += V*P, the rows of the transposed V are contiguous along the KV sequence
+    for (int64_t i = 0; i < D; ++i) {
+        ggml_fp16_t * vp = (ggml_fp16_t *) ((char *) v->data + (ic0*v->nb[0] + i*v->nb[1] + ik2*v->nb[2] + ik3*v->nb[3]));
+
+        for (int64_t ig = 0; ig < n_grp; ++ig) {
+            const int64_t it = grp[ig];
+
+            float r;
+            ggml_vec_dot_f16(nc, &r, vp, P16 + it*B);
+
+            acc[it*D + i] += r;
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb)
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb)
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D  = neq0;
+    const int64_t N  = neq1;
+    const int64_t KV = nek1;
+
+    int64_t B;
+    int64_t C;
+    ggml_flash_attn_ext_sizes(dst, &B, &C);
+
+    GGML_ASSERT(nek0 == D);
+    GGML_ASSERT(nev1 == D);
+    GGML_ASSERT(nev0 == KV);
+
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne1 == neq2);
+    GGML_ASSERT(ne2 == N);
+    GGML_ASSERT(ne3 == neq3);
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == sizeof(ggml_fp16_t));
+    GGML_ASSERT(nbv0 == sizeof(ggml_fp16_t));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    float scale = 1.0f;
+    memcpy(&scale, (float *) dst->op_params + 0, sizeof(float));
+
+    // number of q heads that share a kv head
+    const int64_t rk2 = neq2/nek2;
+
+    // parallelize by q rows - consecutive rows use the same kv head
+    const int64_t nr = neq1*neq2*neq3;
+
+    // rows per thread
+    const int64_t dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int64_t ir0 = dr*ith;
+    const int64_t ir1 = MIN(ir0 + dr, nr);
+
+    if (ir0 >= ir1) {
+        return;
+    }
+
+    const int64_t T   = GGML_FLASH_ATTN_EXT_TILE;
+    const int64_t nch = (KV + C - 1)/C;
+
+    // number of ints in the block list of a q token
+    const int64_t nbl = 2*(KV/C + 1);
+
+    // per-thread buffers, see ggml_flash_attn_ext_wsize
+    ggml_float  * sump = (ggml_float *) ((float *) params->wdata + ith*ggml_flash_attn_ext_wsize(D, N, KV, B, C));
+    int64_t     * grp  = (int64_t *) (sump + N);
+    float       * Mp   = (float *) (grp + N);
+    float       * accp = Mp   + N;
+    float       * acc  = accp + N*D;
+    float       * S    = acc  + T*D;
+    ggml_fp16_t * Q16  = (ggml_fp16_t *) (S + N*B);
+    ggml_fp16_t * P16  = (ggml_fp16_t *) (S + N*B + (N*D + 1)/2);
+    int32_t     * blk  = (int32_t *) (S + N*B + (N*D + 1)/2 + (N*B + 1)/2);
+    int32_t     * blkp = blk + T*nbl;
+    uint8_t     * vis  = (uint8_t *) (blkp + nbl);
+
+    // the chunks of KV positions that each q token sees: 0 - none of their positions, 1 - some, 2 - all
+    // the last row marks the chunks that all the tokens see entirely: the prefix shared by the sequences of the batch
+    uint8_t * shared = vis + N*nch;
+
+    memset(shared, N > 1 ? 2 : 0, nch);
+
+    for (int64_t iq1 = 0; iq1 < N; ++iq1) {
+        const float * mp = mask ? (const float *) ((const char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+        for (int64_t ch = 0; ch < nch; ++ch) {
+            const int64_t c0 = ch*C;
+            const int64_t c1 = MIN(c0 + C, KV);
+
+            int64_t n_seen = c1 - c0;
+            for (int64_t ic = c0; ic < c1 && mp; ++ic) {
+                n_seen -= mp[ic] == -INFINITY;
+            }
+
+            vis[iq1*nch + ch] = n_seen == 0 ? 0 : n_seen < c1 - c0 ? 1 : 2;
+
+            if (vis[iq1*nch + ch] != 2) {
+                shared[ch] = 0;
+            }
+        }
+    }
+
+    const int32_t n_blkp = ggml_flash_attn_ext_blocks(shared, NULL, KV, B, C, blkp);
+
+    // the heads (with the batch dimension) of the rows of this thread
+    const int64_t ih0 = ir0/neq1;
+    const int64_t ih1 = (ir1 - 1)/neq1 + 1;
+
+    // cascade attention: the attention of the q tokens over the shared prefix is computed first for all the tokens at
+    // once (the K and V rows of the prefix are loaded once per head), then the attention of each token over the rest
+    // of its positions, and the two partial results are merged with their log-sum-exp
+    for (int64_t ih = ih0; ih < ih1; ++ih) {
+        // the q tokens of the head in the rows of this thread
+        const int64_t iq1_0 = MAX(ir0, ih*neq1) - ih*neq1;
+        const int64_t iq1_1 = MIN(ir1, (ih + 1)*neq1) - ih*neq1;
+        const int64_t n     = iq1_1 - iq1_0;
+
+        // q indices
+        const int64_t iq3 = ih/neq2;
+        const int64_t iq2 = ih - iq3*neq2;
+
+        // kv head
+        const int64_t ik2 = iq2/rk2;
+        const int64_t ik3 = iq3;
+
+        for (int64_t it = 0; it < n; ++it) {
+            ggml_fp32_to_fp16_row((const float *) ((const char *) q->data + ((iq1_0 + it)*nbq1 + iq2*nbq2 + iq3*nbq3)), Q16 + it*D, D);
+
+            Mp  [it] = -INFINITY;
+            sump[it] = 0.0;
+            grp [it] = it;
+
+            memset(accp + it*D, 0, D*sizeof(float));
+        }
+
+        // prefix pass
+        for (int32_t ib = 0; ib < n_blkp; ++ib) {
+            ggml_flash_attn_ext_block(k, v, mask, ik2, ik3, scale, B, blkp[2*ib + 0], blkp[2*ib + 1],
+                    iq1_0, grp, n, Q16, S, P16, Mp, sump, accp);
+        }
+
+        // suffix pass, by tiles of tokens
+        for (int64_t it0 = 0; it0 < n; it0 += T) {
+            const int64_t nt = MIN(T, n - it0);
+
+            float      M    [GGML_FLASH_ATTN_EXT_TILE];
+            ggml_float sum  [GGML_FLASH_ATTN_EXT_TILE];
+            int32_t    n_blk[GGML_FLASH_ATTN_EXT_TILE];
+            int32_t    ib   [GGML_FLASH_ATTN_EXT_TILE]; // next block of each token
+
+            for (int64_t it = 0; it < nt; ++it) {
+                n_blk[it] = ggml_flash_attn_ext_blocks(vis + (iq1_0 + it0 + it)*nch, shared, KV, B, C, blk + it*nbl);
+
+                M  [it] = -INFINITY;
+                sum[it] = 0.0;
+                ib [it] = 0;
+
+                memset(acc + it*D, 0, D*sizeof(float));
+            }
+
+            while (true) {
+                // the first block that is left, and the tokens that see it
+                int64_t ic0 = KV;
+                int64_t ic1 = KV;
+
+                for (int64_t it = 0; it < nt; ++it) {
+                    if (ib[it] < n_blk[it]) {
+                        const int32_t * b = blk + it*nbl + 2*ib[it];
+
+                        if (b[0] < ic0 || (b[0] == ic0 && b[1] < ic1)) {
+                            ic0 = b[0];
+                            ic1 = b[1];
+                        }
+                    }
+                }
+
+                if (ic0 == KV) {
+                    break;
+                }
+
+                int64_t n_grp = 0;
+
+                for (int64_t it = 0; it < nt; ++it) {
+                    if (ib[it] < n_blk[it]) {
+                        const int32_t * b = blk + it*nbl + 2*ib[it];
+
+                        if (b[0] == ic0 && b[1] == ic1) {
+                            grp[n_grp++] = it;
+                            ib[it]++;
+                        }
+                    }
+                }
+
+                ggml_flash_attn_ext_block(k, v, mask, ik2, ik3, scale, B, ic0, ic1,
+                        iq1_0 + it0, grp, n_grp, Q16 + it0*D, S, P16, M, sum, acc);
+            }
+
+            // merge the prefix and the suffix: both are rescaled to the larger of their maxima
+            for (int64_t it = 0; it < nt; ++it) {
+                const int64_t ip = it0 + it;
+
+                float * out = (float *) ((char *) dst->data + ((iq1_0 + ip)*nb2 + iq2*nb1 + iq3*nb3));
+
+                const float Mx = MAX(Mp[ip], M[it]);
+
+                // rows that are entirely masked out produce zeros
+                if (Mx == -INFINITY) {
+                    memset(out, 0, D*sizeof(float));
+                    continue;
+                }
+
+                const float fp = expf(Mp[ip] - Mx);
+                const float fs = expf(M [it] - Mx);
+
+                const ggml_float s = sump[ip]*(ggml_float) fp + sum[it]*(ggml_float) fs;
+
+                const float inv_sum = s == 0.0 ? 0.0f : (float) (1.0/s);
+
+                for (int64_t i = 0; i < D; ++i) {
+                    out[i] = (accp[ip*D + i]*fp + acc[it*D + i]*fs)*inv_sum;
+                }
+            }
+        }
+    }
+}
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    switch (k->type) {
+        case GGML_TYPE_F16:
+            {
+                ggml_compute_forward_flash_attn_ext_f16(params, q, k, v, mask, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+// ggml_compute_forward_flash_ff
+
+static void ggml_compute_forward_flash_ff_f16(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * a,  // F16
+        const struct ggml_tensor * b0, // F16 fc_w
+        const struct ggml_tensor * b1, // F32 fc_b
+        const struct ggml_tensor * c0, // F16 proj_w
+        const struct ggml_tensor * c1, // F32 proj_b
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, nea,  a,   ne)
+    GGML_TENSOR_LOCALS(size_t,  nba,  a,   nb)
+    GGML_TENSOR_LOCALS(int64_t, neb0, b0,  ne)
+    GGML_TENSOR_LOCALS(size_t,  nbb0, b0,  nb)
+    GGML_TENSOR_LOCALS(int64_t, neb1, b1,  ne)
+    GGML_TENSOR_LOCALS(size_t,  nbb1, b1,  nb)
+    GGML_TENSOR_LOCALS(int64_t, nec0, c0,  ne)
+    GGML_TENSOR_LOCALS(size_t,  nbc0, c0,  nb)
+    GGML_TENSOR_LOCALS(int64_t, nec1, c1,  ne)
+    GGML_TENSOR_LOCALS(size_t,  nbc1, c1,  nb)
+    GGML_TENSOR_LOCALS(int64_t, ne,   dst, ne)
+    GGML_TENSOR_LOCALS(size_t,  nb,   dst, nb)
 
     const int ith = params->ith;
     const int nth = params->nth;
@@ -14490,54 +15713,252 @@ static void ggml_compute_forward_cross_entropy_loss_back(
     }
 }
 
-/////////////////////////////////
+// fused op chains (see ggml_graph_fuse)
+// the kernels compute the last tensor of the chain directly from the inputs of the chain
+// dst may be the same memory as one of the inputs with the same shape - the rows are computed element-wise
 
-static void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
-    GGML_ASSERT(params);
+// RMS_NORM->MUL: dst = rms_norm(norm->src[0])*src1
+static void ggml_compute_forward_rms_norm_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * norm,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    const struct ggml_tensor * src0 = norm->src[0];
 
-    if (tensor->op == GGML_OP_NONE) {
-        return;
-    }
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_can_repeat_rows(src1, dst));
 
-#ifdef GGML_USE_CUBLAS
-    bool skip_cpu = ggml_cuda_compute_forward(params, tensor);
-    if (skip_cpu) {
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
         return;
     }
-    GGML_ASSERT(tensor->src[0] == NULL || tensor->src[0]->backend == GGML_BACKEND_CPU);
-    GGML_ASSERT(tensor->src[1] == NULL || tensor->src[1]->backend == GGML_BACKEND_CPU);
-#endif // GGML_USE_CUBLAS
 
-    switch (tensor->op) {
-        case GGML_OP_DUP:
-            {
-                ggml_compute_forward_dup(params, tensor->src[0], tensor);
-            } break;
-        case GGML_OP_ADD:
-            {
-                ggml_compute_forward_add(params, tensor->src[0], tensor->src[1], tensor);
-            } break;
-        case GGML_OP_ADD1:
-            {
-                ggml_compute_forward_add1(params, tensor->src[0], tensor->src[1], tensor);
-            } break;
-        case GGML_OP_ACC:
-            {
-                ggml_compute_forward_acc(params, tensor->src[0], tensor->src[1], tensor);
-            } break;
-        case GGML_OP_SUB:
-            {
-                ggml_compute_forward_sub(params, tensor->src[0], tensor->src[1], tensor);
-            } break;
-        case GGML_OP_MUL:
-            {
-                ggml_compute_forward_mul(params, tensor->src[0], tensor->src[1], tensor);
-            } break;
-        case GGML_OP_DIV:
-            {
-                ggml_compute_forward_div(params, tensor->src[0], tensor->src[1], tensor);
-            } break;
-        case GGML_OP_SQR:
+    GGML_ASSERT(src0->nb[0] == sizeof(float));
+    GGML_ASSERT(src1->nb[0] == sizeof(float));
+    GGML_ASSERT( dst->nb[0] == sizeof(float));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    GGML_TENSOR_BINARY_OP_LOCALS
+
+    float eps;
+    memcpy(&eps, norm->op_params, sizeof(float));
+
+    for (int64_t i03 = 0; i03 < ne03; i03++) {
+        for (int64_t i02 = 0; i02 < ne02; i02++) {
+            for (int64_t i01 = ith; i01 < ne01; i01 += nth) {
+                const float * x = (float *) ((char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+                const float * w = (float *) ((char *) src1->data + (i01 % ne11)*nb11 + (i02 % ne12)*nb12 + (i03 % ne13)*nb13);
+
+                ggml_float sum = 0.0;
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    sum += (ggml_float)(x[i00] * x[i00]);
+                }
+
+                const float mean = sum/ne00;
+
+                const float scale = 1.0f/sqrtf(mean + eps);
+
+                float * y = (float *) ((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3);
+
+                for (int64_t i00 = 0; i00 < ne00; i00++) {
+                    y[i00] = (x[i00]*scale)*w[i00];
+                }
+            }
+        }
+    }
+}
+
+// SILU->MUL: dst = silu(src0)*src1
+static void ggml_compute_forward_silu_mul_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous_except_dim_1(src0));
+    GGML_ASSERT(ggml_is_contiguous_except_dim_1(src1));
+    GGML_ASSERT(ggml_is_contiguous_except_dim_1(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_are_same_shape(src1, dst));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int nc = src0->ne[0];
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    // the silu of a block of the row is kept on the stack, so that dst can alias src0 or src1
+    float tmp[64];
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        const float * x = (float *) ((char *) src0->data + i1*src0->nb[1]);
+        const float * g = (float *) ((char *) src1->data + i1*src1->nb[1]);
+              float * y = (float *) ((char *)  dst->data + i1* dst->nb[1]);
+
+        for (int i0 = 0; i0 < nc; i0 += 64) {
+            const int n = MIN(64, nc - i0);
+
+            ggml_vec_silu_f32(n, tmp, x + i0);
+            ggml_vec_mul_f32 (n, y + i0, g + i0, tmp);
+        }
+    }
+}
+
+// SCALE->ADD->SOFT_MAX: dst = soft_max(src0*scale + mask)
+static void ggml_compute_forward_scale_add_soft_max_f32(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * scale,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    GGML_ASSERT(ggml_is_contiguous(src0));
+    GGML_ASSERT(ggml_is_contiguous(dst));
+    GGML_ASSERT(ggml_are_same_shape(src0, dst));
+    GGML_ASSERT(ggml_is_scalar(scale));
+    GGML_ASSERT(ggml_can_repeat(mask, dst));
+    GGML_ASSERT(mask->nb[0] == sizeof(float));
+
+    if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    const float v = *(float *) scale->data;
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t ne00 = src0->ne[0];
+    const int64_t ne01 = src0->ne[1];
+    const int64_t ne02 = src0->ne[2];
+
+    const int nc = ne00;
+    const int nr = ggml_nrows(src0);
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int i1 = ir0; i1 < ir1; i1++) {
+        const int64_t i03 = i1/(ne02*ne01);
+        const int64_t i02 = (i1 - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (i1 - i03*ne02*ne01 - i02*ne01);
+
+        const float * sp = (float *) ((char *) src0->data + i1*src0->nb[1]);
+        const float * mp = (float *) ((char *) mask->data +
+                (i01 % mask->ne[1])*mask->nb[1] + (i02 % mask->ne[2])*mask->nb[2] + (i03 % mask->ne[3])*mask->nb[3]);
+              float * dp = (float *) ((char *)  dst->data + i1*dst->nb[1]);
+
+        for (int i = 0; i < nc; ++i) {
+            dp[i] = sp[i]*v + mp[i];
+        }
+
+        ggml_vec_soft_max_f32(nc, dp, dp);
+
+#ifndef NDEBUG
+        for (int i = 0; i < nc; ++i) {
+            assert(!isnan(dp[i]));
+            assert(!isinf(dp[i]));
+        }
+#endif
+    }
+}
+
+// compute the chain of n nodes that starts with nodes[0] - the kind of the chain is given by the first op
+static void ggml_compute_forward_fused(const struct ggml_compute_params * params, struct ggml_tensor * const * nodes, int n) {
+    struct ggml_tensor * first = nodes[0];
+    struct ggml_tensor * dst   = nodes[n - 1];
+
+    // the input of the last node that does not come from the chain
+    struct ggml_tensor * other = dst->src[0] == nodes[n - 2] ? dst->src[1] : dst->src[0];
+
+    switch (first->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                ggml_compute_forward_rms_norm_mul_f32(params, first, other, dst);
+            } break;
+        case GGML_OP_UNARY:
+            {
+                GGML_ASSERT(ggml_get_unary_op(first) == GGML_UNARY_OP_SILU);
+                ggml_compute_forward_silu_mul_f32(params, first->src[0], other, dst);
+            } break;
+        case GGML_OP_SCALE:
+            {
+                GGML_ASSERT(n == 3);
+                ggml_compute_forward_scale_add_soft_max_f32(params, first->src[0], first->src[1], nodes[1]->src[1], dst);
+            } break;
+        case GGML_OP_MUL_MAT:
+            {
+                ggml_compute_forward_mul_mat(params, first->src[0], first->src[1], other, dst);
+            } break;
+        default:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+}
+
+/////////////////////////////////
+
+static void ggml_compute_forward(struct ggml_compute_params * params, struct ggml_tensor * tensor) {
+    GGML_ASSERT(params);
+
+    if (tensor->op == GGML_OP_NONE) {
+        return;
+    }
+
+#ifdef GGML_USE_CUBLAS
+    bool skip_cpu = ggml_cuda_compute_forward(params, tensor);
+    if (skip_cpu) {
+        return;
+    }
+    GGML_ASSERT(tensor->src[0] == NULL || tensor->src[0]->backend == GGML_BACKEND_CPU);
+    GGML_ASSERT(tensor->src[1] == NULL || tensor->src[1]->backend == GGML_BACKEND_CPU);
+#endif // GGML_USE_CUBLAS
+
+    switch (tensor->op) {
+        case GGML_OP_DUP:
+            {
+                ggml_compute_forward_dup(params, tensor->src[0], tensor);
+            } break;
+        case GGML_OP_ADD:
+            {
+                ggml_compute_forward_add(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case GGML_OP_ADD1:
+            {
+                ggml_compute_forward_add1(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case GGML_OP_ACC:
+            {
+                ggml_compute_forward_acc(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case GGML_OP_SUB:
+            {
+                ggml_compute_forward_sub(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case GGML_OP_MUL:
+            {
+                ggml_compute_forward_mul(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case GGML_OP_DIV:
+            {
+                ggml_compute_forward_div(params, tensor->src[0], tensor->src[1], tensor);
+            } break;
+        case GGML_OP_SQR:
             {
                 ggml_compute_forward_sqr(params, tensor->src[0], tensor);
             } break;
@@ -14599,7 +16020,7 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_MUL_MAT:
             {
-                ggml_compute_forward_mul_mat(params, tensor->src[0], tensor->src[1], tensor);
+                ggml_compute_forward_mul_mat(params, tensor->src[0], tensor->src[1], NULL, tensor);
             } break;
         case GGML_OP_OUT_PROD:
             {
@@ -14645,6 +16066,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_get_rows_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                ggml_compute_forward_set_rows(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor);
+            } break;
         case GGML_OP_DIAG:
             {
                 ggml_compute_forward_diag(params, tensor->src[0], tensor);
@@ -14732,6 +16157,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -15513,6 +16942,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
             {
                 GGML_ASSERT(false); // TODO: not implemented
             } break;
+        case GGML_OP_SET_ROWS:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_DIAG:
             {
                 GGML_ASSERT(false); // TODO: not implemented
@@ -15729,6 +17162,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             zero_table);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -16102,7 +17539,7 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) {
     }
 
     // run thread on node_num thread_n / (threads per node)
-    const int node_num = thread_n / ((n_threads + g_state.numa.n_nodes - 1) / g_state.numa.n_nodes);
+    const int node_num = ggml_numa_node_of_thread(thread_n, n_threads);
     struct ggml_numa_node * node = &g_state.numa.nodes[node_num];
     size_t setsize = CPU_ALLOC_SIZE(g_state.numa.total_cpus);
 
@@ -16149,107 +17586,292 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(threa
 static void clear_numa_thread_affinity(void) {}
 #endif
 
-struct ggml_compute_state_shared {
-    const struct ggml_cgraph * cgraph;
-    const struct ggml_cplan  * cplan;
-
-    int64_t perf_node_start_cycles;
-    int64_t perf_node_start_time_us;
-
-    const int n_threads;
-
-    // synchronization primitives
-    atomic_int n_active; // num active threads
-    atomic_int node_n;   // active graph node
-
-    bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
-    void * abort_callback_data;
-};
-
 struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * threadpool;
 };
 
-static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
-    int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
-    int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
+struct ggml_threadpool {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
 
-    node->perf_runs++;
-    node->perf_cycles  += cycles_cur;
-    node->perf_time_us += time_us_cur;
-}
+    // (generation << 16) | n_threads of the current graph - packed so that workers read both atomically
+    atomic_int state;
+    atomic_int n_busy; // number of workers that have not finished the current graph yet
+    atomic_int stop;
 
-static thread_ret_t ggml_graph_compute_thread(void * data) {
-    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    // the thread calling ggml_graph_compute() sleeps on cond_join until n_busy is 0 with GGML_WAIT_POLICY_SLEEP
+    atomic_int     n_joining;
+    pthread_cond_t cond_join;
 
-    const struct ggml_cgraph * cgraph = state->shared->cgraph;
-    const struct ggml_cplan  * cplan  = state->shared->cplan;
+    int n_threads;
 
-    const int * n_tasks_arr = cplan->n_tasks;
-    const int   n_threads   = state->shared->n_threads;
+    struct ggml_compute_state * workers; // workers[0] is the thread calling ggml_graph_compute()
+};
 
-    set_numa_thread_affinity(state->ith, n_threads);
+struct ggml_trace_event {
+    char name[GGML_MAX_NAME];
 
-    int node_n = -1;
+    enum ggml_op        op;
+    enum ggml_task_type type; // the FINALIZE pass of a single-threaded node is a part of its COMPUTE event
 
-    while (true) {
-        if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-            state->shared->node_n += 1;
-            return (thread_ret_t) GGML_EXIT_ABORTED;
-        }
-        if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
-            // all other threads are finished and spinning
-            // do finalize and init here so we don't have synchronize again
-            struct ggml_compute_params params = {
-                /*.type  =*/ GGML_TASK_FINALIZE,
-                /*.ith   =*/ 0,
-                /*.nth   =*/ 0,
-                /*.wsize =*/ cplan->work_size,
-                /*.wdata =*/ cplan->work_data,
-            };
+    int graph;
+    int node;     // -1: the thread was waiting for the other threads to finish the previous nodes
+    int ith, nth;
 
-            if (node_n != -1) {
-                /* FINALIZE */
-                struct ggml_tensor * node = state->shared->cgraph->nodes[node_n];
-                if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = n_tasks_arr[node_n];
-                    ggml_compute_forward(&params, node);
-                }
-                ggml_graph_compute_perf_stats_node(node, state->shared);
-            }
+    int64_t t_start_us;
+    int64_t t_end_us;
+    int64_t t_wait_us; // time spent in ggml_barrier() during the node
 
-            // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
-                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
+    size_t bytes; // size of the node and of its sources
+};
 
-                struct ggml_tensor * node = cgraph->nodes[node_n];
-                const int n_tasks = n_tasks_arr[node_n];
+struct ggml_trace {
+    int64_t t_start_us;
 
-                state->shared->perf_node_start_cycles  = ggml_perf_cycles();
-                state->shared->perf_node_start_time_us = ggml_perf_time_us();
+    atomic_int n_graphs;
+    atomic_int n_events; // can be larger than n_events_max - the events past the end are dropped
 
-                params.nth = n_tasks;
+    int n_events_max;
+    struct ggml_trace_event * events;
+};
 
-                /* INIT */
-                if (GGML_OP_HAS_INIT[node->op]) {
-                    params.type = GGML_TASK_INIT;
-                    ggml_compute_forward(&params, node);
-                }
+struct ggml_trace * ggml_trace_new(int n_events_max) {
+    GGML_ASSERT(n_events_max > 0);
 
-                if (n_tasks == 1) {
-                    // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
-                    // they do something more efficient than spinning (?)
-                    params.type = GGML_TASK_COMPUTE;
-                    ggml_compute_forward(&params, node);
+    struct ggml_trace * trace = malloc(sizeof(struct ggml_trace));
 
-                    if (GGML_OP_HAS_FINALIZE[node->op]) {
-                        params.type = GGML_TASK_FINALIZE;
-                        ggml_compute_forward(&params, node);
-                    }
+    trace->events       = malloc(sizeof(struct ggml_trace_event)*n_events_max);
+    trace->n_events_max = n_events_max;
 
-                    ggml_graph_compute_perf_stats_node(node, state->shared);
+    GGML_ASSERT(trace->events);
+
+    ggml_trace_reset(trace);
+
+    return trace;
+}
+
+void ggml_trace_free(struct ggml_trace * trace) {
+    if (trace == NULL) {
+        return;
+    }
+
+    free(trace->events);
+    free(trace);
+}
+
+void ggml_trace_reset(struct ggml_trace * trace) {
+    trace->t_start_us = ggml_time_us();
+
+    atomic_store(&trace->n_graphs, 0);
+    atomic_store(&trace->n_events, 0);
+}
+
+int ggml_trace_n_events(struct ggml_trace * trace) {
+    return MIN(atomic_load(&trace->n_events), trace->n_events_max);
+}
+
+// record a node (or a wait when node is NULL) computed by thread ith from t_start_us until now
+static void ggml_trace_record(
+        struct ggml_compute_state_shared * shared,
+        const struct ggml_tensor * node,
+        int node_n, enum ggml_task_type type, int ith, int nth, int64_t t_start_us) {
+    struct ggml_trace * trace = shared->cplan->trace;
+
+    const int64_t t_end_us = ggml_time_us();
+
+    const int64_t t_wait_us = shared->trace_wait_us[ith];
+    shared->trace_wait_us[ith] = 0;
+
+    const int i = atomic_fetch_add(&trace->n_events, 1);
+    if (i >= trace->n_events_max) {
+        return;
+    }
+
+    struct ggml_trace_event * ev = &trace->events[i];
+
+    size_t bytes = 0;
+
+    if (node) {
+        memcpy(ev->name, node->name, sizeof(ev->name));
+        ev->op = node->op;
+
+        switch (node->op) {
+            case GGML_OP_NONE:
+            case GGML_OP_RESHAPE:
+            case GGML_OP_VIEW:
+            case GGML_OP_PERMUTE:
+            case GGML_OP_TRANSPOSE:
+                break;
+            case GGML_OP_GET_ROWS:
+                // only the selected rows are read
+                bytes = ggml_nbytes(node) + ggml_nbytes(node->src[1]) + node->src[0]->nb[1]*ggml_nelements(node->src[1]);
+                break;
+            case GGML_OP_SET_ROWS:
+                // only the selected rows are written
+                bytes = ggml_nbytes(node->src[1]) + ggml_nbytes(node->src[2]) +
+                    ggml_type_size(node->type)*node->ne[0]/ggml_blck_size(node->type)*ggml_nelements(node->src[2]);
+                break;
+            default:
+                bytes = ggml_nbytes(node);
+                for (int j = 0; j < GGML_MAX_SRC; ++j) {
+                    if (node->src[j]) {
+                        bytes += ggml_nbytes(node->src[j]);
+                    }
+                }
+                break;
+        }
+    } else {
+        strcpy(ev->name, "wait");
+        ev->op = GGML_OP_NONE;
+    }
+
+    ev->type       = type;
+    ev->graph      = shared->trace_graph;
+    ev->node       = node ? node_n : -1;
+    ev->ith        = ith;
+    ev->nth        = nth;
+    ev->t_start_us = t_start_us;
+    ev->t_end_us   = t_end_us;
+    ev->t_wait_us  = t_wait_us;
+    ev->bytes      = bytes;
+}
+
+static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
+    int64_t cycles_cur  = ggml_perf_cycles()  - st->perf_node_start_cycles;
+    int64_t time_us_cur = ggml_perf_time_us() - st->perf_node_start_time_us;
+
+    node->perf_runs++;
+    node->perf_cycles  += cycles_cur;
+    node->perf_time_us += time_us_cur;
+}
+
+static int ggml_graph_level(const struct ggml_cgraph * cgraph, const int * n_tasks, int start, int n_threads, size_t * work_offs, size_t * work_size);
+
+static thread_ret_t ggml_graph_compute_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+
+    const struct ggml_cgraph * cgraph = state->shared->cgraph;
+    const struct ggml_cplan  * cplan  = state->shared->cplan;
+
+    const int * n_tasks_arr = cplan->n_tasks;
+    const int   n_threads   = state->shared->n_threads;
+
+    const bool trace = cplan->trace != NULL;
+
+    set_numa_thread_affinity(state->ith, n_threads);
+
+    // the nodes are computed in levels of consecutive independent nodes (see ggml_graph_level)
+    int node_n  = -1; // first node of the current level
+    int n_level =  1; // number of nodes in the current level (so that the first level starts at node 0)
+
+    while (true) {
+        if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
+            atomic_fetch_add(&state->shared->node_n, 1);
+            ggml_compute_wake(state->shared);
+            return (thread_ret_t) GGML_EXIT_ABORTED;
+        }
+        if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
+            // all other threads are finished and spinning
+            // do finalize and init here so we don't have synchronize again
+            struct ggml_compute_params params = {
+                /*.type  =*/ GGML_TASK_FINALIZE,
+                /*.ith   =*/ 0,
+                /*.nth   =*/ 0,
+                /*.wsize =*/ cplan->work_size,
+                /*.wdata =*/ cplan->work_data,
+                /*.shared=*/ state->shared,
+            };
+
+            if (node_n != -1) {
+                /* FINALIZE */
+                for (int k = 0; k < n_level; ++k) {
+                    struct ggml_tensor * node = cgraph->nodes[node_n + k];
+                    if (GGML_OP_HAS_FINALIZE[node->op]) {
+                        const int64_t t_start_us = trace ? ggml_time_us() : 0;
+
+                        params.nth = n_tasks_arr[node_n + k];
+                        ggml_compute_forward(&params, node);
+
+                        if (trace) {
+                            ggml_trace_record(state->shared, node, node_n + k, GGML_TASK_FINALIZE, state->ith, 1, t_start_us);
+                        }
+                    }
+                    ggml_graph_compute_perf_stats_node(node, state->shared);
+                }
+            }
+
+            // distribute new work or execute it direct if 1T
+            while ((node_n += n_level) < cgraph->n_nodes) {
+                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
+
+                size_t work_size_level = 0;
+                n_level = ggml_graph_level(cgraph, n_tasks_arr, node_n, n_threads, state->shared->level_work_offs, &work_size_level);
+                GGML_ASSERT(work_size_level <= cplan->work_size);
+
+                state->shared->perf_node_start_cycles  = ggml_perf_cycles();
+                state->shared->perf_node_start_time_us = ggml_perf_time_us();
+
+                int n_tasks_max = 0;
+
+                /* INIT */
+                // (only nodes that are alone in their level have an INIT or FINALIZE pass)
+                for (int k = 0; k < n_level; ++k) {
+                    struct ggml_tensor * node = cgraph->nodes[node_n + k];
+                    const int n_tasks = n_tasks_arr[node_n + k];
+
+                    if (GGML_OP_HAS_INIT[node->op]) {
+                        const int64_t t_start_us = trace ? ggml_time_us() : 0;
+
+                        params.type = GGML_TASK_INIT;
+                        params.nth  = n_tasks;
+                        ggml_compute_forward(&params, node);
+
+                        if (trace) {
+                            ggml_trace_record(state->shared, node, node_n + k, GGML_TASK_INIT, state->ith, 1, t_start_us);
+                        }
+                    }
+
+                    n_tasks_max = MAX(n_tasks_max, n_tasks);
+                }
+
+                if (n_tasks_max == 1) {
+                    // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
+                    // they do something more efficient than spinning (?)
+                    for (int k = 0; k < n_level; ++k) {
+                        struct ggml_tensor * node = cgraph->nodes[node_n + k];
+
+                        params.type  = GGML_TASK_COMPUTE;
+                        params.nth   = 1;
+                        params.wsize = cplan->work_size - state->shared->level_work_offs[k];
+                        params.wdata = (char *) cplan->work_data + state->shared->level_work_offs[k];
+
+                        const int64_t t_start_us = trace ? ggml_time_us() : 0;
+
+                        if (n_tasks_arr[node_n + k] == 0) {
+                            // computed as a part of the fused chain
+                        } else if (node_n + k + 1 < cgraph->n_nodes && n_tasks_arr[node_n + k + 1] == 0) {
+                            ggml_compute_forward_fused(&params, cgraph->nodes + node_n + k, n_level - k);
+                        } else {
+                            ggml_compute_forward(&params, node);
+                        }
+
+                        if (GGML_OP_HAS_FINALIZE[node->op]) {
+                            params.type = GGML_TASK_FINALIZE;
+                            ggml_compute_forward(&params, node);
+                        }
+
+                        if (trace && n_tasks_arr[node_n + k] > 0) {
+                            ggml_trace_record(state->shared, node, node_n + k, GGML_TASK_COMPUTE, state->ith, 1, t_start_us);
+                        }
+
+                        ggml_graph_compute_perf_stats_node(node, state->shared);
+                    }
+
+                    params.wsize = cplan->work_size;
+                    params.wdata = cplan->work_data;
                 } else {
                     break;
                 }
@@ -16259,520 +17881,1124 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
                 }
             }
 
+            state->shared->n_level = n_level;
+
             atomic_store(&state->shared->n_active, n_threads);
             atomic_store(&state->shared->node_n,   node_n);
+            ggml_compute_wake(state->shared);
         } else {
             // wait for other threads to finish
-            const int last = node_n;
-            while (true) {
-                // TODO: this sched_yield can have significant impact on the performance - either positive or negative
-                //       depending on the workload and the operating system.
-                //       since it is not clear what is the best approach, it should potentially become user-configurable
-                //       ref: https://github.com/ggerganov/ggml/issues/291
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                sched_yield();
-#endif
+            // the best way to wait depends on the workload and the operating system, see cplan.wait_policy
+            const int64_t t_start_us = trace ? ggml_time_us() : 0;
 
-                node_n = atomic_load(&state->shared->node_n);
-                if (node_n != last) break;
-            };
+            node_n  = ggml_compute_wait(state->shared, &state->shared->node_n, node_n);
+            n_level = state->shared->n_level;
+
+            if (trace) {
+                ggml_trace_record(state->shared, NULL, node_n, GGML_TASK_COMPUTE, state->ith, n_threads, t_start_us);
+            }
         }
 
         // check if we should stop
         if (node_n >= cgraph->n_nodes) break;
 
         /* COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
-        const int n_tasks = n_tasks_arr[node_n];
-
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_COMPUTE,
-            /*.ith   =*/ state->ith,
-            /*.nth   =*/ n_tasks,
-            /*.wsize =*/ cplan->work_size,
-            /*.wdata =*/ cplan->work_data,
-        };
+        // no barrier is needed between the nodes of a level
+        // the nodes of a fused chain have n_tasks == 0, except for the first one that computes the whole chain
+        const bool fused = n_level > 1 && n_tasks_arr[node_n + 1] == 0;
+
+        for (int k = 0; k < n_level; ++k) {
+            struct ggml_tensor * node = cgraph->nodes[node_n + k];
+            const int n_tasks = n_tasks_arr[node_n + k];
+
+            const size_t work_offs = state->shared->level_work_offs[k];
+
+            struct ggml_compute_params params = {
+                /*.type  =*/ GGML_TASK_COMPUTE,
+                /*.ith   =*/ state->ith,
+                /*.nth   =*/ n_tasks,
+                /*.wsize =*/ cplan->work_size - work_offs,
+                /*.wdata =*/ (char *) cplan->work_data + work_offs,
+                /*.shared=*/ state->shared,
+            };
+
+            if (state->ith < n_tasks) {
+                const int64_t t_start_us = trace ? ggml_time_us() : 0;
+
+                if (fused) {
+                    ggml_compute_forward_fused(&params, cgraph->nodes + node_n, n_level);
+                } else {
+                    ggml_compute_forward(&params, node);
+                }
 
-        if (state->ith < n_tasks) {
-            ggml_compute_forward(&params, node);
+                if (trace) {
+                    ggml_trace_record(state->shared, node, node_n + k, GGML_TASK_COMPUTE, state->ith, n_tasks, t_start_us);
+                }
+            }
         }
     }
 
     return GGML_EXIT_SUCCESS;
 }
 
-struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
-    if (n_threads <= 0) {
-        n_threads = GGML_DEFAULT_N_THREADS;
+static thread_ret_t ggml_threadpool_worker(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool * pool = state->threadpool;
+
+    // the pool is created in state 0 - the first graph may have been published before this thread started running
+    int last = 0;
+
+    while (true) {
+        // poll for a while in case the next graph is submitted soon (e.g. next token), then park
+        int cur = atomic_load(&pool->state);
+        for (int i = 0; i < GGML_WAIT_N_SPIN && cur == last && !atomic_load(&pool->stop); ++i) {
+            ggml_spin_pause();
+            cur = atomic_load(&pool->state);
+        }
+
+        if (cur == last && !atomic_load(&pool->stop)) {
+            pthread_mutex_lock(&pool->mutex);
+            while ((cur = atomic_load(&pool->state)) == last && !atomic_load(&pool->stop)) {
+                pthread_cond_wait(&pool->cond, &pool->mutex);
+            }
+            pthread_mutex_unlock(&pool->mutex);
+        }
+
+        if (atomic_load(&pool->stop)) {
+            break;
+        }
+
+        last = cur;
+
+        // only the first n_threads workers take part in the current graph
+        if (state->ith < (cur & 0xffff)) {
+            ggml_graph_compute_thread(state);
+
+            // n_joining is checked after the decrement, see ggml_threadpool_join()
+            if (atomic_fetch_sub(&pool->n_busy, 1) == 1 && atomic_load(&pool->n_joining) > 0) {
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_broadcast(&pool->cond_join);
+                pthread_mutex_unlock(&pool->mutex);
+            }
+        }
     }
 
-    size_t work_size = 0;
+    return 0;
+}
 
-    struct ggml_cplan cplan;
-    memset(&cplan, 0, sizeof(struct ggml_cplan));
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    GGML_ASSERT(n_threads > 0 && n_threads < 0xffff);
 
-    // thread scheduling for the different operations + work buffer size estimation
-    for (int i = 0; i < cgraph->n_nodes; i++) {
-        int n_tasks = 1;
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool);
 
-        struct ggml_tensor * node = cgraph->nodes[i];
+    pthread_mutex_init(&pool->mutex,     NULL);
+    pthread_cond_init (&pool->cond,      NULL);
+    pthread_cond_init (&pool->cond_join, NULL);
 
-        switch (node->op) {
-            case GGML_OP_CPY:
-            case GGML_OP_DUP:
-                {
-                    n_tasks = n_threads;
+    atomic_store(&pool->state,     0);
+    atomic_store(&pool->n_busy,    0);
+    atomic_store(&pool->stop,      0);
+    atomic_store(&pool->n_joining, 0);
 
-                    size_t cur = 0;
-                    if (ggml_is_quantized(node->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
-                    }
+    pool->n_threads = n_threads;
+    pool->workers   = malloc(sizeof(struct ggml_compute_state)*n_threads);
+    GGML_ASSERT(pool->workers);
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_ADD:
-            case GGML_OP_ADD1:
-                {
-                    n_tasks = n_threads;
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd       = 0,
+            .ith        = j,
+            .shared     = NULL,
+            .threadpool = pool,
+        };
+    }
 
-                    size_t cur = 0;
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_worker, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
 
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
+    return pool;
+}
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_ACC:
-                {
-                    n_tasks = n_threads;
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
 
-                    size_t cur = 0;
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->stop, 1);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
 
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
-                    }
+    for (int j = 1; j < pool->n_threads; ++j) {
+        const int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_SUB:
-            case GGML_OP_DIV:
-            case GGML_OP_SQR:
-            case GGML_OP_SQRT:
-            case GGML_OP_LOG:
-            case GGML_OP_SUM:
-            case GGML_OP_SUM_ROWS:
-            case GGML_OP_MEAN:
-            case GGML_OP_ARGMAX:
-            case GGML_OP_REPEAT:
-            case GGML_OP_REPEAT_BACK:
-            {
-                    n_tasks = 1;
-                } break;
+    pthread_cond_destroy (&pool->cond_join);
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
 
-            case GGML_OP_UNARY:
-                {
-                    switch (ggml_get_unary_op(node)) {
-                        case GGML_UNARY_OP_ABS:
-                        case GGML_UNARY_OP_SGN:
-                        case GGML_UNARY_OP_NEG:
-                        case GGML_UNARY_OP_STEP:
-                        case GGML_UNARY_OP_TANH:
-                        case GGML_UNARY_OP_ELU:
-                        case GGML_UNARY_OP_RELU:
-                            {
-                                n_tasks = 1;
-                            } break;
+    free(pool->workers);
+    free(pool);
+}
 
-                        case GGML_UNARY_OP_GELU:
-                        case GGML_UNARY_OP_GELU_QUICK:
-                        case GGML_UNARY_OP_SILU:
-                            {
-                                n_tasks = n_threads;
-                            } break;
-                    }
-                } break;
-            case GGML_OP_SILU_BACK:
-            case GGML_OP_MUL:
-            case GGML_OP_NORM:
-            case GGML_OP_RMS_NORM:
-            case GGML_OP_RMS_NORM_BACK:
-            case GGML_OP_GROUP_NORM:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_CONCAT:
-            case GGML_OP_MUL_MAT:
-                {
-                    n_tasks = n_threads;
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
 
-                    // TODO: use different scheduling for different matrix sizes
-                    //const int nr0 = ggml_nrows(node->src[0]);
-                    //const int nr1 = ggml_nrows(node->src[1]);
+// wait until the workers have left the current graph, following the wait policy of the plan
+// the pool mutex is used for sleeping: the state of the graph is on the stack of ggml_graph_compute() and
+// cannot be used by a worker after its decrement of n_busy
+static void ggml_threadpool_join(struct ggml_threadpool * pool, const struct ggml_cplan * cplan) {
+    int n_spin;
+    const enum ggml_wait_policy policy = ggml_wait_policy_get(cplan, &n_spin);
 
-                    //n_tasks = MIN(n_threads, MAX(1, nr0/128));
-                    //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks%d\n", nr0, nr1, nr0*nr1, n_tasks);
+    if (policy == GGML_WAIT_POLICY_SPIN) {
+        while (atomic_load(&pool->n_busy) > 0) {
+            ggml_spin_pause();
+        }
+        return;
+    }
 
-                    size_t cur = 0;
-                    const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+    for (int i = 0; i < n_spin; ++i) {
+        if (atomic_load(&pool->n_busy) == 0) {
+            return;
+        }
+        ggml_spin_pause();
+    }
 
-#if defined(GGML_USE_CUBLAS)
-                    if (ggml_cuda_can_mul_mat(node->src[0], node->src[1], node)) {
-                        n_tasks = 1; // TODO: this actually is doing nothing
-                                     //       the threads are still spinning
-                    } else
-#elif defined(GGML_USE_CLBLAST)
-                    if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
-                        n_tasks = 1; // TODO: this actually is doing nothing
-                                     //       the threads are still spinning
-                        cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
-                    } else
-#endif
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                    if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
-                        n_tasks = 1; // TODO: this actually is doing nothing
-                                     //       the threads are still spinning
-                        if (node->src[0]->type != GGML_TYPE_F32) {
-                            // here we need memory just for single 2D matrix from src0
-                            cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
-                        }
-                    } else
-#endif
-                    if (node->src[1]->type != vec_dot_type) {
-                        cur = ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
-                    } else {
-                        cur = 0;
-                    }
+    if (policy == GGML_WAIT_POLICY_YIELD) {
+        while (atomic_load(&pool->n_busy) > 0) {
+            sched_yield();
+        }
+        return;
+    }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_OUT_PROD:
-                {
-                    n_tasks = n_threads;
+    // GGML_WAIT_POLICY_SLEEP
+    // n_joining is set before checking n_busy, so the last worker either sees it and wakes up this thread,
+    // or this thread sees n_busy at 0
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->n_joining, 1);
+    while (atomic_load(&pool->n_busy) > 0) {
+        pthread_cond_wait(&pool->cond_join, &pool->mutex);
+    }
+    atomic_store(&pool->n_joining, 0);
+    pthread_mutex_unlock(&pool->mutex);
+}
 
-                    size_t cur = 0;
+// run the graph on the threads of the pool - the calling thread acts as worker 0
+static int ggml_threadpool_compute(struct ggml_threadpool * pool, struct ggml_compute_state_shared * shared) {
+    const int n_threads = shared->n_threads;
 
-                    if (ggml_is_quantized(node->src[0]->type)) {
-                        cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
-                    }
+    GGML_ASSERT(n_threads <= pool->n_threads);
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_SCALE:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_SET:
-            case GGML_OP_CONT:
-            case GGML_OP_RESHAPE:
-            case GGML_OP_VIEW:
-            case GGML_OP_PERMUTE:
-            case GGML_OP_TRANSPOSE:
-            case GGML_OP_GET_ROWS:
-            case GGML_OP_GET_ROWS_BACK:
-            case GGML_OP_DIAG:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_DIAG_MASK_ZERO:
-            case GGML_OP_DIAG_MASK_INF:
-            case GGML_OP_SOFT_MAX:
-            case GGML_OP_SOFT_MAX_BACK:
-            case GGML_OP_ROPE:
-            case GGML_OP_ROPE_BACK:
-            case GGML_OP_ADD_REL_POS:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_ALIBI:
-                {
-                    n_tasks = 1; //TODO
-                } break;
-            case GGML_OP_CLAMP:
-                {
-                    n_tasks = 1; //TODO
-                } break;
-            case GGML_OP_CONV_1D:
-                {
-                    n_tasks = n_threads;
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j].shared = shared;
+    }
+
+    atomic_store(&pool->n_busy, n_threads - 1);
+
+    // publish the new graph and wake up any parked workers
+    pthread_mutex_lock(&pool->mutex);
+    {
+        const int gen = ((atomic_load(&pool->state) >> 16) + 1) & 0x7fff;
+        atomic_store(&pool->state, (gen << 16) | n_threads);
+    }
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    const int compute_status = (size_t) ggml_graph_compute_thread(&pool->workers[0]);
+
+    // the workers leave the graph at about the same time as the calling thread, unless the threads are oversubscribed
+    ggml_threadpool_join(pool, shared->cplan);
+
+    return compute_status;
+}
+
+// number of tasks to use for the node and the size of the work buffer it needs
+// (without the cache line padding between the threads, see ggml_graph_node_work_size)
+static int ggml_graph_node_n_tasks(struct ggml_tensor * node, int n_threads, size_t * work_size_node) {
+    size_t work_size = 0;
+
+    int n_tasks = 1;
+
+    switch (node->op) {
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+                if (ggml_is_quantized(node->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_ADD:
+        case GGML_OP_ADD1:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_ACC:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[1]->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_SUB:
+        case GGML_OP_DIV:
+        case GGML_OP_SQR:
+        case GGML_OP_SQRT:
+        case GGML_OP_LOG:
+        case GGML_OP_SUM:
+        case GGML_OP_SUM_ROWS:
+        case GGML_OP_MEAN:
+        case GGML_OP_ARGMAX:
+        case GGML_OP_REPEAT:
+        case GGML_OP_REPEAT_BACK:
+        {
+                n_tasks = 1;
+            } break;
+
+        case GGML_OP_UNARY:
+            {
+                switch (ggml_get_unary_op(node)) {
+                    case GGML_UNARY_OP_ABS:
+                    case GGML_UNARY_OP_SGN:
+                    case GGML_UNARY_OP_NEG:
+                    case GGML_UNARY_OP_STEP:
+                    case GGML_UNARY_OP_TANH:
+                    case GGML_UNARY_OP_ELU:
+                    case GGML_UNARY_OP_RELU:
+                        {
+                            n_tasks = 1;
+                        } break;
+
+                    case GGML_UNARY_OP_GELU:
+                    case GGML_UNARY_OP_GELU_QUICK:
+                    case GGML_UNARY_OP_SILU:
+                        {
+                            n_tasks = n_threads;
+                        } break;
+                }
+            } break;
+        case GGML_OP_SILU_BACK:
+        case GGML_OP_MUL:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_RMS_NORM_BACK:
+        case GGML_OP_GROUP_NORM:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_CONCAT:
+        case GGML_OP_MUL_MAT:
+            {
+                n_tasks = n_threads;
+
+                // TODO: use different scheduling for different matrix sizes
+                //const int nr0 = ggml_nrows(node->src[0]);
+                //const int nr1 = ggml_nrows(node->src[1]);
+
+                //n_tasks = MIN(n_threads, MAX(1, nr0/128));
+                //printf("nr0 = %8d, nr1 = %8d, nr0*nr1 = %8d, n_tasks%d\n", nr0, nr1, nr0*nr1, n_tasks);
+
+                size_t cur = 0;
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+
+#if defined(GGML_USE_CUBLAS)
+                if (ggml_cuda_can_mul_mat(node->src[0], node->src[1], node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                 //       the threads are still spinning
+                } else
+#elif defined(GGML_USE_CLBLAST)
+                if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                 //       the threads are still spinning
+                    cur = ggml_cl_mul_mat_get_wsize(node->src[0], node->src[1], node);
+                } else
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], node)) {
+                    n_tasks = 1; // TODO: this actually is doing nothing
+                                 //       the threads are still spinning
+                    if (node->src[0]->type != GGML_TYPE_F32) {
+                        // here we need memory just for single 2D matrix from src0
+                        cur = ggml_type_size(GGML_TYPE_F32)*(node->src[0]->ne[0]*node->src[0]->ne[1]);
+                    }
+                } else
+#endif
+                if (node->src[1]->type != vec_dot_type) {
+                    cur = ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
+                } else {
+                    cur = 0;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_OUT_PROD:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                if (ggml_is_quantized(node->src[0]->type)) {
+                    cur = ggml_type_size(GGML_TYPE_F32) * node->src[0]->ne[0] * n_tasks;
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_SCALE:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_SET:
+        case GGML_OP_CONT:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_GET_ROWS_BACK:
+        case GGML_OP_DIAG:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_SET_ROWS:
+        case GGML_OP_DIAG_MASK_ZERO:
+        case GGML_OP_DIAG_MASK_INF:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_SOFT_MAX_BACK:
+        case GGML_OP_ROPE:
+        case GGML_OP_ROPE_BACK:
+        case GGML_OP_ADD_REL_POS:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_ALIBI:
+            {
+                n_tasks = 1; //TODO
+            } break;
+        case GGML_OP_CLAMP:
+            {
+                n_tasks = 1; //TODO
+            } break;
+        case GGML_OP_CONV_1D:
+            {
+                n_tasks = n_threads;
+
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];
+                const int64_t ne01 = node->src[0]->ne[1];
+                const int64_t ne02 = node->src[0]->ne[2];
+
+                const int64_t ne10 = node->src[1]->ne[0];
+                const int64_t ne11 = node->src[1]->ne[1];
+
+                const int64_t ne0 = node->ne[0];
+                const int64_t ne1 = node->ne[1];
+                const int64_t nk  = ne00;
+                const int64_t ew0 = nk * ne01;
+
+                UNUSED(ne02);
+                UNUSED(ne10);
+                UNUSED(ne11);
+
+                size_t cur = 0;
+
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(ggml_fp16_t)*(ne0*ne1*ew0);
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(float)*(ne0*ne1*ew0);
+                } else {
+                    GGML_ASSERT(false);
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CONV_1D_STAGE_0:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_CONV_1D_STAGE_1:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_1D:
+            {
+                n_tasks = n_threads;
+
+                GGML_ASSERT(node->src[0]->ne[3] == 1);
+                GGML_ASSERT(node->src[1]->ne[2] == 1);
+                GGML_ASSERT(node->src[1]->ne[3] == 1);
+
+                const int64_t ne00 = node->src[0]->ne[0];  // K
+                const int64_t ne01 = node->src[0]->ne[1];  // Cout
+                const int64_t ne02 = node->src[0]->ne[2];  // Cin
+
+                const int64_t ne10 = node->src[1]->ne[0];  // L
+                const int64_t ne11 = node->src[1]->ne[1];  // Cin
+
+                size_t cur = 0;
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
+                    cur += sizeof(ggml_fp16_t)*ne10*ne11;
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur += sizeof(float)*ne00*ne01*ne02;
+                    cur += sizeof(float)*ne10*ne11;
+                } else {
+                    GGML_ASSERT(false);
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CONV_2D:
+            {
+                n_tasks = n_threads;
+
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // C
+                const int64_t ne03 = node->src[0]->ne[3]; // N
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // C
+
+                const int64_t ne0 = node->ne[0];
+                const int64_t ne1 = node->ne[1];
+                const int64_t ne2 = node->ne[2];
+                const int64_t ne3 = node->ne[3];
+                const int64_t nk = ne00*ne01;
+                const int64_t ew0 = nk * ne02;
+
+                UNUSED(ne03);
+                UNUSED(ne2);
+
+                size_t cur = 0;
+
+                if (node->src[0]->type == GGML_TYPE_F16 &&
+                    node->src[1]->type == GGML_TYPE_F32) {
+                    // im2col: [N*OH*OW, IC*KH*KW]
+                    cur = sizeof(ggml_fp16_t)*(ne3*ne0*ne1*ew0);
+                } else if (node->src[0]->type == GGML_TYPE_F32 &&
+                           node->src[1]->type == GGML_TYPE_F32) {
+                    cur = sizeof(float)*      (ne10*ne11*ne12);
+                } else {
+                    GGML_ASSERT(false);
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CONV_2D_STAGE_0:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_CONV_2D_STAGE_1:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_CONV_TRANSPOSE_2D:
+            {
+                n_tasks = n_threads;
+
+                const int64_t ne00 = node->src[0]->ne[0]; // W
+                const int64_t ne01 = node->src[0]->ne[1]; // H
+                const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
+                const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+
+                const int64_t ne10 = node->src[1]->ne[0]; // W
+                const int64_t ne11 = node->src[1]->ne[1]; // H
+                const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+
+                size_t cur = 0;
+                cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
+                cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_POOL_1D:
+        case GGML_OP_POOL_2D:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_UPSCALE:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_FLASH_ATTN:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+
+                if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                n_tasks = n_threads;
+
+                const int64_t D  = node->src[0]->ne[0];
+                const int64_t KV = node->src[1]->ne[1];
+
+                const int64_t N  = node->src[0]->ne[1];
+
+                int64_t B;
+                int64_t C;
+                ggml_flash_attn_ext_sizes(node, &B, &C);
+
+                const size_t cur = sizeof(float)*ggml_flash_attn_ext_wsize(D, N, KV, B, C)*n_tasks;
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_FLASH_FF:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+
+                if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_FLASH_ATTN_BACK:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = 0;
+
+                const int64_t    D = node->src[0]->ne[0];
+                const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
+                if (node->src[1]->type == GGML_TYPE_F32) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+
+                if (node->src[1]->type == GGML_TYPE_F16) {
+                    cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
+                    cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
+                }
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_WIN_PART:
+        case GGML_OP_WIN_UNPART:
+        case GGML_OP_GET_REL_POS:
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_MAP_CUSTOM1:
+            {
+                struct ggml_map_custom1_op_params * p = (struct ggml_map_custom1_op_params *) node->op_params;
+                if (p->n_tasks == GGML_N_TASKS_MAX) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(p->n_tasks, n_threads);
+                }
+            } break;
+        case GGML_OP_MAP_CUSTOM2:
+            {
+                struct ggml_map_custom2_op_params * p = (struct ggml_map_custom2_op_params *) node->op_params;
+                if (p->n_tasks == GGML_N_TASKS_MAX) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(p->n_tasks, n_threads);
+                }
+            } break;
+        case GGML_OP_MAP_CUSTOM3:
+            {
+                struct ggml_map_custom3_op_params * p = (struct ggml_map_custom3_op_params *) node->op_params;
+                if (p->n_tasks == GGML_N_TASKS_MAX) {
+                    n_tasks = n_threads;
+                } else {
+                    n_tasks = MIN(p->n_tasks, n_threads);
+                }
+            } break;
+        case GGML_OP_CROSS_ENTROPY_LOSS:
+            {
+                n_tasks = n_threads;
+
+                size_t cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+
+                work_size = MAX(work_size, cur);
+            } break;
+        case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
+            {
+                n_tasks = n_threads;
+            } break;
+        case GGML_OP_NONE:
+            {
+                n_tasks = 1;
+            } break;
+        case GGML_OP_COUNT:
+            {
+                GGML_ASSERT(false);
+            } break;
+    }
+
+    *work_size_node = work_size;
+
+    return n_tasks;
+}
+
+// size of the part of the work buffer used by the node - including the padding between the threads
+static size_t ggml_graph_node_work_size(struct ggml_tensor * node, int n_threads) {
+    size_t cur = 0;
+    ggml_graph_node_n_tasks(node, n_threads, &cur);
+
+    if (cur == 0) {
+        return 0;
+    }
+
+    cur += CACHE_LINE_SIZE*(n_threads - 1);
+
+    return GGML_PAD(cur, CACHE_LINE_SIZE);
+}
+
+// ops that do not compute anything - the result is a view of the source
+static bool ggml_op_is_view(enum ggml_op op) {
+    return op == GGML_OP_NONE || op == GGML_OP_RESHAPE || op == GGML_OP_VIEW || op == GGML_OP_PERMUTE || op == GGML_OP_TRANSPOSE;
+}
+
+static bool ggml_tensors_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    if (ggml_nelements(a) == 0 || ggml_nelements(b) == 0) {
+        return false;
+    }
+
+    if (a->data == NULL || b->data == NULL) {
+        // unknown location - assume the worst
+        return true;
+    }
+
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// check if the node can be added to a level together with the earlier node prev
+// this also catches memory reuse by the allocator: node must not write to memory that prev reads or writes,
+// and it must not read memory that prev writes
+static bool ggml_graph_nodes_independent(const struct ggml_tensor * prev, const struct ggml_tensor * node) {
+    if (ggml_op_is_view(prev->op) || ggml_op_is_view(node->op)) {
+        return true;
+    }
+
+    if (ggml_tensors_overlap(node, prev)) {
+        return false;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i] && (node->src[i] == prev || ggml_tensors_overlap(node->src[i], prev))) {
+            return false;
+        }
+        if (prev->src[i] && ggml_tensors_overlap(node, prev->src[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// only plain CPU ops are grouped into levels with other nodes
+static bool ggml_graph_node_can_share_level(const struct ggml_tensor * node) {
+    if (GGML_OP_HAS_INIT[node->op] || GGML_OP_HAS_FINALIZE[node->op]) {
+        return false;
+    }
+
+    switch (node->op) {
+        case GGML_OP_MAP_UNARY:
+        case GGML_OP_MAP_BINARY:
+        case GGML_OP_MAP_CUSTOM1_F32:
+        case GGML_OP_MAP_CUSTOM2_F32:
+        case GGML_OP_MAP_CUSTOM3_F32:
+        case GGML_OP_MAP_CUSTOM1:
+        case GGML_OP_MAP_CUSTOM2:
+        case GGML_OP_MAP_CUSTOM3:
+            return false;
+        default:
+            break;
+    }
+
+    if (node->backend != GGML_BACKEND_CPU) {
+        return false;
+    }
+
+    for (int i = 0; i < GGML_MAX_SRC; ++i) {
+        if (node->src[i] && node->src[i]->backend != GGML_BACKEND_CPU) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// number of nodes after node i that are computed as a part of the fused chain started by node i
+static int ggml_graph_n_fused(const struct ggml_cgraph * cgraph, const int * n_tasks, int i) {
+    int n = 0;
+    while (i + n + 1 < cgraph->n_nodes && n_tasks[i + n + 1] == 0) {
+        n++;
+    }
+    return n;
+}
+
+// find the level of consecutive independent nodes that starts at node start
+// the nodes of a level are computed without a barrier between them
+// a fused chain is always a level of its own, with the work buffer shared by all nodes of the chain
+// returns the number of nodes in the level, the offset of the work buffer of each node and the total work size
+static int ggml_graph_level(const struct ggml_cgraph * cgraph, const int * n_tasks, int start, int n_threads, size_t * work_offs, size_t * work_size) {
+    struct ggml_tensor * first = cgraph->nodes[start];
+
+    int n = 1;
+
+    work_offs[0] = 0;
+    *work_size   = ggml_graph_node_work_size(first, n_threads);
+
+    const int n_fused = ggml_graph_n_fused(cgraph, n_tasks, start);
+    if (n_fused > 0) {
+        for (int k = 1; k <= n_fused; ++k) {
+            work_offs[n++] = 0;
+            *work_size     = MAX(*work_size, ggml_graph_node_work_size(cgraph->nodes[start + k], n_threads));
+        }
+        return n;
+    }
+
+    if (n_threads == 1 || !ggml_graph_node_can_share_level(first)) {
+        return n;
+    }
+
+    for (int j = start + 1; j < cgraph->n_nodes && n < GGML_MAX_LEVEL_NODES; ++j) {
+        struct ggml_tensor * node = cgraph->nodes[j];
+
+        if (!ggml_graph_node_can_share_level(node) || ggml_graph_n_fused(cgraph, n_tasks, j) > 0) {
+            break;
+        }
+
+        bool independent = true;
+        for (int k = start; k < j && independent; ++k) {
+            independent = ggml_graph_nodes_independent(cgraph->nodes[k], node);
+        }
+
+        if (!independent) {
+            break;
+        }
+
+        work_offs[n++] = *work_size;
+        *work_size    += ggml_graph_node_work_size(node, n_threads);
+    }
+
+    return n;
+}
+
+// the nodes of a level run concurrently, so each of them needs a separate part of the work buffer
+static size_t ggml_graph_work_size(const struct ggml_cgraph * cgraph, const int * n_tasks, int n_threads) {
+    size_t work_size = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; ) {
+        size_t work_offs[GGML_MAX_LEVEL_NODES];
+        size_t cur = 0;
+
+        i += ggml_graph_level(cgraph, n_tasks, i, n_threads, work_offs, &cur);
+
+        work_size = MAX(work_size, cur);
+    }
+
+    return work_size;
+}
+
+struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+
+    struct ggml_cplan cplan;
+    memset(&cplan, 0, sizeof(struct ggml_cplan));
+
+    // thread scheduling for the different operations
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        size_t cur = 0;
+
+        cplan.n_tasks[i] = ggml_graph_node_n_tasks(cgraph->nodes[i], n_threads, &cur);
+    }
+
+    cplan.n_threads = n_threads;
+    cplan.work_size = ggml_graph_work_size(cgraph, cplan.n_tasks, n_threads);
+    cplan.work_data = NULL;
+
+    return cplan;
+}
 
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
+// dst can be computed by a fused kernel that reads src if they do not overlap
+// or, for element-wise kernels, if they are exactly the same memory
+static bool ggml_fused_can_alias(const struct ggml_tensor * dst, const struct ggml_tensor * src, bool elementwise) {
+    if (!ggml_tensors_overlap(dst, src)) {
+        return true;
+    }
 
-                    const int64_t ne00 = node->src[0]->ne[0];
-                    const int64_t ne01 = node->src[0]->ne[1];
-                    const int64_t ne02 = node->src[0]->ne[2];
+    if (!elementwise || dst->data != src->data || !ggml_are_same_shape(dst, src)) {
+        return false;
+    }
 
-                    const int64_t ne10 = node->src[1]->ne[0];
-                    const int64_t ne11 = node->src[1]->ne[1];
+    for (int i = 0; i < GGML_MAX_DIMS; ++i) {
+        if (dst->nb[i] != src->nb[i]) {
+            return false;
+        }
+    }
 
-                    const int64_t ne0 = node->ne[0];
-                    const int64_t ne1 = node->ne[1];
-                    const int64_t nk  = ne00;
-                    const int64_t ew0 = nk * ne01;
+    return true;
+}
 
-                    UNUSED(ne02);
-                    UNUSED(ne10);
-                    UNUSED(ne11);
+// the result of t is used only by the next node of the chain, so it does not need to be stored
+static bool ggml_graph_fused_intermediate(struct ggml_cgraph * cgraph, const uint8_t * n_uses, struct ggml_tensor * t) {
+    const size_t i = hash_find(cgraph->visited_hash_table, t);
 
-                    size_t cur = 0;
+    return i < GGML_GRAPH_HASHTABLE_SIZE && cgraph->visited_hash_table[i] == t && n_uses[i] == 1 && t->type == GGML_TYPE_F32;
+}
 
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(ggml_fp16_t)*(ne0*ne1*ew0);
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(float)*(ne0*ne1*ew0);
-                    } else {
-                        GGML_ASSERT(false);
-                    }
+// returns the number of nodes in the fusable chain that starts at node i, or 0 if there is none
+static int ggml_graph_match_fused(struct ggml_cgraph * cgraph, const int * n_tasks, const uint8_t * n_uses, int i) {
+    if (i + 1 >= cgraph->n_nodes) {
+        return 0;
+    }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CONV_1D_STAGE_0:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_CONV_1D_STAGE_1:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_1D:
-                {
-                    n_tasks = n_threads;
+    struct ggml_tensor * a = cgraph->nodes[i];
+    struct ggml_tensor * b = cgraph->nodes[i + 1];
 
-                    GGML_ASSERT(node->src[0]->ne[3] == 1);
-                    GGML_ASSERT(node->src[1]->ne[2] == 1);
-                    GGML_ASSERT(node->src[1]->ne[3] == 1);
-
-                    const int64_t ne00 = node->src[0]->ne[0];  // K
-                    const int64_t ne01 = node->src[0]->ne[1];  // Cout
-                    const int64_t ne02 = node->src[0]->ne[2];  // Cin
-
-                    const int64_t ne10 = node->src[1]->ne[0];  // L
-                    const int64_t ne11 = node->src[1]->ne[1];  // Cin
-
-                    size_t cur = 0;
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02;
-                        cur += sizeof(ggml_fp16_t)*ne10*ne11;
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur += sizeof(float)*ne00*ne01*ne02;
-                        cur += sizeof(float)*ne10*ne11;
-                    } else {
-                        GGML_ASSERT(false);
-                    }
+    if (n_tasks[i] == 0 || n_tasks[i + 1] == 0 ||
+        !ggml_graph_node_can_share_level(a) || !ggml_graph_node_can_share_level(b) ||
+        !ggml_graph_fused_intermediate(cgraph, n_uses, a) || b->type != GGML_TYPE_F32) {
+        return 0;
+    }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CONV_2D:
-                {
-                    n_tasks = n_threads;
+    // the input of b that does not come from a
+    struct ggml_tensor * other = b->src[0] == a ? b->src[1] : b->src[0];
 
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // C
-                    const int64_t ne03 = node->src[0]->ne[3]; // N
-
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // C
-
-                    const int64_t ne0 = node->ne[0];
-                    const int64_t ne1 = node->ne[1];
-                    const int64_t ne2 = node->ne[2];
-                    const int64_t ne3 = node->ne[3];
-                    const int64_t nk = ne00*ne01;
-                    const int64_t ew0 = nk * ne02;
-
-                    UNUSED(ne03);
-                    UNUSED(ne2);
-
-                    size_t cur = 0;
-
-                    if (node->src[0]->type == GGML_TYPE_F16 &&
-                        node->src[1]->type == GGML_TYPE_F32) {
-                        // im2col: [N*OH*OW, IC*KH*KW]
-                        cur = sizeof(ggml_fp16_t)*(ne3*ne0*ne1*ew0);
-                    } else if (node->src[0]->type == GGML_TYPE_F32 &&
-                               node->src[1]->type == GGML_TYPE_F32) {
-                        cur = sizeof(float)*      (ne10*ne11*ne12);
-                    } else {
-                        GGML_ASSERT(false);
-                    }
+    switch (a->op) {
+        case GGML_OP_RMS_NORM:
+            {
+                if (b->op != GGML_OP_MUL || b->src[0] != a || other->type != GGML_TYPE_F32 ||
+                    a->src[0]->type != GGML_TYPE_F32 || a->src[0]->nb[0] != sizeof(float) ||
+                    other->nb[0] != sizeof(float) || b->nb[0] != sizeof(float)) {
+                    return 0;
+                }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CONV_2D_STAGE_0:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_CONV_2D_STAGE_1:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_CONV_TRANSPOSE_2D:
-                {
-                    n_tasks = n_threads;
+                if (!ggml_fused_can_alias(b, a->src[0], true) || !ggml_fused_can_alias(b, other, false)) {
+                    return 0;
+                }
 
-                    const int64_t ne00 = node->src[0]->ne[0]; // W
-                    const int64_t ne01 = node->src[0]->ne[1]; // H
-                    const int64_t ne02 = node->src[0]->ne[2]; // Channels Out
-                    const int64_t ne03 = node->src[0]->ne[3]; // Channels In
+                return 2;
+            }
+        case GGML_OP_UNARY:
+            {
+                if (ggml_get_unary_op(a) != GGML_UNARY_OP_SILU || b->op != GGML_OP_MUL || (b->src[0] != a && b->src[1] != a) ||
+                    a->src[0]->type != GGML_TYPE_F32 || other->type != GGML_TYPE_F32 || !ggml_are_same_shape(other, a) ||
+                    !ggml_is_contiguous_except_dim_1(a->src[0]) || !ggml_is_contiguous_except_dim_1(other) ||
+                    !ggml_is_contiguous_except_dim_1(b)) {
+                    return 0;
+                }
 
-                    const int64_t ne10 = node->src[1]->ne[0]; // W
-                    const int64_t ne11 = node->src[1]->ne[1]; // H
-                    const int64_t ne12 = node->src[1]->ne[2]; // Channels In
+                if (!ggml_fused_can_alias(b, a->src[0], true) || !ggml_fused_can_alias(b, other, true)) {
+                    return 0;
+                }
 
-                    size_t cur = 0;
-                    cur += sizeof(ggml_fp16_t)*ne00*ne01*ne02*ne03;
-                    cur += sizeof(ggml_fp16_t)*ne10*ne11*ne12;
+                return 2;
+            }
+        case GGML_OP_SCALE:
+            {
+                if (i + 2 >= cgraph->n_nodes) {
+                    return 0;
+                }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_POOL_1D:
-            case GGML_OP_POOL_2D:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_UPSCALE:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_FLASH_ATTN:
-                {
-                    n_tasks = n_threads;
+                struct ggml_tensor * c = cgraph->nodes[i + 2];
 
-                    size_t cur = 0;
+                if (b->op != GGML_OP_ADD || b->src[0] != a || c->op != GGML_OP_SOFT_MAX || c->src[0] != b ||
+                    n_tasks[i + 2] == 0 || !ggml_graph_node_can_share_level(c) || !ggml_graph_fused_intermediate(cgraph, n_uses, b) ||
+                    a->src[0]->type != GGML_TYPE_F32 || other->type != GGML_TYPE_F32 || c->type != GGML_TYPE_F32 ||
+                    other->nb[0] != sizeof(float) || !ggml_is_contiguous(a->src[0]) || !ggml_is_contiguous(c)) {
+                    return 0;
+                }
 
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
+                if (!ggml_fused_can_alias(c, a->src[0], true) || !ggml_fused_can_alias(c, other, false)) {
+                    return 0;
+                }
 
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
+                return 3;
+            }
+        case GGML_OP_MUL_MAT:
+            {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST)
+                // these backends may decide to compute the mul_mat on the GPU
+                return 0;
+#else
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+                if (ggml_compute_forward_mul_mat_use_blas(a->src[0], a->src[1], a)) {
+                    return 0;
+                }
+#endif
+                if (b->op != GGML_OP_ADD || other->type != GGML_TYPE_F32 || other->nb[0] != sizeof(float) ||
+                    !ggml_are_same_shape(other, a) || !ggml_are_same_shape(b, a) || !ggml_is_contiguous(b)) {
+                    return 0;
+                }
 
-                    if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*ne11*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
-                    }
+                // the result is written in tiles while src0 and src1 are still being read
+                // (unless src1 is converted to vec_dot_type first - then it is not read after the barrier)
+                const bool src1_converted = a->src[1]->type != type_traits[a->src[0]->type].vec_dot_type;
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_FLASH_FF:
-                {
-                    n_tasks = n_threads;
+                if (!ggml_fused_can_alias(b, a->src[0], false) || (!src1_converted && !ggml_fused_can_alias(b, a->src[1], false)) ||
+                    !ggml_fused_can_alias(b, other, true)) {
+                    return 0;
+                }
 
-                    size_t cur = 0;
+                return 2;
+#endif
+            }
+        default:
+            return 0;
+    }
+}
 
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
+static void ggml_graph_count_use(struct ggml_cgraph * cgraph, uint8_t * n_uses, struct ggml_tensor * t) {
+    const size_t i = hash_find(cgraph->visited_hash_table, t);
 
-                    if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*node->src[1]->ne[1]*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*node->src[1]->ne[1]*n_tasks; // this is overestimated by x2
-                    }
+    if (i < GGML_GRAPH_HASHTABLE_SIZE && cgraph->visited_hash_table[i] == t && n_uses[i] < UINT8_MAX) {
+        n_uses[i]++;
+    }
+}
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_FLASH_ATTN_BACK:
-                {
-                    n_tasks = n_threads;
+int ggml_graph_fuse(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    // number of nodes that use each tensor, indexed like the visited hash table of the graph
+    uint8_t * n_uses = calloc(GGML_GRAPH_HASHTABLE_SIZE, sizeof(uint8_t));
+    GGML_ASSERT(n_uses);
 
-                    size_t cur = 0;
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        struct ggml_tensor * node = cgraph->nodes[i];
 
-                    const int64_t    D = node->src[0]->ne[0];
-                    const int64_t ne11 = ggml_up(node->src[1]->ne[1], GGML_SOFT_MAX_UNROLL);
-                    const int64_t mxDn = MAX(D, ne11) * 2; // *2 because of S and SM in ggml_compute_forward_flash_attn_back
-                    if (node->src[1]->type == GGML_TYPE_F32) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
+        // views have their source in src[0], view_src alone may only mean that the allocator reused the memory
+        for (int j = 0; j < GGML_MAX_SRC; ++j) {
+            if (node->src[j]) {
+                ggml_graph_count_use(cgraph, n_uses, node->src[j]);
+            }
+        }
+    }
 
-                    if (node->src[1]->type == GGML_TYPE_F16) {
-                        cur  = sizeof(float)*mxDn*n_tasks; // TODO: this can become (n_tasks-1)
-                        cur += sizeof(float)*mxDn*n_tasks; // this is overestimated by x2
-                    }
+    int n_chains = 0;
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_WIN_PART:
-            case GGML_OP_WIN_UNPART:
-            case GGML_OP_GET_REL_POS:
-            case GGML_OP_MAP_UNARY:
-            case GGML_OP_MAP_BINARY:
-            case GGML_OP_MAP_CUSTOM1_F32:
-            case GGML_OP_MAP_CUSTOM2_F32:
-            case GGML_OP_MAP_CUSTOM3_F32:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_MAP_CUSTOM1:
-                {
-                    struct ggml_map_custom1_op_params * p = (struct ggml_map_custom1_op_params *) node->op_params;
-                    if (p->n_tasks == GGML_N_TASKS_MAX) {
-                        n_tasks = n_threads;
-                    } else {
-                        n_tasks = MIN(p->n_tasks, n_threads);
-                    }
-                } break;
-            case GGML_OP_MAP_CUSTOM2:
-                {
-                    struct ggml_map_custom2_op_params * p = (struct ggml_map_custom2_op_params *) node->op_params;
-                    if (p->n_tasks == GGML_N_TASKS_MAX) {
-                        n_tasks = n_threads;
-                    } else {
-                        n_tasks = MIN(p->n_tasks, n_threads);
-                    }
-                } break;
-            case GGML_OP_MAP_CUSTOM3:
-                {
-                    struct ggml_map_custom3_op_params * p = (struct ggml_map_custom3_op_params *) node->op_params;
-                    if (p->n_tasks == GGML_N_TASKS_MAX) {
-                        n_tasks = n_threads;
-                    } else {
-                        n_tasks = MIN(p->n_tasks, n_threads);
-                    }
-                } break;
-            case GGML_OP_CROSS_ENTROPY_LOSS:
-                {
-                    n_tasks = n_threads;
+    for (int i = 0; i < cgraph->n_nodes; ) {
+        const int n = ggml_graph_match_fused(cgraph, cplan->n_tasks, n_uses, i);
 
-                    size_t cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
+        if (n == 0) {
+            i++;
+            continue;
+        }
 
-                    work_size = MAX(work_size, cur);
-                } break;
-            case GGML_OP_CROSS_ENTROPY_LOSS_BACK:
-                {
-                    n_tasks = n_threads;
-                } break;
-            case GGML_OP_NONE:
-                {
-                    n_tasks = 1;
-                } break;
-            case GGML_OP_COUNT:
-                {
-                    GGML_ASSERT(false);
-                } break;
+        // the first node computes the whole chain
+        for (int k = 1; k < n; ++k) {
+            cplan->n_tasks[i] = MAX(cplan->n_tasks[i], cplan->n_tasks[i + k]);
+            cplan->n_tasks[i + k] = 0;
         }
 
-        cplan.n_tasks[i] = n_tasks;
+        i += n;
+        n_chains++;
     }
 
-    if (work_size > 0) {
-        work_size += CACHE_LINE_SIZE*(n_threads - 1);
+    free(n_uses);
+
+    cplan->work_size = ggml_graph_work_size(cgraph, cplan->n_tasks, cplan->n_threads);
+
+    return n_chains;
+}
+
+// spawn n_threads - 1 new threads for this graph only and join them afterwards
+static int ggml_graph_compute_spawn(struct ggml_compute_state_shared * shared) {
+    const int n_threads = shared->n_threads;
+
+    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+    // create thread pool
+    if (n_threads > 1) {
+        for (int j = 1; j < n_threads; ++j) {
+            workers[j] = (struct ggml_compute_state) {
+                .thrd       = 0,
+                .ith        = j,
+                .shared     = shared,
+                .threadpool = NULL,
+            };
+
+            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+            GGML_ASSERT(rc == 0);
+            UNUSED(rc);
+        }
     }
 
-    cplan.n_threads = n_threads;
-    cplan.work_size = work_size;
-    cplan.work_data = NULL;
+    workers[0].ith        = 0;
+    workers[0].shared     = shared;
+    workers[0].threadpool = NULL;
 
-    return cplan;
+    // this is a work thread too
+    const int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+
+    // join or kill thread pool
+    if (n_threads > 1) {
+        for (int j = 1; j < n_threads; j++) {
+            const int rc = ggml_thread_join(workers[j].thrd, NULL);
+            GGML_ASSERT(rc == 0);
+        }
+    }
+
+    return compute_status;
 }
 
 int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
@@ -16786,13 +19012,20 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
 
         for (int i = 0; i < cgraph->n_nodes; ++i) {
             if (cgraph->nodes[i]->op != GGML_OP_NONE) {
-                GGML_ASSERT(cplan->n_tasks[i] > 0);
+                // n_tasks == 0: computed by a fused chain that starts at an earlier node
+                GGML_ASSERT(cplan->n_tasks[i] > 0 || (cplan->n_tasks[i] == 0 && i > 0));
             }
         }
     }
 
     const int n_threads = cplan->n_threads;
 
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init (&cond,  NULL);
+
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
@@ -16801,46 +19034,44 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.n_threads               =*/ n_threads,
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
+        /*.n_chunk                 =*/ 0,
+        /*.n_chunk_numa            =*/ { 0 },
+        /*.n_barrier               =*/ 0,
+        /*.n_barrier_passed        =*/ 0,
+        /*.n_level                 =*/ 0,
+        /*.level_work_offs         =*/ { 0 },
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
+        /*.n_sleeping              =*/ 0,
+        /*.mutex                   =*/ &mutex,
+        /*.cond                    =*/ &cond,
+        /*.trace_graph             =*/ 0,
+        /*.trace_wait_us           =*/ NULL,
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
-
-    // create thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; ++j) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
-            };
 
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
-        }
+    if (cplan->trace) {
+        state_shared.trace_graph   = atomic_fetch_add(&cplan->trace->n_graphs, 1);
+        state_shared.trace_wait_us = alloca(sizeof(int64_t)*n_threads);
+        memset(state_shared.trace_wait_us, 0, sizeof(int64_t)*n_threads);
     }
 
-    workers[0].ith = 0;
-    workers[0].shared = &state_shared;
-
     const int64_t perf_start_cycles  = ggml_perf_cycles();
     const int64_t perf_start_time_us = ggml_perf_time_us();
 
-    // this is a work thread too
-    int compute_status = (size_t) ggml_graph_compute_thread(&workers[0]);
+    int compute_status;
+
+    if (cplan->threadpool != NULL && n_threads > 1) {
+        compute_status = ggml_threadpool_compute(cplan->threadpool, &state_shared);
+    } else {
+        compute_status = ggml_graph_compute_spawn(&state_shared);
+    }
+
+    pthread_cond_destroy (&cond);
+    pthread_mutex_destroy(&mutex);
 
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
-    // join or kill thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; j++) {
-            const int rc = ggml_thread_join(workers[j].thrd, NULL);
-            GGML_ASSERT(rc == 0);
-        }
-    }
-
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
@@ -17413,6 +19644,165 @@ void ggml_graph_print(const struct ggml_cgraph * cgraph) {
     GGML_PRINT("========================================\n");
 }
 
+static void ggml_trace_write_string(FILE * fout, const char * str) {
+    fputc('"', fout);
+    for (const char * c = str; *c; ++c) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(fout, "\\%c", *c);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(fout, "\\u%04x", *c);
+        } else {
+            fputc(*c, fout);
+        }
+    }
+    fputc('"', fout);
+}
+
+static const char * ggml_trace_event_cat(const struct ggml_trace_event * ev) {
+    if (ev->node < 0) {
+        return "wait";
+    }
+
+    switch (ev->type) {
+        case GGML_TASK_INIT:     return "init";
+        case GGML_TASK_FINALIZE: return "finalize";
+        default:                 return "compute";
+    }
+}
+
+bool ggml_trace_export(struct ggml_trace * trace, const char * fname) {
+    FILE * fout = fopen(fname, "w");
+
+    if (!fout) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, fname);
+        return false;
+    }
+
+    const int n_events  = ggml_trace_n_events(trace);
+    const int n_dropped = atomic_load(&trace->n_events) - n_events;
+
+    int n_threads = 0;
+
+    fprintf(fout, "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"n_graphs\": %d, \"n_events\": %d, \"n_dropped\": %d},\n",
+            atomic_load(&trace->n_graphs), n_events, n_dropped);
+    fprintf(fout, "\"traceEvents\": [\n");
+
+    for (int i = 0; i < n_events; ++i) {
+        const struct ggml_trace_event * ev = &trace->events[i];
+
+        fprintf(fout, "{\"name\": ");
+        ggml_trace_write_string(fout, ev->name[0] ? ev->name : ggml_op_name(ev->op));
+        fprintf(fout, ", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %" PRId64 ", \"dur\": %" PRId64 ", ",
+                ggml_trace_event_cat(ev), ev->ith, ev->t_start_us - trace->t_start_us, ev->t_end_us - ev->t_start_us);
+        fprintf(fout, "\"args\": {\"graph\": %d, \"node\": %d, \"op\": \"%s\", \"nth\": %d, \"wait_us\": %" PRId64 ", \"bytes\": %zu}},\n",
+                ev->graph, ev->node, ggml_op_name(ev->op), ev->nth, ev->t_wait_us, ev->bytes);
+
+        n_threads = MAX(n_threads, ev->ith + 1);
+    }
+
+    for (int i = 0; i < n_threads; ++i) {
+        fprintf(fout, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}%s\n",
+                i, i, i + 1 < n_threads ? "," : "");
+    }
+
+    fprintf(fout, "]}\n");
+
+    const bool ok = ferror(fout) == 0;
+
+    fclose(fout);
+
+    return ok;
+}
+
+static int ggml_trace_event_cmp(const void * a, const void * b) {
+    const struct ggml_trace_event * ea = (const struct ggml_trace_event *) a;
+    const struct ggml_trace_event * eb = (const struct ggml_trace_event *) b;
+
+    if (ea->graph != eb->graph) {
+        return ea->graph < eb->graph ? -1 : 1;
+    }
+    if (ea->node != eb->node) {
+        return ea->node < eb->node ? -1 : 1;
+    }
+    return (ea->t_start_us > eb->t_start_us) - (ea->t_start_us < eb->t_start_us);
+}
+
+void ggml_trace_print(struct ggml_trace * trace) {
+    const int n_events = ggml_trace_n_events(trace);
+
+    // per op: number of nodes, wall time of the nodes, time of all the threads, time waiting in ggml_barrier and bytes
+    int     op_runs   [GGML_OP_COUNT] = {0};
+    int64_t op_wall_us[GGML_OP_COUNT] = {0};
+    int64_t op_busy_us[GGML_OP_COUNT] = {0};
+    int64_t op_wait_us[GGML_OP_COUNT] = {0};
+    double  op_bytes  [GGML_OP_COUNT] = {0};
+
+    int64_t total_wall_us = 0;
+    int64_t total_sync_us = 0;
+
+    // group the events of each node of each graph
+    struct ggml_trace_event * events = malloc(sizeof(struct ggml_trace_event)*MAX(1, n_events));
+    memcpy(events, trace->events, sizeof(struct ggml_trace_event)*n_events);
+    qsort(events, n_events, sizeof(struct ggml_trace_event), ggml_trace_event_cmp);
+
+    for (int i = 0; i < n_events; ) {
+        const struct ggml_trace_event * ev = &events[i];
+
+        int64_t t_start_us = ev->t_start_us;
+        int64_t t_end_us   = ev->t_end_us;
+        int64_t busy_us    = 0;
+        int64_t wait_us    = 0;
+
+        int j = i;
+        for (; j < n_events && events[j].graph == ev->graph && events[j].node == ev->node; ++j) {
+            t_start_us = MIN(t_start_us, events[j].t_start_us);
+            t_end_us   = MAX(t_end_us,   events[j].t_end_us);
+            busy_us   += events[j].t_end_us - events[j].t_start_us;
+            wait_us   += events[j].t_wait_us;
+        }
+
+        if (ev->node < 0) {
+            total_sync_us += busy_us;
+        } else {
+            op_runs   [ev->op] += 1;
+            op_wall_us[ev->op] += t_end_us - t_start_us;
+            op_busy_us[ev->op] += busy_us;
+            op_wait_us[ev->op] += wait_us;
+            op_bytes  [ev->op] += ev->bytes;
+
+            total_wall_us += t_end_us - t_start_us;
+        }
+
+        i = j;
+    }
+
+    free(events);
+
+    GGML_PRINT("=== TRACE ===\n");
+    GGML_PRINT("n_graphs = %d, n_events = %d, n_dropped = %d\n",
+            atomic_load(&trace->n_graphs), n_events, atomic_load(&trace->n_events) - n_events);
+    GGML_PRINT("%16s %8s %10s %6s %10s %10s %10s %8s\n", "op", "nodes", "wall ms", "%", "us/node", "busy ms", "barrier ms", "GB/s");
+
+    for (int i = 0; i < GGML_OP_COUNT; ++i) {
+        if (op_runs[i] == 0) {
+            continue;
+        }
+
+        GGML_PRINT("%16s %8d %10.3f %6.2f %10.3f %10.3f %10.3f %8.2f\n",
+                ggml_op_name(i), op_runs[i],
+                op_wall_us[i] / 1000.0,
+                100.0 * op_wall_us[i] / MAX(1, total_wall_us),
+                (double) op_wall_us[i] / op_runs[i],
+                op_busy_us[i] / 1000.0,
+                op_wait_us[i] / 1000.0,
+                op_bytes[i] / MAX(1, op_wall_us[i]) / 1e3);
+    }
+
+    GGML_PRINT("total wall time of the nodes = %.3f ms, threads waiting between the nodes = %.3f ms\n",
+            total_wall_us / 1000.0, total_sync_us / 1000.0);
+    GGML_PRINT("========================================\n");
+}
+
 // check if node is part of the graph
 static bool ggml_graph_find(const struct ggml_cgraph * cgraph, const struct ggml_tensor * node) {
     if (cgraph == NULL) {
@@ -18698,6 +21088,40 @@ size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, i
     return result;
 }
 
+bool ggml_repack_tensor(struct ggml_tensor * tensor) {
+    if (tensor->type != GGML_TYPE_Q4_0 && tensor->type != GGML_TYPE_Q8_0) {
+        return false;
+    }
+    if (tensor->backend != GGML_BACKEND_CPU || tensor->data == NULL || !ggml_is_contiguous(tensor) || tensor->ne[1] % 4 != 0) {
+        return false;
+    }
+
+    const size_t row_size = tensor->nb[1];
+    const int    nb       = tensor->ne[0]/ggml_blck_size(tensor->type);
+    const int64_t nr      = ggml_nrows(tensor);
+
+    // each group of 4 rows is converted through a copy of the rows
+    char * tmp = malloc(4*row_size);
+    GGML_ASSERT(tmp != NULL);
+
+    for (int64_t ir = 0; ir < nr; ir += 4) {
+        char * data = (char *) tensor->data + ir*row_size;
+        memcpy(tmp, data, 4*row_size);
+
+        if (tensor->type == GGML_TYPE_Q4_0) {
+            ggml_repack_q4_0x4((const block_q4_0 *) tmp, (block_q4_0x4 *) data, nb);
+        } else {
+            ggml_repack_q8_0x4((const block_q8_0 *) tmp, (block_q8_0x4 *) data, nb);
+        }
+    }
+
+    free(tmp);
+
+    tensor->type = tensor->type == GGML_TYPE_Q4_0 ? GGML_TYPE_Q4_0X4 : GGML_TYPE_Q8_0X4;
+
+    return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 struct gguf_str {
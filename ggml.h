@@ -221,6 +221,7 @@
 #define GGML_MAX_NAME          64
 #define GGML_MAX_OP_PARAMS     64
 #define GGML_DEFAULT_N_THREADS 4
+#define GGML_GEMM_TILE         4 // rows and columns of the tiles computed by ggml_gemm_t
 
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
@@ -324,6 +325,9 @@ extern "C" {
         GGML_TYPE_I8,
         GGML_TYPE_I16,
         GGML_TYPE_I32,
+        // 4 rows interleaved block by block - created at load time by ggml_repack_tensor, never stored in files
+        GGML_TYPE_Q4_0X4,
+        GGML_TYPE_Q8_0X4,
         GGML_TYPE_COUNT,
     };
 
@@ -391,6 +395,7 @@ extern "C" {
         GGML_OP_TRANSPOSE,
         GGML_OP_GET_ROWS,
         GGML_OP_GET_ROWS_BACK,
+        GGML_OP_SET_ROWS,
         GGML_OP_DIAG,
         GGML_OP_DIAG_MASK_INF,
         GGML_OP_DIAG_MASK_ZERO,
@@ -414,6 +419,7 @@ extern "C" {
         GGML_OP_UPSCALE, // nearest interpolate
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -523,6 +529,19 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // how the compute threads wait for the other threads to finish the current node
+    // ref: https://github.com/ggerganov/ggml/issues/291
+    enum ggml_wait_policy {
+        GGML_WAIT_POLICY_DEFAULT = 0, // SPIN, or YIELD when built with Accelerate/OpenBLAS
+        GGML_WAIT_POLICY_SPIN,        // busy-wait: lowest latency, but keeps all cores busy
+        GGML_WAIT_POLICY_YIELD,       // busy-wait for wait_n_spin polls, then sched_yield() between polls
+        GGML_WAIT_POLICY_SLEEP,       // busy-wait for wait_n_spin polls, then sleep on a condition variable
+    };
+
+    // persistent pool of worker threads that can be reused across many ggml_graph_compute() calls
+    // the workers are parked on a condition variable between graph computations
+    struct ggml_threadpool;
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -531,12 +550,22 @@ extern "C" {
 
         int n_threads;
 
+        // optional thread pool to run the graph on (NULL: spawn and join new threads for this call)
+        struct ggml_threadpool * threadpool;
+
+        enum ggml_wait_policy wait_policy;
+        int wait_n_spin; // number of polls before a waiting thread yields or sleeps (0 = default)
+
         // the `n_tasks` of nodes, 1:1 mapping to cgraph nodes
+        // 0 for nodes that are computed as a part of a fused chain started by an earlier node (see ggml_graph_fuse)
         int n_tasks[GGML_MAX_NODES];
 
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // optional trace that records the execution of the nodes (NULL: no tracing, see ggml_trace_new)
+        struct ggml_trace * trace;
     };
 
     // next prime after GGML_MAX_NODES
@@ -598,6 +627,8 @@ extern "C" {
         GGML_TASK_FINALIZE,
     };
 
+    struct ggml_compute_state_shared;
+
     struct ggml_compute_params {
         enum ggml_task_type type;
 
@@ -607,6 +638,9 @@ extern "C" {
         // work buffer for all threads
         size_t wsize;
         void * wdata;
+
+        // state shared by the threads computing the graph (used by ops that distribute work dynamically)
+        struct ggml_compute_state_shared * shared;
     };
 
     // misc
@@ -620,6 +654,11 @@ extern "C" {
     GGML_API void    ggml_numa_init(void); // call once for better performance on NUMA systems
     GGML_API bool    ggml_is_numa(void); // true if init detected that system has >1 NUMA node
 
+    // move the rows of a 2D tensor to the NUMA nodes whose threads compute them in ggml_mul_mat
+    // the tensor data must be in anonymous memory: the pages of a shared file mapping are not moved
+    // returns false if the system is not NUMA or the pages could not be moved
+    GGML_API bool    ggml_numa_place_tensor(struct ggml_tensor * tensor);
+
     GGML_API void    ggml_print_object (const struct ggml_object * obj);
     GGML_API void    ggml_print_objects(const struct ggml_context * ctx);
 
@@ -1247,6 +1286,15 @@ extern "C" {
             struct ggml_tensor  * b,
             struct ggml_tensor  * c);
 
+    // store the rows of b (F32) in the rows of a given by the indices in c (I32)
+    // the elements of the rows of a can be strided (e.g. a transposed view)
+    // return view(a)
+    GGML_API struct ggml_tensor * ggml_set_rows(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            struct ggml_tensor  * c);
+
     GGML_API struct ggml_tensor * ggml_diag(
         struct ggml_context     * ctx,
         struct ggml_tensor      * a);
@@ -1502,6 +1550,27 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // attention without materializing KQ: the KV sequence is processed in tiles with an online softmax
+    // q:    [n_embd_head, n_tokens, n_head, ne3] F32
+    // k:    [n_embd_head, n_kv,  n_head_kv, ne3] F16
+    // v:    [n_kv,  n_embd_head, n_head_kv, ne3] F16 (transposed, like the V cache in llama.cpp)
+    // mask: [n_kv, n_tokens] F32 or NULL
+    // res:  [n_embd_head, n_head, n_tokens, ne3] F32 (the heads are merged)
+    // n_head must be a multiple of n_head_kv (grouped-query attention)
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale);
+
+    // the KV positions that are all masked out are skipped in chunks of n_chunk positions (0: the SIMD step of the CPU)
+    // the mask of a paged KV cache changes at the bounds of its blocks, n_chunk is best set to the block size
+    GGML_API void ggml_flash_attn_ext_set_chunk(
+            struct ggml_tensor * a,
+            int32_t              n_chunk);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1741,6 +1810,35 @@ extern "C" {
     GGML_API               int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
     GGML_API              void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // fuse common op chains into single kernels: RMS_NORM->MUL, SILU->MUL, SCALE->ADD->SOFT_MAX, MUL_MAT->ADD
+    // call after ggml_graph_plan() and before allocating plan.work_data, the tensors must already have their data
+    // only the last tensor of a fused chain is computed - a chain is fused only if its intermediate results
+    // are not used by any other node of the graph, but they will not be available to the caller either
+    // returns the number of fused chains
+    GGML_API               int ggml_graph_fuse   (struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+
+    // thread pool for ggml_graph_compute()
+    // a pool created with n_threads can run any plan with cplan.n_threads <= n_threads
+    // the same pool must not be used by more than one ggml_graph_compute() call at a time
+    GGML_API struct ggml_threadpool * ggml_threadpool_new      (int n_threads);
+    GGML_API                    void ggml_threadpool_free     (struct ggml_threadpool * threadpool);
+    GGML_API                     int ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
+    // execution trace of ggml_graph_compute() - set cplan.trace to record the graphs computed with the plan
+    // each thread records the start and end time of the nodes it computes, the time it spends waiting for
+    // the other threads and the size of the node and of its sources (an upper bound of the bytes read and written)
+    // at most n_events_max events are recorded, the rest are dropped
+    GGML_API struct ggml_trace * ggml_trace_new  (int n_events_max);
+    GGML_API               void ggml_trace_free (struct ggml_trace * trace);
+    GGML_API               void ggml_trace_reset(struct ggml_trace * trace);
+    GGML_API                int ggml_trace_n_events(struct ggml_trace * trace);
+
+    // write the trace in the Chrome trace event format (chrome://tracing, Perfetto), returns false on error
+    GGML_API               bool ggml_trace_export(struct ggml_trace * trace, const char * fname);
+
+    // print a summary of the trace per op: time, threads waiting and memory bandwidth
+    GGML_API               void ggml_trace_print(struct ggml_trace * trace);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
@@ -1959,6 +2057,11 @@ extern "C" {
 
     GGML_API size_t ggml_quantize_chunk(enum ggml_type type, const float * src, void * dst, int start, int n, int64_t * hist);
 
+    // convert a Q4_0 or Q8_0 matrix in place to the layout with 4 interleaved rows (GGML_TYPE_Q4_0X4, GGML_TYPE_Q8_0X4)
+    // the size of the data does not change, the result can only be used as src0 of ggml_mul_mat
+    // returns false if the tensor cannot be repacked (other type, not contiguous, ne1 not a multiple of 4)
+    GGML_API bool ggml_repack_tensor(struct ggml_tensor * tensor);
+
     //
     // gguf
     //
@@ -2104,6 +2207,9 @@ extern "C" {
     GGML_API int ggml_cpu_has_ssse3      (void);
     GGML_API int ggml_cpu_has_vsx        (void);
 
+    // the instruction set of the quantization kernels selected at ggml_init (built with LLAMA_CPU_VARIANTS), NULL otherwise
+    GGML_API const char * ggml_cpu_variant(void);
+
     //
     // Internal types and functions exposed for tests and benchmarks
     //
@@ -2118,6 +2224,11 @@ extern "C" {
     typedef void (*ggml_from_float_t)(const float * GGML_RESTRICT x, void  * GGML_RESTRICT y, int k);
     typedef void (*ggml_vec_dot_t)   (const int n, float * GGML_RESTRICT s, const void * GGML_RESTRICT x, const void * GGML_RESTRICT y);
 
+    // computes a GGML_GEMM_TILE x GGML_GEMM_TILE tile of dot products: s[j*bs + i] = x_i . y_j
+    // the rows x_i and y_j start at (const char *) x + i*bx and (const char *) y + j*by
+    typedef void (*ggml_gemm_t)      (const int n, float * GGML_RESTRICT s, size_t bs,
+                                      const void * GGML_RESTRICT x, size_t bx, const void * GGML_RESTRICT y, size_t by);
+
     typedef struct {
         const char      * type_name;
         int               blck_size;
@@ -2128,6 +2239,8 @@ extern "C" {
         ggml_from_float_t from_float_reference;
         ggml_vec_dot_t    vec_dot;
         enum ggml_type    vec_dot_type;
+        ggml_gemm_t       gemm; // optional, used by mul_mat when several src1 rows are available
+        int               nrows; // > 1 for interleaved types: vec_dot computes nrows consecutive rows at once (0 = 1)
     } ggml_type_traits_t;
 
     GGML_API ggml_type_traits_t ggml_internal_get_type_traits(enum ggml_type type);
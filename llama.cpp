@@ -51,6 +51,7 @@
 
 #include <algorithm>
 #include <array>
+#include <bitset>
 #include <cassert>
 #include <cinttypes>
 #include <climits>
@@ -72,7 +73,6 @@
 #include <queue>
 #include <random>
 #include <regex>
-#include <set>
 #include <sstream>
 #include <thread>
 #include <unordered_map>
@@ -581,15 +581,39 @@ static int8_t llama_rope_scaling_type_from_string(const std::string & name) {
 // ggml helpers
 //
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
-    struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+static void ggml_graph_compute_helper(
+        std::vector<uint8_t> & buf,
+                 ggml_cgraph * graph,
+                         int   n_threads,
+            ggml_threadpool  * threadpool  = nullptr,
+       enum ggml_wait_policy   wait_policy = GGML_WAIT_POLICY_DEFAULT,
+                         int   wait_n_spin = 0,
+                        bool   fuse_ops    = false,
+                  ggml_trace * trace       = nullptr,
+                  ggml_cplan * plan_cache  = nullptr) {
+    // a graph that is computed again reuses the plan of the previous call, unless the number of threads changed
+    struct ggml_cplan plan_local;
+    struct ggml_cplan * plan = plan_cache ? plan_cache : &plan_local;
 
-    if (plan.work_size > 0) {
-        buf.resize(plan.work_size);
-        plan.work_data = buf.data();
+    if (!plan_cache || plan->n_threads != n_threads) {
+        *plan = ggml_graph_plan(graph, n_threads);
+
+        if (fuse_ops) {
+            ggml_graph_fuse(graph, plan);
+        }
+    }
+
+    plan->threadpool  = threadpool;
+    plan->wait_policy = wait_policy;
+    plan->wait_n_spin = wait_n_spin;
+    plan->trace       = trace;
+
+    if (plan->work_size > 0) {
+        buf.resize(plan->work_size);
+        plan->work_data = buf.data();
     }
 
-    ggml_graph_compute(graph, &plan);
+    ggml_graph_compute(graph, plan);
 }
 
 //
@@ -624,6 +648,114 @@ static std::string llama_format_win_err(DWORD err) {
 }
 #endif
 
+#if defined(_POSIX_MAPPED_FILES) && defined(__linux__) && defined(MADV_HUGEPAGE) && \
+    !defined(GGML_USE_CUBLAS) && !defined(GGML_USE_METAL) && !defined(GGML_USE_CPU_HBM)
+#define LLAMA_HUGE_PAGES_SUPPORTED
+#endif
+
+static const size_t LLAMA_HUGE_PAGE_SIZE = 2u*1024*1024;
+
+// map n bytes of anonymous memory backed by huge pages, returns NULL if huge pages are not supported
+// *mapped_size is set to the size to pass to munmap
+static void * llama_huge_pages_alloc(size_t n, int huge_pages, size_t * mapped_size) {
+#ifdef LLAMA_HUGE_PAGES_SUPPORTED
+    const size_t size = (n + LLAMA_HUGE_PAGE_SIZE - 1)/LLAMA_HUGE_PAGE_SIZE*LLAMA_HUGE_PAGE_SIZE;
+
+#ifdef MAP_HUGETLB
+    if (huge_pages == LLAMA_HUGE_PAGES_HUGETLB) {
+        void * addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            // the pages are reserved, but count in the coverage only once they are touched
+            memset(addr, 0, size);
+            *mapped_size = size;
+            return addr;
+        }
+        LLAMA_LOG_WARN("%s: failed to map %.2f MB of hugetlbfs pages (%s) - using transparent huge pages\n",
+                __func__, size/1024.0/1024.0, strerror(errno));
+    }
+#endif
+
+    // map one more huge page and trim the ends so that the buffer starts at a huge page boundary
+    char * addr = (char *) mmap(NULL, size + LLAMA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+
+    const size_t head = (LLAMA_HUGE_PAGE_SIZE - (uintptr_t) addr % LLAMA_HUGE_PAGE_SIZE) % LLAMA_HUGE_PAGE_SIZE;
+    if (head > 0) {
+        munmap(addr, head);
+    }
+    munmap(addr + head + size, LLAMA_HUGE_PAGE_SIZE - head);
+    addr += head;
+
+    if (madvise(addr, size, MADV_HUGEPAGE)) {
+        LLAMA_LOG_WARN("%s: madvise(.., MADV_HUGEPAGE) failed: %s\n", __func__, strerror(errno));
+    }
+
+    // fault the pages in now, while the kernel can still find free huge pages
+    memset(addr, 0, size);
+
+    *mapped_size = size;
+    return addr;
+#else
+    LLAMA_LOG_WARN("%s: huge pages are not supported on this platform\n", __func__);
+    (void) n;
+    (void) huge_pages;
+    (void) mapped_size;
+    return NULL;
+#endif
+}
+
+// number of bytes of [addr, addr + size) that are backed by huge pages, from /proc/self/smaps
+static size_t llama_huge_pages_bytes(const void * addr, size_t size) {
+    size_t result = 0;
+#ifdef __linux__
+    FILE * f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return 0;
+    }
+
+    const uintptr_t begin = (uintptr_t) addr;
+    const uintptr_t end   = begin + size;
+
+    uintptr_t vma_begin = 0;
+    uintptr_t vma_end   = 0;
+    bool hugetlb = false;
+
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long a, b;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &a, &b) == 2) {
+            // start of a mapping
+            vma_begin = a;
+            vma_end   = b;
+            hugetlb   = false;
+            continue;
+        }
+        if (vma_end <= begin || vma_begin >= end) {
+            continue;
+        }
+
+        const size_t overlap = std::min(vma_end, end) - std::max(vma_begin, begin);
+
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            result += std::min(kb*1024, overlap);
+        } else if (sscanf(line, "KernelPageSize: %zu kB", &kb) == 1) {
+            hugetlb = kb*1024 >= LLAMA_HUGE_PAGE_SIZE;
+        } else if (hugetlb && sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1) {
+            result += std::min(kb*1024, overlap);
+        }
+    }
+
+    fclose(f);
+#else
+    (void) addr;
+    (void) size;
+#endif
+    return result;
+}
+
 struct llama_buffer {
     void * data = NULL;
     size_t size = 0;
@@ -632,8 +764,19 @@ struct llama_buffer {
     // useful in cases where CUDA can try to allocate PINNED memory
     bool fallback = false;
 
-    void resize(size_t n) {
-        llama_host_free(data);
+    // > 0 if the buffer is mapped with huge pages (see llama_huge_pages_alloc)
+    size_t mapped_size = 0;
+
+    void resize(size_t n, int huge_pages = LLAMA_HUGE_PAGES_NONE) {
+        release();
+
+        if (huge_pages != LLAMA_HUGE_PAGES_NONE) {
+            data = llama_huge_pages_alloc(n, huge_pages, &mapped_size);
+            if (data) {
+                size = n;
+                return;
+            }
+        }
 
         data = llama_host_malloc(n);
         if (!data) {
@@ -647,8 +790,13 @@ struct llama_buffer {
         size = n;
     }
 
-    ~llama_buffer() {
+    void release() {
         if (data) {
+#ifdef LLAMA_HUGE_PAGES_SUPPORTED
+            if (mapped_size > 0) {
+                munmap(data, mapped_size);
+            } else
+#endif
             if (fallback) { // NOLINT
                 free(data);
             } else {
@@ -657,6 +805,16 @@ struct llama_buffer {
         }
 
         data = NULL;
+        mapped_size = 0;
+    }
+
+    // fraction of the buffer backed by huge pages
+    float huge_pages_coverage() const {
+        return size > 0 ? (float) llama_huge_pages_bytes(data, size) / size : 0.0f;
+    }
+
+    ~llama_buffer() {
+        release();
     }
 };
 
@@ -1111,6 +1269,9 @@ struct llama_cparams {
     uint32_t n_threads;       // number of threads to use for generation
     uint32_t n_threads_batch; // number of threads to use for batch processing
 
+    enum ggml_wait_policy wait_policy;
+    int32_t               wait_n_spin;
+
     float    rope_freq_base;
     float    rope_freq_scale;
 
@@ -1122,7 +1283,12 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
 
+    enum llama_pooling_type pooling_type; // LLAMA_POOLING_NONE unless in embedding mode
+
     bool mul_mat_q;
+    bool flash_attn;
+    bool prefix_cache;
+    bool threadpool;
 };
 
 struct llama_layer {
@@ -1161,32 +1327,106 @@ struct llama_layer {
     struct ggml_tensor * ffn_up_b;   // b3
 };
 
+// the sequences of a cell, one bit per sequence id
+typedef std::bitset<LLAMA_MAX_SEQ> llama_seq_mask;
+
 struct llama_kv_cell {
     llama_pos pos   = -1;
     llama_pos delta = 0;
 
-    std::set<llama_seq_id> seq_id;
+    llama_seq_mask seq_id;
+
+    int32_t prefix_node = -1; // node of the prefix cache with the cell, -1 if none
 
     bool has_seq_id(const llama_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return id >= 0 && id < LLAMA_MAX_SEQ && seq_id[id];
     }
 };
 
-// ring-buffer of cached KV data
+// the cells are allocated in blocks of LLAMA_KV_BLOCK_SIZE consecutive cells
+// (the attention kernel is told to skip the masked KV positions by chunks of this size, see llm_build_kqv)
+#define LLAMA_KV_BLOCK_SIZE 32
+
+struct llama_kv_block {
+    llama_seq_id seq_id = -1; // sequence that appends its new tokens to the block, -1 if none
+
+    uint32_t n_alloc = 0; // number of cells handed out (in order, the cells after them are free)
+    uint32_t n_used  = 0; // number of cells in use
+
+    int32_t i_free = -1; // index in llama_kv_cache::free_blocks, -1 if the block is in use
+
+    llama_seq_mask seqs; // the sequences with the block in their block table
+};
+
+struct llama_kv_seq {
+    std::vector<uint32_t> blocks; // block table: the blocks with cells of the sequence, in allocation order
+
+    int32_t tail = -1; // block where the next tokens of the sequence are appended
+};
+
+// node of the prefix cache: a run of tokens that follows the tokens on the path from the root,
+// with the cells that hold their KV data
+struct llama_kv_prefix_node {
+    llama_pos pos    = 0;  // position of the first token
+    int32_t   parent = -1;
+
+    std::vector<llama_token> tokens; // empty for the root and for the unused nodes
+    std::vector<uint32_t>    cells;
+
+    std::map<llama_token, int32_t> children; // by their first token
+
+    uint64_t t_used = 0; // for the LRU eviction
+};
+
+// where a sequence is in the prefix cache: its tokens are the ones on the path to node, followed by the first n tokens of node
+struct llama_kv_prefix_cursor {
+    int32_t  node = -1; // -1 if the tokens of the sequence are not in the tree
+    uint32_t n    = 0;
+};
+
+// paged cache of KV data
+// each sequence gets its own blocks of cells through its block table, a block is returned to the free list
+// when all its cells are empty, so the cells of a batch do not need to be contiguous
+// (the GPU backends compute the KV stores with views and still need a contiguous ring-buffer, see paged)
 struct llama_kv_cache {
     bool has_shift = false;
 
+    // the KV stores use the cells in batch_cells (ggml_set_rows), otherwise the cells from head to head + n_tokens
+    bool paged = false;
+
     // Note: The value of head isn't only used to optimize searching
     // for a free KV slot. llama_decode_internal also uses it, so it
     // cannot be freely changed after a slot has been allocated.
     uint32_t head = 0;
     uint32_t size = 0;
 
+    // number of cells in use
+    uint32_t used = 0;
+
     // computed before each graph build
     uint32_t n = 0;
 
     std::vector<llama_kv_cell> cells;
 
+    std::vector<llama_kv_block> blocks;
+    std::vector<uint32_t>       free_blocks; // the block on top is allocated first
+
+    std::array<llama_kv_seq, LLAMA_MAX_SEQ> seqs;
+
+    // the cells of the tokens of the last batch (see llama_kv_cache_find_slot)
+    std::vector<int32_t> batch_cells;
+
+    // prefix cache: radix tree over the tokens of the sequences that start at position 0 (see llama_kv_cache_seq_prefix)
+    // the cells in the tree are kept when their sequences are removed, the least recently used ones are evicted to make room
+    bool prefix_cache = false;
+
+    std::vector<llama_kv_prefix_node> prefix_nodes; // the root is node 0
+    std::vector<int32_t>              prefix_free;  // unused nodes
+
+    std::array<llama_kv_prefix_cursor, LLAMA_MAX_SEQ> prefix_cursors;
+
+    uint64_t prefix_t = 0;
+
     struct ggml_tensor * k = NULL;
     struct ggml_tensor * v = NULL;
 
@@ -1314,6 +1554,59 @@ struct llama_model {
     }
 };
 
+// input tensors of a graph, their data is set by llama_set_inputs before each computation
+struct llama_graph_inputs {
+    struct ggml_tensor * tokens   = NULL;
+    struct ggml_tensor * embd     = NULL;
+    struct ggml_tensor * pos      = NULL;
+    struct ggml_tensor * KQ_scale = NULL;
+    struct ggml_tensor * KQ_mask  = NULL;
+    struct ggml_tensor * K_shift  = NULL;
+    struct ggml_tensor * KV_idxs  = NULL;
+    struct ggml_tensor * out_ids  = NULL;
+};
+
+// number of graphs kept by llama_decode for the following batches with the same shape
+// the GPU backends assign their buffers while the graph is built, so they always rebuild it
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL) || defined(GGML_USE_MPI)
+#define LLAMA_MAX_GRAPHS 0
+#else
+#define LLAMA_MAX_GRAPHS 4
+#endif
+
+// a graph built and allocated by llama_decode
+// the topology only depends on the number of tokens, the number of outputs, the number of KV cells and the type of input
+// (the cells where the new K and V are stored are an input of the paged KV cache)
+struct llama_graph_cache_entry {
+    ggml_cgraph * gf = NULL;
+
+    int32_t n_tokens  = 0;
+    int32_t n_outputs = 0;
+    int32_t n_kv      = 0;
+    bool    embd      = false;
+
+    llama_graph_inputs inp;
+
+    // the compute plan: the tasks of the nodes after fusing the chains and the size of the work buffer
+    // made by the first llama_decode that computes the graph (n_threads == 0 until then)
+    ggml_cplan plan = {};
+
+    // the tensor and graph objects
+    llama_buffer buf_meta;
+
+    uint64_t last_used = 0;
+};
+
+// pooled embedding of a sequence, over the tokens decoded since its token at position 0
+// a sequence can be decoded in several batches, the next one continues at pos_next
+struct llama_embd_pool {
+    std::vector<float> sum; // sum of the embeddings of the tokens (LLAMA_POOLING_MEAN)
+    std::vector<float> out; // pooled embedding
+
+    int32_t   n_tokens = 0;
+    llama_pos pos_next = 0;
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_start_us(model.t_start_us), t_load_us(model.t_load_us) {}
     ~llama_context() {
@@ -1325,6 +1618,8 @@ struct llama_context {
         if (alloc) {
             ggml_allocr_free(alloc);
         }
+        ggml_threadpool_free(threadpool);
+        ggml_trace_free(trace);
     }
 
     llama_cparams cparams;
@@ -1348,99 +1643,657 @@ struct llama_context {
     int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     int32_t n_eval   = 0; // number of eval calls
 
-    // decode output (2-dimensional array: [n_tokens][n_vocab])
+    // decode output (2-dimensional array: [n_outputs][n_vocab])
+    // only the rows of the tokens whose logits are requested, in the order of the batch
     std::vector<float> logits;
     bool logits_all = false;
 
+    // the outputs of the last batch: out_ids has the indices of the tokens in the batch,
+    // output_ids the row of each token in logits (-1 if its logits were not requested)
+    std::vector<int32_t> out_ids;
+    std::vector<int32_t> output_ids;
+
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
+    // pooled embeddings of the sequences (see llama_pooling_type)
+    std::map<llama_seq_id, llama_embd_pool> embd_seq;
+
     // reusable buffer for `struct ggml_graph_plan.work_data`
     std::vector<uint8_t> work_buffer;
 
+    // worker threads reused by every graph computation of this context
+    ggml_threadpool * threadpool = NULL;
+
+    // execution trace of the graph computations (see llama_set_trace)
+    ggml_trace * trace = NULL;
+    bool trace_enabled = false;
+
     // memory buffers used to evaluate the model
     llama_buffer buf_compute;
 
-    llama_buffer buf_alloc;
-    ggml_allocr * alloc = NULL;
+    llama_buffer buf_alloc;
+    ggml_allocr * alloc = NULL;
+
+    // graphs allocated in buf_alloc that are reused by llama_decode (see llama_graph_cache_entry)
+    std::array<llama_graph_cache_entry, LLAMA_MAX_GRAPHS> graphs;
+    uint64_t n_graph_uses = 0;
+
+    int64_t t_graph_build_us = 0; // time spent building and allocating graphs
+    int32_t n_graph_build    = 0; // number of graphs built
+    int32_t n_graph_reuse    = 0; // number of graphs reused
+
+#ifdef GGML_USE_METAL
+    ggml_metal_context * ctx_metal = NULL;
+#endif
+
+#ifdef GGML_USE_MPI
+    ggml_mpi_context * ctx_mpi = NULL;
+#endif
+};
+
+//
+// kv cache helpers
+//
+
+static uint32_t llama_kv_block_size(const struct llama_kv_cache & cache, uint32_t b) {
+    return std::min<uint32_t>(LLAMA_KV_BLOCK_SIZE, cache.size - b*LLAMA_KV_BLOCK_SIZE);
+}
+
+static void llama_kv_cache_block_free(struct llama_kv_cache & cache, uint32_t b) {
+    auto & block = cache.blocks[b];
+
+    block.seq_id  = -1;
+    block.n_alloc = 0;
+    block.i_free  = cache.free_blocks.size();
+
+    cache.free_blocks.push_back(b);
+}
+
+static void llama_kv_cache_block_alloc(struct llama_kv_cache & cache, uint32_t b) {
+    auto & block = cache.blocks[b];
+
+    // move the last free block to the place of b
+    const uint32_t last = cache.free_blocks.back();
+
+    cache.free_blocks[block.i_free] = last;
+    cache.blocks[last].i_free = block.i_free;
+    cache.free_blocks.pop_back();
+
+    block.i_free = -1;
+}
+
+static void llama_kv_cache_seq_add_block(struct llama_kv_cache & cache, llama_seq_id seq_id, uint32_t b) {
+    auto & block = cache.blocks[b];
+
+    if (!block.seqs[seq_id]) {
+        block.seqs.set(seq_id);
+        cache.seqs[seq_id].blocks.push_back(b);
+    }
+}
+
+// the sequences with cells in block b
+static llama_seq_mask llama_kv_cache_block_seqs(const struct llama_kv_cache & cache, uint32_t b) {
+    llama_seq_mask res;
+
+    for (uint32_t j = 0; j < llama_kv_block_size(cache, b); ++j) {
+        res |= cache.cells[b*LLAMA_KV_BLOCK_SIZE + j].seq_id;
+    }
+
+    return res;
+}
+
+// empty the prefix cache, its cells stay in use by their sequences
+static void llama_kv_prefix_reset(struct llama_kv_cache & cache) {
+    for (const auto & node : cache.prefix_nodes) {
+        for (const uint32_t i : node.cells) {
+            cache.cells[i].prefix_node = -1;
+        }
+    }
+
+    cache.prefix_nodes.assign(1, llama_kv_prefix_node());
+    cache.prefix_free.clear();
+    cache.prefix_cursors.fill(llama_kv_prefix_cursor());
+}
+
+// rebuild the blocks, the free list and the block tables from the cells
+// the prefix cache is emptied and its cells without a sequence are freed
+static void llama_kv_cache_rebuild(struct llama_kv_cache & cache) {
+    const uint32_t n_blocks = (cache.size + LLAMA_KV_BLOCK_SIZE - 1)/LLAMA_KV_BLOCK_SIZE;
+
+    llama_kv_prefix_reset(cache);
+
+    cache.blocks.assign(n_blocks, llama_kv_block());
+    cache.free_blocks.clear();
+    cache.seqs.fill(llama_kv_seq());
+    cache.used = 0;
+
+    // the block with the last token of each sequence
+    std::vector<llama_pos> seq_pos_max(LLAMA_MAX_SEQ, -1);
+    std::vector<int32_t>   seq_block  (LLAMA_MAX_SEQ, -1);
+
+    for (uint32_t b = 0; b < n_blocks; ++b) {
+        auto & block = cache.blocks[b];
+
+        for (uint32_t j = 0; j < llama_kv_block_size(cache, b); ++j) {
+            auto & cell = cache.cells[b*LLAMA_KV_BLOCK_SIZE + j];
+
+            if (cell.seq_id.none()) {
+                cell.pos = -1;
+            }
+
+            if (cell.pos < 0) {
+                continue;
+            }
+
+            block.n_used++;
+            block.n_alloc = j + 1;
+
+            for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+                if (cell.seq_id[s]) {
+                    llama_kv_cache_seq_add_block(cache, s, b);
+
+                    if (cell.pos > seq_pos_max[s]) {
+                        seq_pos_max[s] = cell.pos;
+                        seq_block[s]   = b;
+                    }
+                }
+            }
+        }
+
+        cache.used += block.n_used;
+    }
+
+    // a sequence keeps appending to the block with its last token, if the block only has its cells
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        const int32_t b = seq_block[s];
+
+        if (b >= 0 && llama_kv_cache_block_seqs(cache, b).count() == 1) {
+            cache.blocks[b].seq_id = s;
+            cache.seqs[s].tail = b;
+        }
+    }
+
+    // the blocks with the lowest index are allocated first, to keep n_kv small
+    for (int32_t b = n_blocks - 1; b >= 0; --b) {
+        if (cache.blocks[b].n_used == 0) {
+            llama_kv_cache_block_free(cache, b);
+        }
+    }
+}
+
+static bool llama_kv_cache_init(
+        const struct llama_hparams & hparams,
+             struct llama_kv_cache & cache,
+                         ggml_type   wtype,
+                          uint32_t   n_ctx,
+                               int   n_gpu_layers,
+                               int   huge_pages) {
+    const uint32_t n_embd  = hparams.n_embd_gqa();
+    const uint32_t n_layer = hparams.n_layer;
+
+    const int64_t n_mem      = n_layer*n_ctx;
+    const int64_t n_elements = n_embd*n_mem;
+
+    cache.has_shift = false;
+
+    cache.head = 0;
+    cache.size = n_ctx;
+
+    cache.cells.clear();
+    cache.cells.resize(n_ctx);
+
+    llama_kv_cache_rebuild(cache);
+
+    // the KV stores computed on the CPU can write to any cell
+    cache.paged = true;
+
+    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*ggml_tensor_overhead(), huge_pages);
+    memset(cache.buf.data, 0, cache.buf.size);
+
+    struct ggml_init_params params;
+    params.mem_size   = cache.buf.size;
+    params.mem_buffer = cache.buf.data;
+    params.no_alloc   = false;
+
+    cache.ctx = ggml_init(params);
+
+    if (!cache.ctx) {
+        LLAMA_LOG_ERROR("%s: failed to allocate memory for kv cache\n", __func__);
+        return false;
+    }
+
+    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    ggml_set_name(cache.k, "cache_k");
+    ggml_set_name(cache.v, "cache_v");
+
+    (void) n_gpu_layers;
+#ifdef GGML_USE_CUBLAS
+    size_t vram_kv_cache = 0;
+
+    if (n_gpu_layers > (int)n_layer + 1) {
+        ggml_cuda_assign_buffers_no_scratch(cache.v);
+        LLAMA_LOG_INFO("%s: offloading v cache to GPU\n", __func__);
+        vram_kv_cache += ggml_nbytes(cache.v);
+    }
+    if (n_gpu_layers > (int)n_layer + 2) {
+        ggml_cuda_assign_buffers_no_scratch(cache.k);
+        LLAMA_LOG_INFO("%s: offloading k cache to GPU\n", __func__);
+        vram_kv_cache += ggml_nbytes(cache.k);
+    }
+    if (vram_kv_cache > 0) {
+        LLAMA_LOG_INFO("%s: VRAM kv self = %.2f MB\n", __func__, vram_kv_cache / 1024.0 / 1024.0);
+        cache.paged = false;
+    }
+#endif // GGML_USE_CUBLAS
+
+#ifdef GGML_USE_METAL
+    // the whole graph is computed with Metal
+    if (n_gpu_layers > 0) {
+        cache.paged = false;
+    }
+#endif
+
+    return true;
+}
+
+static void llama_kv_cache_cell_use(
+        struct llama_kv_cache & cache,
+                     uint32_t   i,
+                    llama_pos   pos,
+           const llama_seq_id * seq_id,
+                      int32_t   n_seq_id) {
+    const uint32_t b = i/LLAMA_KV_BLOCK_SIZE;
+
+    auto & block = cache.blocks[b];
+
+    if (block.i_free >= 0) {
+        llama_kv_cache_block_alloc(cache, b);
+    }
+
+    block.n_used++;
+    block.n_alloc = std::max(block.n_alloc, i%LLAMA_KV_BLOCK_SIZE + 1);
+    cache.used++;
+
+    cache.cells[i].pos = pos;
+
+    for (int32_t j = 0; j < n_seq_id; j++) {
+        cache.cells[i].seq_id.set(seq_id[j]);
+        llama_kv_cache_seq_add_block(cache, seq_id[j], b);
+    }
+}
+
+static void llama_kv_cache_cell_free(struct llama_kv_cache & cache, uint32_t i) {
+    const uint32_t b = i/LLAMA_KV_BLOCK_SIZE;
+
+    cache.cells[i].pos = -1;
+    cache.cells[i].seq_id.reset();
+
+    cache.used--;
+
+    if (--cache.blocks[b].n_used == 0) {
+        llama_kv_cache_block_free(cache, b);
+    }
+}
+
+// apply f to the used cells of the blocks and update the block tables of the sequences that gain or lose cells
+// (the blocks that are no longer in a block table are removed from it at the end, in a single pass)
+template <typename F>
+static void llama_kv_cache_update_blocks(struct llama_kv_cache & cache, const std::vector<uint32_t> & blocks, F && f) {
+    llama_seq_mask seqs_removed;
+
+    for (const uint32_t b : blocks) {
+        const llama_seq_mask seqs_old = llama_kv_cache_block_seqs(cache, b);
+
+        for (uint32_t j = 0; j < llama_kv_block_size(cache, b); ++j) {
+            if (cache.cells[b*LLAMA_KV_BLOCK_SIZE + j].pos >= 0) {
+                f(b*LLAMA_KV_BLOCK_SIZE + j);
+            }
+        }
+
+        const llama_seq_mask seqs_new = llama_kv_cache_block_seqs(cache, b);
+
+        if (seqs_new == seqs_old) {
+            continue;
+        }
+
+        for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+            if (seqs_old[s] && !seqs_new[s]) {
+                cache.blocks[b].seqs.reset(s);
+                seqs_removed.set(s);
+
+                // the sequence does not append to a block without its cells
+                if (cache.blocks[b].seq_id == s) {
+                    cache.blocks[b].seq_id = -1;
+                }
+            } else if (!seqs_old[s] && seqs_new[s]) {
+                llama_kv_cache_seq_add_block(cache, s, b);
+            }
+        }
+    }
+
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        if (seqs_removed[s]) {
+            auto & seq_blocks = cache.seqs[s].blocks;
+
+            seq_blocks.erase(std::remove_if(seq_blocks.begin(), seq_blocks.end(), [&](uint32_t b) {
+                return !cache.blocks[b].seqs[s];
+            }), seq_blocks.end());
+        }
+    }
+}
+
+// the blocks with cells of seq_id (all the blocks in use if seq_id < 0)
+static std::vector<uint32_t> llama_kv_cache_seq_blocks(const struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    if (seq_id >= LLAMA_MAX_SEQ) {
+        return std::vector<uint32_t>();
+    }
+
+    if (seq_id >= 0) {
+        return cache.seqs[seq_id].blocks;
+    }
+
+    std::vector<uint32_t> res;
+
+    for (uint32_t b = 0; b < cache.blocks.size(); ++b) {
+        if (cache.blocks[b].n_used > 0) {
+            res.push_back(b);
+        }
+    }
+
+    return res;
+}
+
+//
+// prefix cache
+//
+
+static llama_pos llama_kv_prefix_depth(const struct llama_kv_cache & cache, const llama_kv_prefix_cursor & cur) {
+    return cache.prefix_nodes[cur.node].pos + cur.n;
+}
+
+static int32_t llama_kv_prefix_node_new(struct llama_kv_cache & cache, int32_t parent, llama_pos pos) {
+    int32_t i;
+
+    if (!cache.prefix_free.empty()) {
+        i = cache.prefix_free.back();
+        cache.prefix_free.pop_back();
+    } else {
+        i = cache.prefix_nodes.size();
+        cache.prefix_nodes.emplace_back();
+    }
+
+    auto & node = cache.prefix_nodes[i];
+
+    node.pos    = pos;
+    node.parent = parent;
+    node.t_used = cache.prefix_t;
+
+    return i;
+}
+
+// split node i after its first n tokens
+static void llama_kv_prefix_split(struct llama_kv_cache & cache, int32_t i, uint32_t n) {
+    const int32_t j = llama_kv_prefix_node_new(cache, i, cache.prefix_nodes[i].pos + n);
+
+    auto & node_i = cache.prefix_nodes[i];
+    auto & node_j = cache.prefix_nodes[j];
+
+    node_j.tokens.assign(node_i.tokens.begin() + n, node_i.tokens.end());
+    node_j.cells .assign(node_i.cells .begin() + n, node_i.cells .end());
+    node_j.children.swap(node_i.children);
+    node_j.t_used = node_i.t_used;
+
+    node_i.tokens.resize(n);
+    node_i.cells .resize(n);
+    node_i.children[node_j.tokens[0]] = j;
+
+    for (const auto & child : node_j.children) {
+        cache.prefix_nodes[child.second].parent = j;
+    }
+
+    for (const uint32_t c : node_j.cells) {
+        cache.cells[c].prefix_node = j;
+    }
+
+    for (auto & cur : cache.prefix_cursors) {
+        if (cur.node == i && cur.n > n) {
+            cur.node  = j;
+            cur.n    -= n;
+        }
+    }
+}
+
+// remove the tokens of node i after the first n and the nodes below it
+// their cells that are not used by any sequence are freed, the sequences in the removed part leave the tree
+static void llama_kv_prefix_cut(struct llama_kv_cache & cache, int32_t i, uint32_t n) {
+    auto release = [&](int32_t k, uint32_t n0) {
+        auto & node = cache.prefix_nodes[k];
+
+        for (uint32_t j = n0; j < node.cells.size(); ++j) {
+            auto & cell = cache.cells[node.cells[j]];
+
+            cell.prefix_node = -1;
+
+            if (cell.pos >= 0 && cell.seq_id.none()) {
+                llama_kv_cache_cell_free(cache, node.cells[j]);
+            }
+        }
+
+        node.tokens.resize(n0);
+        node.cells .resize(n0);
+
+        // the root is never removed
+        const bool removed = n0 == 0 && k > 0;
+
+        for (auto & cur : cache.prefix_cursors) {
+            if (cur.node == k && (cur.n > n0 || removed)) {
+                cur.node = -1;
+            }
+        }
+
+        if (removed) {
+            node.children.clear();
+            cache.prefix_free.push_back(k);
+        }
+    };
+
+    std::vector<int32_t> stack;
+    for (const auto & child : cache.prefix_nodes[i].children) {
+        stack.push_back(child.second);
+    }
+    cache.prefix_nodes[i].children.clear();
+
+    while (!stack.empty()) {
+        const int32_t k = stack.back();
+        stack.pop_back();
+
+        for (const auto & child : cache.prefix_nodes[k].children) {
+            stack.push_back(child.second);
+        }
+
+        release(k, 0);
+    }
+
+    if (i > 0 && n == 0) {
+        auto & node = cache.prefix_nodes[i];
+        cache.prefix_nodes[node.parent].children.erase(node.tokens[0]);
+    }
+
+    release(i, n);
+}
+
+// free the cells at the end of the least recently used leaf that no sequence uses, returns false if there are none
+static bool llama_kv_prefix_evict(struct llama_kv_cache & cache) {
+    int32_t best = -1;
+
+    for (int32_t i = 1; i < (int32_t) cache.prefix_nodes.size(); ++i) {
+        const auto & node = cache.prefix_nodes[i];
+
+        if (node.tokens.empty() || !node.children.empty() || cache.cells[node.cells.back()].seq_id.any()) {
+            continue;
+        }
+
+        if (best < 0 || node.t_used < cache.prefix_nodes[best].t_used) {
+            best = i;
+        }
+    }
+
+    if (best < 0) {
+        return false;
+    }
+
+    const auto & node = cache.prefix_nodes[best];
+
+    uint32_t n = node.cells.size();
+    while (n > 0 && cache.cells[node.cells[n - 1]].seq_id.none()) {
+        n--;
+    }
+
+    llama_kv_prefix_cut(cache, best, n);
+
+    return true;
+}
+
+// move the sequence (all of them if seq_id < 0) back to position p in the tree, after its tokens from p are removed
+static void llama_kv_prefix_seq_rm(struct llama_kv_cache & cache, llama_seq_id seq_id, llama_pos p) {
+    for (llama_seq_id s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        auto & cur = cache.prefix_cursors[s];
+
+        if ((seq_id >= 0 && s != seq_id) || cur.node < 0 || llama_kv_prefix_depth(cache, cur) <= p) {
+            continue;
+        }
+
+        while (cache.prefix_nodes[cur.node].pos > p) {
+            cur.node = cache.prefix_nodes[cur.node].parent;
+        }
+        cur.n = p - cache.prefix_nodes[cur.node].pos;
+    }
+}
+
+// add the tokens of the batch to the tree: each sequence that starts at position 0 extends its path with the cells
+// of its new tokens, or follows the path of the same tokens if another sequence already added them
+static void llama_kv_prefix_insert(struct llama_kv_cache & cache, const struct llama_batch & batch) {
+    cache.prefix_t++;
+
+    for (int32_t i = 0; i < batch.n_tokens; ++i) {
+        const uint32_t cell = cache.batch_cells[i];
+
+        for (int32_t j = 0; j < batch.n_seq_id[i]; ++j) {
+            auto & cur = cache.prefix_cursors[batch.seq_id[i][j]];
+
+            if (batch.pos[i] == 0) {
+                cur.node = 0;
+                cur.n    = 0;
+            }
+
+            // only the tokens that follow the path of the sequence, embeddings are not cached
+            if (!batch.token || cur.node < 0 || llama_kv_prefix_depth(cache, cur) != batch.pos[i]) {
+                cur.node = -1;
+                continue;
+            }
+
+            const llama_token token = batch.token[i];
+
+            if (cur.n < cache.prefix_nodes[cur.node].tokens.size()) {
+                if (cache.prefix_nodes[cur.node].tokens[cur.n] == token) {
+                    cache.prefix_nodes[cur.node].t_used = cache.prefix_t;
+                    cur.n++;
+                    continue;
+                }
+
+                llama_kv_prefix_split(cache, cur.node, cur.n);
+            }
+
+            auto & node = cache.prefix_nodes[cur.node];
 
-#ifdef GGML_USE_METAL
-    ggml_metal_context * ctx_metal = NULL;
-#endif
+            const auto it = node.children.find(token);
+            if (it != node.children.end()) {
+                cache.prefix_nodes[it->second].t_used = cache.prefix_t;
+                cur.node = it->second;
+                cur.n    = 1;
+                continue;
+            }
 
-#ifdef GGML_USE_MPI
-    ggml_mpi_context * ctx_mpi = NULL;
-#endif
-};
+            // the cell is already in the tree for another sequence with different tokens before it
+            if (cache.cells[cell].prefix_node >= 0) {
+                cur.node = -1;
+                continue;
+            }
 
-//
-// kv cache helpers
-//
+            if (cur.node > 0 && node.children.empty()) {
+                // extend the leaf
+                node.tokens.push_back(token);
+                node.cells .push_back(cell);
+                node.t_used = cache.prefix_t;
 
-static bool llama_kv_cache_init(
-        const struct llama_hparams & hparams,
-             struct llama_kv_cache & cache,
-                         ggml_type   wtype,
-                          uint32_t   n_ctx,
-                               int   n_gpu_layers) {
-    const uint32_t n_embd  = hparams.n_embd_gqa();
-    const uint32_t n_layer = hparams.n_layer;
+                cache.cells[cell].prefix_node = cur.node;
+                cur.n++;
+            } else {
+                const int32_t k = llama_kv_prefix_node_new(cache, cur.node, batch.pos[i]);
 
-    const int64_t n_mem      = n_layer*n_ctx;
-    const int64_t n_elements = n_embd*n_mem;
+                cache.prefix_nodes[k].tokens.push_back(token);
+                cache.prefix_nodes[k].cells .push_back(cell);
+                cache.prefix_nodes[cur.node].children[token] = k;
 
-    cache.has_shift = false;
+                cache.cells[cell].prefix_node = k;
+                cur.node = k;
+                cur.n    = 1;
+            }
+        }
+    }
+}
 
-    cache.head = 0;
-    cache.size = n_ctx;
+// find a free cell for a new token of seq_id: after the last token of the sequence in its tail block,
+// at the start of a free block or, when all the blocks are in use, anywhere in the cache
+static uint32_t llama_kv_cache_alloc_cell(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    auto & seq = cache.seqs[seq_id];
 
-    cache.cells.clear();
-    cache.cells.resize(n_ctx);
+    if (seq.tail >= 0) {
+        const auto & block = cache.blocks[seq.tail];
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*ggml_tensor_overhead());
-    memset(cache.buf.data, 0, cache.buf.size);
+        if (block.seq_id == seq_id && block.n_alloc < llama_kv_block_size(cache, seq.tail)) {
+            return seq.tail*LLAMA_KV_BLOCK_SIZE + block.n_alloc;
+        }
+    }
 
-    struct ggml_init_params params;
-    params.mem_size   = cache.buf.size;
-    params.mem_buffer = cache.buf.data;
-    params.no_alloc   = false;
+    // make room with the least recently used cells of the prefix cache
+    while (cache.free_blocks.empty() && llama_kv_prefix_evict(cache)) {}
 
-    cache.ctx = ggml_init(params);
+    if (!cache.free_blocks.empty()) {
+        const uint32_t b = cache.free_blocks.back();
 
-    if (!cache.ctx) {
-        LLAMA_LOG_ERROR("%s: failed to allocate memory for kv cache\n", __func__);
-        return false;
+        cache.blocks[b].seq_id = seq_id;
+        seq.tail = b;
+
+        return b*LLAMA_KV_BLOCK_SIZE;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    ggml_set_name(cache.k, "cache_k");
-    ggml_set_name(cache.v, "cache_v");
+    for (uint32_t k = 0; k < cache.size; ) {
+        const uint32_t i = (cache.head + k) % cache.size;
+        const uint32_t b = i/LLAMA_KV_BLOCK_SIZE;
 
-    (void) n_gpu_layers;
-#ifdef GGML_USE_CUBLAS
-    size_t vram_kv_cache = 0;
+        // skip the rest of a full block
+        if (cache.blocks[b].n_used == llama_kv_block_size(cache, b)) {
+            k += b*LLAMA_KV_BLOCK_SIZE + llama_kv_block_size(cache, b) - i;
+            continue;
+        }
 
-    if (n_gpu_layers > (int)n_layer + 1) {
-        ggml_cuda_assign_buffers_no_scratch(cache.v);
-        LLAMA_LOG_INFO("%s: offloading v cache to GPU\n", __func__);
-        vram_kv_cache += ggml_nbytes(cache.v);
-    }
-    if (n_gpu_layers > (int)n_layer + 2) {
-        ggml_cuda_assign_buffers_no_scratch(cache.k);
-        LLAMA_LOG_INFO("%s: offloading k cache to GPU\n", __func__);
-        vram_kv_cache += ggml_nbytes(cache.k);
-    }
-    if (vram_kv_cache > 0) {
-        LLAMA_LOG_INFO("%s: VRAM kv self = %.2f MB\n", __func__, vram_kv_cache / 1024.0 / 1024.0);
+        if (cache.cells[i].pos < 0) {
+            cache.head = i;
+            return i;
+        }
+
+        k++;
     }
-#endif // GGML_USE_CUBLAS
 
-    return true;
+    GGML_ASSERT(false && "no free cell in the KV cache");
 }
 
-// find an empty slot of size "n_tokens" in the cache
-// updates the cache head
+// find empty cells for the "n_tokens" tokens of the batch, their indices are stored in cache.batch_cells
+// with a paged cache, this only fails when there are not enough free cells
+// otherwise the cells must be contiguous, they start at cache.head
 // Note: On success, it's important that cache.head points
 // to the first cell of the slot.
 static bool llama_kv_cache_find_slot(
@@ -1454,6 +2307,26 @@ static bool llama_kv_cache_find_slot(
         return false;
     }
 
+    cache.batch_cells.resize(n_tokens);
+
+    if (cache.paged) {
+        while (n_tokens > cache.size - cache.used && llama_kv_prefix_evict(cache)) {}
+
+        if (n_tokens > cache.size - cache.used) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            const uint32_t cell = llama_kv_cache_alloc_cell(cache, batch.seq_id[i][0]);
+
+            llama_kv_cache_cell_use(cache, cell, batch.pos[i], batch.seq_id[i], batch.n_seq_id[i]);
+
+            cache.batch_cells[i] = cell;
+        }
+
+        return true;
+    }
+
     uint32_t n_tested = 0;
 
     while (true) {
@@ -1477,6 +2350,11 @@ static bool llama_kv_cache_find_slot(
             break;
         }
 
+        if (n_tested >= n_ctx && llama_kv_prefix_evict(cache)) {
+            n_tested = 0;
+            continue;
+        }
+
         if (n_tested >= n_ctx) {
             //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return false;
@@ -1484,11 +2362,9 @@ static bool llama_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        llama_kv_cache_cell_use(cache, cache.head + i, batch.pos[i], batch.seq_id[i], batch.n_seq_id[i]);
 
-        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
-        }
+        cache.batch_cells[i] = cache.head + i;
     }
 
     return true;
@@ -1496,9 +2372,15 @@ static bool llama_kv_cache_find_slot(
 
 // find how many cells are currently in use
 static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
+    for (int32_t b = cache.blocks.size() - 1; b >= 0; --b) {
+        if (cache.blocks[b].n_used == 0) {
+            continue;
+        }
+
+        for (int32_t i = b*LLAMA_KV_BLOCK_SIZE + llama_kv_block_size(cache, b) - 1; i >= b*LLAMA_KV_BLOCK_SIZE; --i) {
+            if (cache.cells[i].pos >= 0 && cache.cells[i].seq_id.any()) {
+                return i + 1;
+            }
         }
     }
 
@@ -1508,9 +2390,11 @@ static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
 static void llama_kv_cache_clear(struct llama_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].seq_id.reset();
     }
     cache.head = 0;
+
+    llama_kv_cache_rebuild(cache);
 }
 
 static void llama_kv_cache_seq_rm(
@@ -1523,21 +2407,28 @@ static void llama_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+    if (cache.prefix_cache && p1 > p0) {
+        llama_kv_prefix_seq_rm(cache, seq_id, p0);
+    }
+
+    llama_kv_cache_update_blocks(cache, llama_kv_cache_seq_blocks(cache, seq_id), [&](uint32_t i) {
+        auto & cell = cache.cells[i];
+
+        if (cell.pos >= p0 && cell.pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cell.seq_id.reset();
+            } else if (cell.has_seq_id(seq_id)) {
+                cell.seq_id.reset(seq_id);
             } else {
-                continue;
+                return;
             }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
-                if (new_head == cache.size) new_head = i;
+            // the cells of the prefix cache are kept until they are evicted
+            if (cell.seq_id.none() && cell.prefix_node < 0) {
+                llama_kv_cache_cell_free(cache, i);
+                new_head = std::min(new_head, i);
             }
         }
-    }
+    });
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size) cache.head = new_head;
@@ -1549,31 +2440,54 @@ static void llama_kv_cache_seq_cp(
                  llama_seq_id   seq_id_dst,
                     llama_pos   p0,
                     llama_pos   p1) {
+    if (seq_id_dst < 0 || seq_id_dst >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id_dst = %d, must be in [0, %d)\n", __func__, seq_id_dst, LLAMA_MAX_SEQ);
+        return;
+    }
+
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+    // the destination follows the path of the source in the prefix cache if it gets all its cached tokens
+    if (cache.prefix_cache) {
+        const auto & src = cache.prefix_cursors[seq_id_src];
+        auto       & dst = cache.prefix_cursors[seq_id_dst];
+
+        if (src.node >= 0 && p0 == 0 && llama_kv_prefix_depth(cache, src) <= p1) {
+            dst = src;
+        } else {
+            dst.node = -1;
         }
     }
+
+    llama_kv_cache_update_blocks(cache, llama_kv_cache_seq_blocks(cache, seq_id_src), [&](uint32_t i) {
+        auto & cell = cache.cells[i];
+
+        if (cell.has_seq_id(seq_id_src) && cell.pos >= p0 && cell.pos < p1) {
+            cell.seq_id.set(seq_id_dst);
+        }
+    });
 }
 
 static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
     uint32_t new_head = cache.size;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (!cache.cells[i].has_seq_id(seq_id)) {
-            cache.cells[i].pos = -1;
-            cache.cells[i].seq_id.clear();
-            if (new_head == cache.size) new_head = i;
+    // the cells of the other sequences are freed, including the ones of the prefix cache
+    llama_kv_prefix_reset(cache);
+
+    llama_kv_cache_update_blocks(cache, llama_kv_cache_seq_blocks(cache, -1), [&](uint32_t i) {
+        auto & cell = cache.cells[i];
+
+        if (!cell.has_seq_id(seq_id)) {
+            llama_kv_cache_cell_free(cache, i);
+            new_head = std::min(new_head, i);
         } else {
-            cache.cells[i].seq_id.clear();
-            cache.cells[i].seq_id.insert(seq_id);
+            cell.seq_id.reset();
+            cell.seq_id.set(seq_id);
         }
-    }
+    });
 
     // If we freed up a slot, set head to it so searching can start there.
     if (new_head != cache.size) cache.head = new_head;
@@ -1590,25 +2504,100 @@ static void llama_kv_cache_seq_shift(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.has_shift = true;
-            cache.cells[i].pos   += delta;
-            cache.cells[i].delta += delta;
+    // the shifted cells no longer match the positions of their tokens in the prefix cache
+    if (cache.prefix_cache) {
+        for (const uint32_t b : llama_kv_cache_seq_blocks(cache, seq_id)) {
+            for (uint32_t i = b*LLAMA_KV_BLOCK_SIZE; i < b*LLAMA_KV_BLOCK_SIZE + llama_kv_block_size(cache, b); ++i) {
+                const auto & cell = cache.cells[i];
 
-            if (cache.cells[i].pos < 0) {
-                cache.cells[i].pos = -1;
-                cache.cells[i].seq_id.clear();
-                if (new_head == cache.size) new_head = i;
+                if (cell.prefix_node >= 0 && cell.has_seq_id(seq_id) && cell.pos >= p0 && cell.pos < p1) {
+                    const auto & cells = cache.prefix_nodes[cell.prefix_node].cells;
+                    llama_kv_prefix_cut(cache, cell.prefix_node, std::find(cells.begin(), cells.end(), i) - cells.begin());
+                }
             }
         }
+
+        llama_kv_prefix_seq_rm(cache, seq_id, p0);
     }
 
+    llama_kv_cache_update_blocks(cache, llama_kv_cache_seq_blocks(cache, seq_id), [&](uint32_t i) {
+        auto & cell = cache.cells[i];
+
+        if (cell.has_seq_id(seq_id) && cell.pos >= p0 && cell.pos < p1) {
+            cache.has_shift = true;
+            cell.pos   += delta;
+            cell.delta += delta;
+
+            if (cell.pos < 0) {
+                llama_kv_cache_cell_free(cache, i);
+                new_head = std::min(new_head, i);
+            }
+        }
+    });
+
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     cache.head = new_head != cache.size ? new_head : 0;
 }
 
+// replace the cells of seq_id with the ones of the longest prefix of tokens in the prefix cache
+static int32_t llama_kv_cache_seq_prefix(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+            const llama_token * tokens,
+                      int32_t   n_tokens) {
+    if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d, must be in [0, %d)\n", __func__, seq_id, LLAMA_MAX_SEQ);
+        return -1;
+    }
+
+    llama_kv_cache_seq_rm(cache, seq_id, -1, -1);
+
+    if (!cache.prefix_cache) {
+        return 0;
+    }
+
+    cache.prefix_t++;
+
+    llama_kv_prefix_cursor cur;
+    cur.node = 0;
+
+    int32_t n = 0;
+
+    while (n < n_tokens) {
+        auto & node = cache.prefix_nodes[cur.node];
+
+        if (cur.n == node.tokens.size()) {
+            const auto it = node.children.find(tokens[n]);
+            if (it == node.children.end()) {
+                break;
+            }
+
+            cur.node = it->second;
+            cur.n    = 0;
+            continue;
+        }
+
+        if (node.tokens[cur.n] != tokens[n]) {
+            break;
+        }
+
+        const uint32_t i = node.cells[cur.n];
+
+        cache.cells[i].seq_id.set(seq_id);
+        llama_kv_cache_seq_add_block(cache, seq_id, i/LLAMA_KV_BLOCK_SIZE);
+
+        node.t_used = cache.prefix_t;
+
+        cur.n++;
+        n++;
+    }
+
+    cache.prefix_cursors[seq_id] = cur;
+
+    return n;
+}
+
 //
 // model loading and saving
 //
@@ -2484,6 +3473,8 @@ static void llm_load_tensors(
         int main_gpu,
         const float * tensor_split,
         bool use_mlock,
+        bool repack,
+        int  huge_pages,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -2502,7 +3493,8 @@ static void llm_load_tensors(
 
     // create the ggml context
     {
-        model.buf.resize(ctx_size);
+        // with mmap the buffer only contains the tensor structs
+        model.buf.resize(ctx_size, ml.use_mmap ? LLAMA_HUGE_PAGES_NONE : huge_pages);
         if (use_mlock) {
             model.mlock_buf.init   (model.buf.data);
             model.mlock_buf.grow_to(model.buf.size);
@@ -3101,6 +4093,51 @@ static void llm_load_tensors(
 
     ml.load_all_data(ctx, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL);
 
+    if (huge_pages != LLAMA_HUGE_PAGES_NONE && !ml.use_mmap) {
+        LLAMA_LOG_INFO("%s: weights huge page coverage = %5.1f%%\n", __func__, 100.0f*model.buf.huge_pages_coverage());
+    }
+
+    if (repack) {
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
+        // the GPU backends may take over the matrix multiplications of CPU tensors
+        LLAMA_LOG_WARN("%s: weight repacking is not supported with GPU backends - skipping\n", __func__);
+#else
+        int n_repacked = 0;
+        for (auto & it : model.tensors_by_name) {
+            struct ggml_tensor * cur = it.second;
+
+            // the embeddings are read by ggml_get_rows
+            if (cur == model.tok_embd || cur == model.pos_embd) {
+                continue;
+            }
+
+            n_repacked += ggml_repack_tensor(cur);
+        }
+        LLAMA_LOG_INFO("%s: repacked %d tensors into interleaved layouts\n", __func__, n_repacked);
+#endif
+    }
+
+#if !defined(GGML_USE_CUBLAS) && !defined(GGML_USE_CLBLAST) && !defined(GGML_USE_METAL)
+    if (ggml_is_numa() && ml.use_mmap) {
+        // mbind does not move the pages of a shared file mapping: they belong to the page cache
+        // the pages that are not in memory yet are loaded by the node that touches them first
+        LLAMA_LOG_INFO("%s: the weights are memory mapped, use --no-mmap to place their rows on the NUMA nodes\n", __func__);
+    } else if (ggml_is_numa()) {
+        // move the rows of the weights to the nodes whose threads compute them
+        int n_placed = 0;
+        for (auto & it : model.tensors_by_name) {
+            struct ggml_tensor * cur = it.second;
+
+            if (cur == model.tok_embd || cur == model.pos_embd) {
+                continue;
+            }
+
+            n_placed += ggml_numa_place_tensor(cur);
+        }
+        LLAMA_LOG_INFO("%s: placed the rows of %d tensors on their NUMA nodes\n", __func__, n_placed);
+    }
+#endif
+
     if (progress_callback) {
         progress_callback(1.0f, progress_callback_user_data);
     }
@@ -3114,7 +4151,17 @@ static void llm_load_tensors(
 
 static bool llama_model_load(const std::string & fname, llama_model & model, const llama_model_params & params) {
     try {
-        llama_model_loader ml(fname, params.use_mmap);
+        // the repacked weights are written in place, so they cannot be mapped from the file
+        if (params.repack && params.use_mmap) {
+            LLAMA_LOG_INFO("%s: weight repacking requested - mmap disabled\n", __func__);
+        }
+
+        // the weights are copied into the huge pages
+        if (params.huge_pages != LLAMA_HUGE_PAGES_NONE && params.use_mmap) {
+            LLAMA_LOG_INFO("%s: huge pages requested - mmap disabled\n", __func__);
+        }
+
+        llama_model_loader ml(fname, params.use_mmap && !params.repack && params.huge_pages == LLAMA_HUGE_PAGES_NONE);
 
         model.hparams.vocab_only = params.vocab_only;
 
@@ -3134,7 +4181,7 @@ static bool llama_model_load(const std::string & fname, llama_model & model, con
         }
 
         llm_load_tensors(
-            ml, model, params.n_gpu_layers, params.main_gpu, params.tensor_split, params.use_mlock,
+            ml, model, params.n_gpu_layers, params.main_gpu, params.tensor_split, params.use_mlock, params.repack, params.huge_pages,
             params.progress_callback, params.progress_callback_user_data
         );
     } catch (const std::exception & err) {
@@ -3263,10 +4310,31 @@ static void llm_build_kv_store(
                     int64_t   n_ctx,
                     int32_t   n_tokens,
                     int32_t   kv_head,
+         struct ggml_tensor * kv_idxs,
          const llm_build_cb & cb,
                     int64_t   il) {
     const int64_t n_embd_gqa = hparams.n_embd_gqa();
 
+    if (kv.paged) {
+        // the cells of the tokens are given by kv_idxs
+        struct ggml_tensor * k_cache_view = ggml_view_2d(ctx, kv.k, n_embd_gqa, n_ctx,
+                ggml_element_size(kv.k)*n_embd_gqa,
+                ggml_element_size(kv.k)*n_embd_gqa*n_ctx*il);
+        cb(k_cache_view, "k_cache_view", il);
+
+        // the V cache is transposed, the cells are the columns of the layer
+        struct ggml_tensor * v_cache_view = ggml_transpose(ctx, ggml_view_2d(ctx, kv.v, n_ctx, n_embd_gqa,
+                ggml_element_size(kv.v)*n_ctx,
+                ggml_element_size(kv.v)*n_embd_gqa*n_ctx*il));
+        cb(v_cache_view, "v_cache_view", il);
+
+        // important: storing RoPE-ed version of K in the KV cache!
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, k_cache_view, ggml_reshape_2d(ctx, k_cur, n_embd_gqa, n_tokens), kv_idxs));
+        ggml_build_forward_expand(graph, ggml_set_rows(ctx, v_cache_view, ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens), kv_idxs));
+
+        return;
+    }
+
     // compute the transposed [n_tokens, n_embd] V matrix
     struct ggml_tensor * v_cur_t = ggml_transpose(ctx, ggml_reshape_2d(ctx, v_cur, n_embd_gqa, n_tokens));
     //struct ggml_tensor * v_cur_t = ggml_transpose(ctx, v_cur); // TODO: reshape above is likely not needed
@@ -3388,7 +4456,8 @@ static struct ggml_tensor * llm_build_ffn(
     }
 
     if (type_gate == LLM_FFN_PAR) {
-        cur = ggml_mul(ctx, cur, tmp);
+        // tmp first, so that the up and gate projections are adjacent in the graph
+        cur = ggml_mul(ctx, tmp, cur);
         cb(cur, "ffn_gate_par", il);
     }
 
@@ -3404,15 +4473,44 @@ static struct ggml_tensor * llm_build_ffn(
     return cur;
 }
 
+// scale of KQ before the softmax (the value of the KQ_scale input)
+static float llama_kq_scale(const llama_hparams & hparams) {
+    return 1.0f/sqrtf(float(hparams.n_embd_head()));
+}
+
+// the fused attention kernel does not support ALiBi
+static bool llm_use_flash_attn(const llama_cparams & cparams, float max_alibi_bias) {
+    return cparams.flash_attn && max_alibi_bias <= 0.0f;
+}
+
+// KQ_scale input - NULL if the layers use the fused attention, which takes the scale as a parameter
+static struct ggml_tensor * llm_build_kq_scale(
+        struct ggml_context * ctx,
+        const llama_cparams & cparams,
+                      float   max_alibi_bias,
+         const llm_build_cb & cb) {
+    if (llm_use_flash_attn(cparams, max_alibi_bias)) {
+        return NULL;
+    }
+
+    struct ggml_tensor * kq_scale = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, 1);
+    cb(kq_scale, "KQ_scale", -1);
+
+    return kq_scale;
+}
+
+// kq_scale is the value of the KQ_scale input kq_scale_inp (NULL with the fused attention)
 // if max_alibi_bias > 0 then apply ALiBi
 static struct ggml_tensor * llm_build_kqv(
         struct ggml_context * ctx,
         const llama_hparams & hparams,
+        const llama_cparams & cparams,
        const llama_kv_cache & kv,
          struct ggml_tensor * wo,
          struct ggml_tensor * wo_b,
          struct ggml_tensor * q_cur,
-         struct ggml_tensor * kq_scale,
+                      float   kq_scale,
+         struct ggml_tensor * kq_scale_inp,
          struct ggml_tensor * kq_mask,
                     int64_t   n_ctx,
                     int32_t   n_tokens,
@@ -3437,26 +4535,6 @@ static struct ggml_tensor * llm_build_kqv(
                 ggml_element_size(kv.k)*n_embd_gqa*n_ctx*il);
     cb(k, "k", il);
 
-    struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
-    cb(kq, "kq", il);
-
-    kq = ggml_scale(ctx, kq, kq_scale);
-    cb(kq, "kq_scaled", il);
-
-    if (max_alibi_bias > 0.0f) {
-        // TODO: n_head or n_head_kv
-        // TODO: K-shift is likely not working
-        // TODO: change to ggml_add
-        kq = ggml_alibi(ctx, kq, /*n_past*/ 0, n_head, max_alibi_bias);
-        cb(kq, "kq_scaled_alibi", il);
-    }
-
-    kq = ggml_add(ctx, kq, kq_mask);
-    cb(kq, "kq_masked", il);
-
-    kq = ggml_soft_max(ctx, kq);
-    cb(kq, "kq_soft_max", il);
-
     // split cached v into n_head heads
     struct ggml_tensor * v =
         ggml_view_3d(ctx, kv.v,
@@ -3466,14 +4544,50 @@ static struct ggml_tensor * llm_build_kqv(
                 ggml_element_size(kv.v)*n_ctx*n_embd_gqa*il);
     cb(v, "v", il);
 
-    struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
-    cb(kqv, "kqv", il);
+    struct ggml_tensor * cur;
+
+    if (llm_use_flash_attn(cparams, max_alibi_bias)) {
+        // the fused kernel does not materialize KQ and writes the heads already merged
+        cur = ggml_flash_attn_ext(ctx, q, k, v, kq_mask, kq_scale);
+        cb(cur, "kqv_flash", il);
+
+        // the KV positions of the other sequences are in other blocks
+        ggml_flash_attn_ext_set_chunk(cur, LLAMA_KV_BLOCK_SIZE);
+
+        cur = ggml_reshape_2d(ctx, cur, n_embd, n_tokens);
+        cb(cur, "kqv_merged_cont", il);
+    } else {
+        struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
+        cb(kq, "kq", il);
+
+        GGML_ASSERT(kq_scale_inp);
+
+        kq = ggml_scale(ctx, kq, kq_scale_inp);
+        cb(kq, "kq_scaled", il);
+
+        if (max_alibi_bias > 0.0f) {
+            // TODO: n_head or n_head_kv
+            // TODO: K-shift is likely not working
+            // TODO: change to ggml_add
+            kq = ggml_alibi(ctx, kq, /*n_past*/ 0, n_head, max_alibi_bias);
+            cb(kq, "kq_scaled_alibi", il);
+        }
+
+        kq = ggml_add(ctx, kq, kq_mask);
+        cb(kq, "kq_masked", il);
+
+        kq = ggml_soft_max(ctx, kq);
+        cb(kq, "kq_soft_max", il);
 
-    struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
-    cb(kqv_merged, "kqv_merged", il);
+        struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+        cb(kqv, "kqv", il);
 
-    struct ggml_tensor * cur = ggml_cont_2d(ctx, kqv_merged, n_embd, n_tokens);
-    cb(cur, "kqv_merged_cont", il);
+        struct ggml_tensor * kqv_merged = ggml_permute(ctx, kqv, 0, 2, 1, 3);
+        cb(kqv_merged, "kqv_merged", il);
+
+        cur = ggml_cont_2d(ctx, kqv_merged, n_embd, n_tokens);
+        cb(cur, "kqv_merged_cont", il);
+    }
 
     cur = ggml_mul_mat(ctx, wo, cur);
     if (wo_b) {
@@ -3510,13 +4624,16 @@ struct llm_build_context {
     const float beta_slow;
     const float norm_eps;
     const float norm_rms_eps;
+    const float kq_scale;
 
     const int32_t n_tokens;
+    const int32_t n_outputs; // number of tokens whose logits are requested (n_outputs <= n_tokens)
     const int32_t n_kv;     // size of KV cache to consider (n_kv <= n_ctx)
     const int32_t kv_head;  // index of where we store new KV data in the cache
     const int32_t n_orig_ctx;
 
     const bool do_rope_shift;
+    const bool pooled;        // the final norm is computed for every token, for the pooled embeddings
 
     const llm_build_cb & cb;
 
@@ -3528,6 +4645,7 @@ struct llm_build_context {
     llm_build_context(
         llama_context  & lctx,
     const llama_batch  & batch,
+          llama_buffer & buf_compute,
     const llm_build_cb & cb,
                   bool   worst_case) :
         model         (lctx.model),
@@ -3550,13 +4668,16 @@ struct llm_build_context {
         beta_slow     (cparams.yarn_beta_slow),
         norm_eps      (hparams.f_norm_eps),
         norm_rms_eps  (hparams.f_norm_rms_eps),
+        kq_scale      (llama_kq_scale(hparams)),
         n_tokens      (batch.n_tokens),
+        n_outputs     (worst_case ? n_tokens : (int32_t) lctx.out_ids.size()),
         n_kv          (worst_case ? n_ctx            : kv_self.n),
         kv_head       (worst_case ? n_ctx - n_tokens : kv_self.head),
         n_orig_ctx    (cparams.n_yarn_orig_ctx),
         do_rope_shift (worst_case || kv_self.has_shift),
+        pooled        (cparams.pooling_type != LLAMA_POOLING_NONE),
         cb            (cb),
-        buf_compute   (lctx.buf_compute) {
+        buf_compute   (buf_compute) {
             GGML_ASSERT(!!kv_self.ctx);
 
             // all initializations should be done in init()
@@ -3579,6 +4700,35 @@ struct llm_build_context {
         }
     }
 
+    // gather the rows of the outputs, a no-op when all the logits are requested
+    // the pooled embeddings need the final norm of all the tokens, their rows are not gathered
+    struct ggml_tensor * build_out_rows(struct ggml_tensor * cur) {
+        if (n_outputs == n_tokens || pooled) {
+            return cur;
+        }
+
+        // inp_out_ids - the indices of the outputs in the batch
+        struct ggml_tensor * inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+        cb(inp_out_ids, "inp_out_ids", -1);
+
+        cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+        cb(cur, "result_rows", -1);
+
+        return cur;
+    }
+
+    // output projection of the final norm, skipped for a batch of pooled embeddings without logits
+    struct ggml_tensor * build_lm_head(struct ggml_tensor * cur) {
+        if (pooled && n_outputs == 0) {
+            return cur;
+        }
+
+        cur = ggml_mul_mat(ctx0, model.output, cur);
+        cb(cur, "result_output", -1);
+
+        return cur;
+    }
+
     struct ggml_cgraph * build_llama() {
         struct ggml_cgraph * gf = ggml_new_graph(ctx0);
 
@@ -3595,13 +4745,16 @@ struct llm_build_context {
         cb(inp_pos, "inp_pos", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, -1.0f, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -3628,6 +4781,11 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
+                // keep the projections next to each other in the graph so that they are computed together
+                ggml_build_forward_expand(gf, Qcur);
+                ggml_build_forward_expand(gf, Kcur);
+                ggml_build_forward_expand(gf, Vcur);
+
                 Qcur = ggml_rope_custom(
                     ctx0, ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens), inp_pos,
                     n_embd_head, 0, 0, n_orig_ctx, freq_base, freq_scale,
@@ -3642,11 +4800,11 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -3677,14 +4835,16 @@ struct llm_build_context {
 
         cur = inpL;
 
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
         cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm, NULL,
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -3704,14 +4864,20 @@ struct llm_build_context {
         struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
         cb(inp_pos, "inp_pos", -1);
 
+        // apply ALiBi for 13B model
+        const float max_alibi_bias = model.type == MODEL_13B ? 8.0f : -1.0f;
+
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, max_alibi_bias, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -3736,6 +4902,11 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
+                // keep the projections next to each other in the graph so that they are computed together
+                ggml_build_forward_expand(gf, Qcur);
+                ggml_build_forward_expand(gf, Kcur);
+                ggml_build_forward_expand(gf, Vcur);
+
                 switch (model.type) {
                     case MODEL_7B:
                         Qcur = ggml_rope_custom(
@@ -3759,14 +4930,11 @@ struct llm_build_context {
                 cb(Qcur, "Qcur", il);
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
-
-                // apply ALiBi for 13B model
-                const float max_alibi_bias = model.type == MODEL_13B ? 8.0f : -1.0f;
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, max_alibi_bias, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, max_alibi_bias, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -3797,14 +4965,16 @@ struct llm_build_context {
 
         cur = inpL;
 
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
         cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm, NULL,
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -3825,13 +4995,16 @@ struct llm_build_context {
         cb(inp_pos, "inp_pos", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, -1.0f, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         // shift the entire K-cache if needed
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
@@ -3886,11 +5059,11 @@ struct llm_build_context {
                 );
                 cb(Kcur, "Kcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -3918,6 +5091,9 @@ struct llm_build_context {
 
         cur = inpL;
 
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
         // norm
         cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm,
@@ -3925,8 +5101,7 @@ struct llm_build_context {
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -3948,13 +5123,16 @@ struct llm_build_context {
         cb(inp_pos, "inp_pos", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, -1.0f, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         pos = ggml_get_rows(ctx0, model.pos_embd, inp_pos);
         cb(pos, "pos_embd", -1);
 
@@ -3986,11 +5164,11 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4018,14 +5196,18 @@ struct llm_build_context {
             cb(inpL, "l_out", il);
         }
 
-        cur = llm_build_norm(ctx0, inpL, hparams,
+        cur = inpL;
+
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
+        cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm,
                 model.output_norm_b,
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -4047,12 +5229,15 @@ struct llm_build_context {
         cb(inp_pos, "inp_pos", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, -1.0f, cb);
 
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         if (do_rope_shift) {
             llm_build_k_shift(ctx0, hparams, cparams, kv_self, gf, LLM_ROPE_NEOX, n_ctx, n_embd_head, freq_base, freq_scale, cb);
         }
@@ -4192,12 +5377,12 @@ struct llm_build_context {
                         );
                 cb(Vcur, "Vcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
                 // TODO: not tested, could be broken
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Q, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
+                        Q, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, -1.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4228,14 +5413,16 @@ struct llm_build_context {
 
         cur = inpL;
 
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
         cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm,
                 model.output_norm_b,
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -4252,13 +5439,16 @@ struct llm_build_context {
         cb(inpL, "inp_embd", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, 8.0f, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         for (int il = 0; il < n_layer; ++il) {
             struct ggml_tensor * inpSA = inpL;
 
@@ -4278,17 +5468,22 @@ struct llm_build_context {
                 struct ggml_tensor * Vcur = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
                 cb(Vcur, "Vcur", il);
 
+                // keep the projections next to each other in the graph so that they are computed together
+                ggml_build_forward_expand(gf, Qcur);
+                ggml_build_forward_expand(gf, Kcur);
+                ggml_build_forward_expand(gf, Vcur);
+
                 Kcur = ggml_reshape_3d(ctx0, Kcur, n_embd_head, n_head_kv, n_tokens);
                 cb(Kcur, "Kcur", il);
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head,    n_tokens);
                 cb(Qcur, "Qcur", il);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4319,14 +5514,16 @@ struct llm_build_context {
 
         cur = inpL;
 
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
         cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm, NULL,
                 LLM_NORM_RMS, cb, -1);
         cb(cur, "result_norm", -1);
 
         // lm_head
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -4343,13 +5540,16 @@ struct llm_build_context {
         cb(inpL, "inp_embd", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, 8.0f, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         inpL = llm_build_norm(ctx0, inpL, hparams,
                 model.tok_norm,
                 model.tok_norm_b,
@@ -4381,11 +5581,11 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, model.layers[il].bo,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, 8.0f, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4413,14 +5613,18 @@ struct llm_build_context {
             cb(inpL, "l_out", il);
         }
 
-        cur = llm_build_norm(ctx0, inpL, hparams,
+        cur = inpL;
+
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
+        cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm,
                 model.output_norm_b,
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -4437,13 +5641,16 @@ struct llm_build_context {
         cb(inpL, "inp_embd", -1);
 
         // KQ_scale
-        struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
-        cb(KQ_scale, "KQ_scale", -1);
+        struct ggml_tensor * KQ_scale = llm_build_kq_scale(ctx0, cparams, hparams.f_max_alibi_bias, cb);
 
         // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
         struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, n_tokens, 1);
         cb(KQ_mask, "KQ_mask", -1);
 
+        // KV_idxs - the cells where the new K and V are stored
+        struct ggml_tensor * KV_idxs = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+        cb(KV_idxs, "KV_idxs", -1);
+
         for (int il = 0; il < n_layer; ++il) {
             struct ggml_tensor * attn_norm;
 
@@ -4475,11 +5682,11 @@ struct llm_build_context {
 
                 Qcur = ggml_reshape_3d(ctx0, Qcur, n_embd_head, n_head, n_tokens);
 
-                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, cb, il);
+                llm_build_kv_store(ctx0, hparams, kv_self, gf, Kcur, Vcur, n_ctx, n_tokens, kv_head, KV_idxs, cb, il);
 
-                cur = llm_build_kqv(ctx0, hparams, kv_self,
+                cur = llm_build_kqv(ctx0, hparams, cparams, kv_self,
                         model.layers[il].wo, NULL,
-                        Qcur, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, hparams.f_max_alibi_bias, cb, il);
+                        Qcur, kq_scale, KQ_scale, KQ_mask, n_ctx, n_tokens, n_kv, hparams.f_max_alibi_bias, cb, il);
                 cb(cur, "kqv_out", il);
             }
 
@@ -4512,14 +5719,16 @@ struct llm_build_context {
 
         cur = inpL;
 
+        // only the rows of the tokens whose logits are requested go through the final norm and lm_head
+        cur = build_out_rows(cur);
+
         cur = llm_build_norm(ctx0, cur, hparams,
                 model.output_norm,
                 NULL,
                 LLM_NORM, cb, -1);
         cb(cur, "result_norm", -1);
 
-        cur = ggml_mul_mat(ctx0, model.output, cur);
-        cb(cur, "result_output", -1);
+        cur = build_lm_head(cur);
 
         ggml_build_forward_expand(gf, cur);
 
@@ -4668,6 +5877,7 @@ static const std::unordered_map<const char *, llm_offload_func_e> k_offload_map
     { "kqv",                        OFFLOAD_FUNC_V   },
     { "kqv_merged",                 OFFLOAD_FUNC_V   },
     { "kqv_merged_cont",            OFFLOAD_FUNC_V   },
+    { "kqv_flash",                  OFFLOAD_FUNC_V   },
     { "kqv_wo",                     OFFLOAD_FUNC_V   },
     { "kqv_out",                    OFFLOAD_FUNC_V   },
 
@@ -4690,27 +5900,25 @@ static const std::unordered_map<const char *, llm_offload_func_e> k_offload_map
 
     { "l_out",                      OFFLOAD_FUNC     },
 
+    { "result_rows",                OFFLOAD_FUNC_EMB },
     { "result_norm",                OFFLOAD_FUNC_EMB },
     { "result_output",              OFFLOAD_FUNC_OUT },
 };
 
 static llm_offload_trie k_offload_func_trie(k_offload_map);
 
+// the graph objects are created in buf_meta, the input tensors are returned in inp
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
-     const llama_batch & batch) {
+     const llama_batch & batch,
+          llama_buffer & buf_meta,
+    llama_graph_inputs & inp) {
     const auto & model = lctx.model;
 
     // check if we should build the worst-case graph (for memory measurement)
     const bool worst_case = ggml_allocr_is_measure(lctx.alloc);
 
-    // keep track of the input that has already been allocated
-    bool alloc_inp_tokens   = false;
-    bool alloc_inp_embd     = false;
-    bool alloc_inp_pos      = false;
-    bool alloc_inp_KQ_scale = false;
-    bool alloc_inp_KQ_mask  = false;
-    bool alloc_inp_K_shift  = false;
+    inp = {};
 
 #ifdef GGML_USE_CUBLAS
     const bool do_offload = true;
@@ -4730,103 +5938,48 @@ static struct ggml_cgraph * llama_build_graph(
         }
 
         //
-        // allocate input tensors and set input data
+        // allocate input tensors, their data is set in llama_set_inputs
         //
         // TODO: will be removed with backend v2
 
-        if (!alloc_inp_tokens && strcmp(name, "inp_tokens") == 0) {
+        if (!inp.tokens && strcmp(name, "inp_tokens") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.token) {
-                const int64_t n_tokens = cur->ne[0];
-
-                memcpy(cur->data, batch.token, n_tokens*ggml_element_size(cur));
-            }
-
-            alloc_inp_tokens = true;
+            inp.tokens = cur;
         }
 
-        if (!alloc_inp_embd && strcmp(name, "inp_embd") == 0) {
+        if (!inp.embd && strcmp(name, "inp_embd") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.embd) {
-                const int64_t n_embd   = cur->ne[0];
-                const int64_t n_tokens = cur->ne[1];
-
-                memcpy(cur->data, batch.embd, n_tokens*n_embd*ggml_element_size(cur));
-            }
-
-            alloc_inp_embd = true;
+            inp.embd = cur;
         }
 
-        if (!alloc_inp_pos && strcmp(name, "inp_pos") == 0) {
+        if (!inp.pos && strcmp(name, "inp_pos") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc) && batch.pos) {
-                const int64_t n_tokens = cur->ne[0];
-
-                int32_t * data = (int32_t *) cur->data;
-
-                for (int i = 0; i < n_tokens; ++i) {
-                    data[i] = batch.pos[i];
-                }
-            }
-
-            alloc_inp_pos = true;
+            inp.pos = cur;
         }
 
-        if (!alloc_inp_KQ_scale && strcmp(name, "KQ_scale") == 0) {
+        if (!inp.KQ_scale && strcmp(name, "KQ_scale") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_embd_head = model.hparams.n_embd_head();
-                ggml_set_f32(cur, 1.0f/sqrtf(float(n_embd_head)));
-            }
-
-            alloc_inp_KQ_scale = true;
+            inp.KQ_scale = cur;
         }
 
-        if (!alloc_inp_KQ_mask && strcmp(name, "KQ_mask") == 0) {
+        if (!inp.KQ_mask && strcmp(name, "KQ_mask") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
-
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_kv     = cur->ne[0];
-                const int64_t n_tokens = cur->ne[1];
-
-                float * data = (float *) cur->data;
-                memset(data, 0, ggml_nbytes(cur));
-
-                for (int h = 0; h < 1; ++h) {
-                    for (int j = 0; j < n_tokens; ++j) {
-                        const llama_pos    pos    = batch.pos[j];
-                        const llama_seq_id seq_id = batch.seq_id[j][0];
-
-                        for (int i = 0; i < n_kv; ++i) {
-                            if (!lctx.kv_self.cells[i].has_seq_id(seq_id) || lctx.kv_self.cells[i].pos > pos) {
-                                data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
-            }
-
-            alloc_inp_KQ_mask = true;
+            inp.KQ_mask = cur;
         }
 
-        if (!alloc_inp_K_shift && strcmp(name, "K_shift") == 0) {
+        if (!inp.K_shift && strcmp(name, "K_shift") == 0) {
             ggml_allocr_alloc(lctx.alloc, cur);
+            inp.K_shift = cur;
+        }
 
-            if (!ggml_allocr_is_measure(lctx.alloc)) {
-                const int64_t n_ctx = cur->ne[0];
-
-                int32_t * data = (int32_t *) cur->data;
-
-                for (int i = 0; i < n_ctx; ++i) {
-                    data[i] = lctx.kv_self.cells[i].delta;
-                }
-            }
+        if (!inp.KV_idxs && strcmp(name, "KV_idxs") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.KV_idxs = cur;
+        }
 
-            alloc_inp_K_shift = true;
+        if (!inp.out_ids && strcmp(name, "inp_out_ids") == 0) {
+            ggml_allocr_alloc(lctx.alloc, cur);
+            inp.out_ids = cur;
         }
 
         // view tensors are not processed further
@@ -4957,7 +6110,7 @@ static struct ggml_cgraph * llama_build_graph(
 
     struct ggml_cgraph * result = NULL;
 
-    struct llm_build_context llm(lctx, batch, cb, worst_case);
+    struct llm_build_context llm(lctx, batch, buf_meta, cb, worst_case);
 
     llm.init();
 
@@ -5024,6 +6177,148 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
+static void llama_set_inputs(llama_context & lctx, const llama_graph_inputs & inp, const llama_batch & batch) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & kv_self = lctx.kv_self;
+
+    if (inp.tokens && batch.token) {
+        const int64_t n_tokens = inp.tokens->ne[0];
+
+        memcpy(inp.tokens->data, batch.token, n_tokens*ggml_element_size(inp.tokens));
+    }
+
+    if (inp.embd && batch.embd) {
+        const int64_t n_embd   = inp.embd->ne[0];
+        const int64_t n_tokens = inp.embd->ne[1];
+
+        memcpy(inp.embd->data, batch.embd, n_tokens*n_embd*ggml_element_size(inp.embd));
+    }
+
+    if (inp.pos && batch.pos) {
+        const int64_t n_tokens = inp.pos->ne[0];
+
+        int32_t * data = (int32_t *) inp.pos->data;
+
+        for (int i = 0; i < n_tokens; ++i) {
+            data[i] = batch.pos[i];
+        }
+    }
+
+    if (inp.KQ_scale) {
+        ggml_set_f32(inp.KQ_scale, llama_kq_scale(hparams));
+    }
+
+    if (inp.KQ_mask) {
+        const int64_t n_kv     = inp.KQ_mask->ne[0];
+        const int64_t n_tokens = inp.KQ_mask->ne[1];
+
+        float * data = (float *) inp.KQ_mask->data;
+        std::fill(data, data + n_kv*n_tokens, -INFINITY);
+
+        // only visit the cells in the block table of the sequence of each token
+        for (int j = 0; j < n_tokens; ++j) {
+            const llama_pos    pos    = batch.pos[j];
+            const llama_seq_id seq_id = batch.seq_id[j][0];
+
+            for (const uint32_t b : kv_self.seqs[seq_id].blocks) {
+                const int64_t i0 = b*LLAMA_KV_BLOCK_SIZE;
+                const int64_t i1 = std::min<int64_t>(n_kv, i0 + llama_kv_block_size(kv_self, b));
+
+                for (int64_t i = i0; i < i1; ++i) {
+                    if (kv_self.cells[i].seq_id[seq_id] && kv_self.cells[i].pos <= pos) {
+                        data[j*n_kv + i] = 0.0f;
+                    }
+                }
+            }
+        }
+    }
+
+    if (inp.K_shift) {
+        const int64_t n_ctx = inp.K_shift->ne[0];
+
+        int32_t * data = (int32_t *) inp.K_shift->data;
+
+        for (int i = 0; i < n_ctx; ++i) {
+            data[i] = kv_self.cells[i].delta;
+        }
+    }
+
+    if (inp.KV_idxs) {
+        memcpy(inp.KV_idxs->data, kv_self.batch_cells.data(), ggml_nbytes(inp.KV_idxs));
+    }
+
+    if (inp.out_ids) {
+        memcpy(inp.out_ids->data, lctx.out_ids.data(), ggml_nbytes(inp.out_ids));
+    }
+}
+
+// find a graph built for a batch with the same shape
+static llama_graph_cache_entry * llama_graph_cache_find(llama_context & lctx, const llama_batch & batch) {
+    const auto & kv_self = lctx.kv_self;
+
+    if (kv_self.has_shift) {
+        return nullptr;
+    }
+
+    for (auto & entry : lctx.graphs) {
+        if (!entry.gf || entry.n_tokens != batch.n_tokens || entry.n_outputs != (int32_t) lctx.out_ids.size() ||
+            entry.n_kv != (int32_t) kv_self.n || entry.embd != (batch.embd != nullptr)) {
+            continue;
+        }
+
+        entry.last_used = ++lctx.n_graph_uses;
+
+        return &entry;
+    }
+
+    return nullptr;
+}
+
+// the least recently used entry, where the graph for this batch will be built
+// the graphs that shift the KV cache are used only once and are not kept,
+// the graphs of a KV cache that is not paged depend on the head and are not kept either
+static llama_graph_cache_entry * llama_graph_cache_evict(llama_context & lctx) {
+    if (lctx.kv_self.has_shift || !lctx.kv_self.paged || lctx.graphs.empty()) {
+        return nullptr;
+    }
+
+    llama_graph_cache_entry * res = &lctx.graphs[0];
+    for (auto & entry : lctx.graphs) {
+        if (entry.last_used < res->last_used) {
+            res = &entry;
+        }
+    }
+
+    res->gf = NULL;
+
+    if (!res->buf_meta.data) {
+        res->buf_meta.resize(lctx.buf_compute.size);
+        memset(res->buf_meta.data, 0, res->buf_meta.size); // do not count the page faults as build time
+    }
+
+    return res;
+}
+
+static void llama_graph_cache_add(
+              llama_context & lctx,
+    llama_graph_cache_entry & entry,
+                ggml_cgraph * gf,
+   const llama_graph_inputs & inp,
+          const llama_batch & batch) {
+    const auto & kv_self = lctx.kv_self;
+
+    entry.gf        = gf;
+    entry.inp       = inp;
+    entry.n_tokens  = batch.n_tokens;
+    entry.n_outputs = lctx.out_ids.size();
+    entry.n_kv      = kv_self.n;
+    entry.embd      = batch.embd != nullptr;
+
+    entry.plan.n_threads = 0;
+
+    entry.last_used = ++lctx.n_graph_uses;
+}
+
 // decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
@@ -5103,29 +6398,133 @@ static int llama_decode_internal(
         batch.seq_id = seq_id_arr.data();
     }
 
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            if (batch.seq_id[i][j] < 0 || batch.seq_id[i][j] >= LLAMA_MAX_SEQ) {
+                LLAMA_LOG_ERROR("%s: invalid seq_id[%d][%d] = %d, must be in [0, %d)\n", __func__, i, j, batch.seq_id[i][j], LLAMA_MAX_SEQ);
+                return -1;
+            }
+        }
+    }
+
+    // the mean and the first token need all the tokens of the sequence: they start at position 0
+    // or continue the tokens of the sequence in the previous batches
+    if (cparams.pooling_type == LLAMA_POOLING_MEAN || cparams.pooling_type == LLAMA_POOLING_CLS) {
+        std::map<llama_seq_id, llama_pos> pos_next;
+
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+                const llama_seq_id seq_id = batch.seq_id[i][j];
+
+                auto it = pos_next.find(seq_id);
+                if (it == pos_next.end()) {
+                    const auto ip = lctx.embd_seq.find(seq_id);
+                    it = pos_next.emplace(seq_id, ip != lctx.embd_seq.end() ? ip->second.pos_next : 0).first;
+                }
+
+                if (batch.pos[i] != 0 && batch.pos[i] != it->second) {
+                    LLAMA_LOG_ERROR("%s: pooled embeddings: the token %d of seq_id %d has pos %d, expected 0 or %d\n", __func__, i, seq_id, batch.pos[i], it->second);
+                    return -1;
+                }
+
+                it->second = batch.pos[i] + 1;
+            }
+        }
+    }
+
     if (!llama_kv_cache_find_slot(kv_self, batch)) {
         return 1;
     }
 
+    if (kv_self.prefix_cache) {
+        llama_kv_prefix_insert(kv_self, batch);
+    }
+
+    const bool pooled = cparams.pooling_type != LLAMA_POOLING_NONE;
+
+    // the tokens whose logits are computed: the last one is always kept for the embeddings
+    // and for a batch that does not request any logits, so that the graph has an output
+    // (the pooled embeddings are computed for all the tokens, a batch of them may have no logits)
+    {
+        auto & out_ids    = lctx.out_ids;
+        auto & output_ids = lctx.output_ids;
+
+        out_ids.clear();
+        output_ids.assign(n_tokens, -1);
+
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            const bool output = batch.logits ? batch.logits[i] != 0 : lctx.logits_all || i == n_tokens - 1;
+
+            if (output || (!pooled && i == n_tokens - 1 && (out_ids.empty() || !lctx.embedding.empty()))) {
+                output_ids[i] = out_ids.size();
+                out_ids.push_back(i);
+            }
+        }
+
+        // without logits array, the rows are indexed directly as before (row 0 is the last token)
+        if (!batch.logits) {
+            for (uint32_t i = 0; i < n_tokens; i++) {
+                output_ids[i] = i < out_ids.size() ? (int32_t) i : -1;
+            }
+        }
+    }
+
     // a heuristic, to avoid attending the full cache if it is not yet utilized
     // after enough generations, the benefit from this heuristic disappears
     // if we start defragmenting the cache, the benefit from this will be more important
-    //kv_self.n = std::max(32, GGML_PAD(llama_kv_cache_cell_max(kv_self), 32));   // TODO: this might be better for CUDA?
-    kv_self.n = std::min((int32_t) cparams.n_ctx, std::max(32, llama_kv_cache_cell_max(kv_self)));
+    // the padding also lets the following batches reuse the graph until n_kv grows past the next multiple of 32
+    // the cells after the last used one are masked
+    kv_self.n = std::min((int32_t) cparams.n_ctx, std::max(32, GGML_PAD(llama_kv_cache_cell_max(kv_self), 32)));
 
     //printf("kv_self.n = %d\n", kv_self.n);
 
-    ggml_allocr_reset(lctx.alloc);
+    ggml_cgraph * gf = NULL;
+
+    llama_graph_inputs inp;
+
+    llama_graph_cache_entry * entry = llama_graph_cache_find(lctx, batch);
+
+    if (entry) {
+        gf  = entry->gf;
+        inp = entry->inp;
+
+        lctx.n_graph_reuse++;
+    } else {
+        entry = llama_graph_cache_evict(lctx);
+
+        const int64_t t_build_start_us = ggml_time_us();
+
+        ggml_allocr_reset(lctx.alloc);
+
+        gf = llama_build_graph(lctx, batch, entry ? entry->buf_meta : lctx.buf_compute, inp);
+
+        ggml_allocr_alloc_graph(lctx.alloc, gf);
+
+        if (entry) {
+            llama_graph_cache_add(lctx, *entry, gf, inp, batch);
+        }
+
+        lctx.t_graph_build_us += ggml_time_us() - t_build_start_us;
+        lctx.n_graph_build++;
+    }
 
-    ggml_cgraph * gf = llama_build_graph(lctx, batch);
+    llama_set_inputs(lctx, inp, batch);
 
-    ggml_allocr_alloc_graph(lctx.alloc, gf);
+    // the graph ends with the final norm and the output projection
+    // (the projection is missing for a batch of pooled embeddings without logits)
+    struct ggml_tensor * res        = nullptr;
+    struct ggml_tensor * embeddings = nullptr;
 
-    struct ggml_tensor * res        = gf->nodes[gf->n_nodes - 1];
-    struct ggml_tensor * embeddings = gf->nodes[gf->n_nodes - 2];
+    for (int i = gf->n_nodes - 1; i >= std::max(0, gf->n_nodes - 2) && !embeddings; --i) {
+        if (strcmp(gf->nodes[i]->name, "result_output") == 0) {
+            res = gf->nodes[i];
+        } else if (strcmp(gf->nodes[i]->name, "result_norm") == 0) {
+            embeddings = gf->nodes[i];
+        }
+    }
 
-    GGML_ASSERT(strcmp(res->name,        "result_output") == 0);
-    GGML_ASSERT(strcmp(embeddings->name, "result_norm")   == 0);
+    GGML_ASSERT(embeddings != nullptr);
+    GGML_ASSERT(res != nullptr || (pooled && lctx.out_ids.empty()));
 
 
 #ifdef GGML_USE_CUBLAS
@@ -5148,7 +6547,9 @@ static int llama_decode_internal(
     if (!lctx.embedding.empty()) {
         embeddings->backend = GGML_BACKEND_CPU;
     }
-    res->backend = GGML_BACKEND_CPU;
+    if (res) {
+        res->backend = GGML_BACKEND_CPU;
+    }
 #endif
 
     // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
@@ -5181,15 +6582,23 @@ static int llama_decode_internal(
     ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf, n_layer);
 #endif
 
+    // (re)create the thread pool if it cannot serve the requested number of threads
+    if (cparams.threadpool && n_threads > 1 && (!lctx.threadpool || ggml_threadpool_n_threads(lctx.threadpool) < n_threads)) {
+        ggml_threadpool_free(lctx.threadpool);
+        lctx.threadpool = ggml_threadpool_new(std::max<int>(n_threads, std::max(cparams.n_threads, cparams.n_threads_batch)));
+    }
+
 #ifdef GGML_USE_METAL
     if (lctx.ctx_metal) {
         ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         ggml_metal_graph_compute(lctx.ctx_metal, gf);
     } else {
-        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.threadpool, cparams.wait_policy, cparams.wait_n_spin, /*fuse_ops*/ true,
+                lctx.trace_enabled ? lctx.trace : nullptr, entry ? &entry->plan : nullptr);
     }
 #else
-    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads, lctx.threadpool, cparams.wait_policy, cparams.wait_n_spin, /*fuse_ops*/ true,
+                lctx.trace_enabled ? lctx.trace : nullptr, entry ? &entry->plan : nullptr);
 #endif
 
 #if GGML_USE_MPI
@@ -5227,32 +6636,88 @@ static int llama_decode_internal(
     // extract logits
     // TODO: do not compute and extract logits if only embeddings are needed
     //       need to update the graphs to skip "result_output"
+    // the graph only computes the rows of the outputs, they are stored in the same order
+    // (with pooled embeddings, the graph computes the rows of all the tokens)
     {
         auto & logits_out = lctx.logits;
 
-        if (batch.logits) {
-            logits_out.resize(n_vocab * n_tokens);
-            for (uint32_t i = 0; i < n_tokens; i++) {
-                if (batch.logits[i] == 0) {
-                    continue;
-                }
-                memcpy(logits_out.data() + (n_vocab*i), (float *) ggml_get_data(res) + (n_vocab*i), sizeof(float)*n_vocab);
-            }
-        } else if (lctx.logits_all) {
-            logits_out.resize(n_vocab * n_tokens);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res), sizeof(float)*n_vocab*n_tokens);
+        const size_t n_outputs = lctx.out_ids.size();
+
+        logits_out.resize(n_vocab * n_outputs);
+
+        if (n_outputs > 0 && res->ne[1] == (int64_t) n_outputs) {
+            memcpy(logits_out.data(), (float *) ggml_get_data(res), sizeof(float)*n_vocab*n_outputs);
         } else {
-            logits_out.resize(n_vocab);
-            memcpy(logits_out.data(), (float *) ggml_get_data(res) + (n_vocab*(n_tokens - 1)), sizeof(float)*n_vocab);
+            for (size_t i = 0; i < n_outputs; i++) {
+                memcpy(logits_out.data() + n_vocab*i, (float *) ggml_get_data(res) + n_vocab*lctx.out_ids[i], sizeof(float)*n_vocab);
+            }
         }
     }
 
     // extract embeddings
+    // the last token is always the last output, or the last row of all the tokens with pooled embeddings
     if (!lctx.embedding.empty()) {
         auto & embedding_out = lctx.embedding;
 
+        const int64_t i_last = pooled ? n_tokens - 1 : lctx.out_ids.size() - 1;
+
         embedding_out.resize(n_embd);
-        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*(n_tokens - 1)), sizeof(float)*n_embd);
+        memcpy(embedding_out.data(), (float *) ggml_get_data(embeddings) + (n_embd*i_last), sizeof(float)*n_embd);
+    }
+
+    // pool the embeddings of the tokens of each sequence, a token at position 0 starts the sequence again
+    if (pooled) {
+        llama_seq_mask seqs_mean;
+
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            const float * embd = (float *) ggml_get_data(embeddings) + n_embd*i;
+
+            for (int32_t s = 0; s < batch.n_seq_id[i]; s++) {
+                const llama_seq_id seq_id = batch.seq_id[i][s];
+
+                auto & pool = lctx.embd_seq[seq_id];
+
+                if (batch.pos[i] == 0 || pool.out.empty()) {
+                    pool.sum.assign(cparams.pooling_type == LLAMA_POOLING_MEAN ? n_embd : 0, 0.0f);
+                    pool.out.assign(n_embd, 0.0f);
+                    pool.n_tokens = 0;
+                }
+
+                switch (cparams.pooling_type) {
+                    case LLAMA_POOLING_MEAN:
+                        for (int64_t j = 0; j < n_embd; j++) {
+                            pool.sum[j] += embd[j];
+                        }
+                        seqs_mean.set(seq_id);
+                        break;
+                    case LLAMA_POOLING_CLS:
+                        if (pool.n_tokens == 0) {
+                            std::copy(embd, embd + n_embd, pool.out.begin());
+                        }
+                        break;
+                    case LLAMA_POOLING_LAST:
+                        std::copy(embd, embd + n_embd, pool.out.begin());
+                        break;
+                    case LLAMA_POOLING_NONE:
+                        break;
+                }
+
+                pool.n_tokens++;
+                pool.pos_next = batch.pos[i] + 1;
+            }
+        }
+
+        for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+            if (!seqs_mean[seq_id]) {
+                continue;
+            }
+
+            auto & pool = lctx.embd_seq[seq_id];
+
+            for (int64_t j = 0; j < n_embd; j++) {
+                pool.out[j] = pool.sum[j]/pool.n_tokens;
+            }
+        }
     }
 
     // measure the performance only for the single-token evals
@@ -7838,6 +9303,11 @@ static int llama_apply_lora_from_file_internal(
 
             ggml_tensor * dest_t = model_tensors[base_name];
 
+            if (ggml_internal_get_type_traits(dest_t->type).nrows > 1) {
+                LLAMA_LOG_ERROR("%s: tensor '%s' has been repacked at load time, load the model without repacking to apply a LoRA\n", __func__, base_name.c_str());
+                return 1;
+            }
+
             offload_func_t offload_func               = ggml_offload_nop;
             offload_func_t offload_func_force_inplace = ggml_offload_nop;
 
@@ -7961,9 +9431,11 @@ struct llama_model_params llama_model_default_params() {
         /*.tensor_split                =*/ nullptr,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
+        /*.huge_pages                  =*/ LLAMA_HUGE_PAGES_NONE,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
+        /*.repack                      =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -7988,10 +9460,17 @@ struct llama_context_params llama_context_default_params() {
         /*.yarn_beta_fast              =*/ 32.0f,
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
+        /*.wait_policy                 =*/ GGML_WAIT_POLICY_DEFAULT,
+        /*.wait_n_spin                 =*/ 0,
+        /*.huge_pages                  =*/ LLAMA_HUGE_PAGES_NONE,
+        /*.pooling_type                =*/ LLAMA_POOLING_NONE,
         /*.mul_mat_q                   =*/ true,
         /*.f16_kv                      =*/ true,
         /*.logits_all                  =*/ false,
         /*.embedding                   =*/ false,
+        /*.flash_attn                  =*/ false,
+        /*.prefix_cache                =*/ false,
+        /*.threadpool                  =*/ true,
     };
 
     return result;
@@ -8103,11 +9582,23 @@ struct llama_context * llama_new_context_with_model(
     cparams.n_batch          = params.n_batch;
     cparams.n_threads        = params.n_threads;
     cparams.n_threads_batch  = params.n_threads_batch;
+    cparams.wait_policy      = (enum ggml_wait_policy) params.wait_policy;
+    cparams.wait_n_spin      = params.wait_n_spin;
     cparams.yarn_ext_factor  = params.yarn_ext_factor;
     cparams.yarn_attn_factor = params.yarn_attn_factor;
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.mul_mat_q        = params.mul_mat_q;
+    cparams.flash_attn       = params.flash_attn;
+    cparams.prefix_cache     = params.prefix_cache;
+    cparams.threadpool       = params.threadpool;
+    cparams.pooling_type     = params.embedding ? (enum llama_pooling_type) params.pooling_type : LLAMA_POOLING_NONE;
+
+    if (params.pooling_type < LLAMA_POOLING_NONE || params.pooling_type > LLAMA_POOLING_LAST) {
+        LLAMA_LOG_ERROR("%s: invalid pooling_type = %d\n", __func__, params.pooling_type);
+        delete ctx;
+        return nullptr;
+    }
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -8143,17 +9634,35 @@ struct llama_context * llama_new_context_with_model(
 
     ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
 
+    // the fused attention kernel is CPU only and reads the KV cache as F16
+    if (cparams.flash_attn && memory_type != GGML_TYPE_F16) {
+        LLAMA_LOG_WARN("%s: flash_attn requires an F16 KV cache - disabling\n", __func__);
+        cparams.flash_attn = false;
+    }
+
+#if defined(GGML_USE_CUBLAS) || defined(GGML_USE_METAL)
+    if (cparams.flash_attn && model->n_gpu_layers > 0) {
+        LLAMA_LOG_WARN("%s: flash_attn is not supported with GPU offloading - disabling\n", __func__);
+        cparams.flash_attn = false;
+    }
+#endif
+
     // reserve memory for context buffers
     if (!hparams.vocab_only) {
-        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, cparams.n_ctx, model->n_gpu_layers)) {
+        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, cparams.n_ctx, model->n_gpu_layers, params.huge_pages)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
         }
 
+        ctx->kv_self.prefix_cache = cparams.prefix_cache;
+
         {
             const size_t memory_size = ggml_nbytes(ctx->kv_self.k) + ggml_nbytes(ctx->kv_self.v);
             LLAMA_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+            if (params.huge_pages != LLAMA_HUGE_PAGES_NONE) {
+                LLAMA_LOG_INFO("%s: kv self huge page coverage = %5.1f%%\n", __func__, 100.0f*ctx->kv_self.buf.huge_pages_coverage());
+            }
         }
 
         // resized during inference
@@ -8179,7 +9688,8 @@ struct llama_context * llama_new_context_with_model(
             int n_tokens = (int)std::min(cparams.n_ctx, cparams.n_batch);
             int n_past = cparams.n_ctx - n_tokens;
             llama_token token = llama_token_bos(&ctx->model); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0));
+            llama_graph_inputs inp;
+            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, n_past, 0), ctx->buf_compute, inp);
 
 #ifdef GGML_USE_METAL
             if (model->n_gpu_layers > 0) {
@@ -8203,7 +9713,10 @@ struct llama_context * llama_new_context_with_model(
             // recreate allocator with exact memory requirements
             ggml_allocr_free(ctx->alloc);
 
-            ctx->buf_alloc.resize(alloc_size);
+            ctx->buf_alloc.resize(alloc_size, params.huge_pages);
+            if (params.huge_pages != LLAMA_HUGE_PAGES_NONE) {
+                LLAMA_LOG_INFO("%s: compute buffer huge page coverage = %5.1f%%\n", __func__, 100.0f*ctx->buf_alloc.huge_pages_coverage());
+            }
             ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
 #ifdef GGML_USE_METAL
             if (ctx->ctx_metal) {
@@ -8381,15 +9894,26 @@ int llama_model_apply_lora_from_file(const struct llama_model * model, const cha
 }
 
 int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
-    return ctx->kv_self.head;
+    return ctx->kv_self.used;
+}
+
+// the pooled embeddings of a sequence are no longer valid once its tokens are removed (all the sequences if seq_id < 0)
+static void llama_embd_seq_rm(struct llama_context * ctx, llama_seq_id seq_id) {
+    if (seq_id < 0) {
+        ctx->embd_seq.clear();
+    } else {
+        ctx->embd_seq.erase(seq_id);
+    }
 }
 
 void llama_kv_cache_clear(struct llama_context * ctx) {
     llama_kv_cache_clear(ctx->kv_self);
+    llama_embd_seq_rm(ctx, -1);
 }
 
 void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
     llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
+    llama_embd_seq_rm(ctx, seq_id);
 }
 
 void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
@@ -8401,12 +9925,26 @@ void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src,
 
 void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
     llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
+
+    for (auto it = ctx->embd_seq.begin(); it != ctx->embd_seq.end(); ) {
+        it = it->first != seq_id ? ctx->embd_seq.erase(it) : std::next(it);
+    }
 }
 
 void llama_kv_cache_seq_shift(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
     llama_kv_cache_seq_shift(ctx->kv_self, seq_id, p0, p1, delta);
 }
 
+int32_t llama_kv_cache_seq_prefix(struct llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, int32_t n_tokens) {
+    const int32_t n_prefix = llama_kv_cache_seq_prefix(ctx->kv_self, seq_id, tokens, n_tokens);
+
+    if (n_prefix >= 0) {
+        llama_embd_seq_rm(ctx, seq_id);
+    }
+
+    return n_prefix;
+}
+
 // Returns the *maximum* size of the state
 size_t llama_get_state_size(const struct llama_context * ctx) {
     // we don't know size of rng until we actually serialize it. so reserve more than enough memory for its serialized state.
@@ -8549,7 +10087,7 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         const auto   n_ctx   = cparams.n_ctx;
 
         const size_t   kv_buf_size = kv_self.buf.size;
-        const uint32_t kv_head     = kv_self.head;
+        const uint32_t kv_head     = llama_kv_cache_cell_max(kv_self); // the cells after it are empty
         const uint32_t kv_size     = kv_self.size;
 
         data_ctx->write(&kv_buf_size, sizeof(kv_buf_size));
@@ -8594,13 +10132,15 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
             const auto & cell = kv_self.cells[i];
 
             const llama_pos pos         = cell.pos;
-            const size_t    seq_id_size = cell.seq_id.size();
+            const size_t    seq_id_size = cell.seq_id.count();
 
             data_ctx->write(&pos,         sizeof(pos));
             data_ctx->write(&seq_id_size, sizeof(seq_id_size));
 
-            for (auto seq_id : cell.seq_id) {
-                data_ctx->write(&seq_id, sizeof(seq_id));
+            for (llama_seq_id seq_id = 0; seq_id < LLAMA_MAX_SEQ; ++seq_id) {
+                if (cell.seq_id[seq_id]) {
+                    data_ctx->write(&seq_id, sizeof(seq_id));
+                }
             }
         }
     }
@@ -8640,13 +10180,20 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         memcpy(&logits_cap,  inp, sizeof(logits_cap));  inp += sizeof(logits_cap);
         memcpy(&logits_size, inp, sizeof(logits_size)); inp += sizeof(logits_size);
 
-        GGML_ASSERT(ctx->logits.capacity() == logits_cap);
+        // the logits of the saved context may have grown past the initial capacity with batches of several outputs
+        if (ctx->logits.capacity() < logits_cap) {
+            ctx->logits.reserve(logits_cap);
+        }
 
         if (logits_size) {
             ctx->logits.resize(logits_size);
             memcpy(ctx->logits.data(), inp, logits_size * sizeof(float));
         }
 
+        // the restored rows are indexed directly
+        ctx->output_ids.resize(logits_size / ctx->model.hparams.n_vocab);
+        std::iota(ctx->output_ids.begin(), ctx->output_ids.end(), 0);
+
         inp += logits_cap * sizeof(float);
     }
 
@@ -8718,6 +10265,9 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
 
         ctx->kv_self.cells.resize(kv_size);
 
+        // the cells of a state saved with a larger LLAMA_MAX_SEQ may have sequences that do not fit
+        int32_t n_seq_invalid = 0;
+
         for (uint32_t i = 0; i < kv_size; ++i) {
             llama_pos pos;
             size_t    seq_id_size;
@@ -8726,14 +10276,25 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
             memcpy(&seq_id_size, inp, sizeof(seq_id_size)); inp += sizeof(seq_id_size);
 
             ctx->kv_self.cells[i].pos = pos;
+            ctx->kv_self.cells[i].seq_id.reset();
 
             llama_seq_id seq_id;
 
             for (size_t j = 0; j < seq_id_size; ++j) {
                 memcpy(&seq_id, inp, sizeof(seq_id)); inp += sizeof(seq_id);
-                ctx->kv_self.cells[i].seq_id.insert(seq_id);
+                if (seq_id < 0 || seq_id >= LLAMA_MAX_SEQ) {
+                    n_seq_invalid++;
+                    continue;
+                }
+                ctx->kv_self.cells[i].seq_id.set(seq_id);
             }
         }
+
+        if (n_seq_invalid > 0) {
+            LLAMA_LOG_ERROR("%s: ignored %d sequence ids of the KV cells outside of [0, %d)\n", __func__, n_seq_invalid, LLAMA_MAX_SEQ);
+        }
+
+        llama_kv_cache_rebuild(ctx->kv_self);
     }
 
     const size_t nread    = inp - src;
@@ -8932,13 +10493,21 @@ float * llama_get_logits(struct llama_context * ctx) {
 }
 
 float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
-    return ctx->logits.data() + i*ctx->model.hparams.n_vocab;
+    GGML_ASSERT(i >= 0 && i < (int32_t) ctx->output_ids.size() && ctx->output_ids[i] >= 0 && "the logits of this token were not requested");
+
+    return ctx->logits.data() + ctx->output_ids[i]*ctx->model.hparams.n_vocab;
 }
 
 float * llama_get_embeddings(struct llama_context * ctx) {
     return ctx->embedding.data();
 }
 
+float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id) {
+    const auto it = ctx->embd_seq.find(seq_id);
+
+    return it != ctx->embd_seq.end() ? it->second.out.data() : nullptr;
+}
+
 const char * llama_token_get_text(const struct llama_model * model, llama_token token) {
     return model->vocab.id_to_token[token].text.c_str();
 }
@@ -9082,6 +10651,10 @@ struct llama_timings llama_get_timings(struct llama_context * ctx) {
         /*.n_sample =*/ std::max(1, ctx->n_sample),
         /*.n_p_eval =*/ std::max(1, ctx->n_p_eval),
         /*.n_eval   =*/ std::max(1, ctx->n_eval),
+
+        /*.t_graph_build_ms =*/ 1e-3 * ctx->t_graph_build_us,
+        /*.n_graph_build    =*/ ctx->n_graph_build,
+        /*.n_graph_reuse    =*/ ctx->n_graph_reuse,
     };
 
     return result;
@@ -9098,6 +10671,12 @@ void llama_print_timings(struct llama_context * ctx) {
             __func__, timings.t_p_eval_ms, timings.n_p_eval, timings.t_p_eval_ms / timings.n_p_eval, 1e3 / timings.t_p_eval_ms * timings.n_p_eval);
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, timings.t_eval_ms, timings.n_eval, timings.t_eval_ms / timings.n_eval, 1e3 / timings.t_eval_ms * timings.n_eval);
+    if (timings.n_graph_build > 0) {
+        // the time saved is estimated with the average build time
+        const double t_per_build_ms = timings.t_graph_build_ms / timings.n_graph_build;
+        LLAMA_LOG_INFO("%s:  graph build time = %10.2f ms / %5d graphs (%8.2f ms per graph, %5d reused, %8.2f ms saved)\n",
+                __func__, timings.t_graph_build_ms, timings.n_graph_build, t_per_build_ms, timings.n_graph_reuse, t_per_build_ms * timings.n_graph_reuse);
+    }
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms\n", __func__, (timings.t_end_ms - timings.t_start_ms));
 }
 
@@ -9106,6 +10685,38 @@ void llama_reset_timings(struct llama_context * ctx) {
     ctx->t_sample_us = ctx->n_sample = 0;
     ctx->t_eval_us   = ctx->n_eval   = 0;
     ctx->t_p_eval_us = ctx->n_p_eval = 0;
+
+    ctx->t_graph_build_us = ctx->n_graph_build = ctx->n_graph_reuse = 0;
+
+    if (ctx->trace) {
+        ggml_trace_reset(ctx->trace);
+    }
+}
+
+void llama_set_trace(struct llama_context * ctx, int32_t n_events_max) {
+    ctx->trace_enabled = n_events_max > 0;
+
+    if (!ctx->trace_enabled) {
+        return;
+    }
+
+    ggml_trace_free(ctx->trace);
+    ctx->trace = ggml_trace_new(n_events_max);
+}
+
+bool llama_trace_export(struct llama_context * ctx, const char * fname) {
+    if (!ctx->trace) {
+        LLAMA_LOG_ERROR("%s: tracing was not enabled with llama_set_trace\n", __func__);
+        return false;
+    }
+
+    return ggml_trace_export(ctx->trace, fname);
+}
+
+void llama_trace_print(struct llama_context * ctx) {
+    if (ctx->trace) {
+        ggml_trace_print(ctx->trace);
+    }
 }
 
 const char * llama_print_system_info(void) {
@@ -9127,6 +10738,9 @@ const char * llama_print_system_info(void) {
     s += "SSE3 = "        + std::to_string(ggml_cpu_has_sse3())        + " | ";
     s += "SSSE3 = "       + std::to_string(ggml_cpu_has_ssse3())       + " | ";
     s += "VSX = "         + std::to_string(ggml_cpu_has_vsx())         + " | ";
+    if (ggml_cpu_variant()) {
+        s += "CPU_VARIANT = " + std::string(ggml_cpu_variant()) + " | ";
+    }
 
     return s.c_str();
 }
@@ -44,6 +44,9 @@
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
 #define LLAMA_SESSION_VERSION 2
 
+// the sequence ids of the tokens must be in [0, LLAMA_MAX_SEQ)
+#define LLAMA_MAX_SEQ 64
+
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
 #define LLAMA_SUPPORTS_GPU_OFFLOAD
@@ -114,6 +117,22 @@ extern "C" {
         LLAMA_ROPE_SCALING_MAX_VALUE   = LLAMA_ROPE_SCALING_YARN,
     };
 
+    // backing of the CPU buffers with huge pages, to reduce the TLB misses (Linux only)
+    enum llama_huge_pages {
+        LLAMA_HUGE_PAGES_NONE    = 0,
+        LLAMA_HUGE_PAGES_THP     = 1, // transparent huge pages - madvise(MADV_HUGEPAGE)
+        LLAMA_HUGE_PAGES_HUGETLB = 2, // pages reserved with vm.nr_hugepages - falls back to THP if there are not enough
+    };
+
+    // how the embeddings of the tokens of a sequence are combined, see llama_get_embeddings_seq
+    // the tokens of a sequence are the ones decoded since its token at position 0, possibly over several batches
+    enum llama_pooling_type {
+        LLAMA_POOLING_NONE = 0,
+        LLAMA_POOLING_MEAN = 1, // mean of the embeddings of the tokens of the sequence
+        LLAMA_POOLING_CLS  = 2, // embedding of the first token of the sequence
+        LLAMA_POOLING_LAST = 3, // embedding of the last token of the sequence
+    };
+
     typedef struct llama_token_data {
         llama_token id; // token id
         float logit;    // log-odds of the token
@@ -135,7 +154,7 @@ extern "C" {
     // - token  : the token ids of the input (used when embd is NULL)
     // - embd   : token embeddings (i.e. float vector of size n_embd) (used when token is NULL)
     // - pos    : the positions of the respective token in the sequence
-    // - seq_id : the sequence to which the respective token belongs
+    // - seq_id : the sequence to which the respective token belongs (0 <= seq_id < LLAMA_MAX_SEQ)
     // - logits : if zero, the logits for the respective token will not be output
     //
     typedef struct llama_batch {
@@ -168,10 +187,13 @@ extern "C" {
         // context pointer passed to the progress callback
         void * progress_callback_user_data;
 
+        int32_t huge_pages; // copy the weights into huge pages, from `enum llama_huge_pages` (disables mmap)
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
+        bool repack;     // interleave the rows of Q4_0/Q8_0 weights for faster CPU matrix multiplication (disables mmap)
     };
 
     struct llama_context_params {
@@ -191,11 +213,19 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
 
+        int32_t  wait_policy;      // how idle compute threads wait, from `enum ggml_wait_policy`
+        int32_t  wait_n_spin;      // number of polls before an idle compute thread yields or sleeps, 0 = default
+        int32_t  huge_pages;       // huge pages for the KV cache and the compute buffer, from `enum llama_huge_pages`
+        int32_t  pooling_type;     // pooled embeddings of each sequence in embedding mode, from `enum llama_pooling_type`
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool mul_mat_q;  // if true, use experimental mul_mat_q kernels (DEPRECATED - always true)
         bool f16_kv;     // use fp16 for KV cache, fp32 otherwise
         bool logits_all; // the llama_eval() call computes all logits, not just the last one
         bool embedding;  // embedding mode only
+        bool flash_attn; // use the fused attention kernel (CPU only, requires f16_kv)
+        bool prefix_cache; // keep the KV cells of the decoded prompts to share them with new sequences (see llama_kv_cache_seq_prefix)
+        bool threadpool;   // keep the compute threads alive between llama_decode calls instead of creating them for each graph
     };
 
     // model quantization parameters
@@ -254,6 +284,11 @@ extern "C" {
         int32_t n_sample;
         int32_t n_p_eval;
         int32_t n_eval;
+
+        // graphs built by llama_decode and graphs reused for a batch of the same shape
+        double  t_graph_build_ms;
+        int32_t n_graph_build;
+        int32_t n_graph_reuse;
     };
 
     // Helpers for getting default parameters
@@ -364,6 +399,7 @@ extern "C" {
 
     // Copy all tokens that belong to the specified sequence to another sequence
     // Note that this does not allocate extra KV cache memory - it simply assigns the tokens to the new sequence
+    // Does nothing (and logs an error) if seq_id_dst is not in [0, LLAMA_MAX_SEQ)
     // p0 < 0 : [0,  p1]
     // p1 < 0 : [p0, inf)
     LLAMA_API void llama_kv_cache_seq_cp(
@@ -373,7 +409,7 @@ extern "C" {
                        llama_pos   p0,
                        llama_pos   p1);
 
-    // Removes all tokens that do not belong to the specified sequence
+    // Removes all tokens that do not belong to the specified sequence (and empties the prefix cache)
     LLAMA_API void llama_kv_cache_seq_keep(
             struct llama_context * ctx,
                     llama_seq_id   seq_id);
@@ -389,6 +425,21 @@ extern "C" {
                        llama_pos   p1,
                        llama_pos   delta);
 
+    // Prefix cache (llama_context_params.prefix_cache)
+    // llama_decode adds the tokens of the sequences that start at position 0 to a radix tree that maps them to their
+    // cells, which are kept after the sequences are removed and evicted (least recently used first) when cells are needed
+    //
+    // Replaces the tokens of the specified sequence with the longest prefix of "tokens" (at positions [0, n_tokens))
+    // found in the cache, shared with the sequences that computed it, and returns its length
+    // The tokens from this position onward must be decoded as usual (leave at least one to get logits)
+    // Without the prefix cache, this only removes the tokens of the sequence and returns 0
+    // Returns -1 if seq_id is not in [0, LLAMA_MAX_SEQ)
+    LLAMA_API int32_t llama_kv_cache_seq_prefix(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                         int32_t   n_tokens);
+
     //
     // State / sessions
     //
@@ -489,19 +540,27 @@ extern "C" {
 
     // Token logits obtained from the last call to llama_eval()
     // The logits for the last token are stored in the last row
-    // Logits for which llama_batch.logits[i] == 0 are undefined
-    // Rows: n_tokens provided with llama_batch
+    // Only the logits of the tokens with llama_batch.logits[i] != 0 are computed and stored, in the order of the batch
+    // Rows: number of tokens with logits (n_tokens if all of them are requested)
     // Cols: n_vocab
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
-    // Logits for the ith token. Equivalent to:
-    // llama_get_logits(ctx) + i*n_vocab
+    // Logits for the ith token of the batch, its logits must have been requested
+    // Without llama_batch.logits, equivalent to: llama_get_logits(ctx) + i*n_vocab
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
     // Get the embeddings for the input
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
 
+    // Get the pooled embeddings of a sequence, with embedding and pooling_type != LLAMA_POOLING_NONE
+    // With mean and cls pooling, llama_decode fails if the tokens of a sequence do not start at position 0 or
+    // continue the ones of the previous batches
+    // The output projection is skipped when the batch does not request any logits
+    // Removing the tokens of a sequence from the KV cache (clear, seq_rm, seq_keep, seq_prefix) also drops its pooled embeddings
+    // shape: [n_embd] (1-dimensional), NULL if no tokens of the sequence were decoded since then
+    LLAMA_API float * llama_get_embeddings_seq(struct llama_context * ctx, llama_seq_id seq_id);
+
     //
     // Vocab
     //
@@ -741,7 +800,18 @@ extern "C" {
     LLAMA_API struct llama_timings llama_get_timings(struct llama_context * ctx);
 
     LLAMA_API void llama_print_timings(struct llama_context * ctx);
-    LLAMA_API void llama_reset_timings(struct llama_context * ctx);
+    LLAMA_API void llama_reset_timings(struct llama_context * ctx); // also clears the trace
+
+    // Tracing of the CPU graph computations
+    // record the nodes computed by each thread in the following llama_decode calls, at most n_events_max events
+    // n_events_max = 0 stops the recording, the events recorded so far are kept until the next llama_set_trace
+    LLAMA_API void llama_set_trace(struct llama_context * ctx, int32_t n_events_max);
+
+    // write the trace in the Chrome trace event format (chrome://tracing, Perfetto), returns false on error
+    LLAMA_API bool llama_trace_export(struct llama_context * ctx, const char * fname);
+
+    // print a summary of the trace per op
+    LLAMA_API void llama_trace_print(struct llama_context * ctx);
 
     // Print system information
     LLAMA_API const char * llama_print_system_info(void);
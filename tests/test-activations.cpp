@@ -0,0 +1,97 @@
+#include "ggml.h"
+#include "test-helpers.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// compare the exp based ops (silu, gelu, soft_max) with a double precision reference
+
+static bool test(const char * name, const std::vector<float> & x, int64_t ne0, double max_err_ok, double abs_min,
+        std::function<struct ggml_tensor * (struct ggml_context *, struct ggml_tensor *)> op,
+        std::function<void (const float *, double *, int64_t)> ref_row) {
+    struct ggml_context * ctx = test_ctx_init(16*1024*1024 + 4*x.size()*sizeof(float));
+
+    const int64_t ne1 = x.size()/ne0;
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1);
+    std::copy(x.begin(), x.end(), (float *) a->data);
+
+    struct ggml_tensor * out = op(ctx, a);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_graph_compute_with_ctx(ctx, gf, 2);
+
+    std::vector<float>  res((float *) out->data, (float *) out->data + x.size());
+    std::vector<double> ref(x.size());
+    for (int64_t i1 = 0; i1 < ne1; ++i1) {
+        ref_row(x.data() + i1*ne0, ref.data() + i1*ne0, ne0);
+    }
+
+    ggml_free(ctx);
+
+    printf("%s", name);
+
+    return test_report(max_error(res.data(), ref.data(), ref.size(), abs_min), max_err_ok);
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    srand(0);
+
+    // the SIMD kernels compute in fp32, the others use fp16 lookup tables
+    const bool simd = ggml_cpu_has_avx512() || (ggml_cpu_has_avx2() && ggml_cpu_has_fma());
+    const double max_err = simd ? 1e-5 : 1e-2;
+
+    // odd sizes to cover the leftover loops
+    std::vector<float> x(1003*7);
+    for (auto & v : x) {
+        v = frand(-20.0f, 20.0f);
+    }
+    // extreme values
+    x[0] = -100.0f; x[1] = 100.0f; x[2] = 0.0f; x[3] = -1e-6f; x[4] = 88.5f; x[5] = -88.5f;
+
+    bool ok = true;
+
+    ok &= test("silu", x, 1003, max_err, 1e-3, ggml_silu, [](const float * x, double * y, int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            y[i] = x[i]/(1.0 + exp(-(double) x[i]));
+        }
+    });
+
+    ok &= test("gelu", x, 1003, max_err, 1e-3, ggml_gelu, [](const float * x, double * y, int64_t n) {
+        for (int64_t i = 0; i < n; ++i) {
+            const double v = x[i];
+            y[i] = 0.5*v*(1.0 + tanh(0.7978845608028654*v*(1.0 + 0.044715*v*v)));
+        }
+    });
+
+    // attention scores with masked positions
+    std::vector<float> s(517*9);
+    for (size_t i = 0; i < s.size(); ++i) {
+        s[i] = i % 7 == 3 ? -INFINITY : frand(-30.0f, 10.0f);
+    }
+
+    ok &= test("soft_max", s, 517, max_err, 1e-6, ggml_soft_max, [](const float * x, double * y, int64_t n) {
+        double max = -INFINITY;
+        for (int64_t i = 0; i < n; ++i) {
+            max = std::max(max, (double) x[i]);
+        }
+        double sum = 0.0;
+        for (int64_t i = 0; i < n; ++i) {
+            y[i] = exp(x[i] - max);
+            sum += y[i];
+        }
+        for (int64_t i = 0; i < n; ++i) {
+            y[i] /= sum;
+        }
+    });
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+#include "ggml.h"
+#include "test-helpers.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// compare ggml_flash_attn_ext with the separate KQ, softmax and KQV ops as used in llm_build_kqv
+
+// n_seq > 1: the KV cells are assigned to the sequences in blocks of 16 cells,
+// token i belongs to sequence i % n_seq and only sees the cells of its sequence
+// n_prefix > 0: the first n_prefix cells are a prompt shared by all the sequences
+// n_chunk > 0: the masked cells are skipped in chunks of n_chunk cells (ggml_flash_attn_ext_set_chunk)
+static bool test(int n_embd_head, int n_head, int n_head_kv, int n_kv, int n_tokens, bool causal, int n_threads, int n_seq = 1, int n_prefix = 0, int n_chunk = 0) {
+    struct ggml_context * ctx = test_ctx_init();
+
+    const float scale = 1.0f/sqrtf(float(n_embd_head));
+
+    // q is permuted like in llm_build_kqv
+    struct ggml_tensor * q_cur = new_rand_tensor(ctx, GGML_TYPE_F32, n_embd_head, n_head, n_tokens);
+    struct ggml_tensor * q     = ggml_permute(ctx, q_cur, 0, 2, 1, 3);
+    struct ggml_tensor * k     = new_rand_tensor(ctx, GGML_TYPE_F16, n_embd_head, n_kv, n_head_kv);
+    struct ggml_tensor * v     = new_rand_tensor(ctx, GGML_TYPE_F16, n_kv, n_embd_head, n_head_kv);
+    struct ggml_tensor * mask  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_kv, n_tokens);
+
+    for (int i1 = 0; i1 < n_tokens; ++i1) {
+        for (int i0 = 0; i0 < n_kv; ++i0) {
+            const bool masked = (causal && i0 > n_kv - n_tokens + i1) || (i0 >= n_prefix && (i0/16) % n_seq != i1 % n_seq);
+            ((float *) mask->data)[i1*n_kv + i0] = masked ? -INFINITY : 0.0f;
+        }
+    }
+
+    // reference
+    struct ggml_tensor * kq = ggml_mul_mat(ctx, k, q);
+    kq = ggml_soft_max(ctx, ggml_add(ctx, ggml_scale(ctx, kq, ggml_new_f32(ctx, scale)), mask));
+    struct ggml_tensor * kqv = ggml_mul_mat(ctx, v, kq);
+    struct ggml_tensor * ref = ggml_cont_2d(ctx, ggml_permute(ctx, kqv, 0, 2, 1, 3), n_embd_head*n_head, n_tokens);
+
+    struct ggml_tensor * res = ggml_flash_attn_ext(ctx, q, k, v, mask, scale);
+    ggml_flash_attn_ext_set_chunk(res, n_chunk);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, ref);
+    ggml_build_forward_expand(gf, res);
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    const double max_err = max_error((const float *) res->data, (const float *) ref->data, ggml_nelements(ref));
+
+    ggml_free(ctx);
+
+    printf("%s: n_embd_head = %3d, n_head = %2d, n_head_kv = %2d, n_kv = %3d, n_tokens = %2d, causal = %d, n_threads = %d, n_seq = %d, n_prefix = %d, n_chunk = %2d",
+            __func__, n_embd_head, n_head, n_head_kv, n_kv, n_tokens, causal, n_threads, n_seq, n_prefix, n_chunk);
+
+    return test_report(max_err, 1e-3);
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    bool ok = true;
+
+    srand(0);
+
+    ok &= test( 64, 4, 4,  32,  1, false, 1);
+    ok &= test( 64, 4, 4,  32,  8, true,  2);
+    ok &= test(128, 8, 2, 200, 17, true,  3); // grouped-query attention, several KV blocks
+    ok &= test( 80, 6, 1, 129,  5, true,  4);
+    ok &= test( 32, 2, 2, 256, 32, false, 2);
+    ok &= test( 64, 4, 2, 512,  8, false, 3, 8); // one token per sequence, each sees 1/8 of the cells
+    ok &= test( 64, 4, 4, 300, 20, true,  2, 3);
+    ok &= test( 64, 4, 2, 600, 24, false, 2, 6, 200); // sequences forked from a common prompt
+    ok &= test( 64, 2, 2, 400, 40, false, 1, 4, 100); // more tokens than a tile of the kernel
+    ok &= test( 64, 4, 2, 600, 24, false, 2, 6, 200, 16); // chunks of the size of the blocks of cells
+    ok &= test( 64, 4, 2, 300, 20, true,  2, 3,   0, 48); // chunks that do not divide the blocks of the kernel
+
+    return ok ? 0 : 1;
+}
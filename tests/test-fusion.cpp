@@ -0,0 +1,217 @@
+#include "ggml.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// compare the results of the fused op chains (ggml_graph_fuse) with the results of the separate ops
+
+static float frand(void) {
+    return 2.0f*(float)rand()/(float)RAND_MAX - 1.0f;
+}
+
+static struct ggml_tensor * new_rand_tensor(struct ggml_context * ctx, ggml_type type, int64_t ne0, int64_t ne1, int64_t ne2 = 1) {
+    struct ggml_tensor * t = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ne0, ne1, ne2);
+
+    float * data = (float *) t->data;
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        data[i] = frand();
+    }
+
+    if (type == GGML_TYPE_F32) {
+        return t;
+    }
+
+    // quantize through ggml_cpy
+    struct ggml_tensor * q = ggml_new_tensor_3d(ctx, type, ne0, ne1, ne2);
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, ggml_cpy(ctx, t, q));
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+
+    return q;
+}
+
+static void compute(struct ggml_cgraph * gf, int n_threads, bool fuse, int n_chains_expected, const char * name) {
+    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+
+    if (fuse) {
+        const int n_chains = ggml_graph_fuse(gf, &plan);
+        if (n_chains != n_chains_expected) {
+            fprintf(stderr, "%s: expected %d fused chains, got %d\n", name, n_chains_expected, n_chains);
+            exit(1);
+        }
+    }
+
+    std::vector<uint8_t> work(plan.work_size);
+    plan.work_data = work.data();
+
+    ggml_graph_compute(gf, &plan);
+}
+
+// build the graph twice with the same inputs and compare the output with and without fusion
+template <typename F>
+static bool test(const char * name, int n_chains_expected, F build) {
+    bool ok = true;
+
+    for (int n_threads = 1; n_threads <= 4; ++n_threads) {
+        struct ggml_init_params params = {
+            /* .mem_size   = */ 64*1024*1024,
+            /* .mem_buffer = */ NULL,
+            /* .no_alloc   = */ false,
+        };
+
+        struct ggml_context * ctx = ggml_init(params);
+
+        srand(n_threads);
+
+        std::vector<struct ggml_tensor *> inputs;
+        struct ggml_tensor * out = build(ctx, inputs);
+
+        struct ggml_cgraph * gf = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf, out);
+
+        // the graph may overwrite its inputs, keep a copy of them
+        std::vector<std::vector<uint8_t>> saved;
+        for (auto * t : inputs) {
+            saved.emplace_back((uint8_t *) t->data, (uint8_t *) t->data + ggml_nbytes(t));
+        }
+
+        compute(gf, n_threads, false, 0, name);
+        std::vector<float> ref((float *) out->data, (float *) out->data + ggml_nelements(out));
+
+        // make sure that the result is computed again
+        for (int64_t i = 0; i < ggml_nelements(out); ++i) {
+            ((float *) out->data)[i] = NAN;
+        }
+
+        for (size_t i = 0; i < inputs.size(); ++i) {
+            memcpy(inputs[i]->data, saved[i].data(), saved[i].size());
+        }
+
+        compute(gf, n_threads, true, n_chains_expected, name);
+        const float * res = (const float *) out->data;
+
+        double max_err = 0.0;
+        for (size_t i = 0; i < ref.size(); ++i) {
+            const double err = fabs((double) res[i] - ref[i]);
+            max_err = std::isnan(err) ? INFINITY : std::max(max_err, err);
+        }
+
+        if (max_err > 1e-4) {
+            fprintf(stderr, "%s: n_threads = %d: max error %g\n", name, n_threads, max_err);
+            ok = false;
+        }
+
+        ggml_free(ctx);
+    }
+
+    printf("%s: %s\n", name, ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    bool ok = true;
+
+    ok &= test("rms_norm_mul", 1, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        ggml_tensor * x = new_rand_tensor(ctx, GGML_TYPE_F32, 96, 7);
+        ggml_tensor * w = new_rand_tensor(ctx, GGML_TYPE_F32, 96, 1);
+        inputs = { x, w };
+        return ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), w);
+    });
+
+    ok &= test("silu_mul", 1, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        ggml_tensor * g = new_rand_tensor(ctx, GGML_TYPE_F32, 200, 5);
+        ggml_tensor * u = new_rand_tensor(ctx, GGML_TYPE_F32, 200, 5);
+        inputs = { g, u };
+        return ggml_mul(ctx, u, ggml_silu(ctx, g));
+    });
+
+    // the result is written over one of the inputs
+    ok &= test("silu_mul_inplace", 1, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        ggml_tensor * g = new_rand_tensor(ctx, GGML_TYPE_F32, 130, 3);
+        ggml_tensor * u = new_rand_tensor(ctx, GGML_TYPE_F32, 130, 3);
+        inputs = { g, u };
+        return ggml_mul_inplace(ctx, u, ggml_silu(ctx, g));
+    });
+
+    ok &= test("scale_add_soft_max", 1, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        ggml_tensor * kq    = new_rand_tensor(ctx, GGML_TYPE_F32, 33, 6, 4);
+        ggml_tensor * mask  = new_rand_tensor(ctx, GGML_TYPE_F32, 33, 6);
+        ggml_tensor * scale = ggml_new_f32(ctx, 0.125f);
+        for (int i1 = 0; i1 < 6; ++i1) {
+            for (int i0 = 20 + i1; i0 < 33; ++i0) {
+                ((float *) mask->data)[i1*33 + i0] = -INFINITY;
+            }
+        }
+        inputs = { kq, mask };
+        return ggml_soft_max(ctx, ggml_add(ctx, ggml_scale(ctx, kq, scale), mask));
+    });
+
+    for (ggml_type type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0 }) {
+        ok &= test(type == GGML_TYPE_F32 ? "mul_mat_add_f32" : type == GGML_TYPE_F16 ? "mul_mat_add_f16" :
+                   type == GGML_TYPE_Q4_0 ? "mul_mat_add_q4_0" : "mul_mat_add_q8_0", 1,
+                [type](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+            ggml_tensor * w = new_rand_tensor(ctx, type,           128, 80);
+            ggml_tensor * x = new_rand_tensor(ctx, GGML_TYPE_F32,  128,  9);
+            ggml_tensor * r = new_rand_tensor(ctx, GGML_TYPE_F32,   80,  9);
+            inputs = { x, r };
+            return ggml_add(ctx, ggml_mul_mat(ctx, w, x), r);
+        });
+    }
+
+    ok &= test("mul_mat_add_inplace", 1, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        ggml_tensor * w = new_rand_tensor(ctx, GGML_TYPE_F32, 64, 64);
+        ggml_tensor * x = new_rand_tensor(ctx, GGML_TYPE_F32, 64,  1);
+        ggml_tensor * r = new_rand_tensor(ctx, GGML_TYPE_F32, 64,  1);
+        inputs = { x, r };
+        return ggml_add_inplace(ctx, r, ggml_mul_mat(ctx, w, x));
+    });
+
+    // the intermediate result is used by another node - nothing can be fused
+    ok &= test("no_fusion", 0, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        ggml_tensor * x = new_rand_tensor(ctx, GGML_TYPE_F32, 64, 4);
+        ggml_tensor * w = new_rand_tensor(ctx, GGML_TYPE_F32, 64, 1);
+        inputs = { x, w };
+        ggml_tensor * norm = ggml_rms_norm(ctx, x, 1e-5f);
+        return ggml_add(ctx, ggml_mul(ctx, norm, w), norm);
+    });
+
+    // a small transformer block with all the patterns
+    ok &= test("block", 5, [](ggml_context * ctx, std::vector<ggml_tensor *> & inputs) {
+        const int n_embd = 64, n_ff = 96, n_tokens = 5;
+
+        ggml_tensor * inp   = new_rand_tensor(ctx, GGML_TYPE_F32,  n_embd, n_tokens);
+        ggml_tensor * nw    = new_rand_tensor(ctx, GGML_TYPE_F32,  n_embd, 1);
+        ggml_tensor * wk    = new_rand_tensor(ctx, GGML_TYPE_Q8_0, n_embd, n_embd);
+        ggml_tensor * wq    = new_rand_tensor(ctx, GGML_TYPE_Q8_0, n_embd, n_embd);
+        ggml_tensor * wo    = new_rand_tensor(ctx, GGML_TYPE_Q8_0, n_embd, n_embd);
+        ggml_tensor * up    = new_rand_tensor(ctx, GGML_TYPE_Q4_0, n_embd, n_ff);
+        ggml_tensor * gate  = new_rand_tensor(ctx, GGML_TYPE_Q4_0, n_embd, n_ff);
+        ggml_tensor * down  = new_rand_tensor(ctx, GGML_TYPE_F16,  n_ff,   n_embd);
+        ggml_tensor * mask  = new_rand_tensor(ctx, GGML_TYPE_F32,  n_tokens, n_tokens);
+        ggml_tensor * scale = ggml_new_f32(ctx, 0.125f);
+        inputs = { inp };
+
+        ggml_tensor * cur = ggml_mul(ctx, ggml_rms_norm(ctx, inp, 1e-5f), nw);
+        ggml_tensor * k   = ggml_mul_mat(ctx, wk, cur);
+        ggml_tensor * q   = ggml_mul_mat(ctx, wq, cur);
+        ggml_tensor * kq  = ggml_soft_max(ctx, ggml_add(ctx, ggml_scale(ctx, ggml_mul_mat(ctx, k, q), scale), mask));
+        ggml_tensor * kqv = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, k)), kq);
+        ggml_tensor * ffn_inp = ggml_add(ctx, ggml_mul_mat(ctx, wo, kqv), inp);
+
+        ggml_tensor * tmp = ggml_mul_mat(ctx, up, ffn_inp);
+        cur = ggml_mul(ctx, tmp, ggml_silu(ctx, ggml_mul_mat(ctx, gate, ffn_inp)));
+        cur = ggml_mul_mat(ctx, down, cur);
+
+        return ggml_add(ctx, cur, ffn_inp);
+    });
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// helpers of the tests that compare a ggml op with a reference
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// uniform random value in [lo, hi]
+static inline float frand(float lo = -1.0f, float hi = 1.0f) {
+    return lo + (hi - lo)*(float)rand()/(float)RAND_MAX;
+}
+
+// context for the tensors, the graph and the work buffer of a test
+static inline struct ggml_context * test_ctx_init(size_t mem_size = 64*1024*1024) {
+    struct ggml_init_params params = {
+        /* .mem_size   = */ mem_size,
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    return ggml_init(params);
+}
+
+// tensor with random values in [-1, 1], converted to type through ggml_cpy
+static inline struct ggml_tensor * new_rand_tensor(struct ggml_context * ctx, ggml_type type, int64_t ne0, int64_t ne1, int64_t ne2 = 1) {
+    struct ggml_tensor * t = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ne0, ne1, ne2);
+
+    for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+        ((float *) t->data)[i] = frand();
+    }
+
+    if (type == GGML_TYPE_F32) {
+        return t;
+    }
+
+    struct ggml_tensor * res = ggml_new_tensor_3d(ctx, type, ne0, ne1, ne2);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, ggml_cpy(ctx, t, res));
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+
+    return res;
+}
+
+// max error of res, absolute if abs_min is 0, otherwise relative to max(|ref|, abs_min)
+// a nan gives an infinite error
+template <typename T>
+static inline double max_error(const float * res, const T * ref, size_t n, double abs_min = 0.0) {
+    double max_err = 0.0;
+
+    for (size_t i = 0; i < n; ++i) {
+        double err = fabs((double) res[i] - (double) ref[i]);
+        if (abs_min > 0.0) {
+            err /= std::max(fabs((double) ref[i]), abs_min);
+        }
+        max_err = std::isnan(err) ? INFINITY : std::max(max_err, err);
+    }
+
+    return max_err;
+}
+
+// ends the line of a test case with its max error, returns false if it is above max_err_ok
+static inline bool test_report(double max_err, double max_err_ok) {
+    const bool ok = max_err <= max_err_ok;
+
+    printf(": max error %g %s\n", max_err, ok ? "OK" : "FAILED");
+
+    return ok;
+}
@@ -0,0 +1,145 @@
+#include "llama.h"
+#include "common.h"
+#include "test-helpers.h"
+#include "test-model.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// edit sequences in the paged KV cache (seq_rm, seq_cp, seq_shift, state save/load) and compare the logits of their
+// next tokens with the logits of the same tokens decoded alone in a new context, where the cells are contiguous
+
+static struct llama_context * new_context(struct llama_model * model) {
+    struct llama_context_params cparams = llama_context_default_params();
+    cparams.seed            = 1;
+    cparams.n_ctx           = 1024;
+    cparams.n_batch         = 1024;
+    cparams.n_threads       = 2;
+    cparams.n_threads_batch = 2;
+
+    return llama_new_context_with_model(model, cparams);
+}
+
+// logits of the last token when the tokens are decoded alone at the positions [0, n)
+static std::vector<float> decode_ref(struct llama_model * model, const std::vector<llama_token> & tokens) {
+    struct llama_context * ctx = new_context(model);
+
+    std::vector<float> res = test_decode(ctx, { { 0, 0, tokens } })[0];
+
+    llama_free(ctx);
+
+    return res;
+}
+
+static bool check(const char * name, const std::vector<float> & res, const std::vector<float> & ref, double max_err_ok = 1e-4) {
+    printf("%s", name);
+
+    return test_report(max_error(res.data(), ref.data(), ref.size()), max_err_ok);
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    llama_backend_init(false);
+
+    struct llama_model * model = test_model_load("test-kv-cache.gguf");
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    struct llama_context * ctx = new_context(model);
+
+    srand(2);
+
+    bool ok = true;
+
+    // the sequences are longer than a block and their cells are mixed in the cache
+    const auto a = test_model_tokens(70);
+    const auto b = test_model_tokens(50);
+    {
+        const auto res = test_decode(ctx, { { 0, 0, a }, { 1, 0, b } });
+
+        ok &= check("decode     seq 0", res[0], decode_ref(model, a));
+        ok &= check("decode     seq 1", res[1], decode_ref(model, b));
+    }
+
+    // seq 0: A[0, 40) + C
+    const auto c = test_model_tokens(25);
+    const auto e = test_model_tokens(10);
+    {
+        llama_kv_cache_seq_rm(ctx, 0, 40, -1);
+
+        const auto res = test_decode(ctx, { { 0, 40, c } });
+
+        ok &= check("seq_rm     seq 0", res[0], decode_ref(model, test_concat(test_slice(a, 0, 40), c)));
+    }
+
+    // seq 2: copy of B + D, seq 1: B + E, seq 4: X
+    const auto d = test_model_tokens(10);
+    const auto x = test_model_tokens(60);
+    {
+        llama_kv_cache_seq_cp(ctx, 1, 2, -1, -1);
+
+        const auto res = test_decode(ctx, { { 2, 50, d }, { 1, 50, e }, { 4, 0, x } });
+
+        ok &= check("seq_cp     seq 2", res[0], decode_ref(model, test_concat(b, d)));
+        ok &= check("seq_cp     seq 1", res[1], decode_ref(model, test_concat(b, e)));
+    }
+
+    // seq 3: (A[0, 40) + C)[0, 20) + G, the first block is shared with seq 0
+    const auto g = test_model_tokens(30);
+    {
+        llama_kv_cache_seq_cp(ctx, 0, 3, 0, 20);
+
+        const auto res = test_decode(ctx, { { 3, 20, g } });
+
+        ok &= check("seq_cp     seq 3", res[0], decode_ref(model, test_concat(test_slice(a, 0, 20), g)));
+    }
+
+    // seq 4: X moved to the positions [20, 80) + F
+    // the attention only depends on the distance between the positions, so the logits are the ones of X + F
+    // (a shift moves the cells shared with other sequences as well, so seq 4 does not share any)
+    const auto f = test_model_tokens(5);
+    {
+        llama_kv_cache_seq_shift(ctx, 4, 0, -1, 20);
+
+        const auto res = test_decode(ctx, { { 4, 80, f } });
+
+        ok &= check("seq_shift  seq 4", res[0], decode_ref(model, test_concat(x, f)), 2e-3);
+    }
+
+    // state save/load: the loaded context continues the sequences in the same cells
+    {
+        std::vector<uint8_t> state(llama_get_state_size(ctx));
+        state.resize(llama_copy_state_data(ctx, state.data()));
+
+        struct llama_context * ctx_load = new_context(model);
+        llama_set_state_data(ctx_load, state.data());
+
+        const auto h = test_model_tokens(8);
+        const auto i = test_model_tokens(3);
+
+        const std::vector<test_seq_input> inputs = { { 0, 65, h }, { 3, 50, i } };
+
+        const auto res      = test_decode(ctx,      inputs);
+        const auto res_load = test_decode(ctx_load, inputs);
+
+        ok &= check("state load seq 0", res_load[0], res[0], 0.0);
+        ok &= check("state load seq 3", res_load[1], res[1], 0.0);
+        ok &= check("state      seq 0", res[0], decode_ref(model, test_concat(test_concat(test_slice(a, 0, 40), c), h)));
+        ok &= check("state      seq 3", res[1], decode_ref(model, test_concat(test_concat(test_slice(a, 0, 20), g), i)));
+
+        llama_free(ctx_load);
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,207 @@
+#pragma once
+
+// tiny llama model with random weights and a byte vocab, for the tests that run llama_decode
+
+#include "ggml.h"
+#include "llama.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct test_model_params {
+    int n_embd    = 64;
+    int n_layer   = 2;
+    int n_head    = 4;
+    int n_head_kv = 2;
+    int n_ff      = 128;
+
+    unsigned int seed = 1;
+};
+
+// <unk>, <s>, </s> and the 256 byte tokens
+static const int test_model_n_vocab = 3 + 256;
+
+static inline float test_model_rand(float scale) {
+    return scale*(2.0f*(float)rand()/(float)RAND_MAX - 1.0f);
+}
+
+static inline bool test_model_write(const char * fname, const test_model_params & hp) {
+    srand(hp.seed);
+
+    const int n_vocab   = test_model_n_vocab;
+    const int n_embd    = hp.n_embd;
+    const int n_embd_kv = hp.n_embd/hp.n_head*hp.n_head_kv;
+    const int n_ff      = hp.n_ff;
+
+    struct gguf_context * gguf = gguf_init_empty();
+
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_str(gguf, "general.name",         "test");
+    gguf_set_val_u32(gguf, "llama.context_length",       2048);
+    gguf_set_val_u32(gguf, "llama.embedding_length",     n_embd);
+    gguf_set_val_u32(gguf, "llama.block_count",          hp.n_layer);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length",  n_ff);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count", n_embd/hp.n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count",    hp.n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv", hp.n_head_kv);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    std::vector<std::string>  tokens = { "<unk>", "<s>", "</s>" };
+    std::vector<float>        scores(n_vocab, 0.0f);
+    std::vector<int32_t>      types = { 2, 3, 3 }; // unknown, control, control
+    std::vector<const char *> texts;
+
+    for (int i = 0; i < 256; ++i) {
+        char buf[8];
+        snprintf(buf, sizeof(buf), "<0x%02X>", i);
+        tokens.push_back(buf);
+        types.push_back(6); // byte
+    }
+    for (const auto & t : tokens) {
+        texts.push_back(t.c_str());
+    }
+
+    gguf_set_val_str (gguf, "tokenizer.ggml.model", "llama");
+    gguf_set_arr_str (gguf, "tokenizer.ggml.tokens",     texts.data(), n_vocab);
+    gguf_set_arr_data(gguf, "tokenizer.ggml.scores",     GGUF_TYPE_FLOAT32, scores.data(), n_vocab);
+    gguf_set_arr_data(gguf, "tokenizer.ggml.token_type", GGUF_TYPE_INT32,   types.data(),  n_vocab);
+
+    const size_t n_weights = 2*n_vocab*n_embd + hp.n_layer*(2*n_embd*n_embd + 2*n_embd*n_embd_kv + 3*n_embd*n_ff + 2*n_embd) + n_embd;
+
+    struct ggml_init_params params = {
+        /* .mem_size   = */ n_weights*sizeof(float) + 1024*ggml_tensor_overhead(),
+        /* .mem_buffer = */ NULL,
+        /* .no_alloc   = */ false,
+    };
+
+    struct ggml_context * ctx = ggml_init(params);
+
+    // matrices scaled by 1/sqrt(n_in) and norms close to 1, so that the activations stay in range
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1) {
+        struct ggml_tensor * t = ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            ((float *) t->data)[i] = ne1 > 0 ? test_model_rand(1.0f/sqrtf(float(ne0))) : 1.0f + test_model_rand(0.1f);
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight", n_embd, n_vocab);
+    for (int il = 0; il < hp.n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   n_embd, 0);
+        add(blk + "attn_q.weight",      n_embd, n_embd);
+        add(blk + "attn_k.weight",      n_embd, n_embd_kv);
+        add(blk + "attn_v.weight",      n_embd, n_embd_kv);
+        add(blk + "attn_output.weight", n_embd, n_embd);
+        add(blk + "ffn_norm.weight",    n_embd, 0);
+        add(blk + "ffn_gate.weight",    n_embd, n_ff);
+        add(blk + "ffn_down.weight",    n_ff,   n_embd);
+        add(blk + "ffn_up.weight",      n_embd, n_ff);
+    }
+    add("output_norm.weight", n_embd, 0);
+    add("output.weight",      n_embd, n_vocab);
+
+    gguf_write_to_file(gguf, fname, false);
+
+    gguf_free(gguf);
+    ggml_free(ctx);
+
+    return true;
+}
+
+// writes the model to fname and loads it, the file is removed once loaded
+static inline struct llama_model * test_model_load(const char * fname, const test_model_params & hp = test_model_params()) {
+    if (!test_model_write(fname, hp)) {
+        return NULL;
+    }
+
+    struct llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap = false;
+
+    struct llama_model * model = llama_load_model_from_file(fname, mparams);
+
+    remove(fname);
+
+    return model;
+}
+
+// random tokens, without the special ones
+static inline std::vector<llama_token> test_model_tokens(int n) {
+    std::vector<llama_token> res(n);
+
+    for (auto & t : res) {
+        t = 3 + rand() % (test_model_n_vocab - 3);
+    }
+
+    return res;
+}
+
+// tokens of a sequence, decoded at the positions [pos0, pos0 + n)
+struct test_seq_input {
+    llama_seq_id             seq_id;
+    llama_pos                pos0;
+    std::vector<llama_token> tokens;
+};
+
+static inline std::vector<llama_token> test_concat(std::vector<llama_token> a, const std::vector<llama_token> & b) {
+    a.insert(a.end(), b.begin(), b.end());
+    return a;
+}
+
+static inline std::vector<llama_token> test_slice(const std::vector<llama_token> & a, size_t i0, size_t i1) {
+    return std::vector<llama_token>(a.begin() + i0, a.begin() + i1);
+}
+
+// decodes the inputs in one batch with their tokens interleaved, returns the logits of the last token of each input
+static inline std::vector<std::vector<float>> test_decode(struct llama_context * ctx, const std::vector<test_seq_input> & inputs) {
+    const int n_vocab = llama_n_vocab(llama_get_model(ctx));
+
+    size_t n_tokens = 0;
+    size_t n_max    = 0;
+    for (const auto & inp : inputs) {
+        n_tokens += inp.tokens.size();
+        n_max     = std::max(n_max, inp.tokens.size());
+    }
+
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+    std::vector<int32_t> i_last(inputs.size());
+
+    for (size_t i = 0; i < n_max; ++i) {
+        for (size_t s = 0; s < inputs.size(); ++s) {
+            const auto & inp = inputs[s];
+
+            if (i < inp.tokens.size()) {
+                const bool last = i + 1 == inp.tokens.size();
+                if (last) {
+                    i_last[s] = batch.n_tokens;
+                }
+                llama_batch_add(batch, inp.tokens[i], inp.pos0 + i, { inp.seq_id }, last);
+            }
+        }
+    }
+
+    if (llama_decode(ctx, batch) != 0) {
+        fprintf(stderr, "%s: llama_decode failed\n", __func__);
+        exit(1);
+    }
+
+    llama_batch_free(batch);
+
+    std::vector<std::vector<float>> res;
+    for (int32_t i : i_last) {
+        const float * logits = llama_get_logits_ith(ctx, i);
+        res.emplace_back(logits, logits + n_vocab);
+    }
+
+    return res;
+}
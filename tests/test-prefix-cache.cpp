@@ -0,0 +1,126 @@
+#include "llama.h"
+#include "common.h"
+#include "test-helpers.h"
+#include "test-model.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// reuse the prompts kept in the prefix cache (llama_kv_cache_seq_prefix), split and cut its nodes and evict them,
+// and compare the logits of the tokens decoded after the reused prefix with the ones of a context without the cache
+
+static struct llama_context * new_context(struct llama_model * model, uint32_t n_ctx, bool prefix_cache) {
+    struct llama_context_params cparams = llama_context_default_params();
+    cparams.seed            = 1;
+    cparams.n_ctx           = n_ctx;
+    cparams.n_batch         = n_ctx;
+    cparams.n_threads       = 2;
+    cparams.n_threads_batch = 2;
+    cparams.prefix_cache    = prefix_cache;
+
+    return llama_new_context_with_model(model, cparams);
+}
+
+// logits of the last token when the tokens are decoded alone at the positions [0, n)
+static std::vector<float> decode_ref(struct llama_model * model, const std::vector<llama_token> & tokens) {
+    struct llama_context * ctx = new_context(model, 512, false);
+
+    std::vector<float> res = test_decode(ctx, { { 0, 0, tokens } })[0];
+
+    llama_free(ctx);
+
+    return res;
+}
+
+// replaces the tokens of seq_id with the cached prefix of tokens, decodes the rest and checks the logits of the last one
+static bool check_prefix(struct llama_model * model, struct llama_context * ctx, const char * name, llama_seq_id seq_id, const std::vector<llama_token> & tokens, int32_t n_prefix_exp) {
+    // the last token is always decoded, for its logits
+    const int32_t n_prefix = llama_kv_cache_seq_prefix(ctx, seq_id, tokens.data(), tokens.size() - 1);
+
+    const auto res = test_decode(ctx, { { seq_id, n_prefix, test_slice(tokens, n_prefix, tokens.size()) } });
+
+    printf("%s: n_prefix = %d (expected %d)", name, n_prefix, n_prefix_exp);
+
+    return test_report(max_error(res[0].data(), decode_ref(model, tokens).data(), res[0].size()), 1e-4) && n_prefix == n_prefix_exp;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    llama_backend_init(false);
+
+    struct llama_model * model = test_model_load("test-prefix-cache.gguf");
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    srand(3);
+
+    bool ok = true;
+
+    // the tokens of the branches start with different tokens, so that the matches end where expected
+    const auto p = test_model_tokens(40);
+    const auto a = test_concat({ 3 }, test_model_tokens(29));
+    const auto b = test_concat({ 4 }, test_model_tokens(19));
+    const auto c = test_concat({ 5 }, test_model_tokens(9));
+
+    {
+        struct llama_context * ctx = new_context(model, 512, true);
+
+        // P + A is kept after seq 0 is removed
+        ok &= check_prefix(model, ctx, "new        P + A", 0, test_concat(p, a), 0);
+        llama_kv_cache_seq_rm(ctx, 0, -1, -1);
+
+        // P is shared with seq 1, the node of P + A is split after P
+        ok &= check_prefix(model, ctx, "reuse      P + B", 1, test_concat(p, b), 40);
+
+        // both branches stay in the cache
+        ok &= check_prefix(model, ctx, "reuse      P + A", 2, test_concat(p, a), 69);
+        ok &= check_prefix(model, ctx, "reuse      P + B", 3, test_concat(p, b), 59);
+
+        // the shift of the tokens of seq 2 from position 50 cuts the A branch after its first 10 tokens
+        llama_kv_cache_seq_shift(ctx, 2, 50, -1, 5);
+        ok &= check_prefix(model, ctx, "cut        P + A", 4, test_concat(p, a), 50);
+
+        // a new branch from the middle of the cut node
+        ok &= check_prefix(model, ctx, "split      P + A[0, 5) + C", 5, test_concat(test_concat(p, test_slice(a, 0, 5)), c), 45);
+
+        llama_free(ctx);
+    }
+
+    // 256 cells: G and H are kept, G is used again, then a long prompt needs the cells of one of them
+    {
+        struct llama_context * ctx = new_context(model, 256, true);
+
+        const auto g = test_concat({ 3 }, test_model_tokens(59));
+        const auto h = test_concat({ 4 }, test_model_tokens(59));
+        const auto i = test_concat({ 5 }, test_model_tokens(179));
+
+        ok &= check_prefix(model, ctx, "new        G", 0, g, 0);
+        ok &= check_prefix(model, ctx, "new        H", 1, h, 0);
+        llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+
+        ok &= check_prefix(model, ctx, "reuse      G", 2, g, 59);
+        llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+
+        // the least recently used H is evicted
+        ok &= check_prefix(model, ctx, "evict      I", 3, i, 0);
+        llama_kv_cache_seq_rm(ctx, -1, -1, -1);
+
+        ok &= check_prefix(model, ctx, "kept       G", 4, g, 59);
+        llama_kv_cache_seq_rm(ctx, 4, -1, -1);
+        ok &= check_prefix(model, ctx, "evicted    H", 5, h, 0);
+
+        llama_free(ctx);
+    }
+
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return ok ? 0 : 1;
+}
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -18,6 +19,7 @@ constexpr float MAX_QUANTIZATION_TOTAL_ERROR = 0.002f;
 constexpr float MAX_QUANTIZATION_TOTAL_ERROR_2BITS = 0.0075f;
 constexpr float MAX_QUANTIZATION_TOTAL_ERROR_3BITS = 0.0040f;
 constexpr float MAX_DOT_PRODUCT_ERROR = 0.02f;
+constexpr float MAX_GEMM_ERROR = 0.0001f;
 
 static const char* RESULT_STR[] = {"ok", "FAILED"};
 
@@ -92,6 +94,44 @@ static float dot_product_error(
     return fabsf(result - dot_ref) / test_size;
 }
 
+// Maximum difference between the gemm tile and the separate dot products
+static float gemm_error(ggml_type_traits_t & qfns, size_t test_size) {
+    const int nt = GGML_GEMM_TILE;
+
+    auto vdot = ggml_internal_get_type_traits(qfns.vec_dot_type);
+
+    const size_t row_size_x = test_size*qfns.type_size/qfns.blck_size;
+    const size_t row_size_y = test_size*vdot.type_size/vdot.blck_size;
+
+    std::vector<float> tmp(test_size);
+    std::vector<uint8_t> tmp_qx(nt*row_size_x);
+    std::vector<uint8_t> tmp_qy(nt*row_size_y);
+
+    for (int i = 0; i < nt; i++) {
+        generate_data(2.0 + i, test_size, tmp.data());
+        qfns.from_float(tmp.data(), tmp_qx.data() + i*row_size_x, test_size);
+
+        generate_data(0.5 - i, test_size, tmp.data());
+        vdot.from_float(tmp.data(), tmp_qy.data() + i*row_size_y, test_size);
+    }
+
+    // the result is written with a stride larger than the tile
+    const int bs = nt + 3;
+    std::vector<float> result(nt*bs, INFINITY);
+    qfns.gemm(test_size, result.data(), bs, tmp_qx.data(), row_size_x, tmp_qy.data(), row_size_y);
+
+    float max_error = 0.0f;
+    for (int j = 0; j < nt; j++) {
+        for (int i = 0; i < nt; i++) {
+            float dot = INFINITY;
+            qfns.vec_dot(test_size, &dot, tmp_qx.data() + i*row_size_x, tmp_qy.data() + j*row_size_y);
+            max_error = std::max(max_error, fabsf(result[j*bs + i] - dot) / test_size);
+        }
+    }
+
+    return max_error;
+}
+
 int main(int argc, char * argv[]) {
     bool verbose = false;
     const size_t test_size = 32 * 128;
@@ -160,6 +200,15 @@ int main(int argc, char * argv[]) {
             if (failed || verbose) {
                 printf("%5s dot product error:              %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], vec_dot_error);
             }
+
+            if (qfns.gemm) {
+                const float gemm_tile_error = gemm_error(qfns, test_size);
+                failed = !(gemm_tile_error < MAX_GEMM_ERROR);
+                num_failed += failed;
+                if (failed || verbose) {
+                    printf("%5s gemm tile error:                %s (%f)\n", ggml_type_name(type), RESULT_STR[failed], gemm_tile_error);
+                }
+            }
         }
     }
 
@@ -0,0 +1,75 @@
+#include "ggml.h"
+#include "test-helpers.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// compare ggml_mul_mat with the weights in the original layout and after ggml_repack_tensor
+
+static bool test(ggml_type type, int64_t ne0, int64_t ne1, int64_t n_cols, int n_threads) {
+    struct ggml_context * ctx = test_ctx_init();
+
+    struct ggml_tensor * w = new_rand_tensor(ctx, type, ne0, ne1);
+    struct ggml_tensor * x = new_rand_tensor(ctx, GGML_TYPE_F32, ne0, n_cols);
+
+    struct ggml_tensor * out = ggml_mul_mat(ctx, w, x);
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+    std::vector<float> ref((float *) out->data, (float *) out->data + ggml_nelements(out));
+
+    const bool repacked = ggml_repack_tensor(w);
+
+    ggml_graph_compute_with_ctx(ctx, gf, n_threads);
+
+    const double max_err = max_error((const float *) out->data, ref.data(), ref.size());
+
+    ggml_free(ctx);
+
+    printf("%s: %s, ne0 = %3d, ne1 = %3d, n_cols = %2d, n_threads = %d",
+            __func__, ggml_type_name(type), (int) ne0, (int) ne1, (int) n_cols, n_threads);
+
+    if (!repacked) {
+        printf(" (not repacked)");
+    }
+
+    return test_report(max_err, 1e-4) && repacked;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    bool ok = true;
+
+    srand(0);
+
+    for (ggml_type type : { GGML_TYPE_Q4_0, GGML_TYPE_Q8_0 }) {
+        ok &= test(type, 256,  64,  1, 1);
+        ok &= test(type, 256,  64,  1, 3);
+        ok &= test(type, 128, 100,  5, 2); // src1 rows that do not fill a gemm tile
+        ok &= test(type, 512, 260, 16, 3);
+        ok &= test(type,  64, 512, 33, 4);
+    }
+
+    // only Q4_0 and Q8_0 matrices with a multiple of 4 rows can be repacked
+    {
+        struct ggml_context * ctx = test_ctx_init(1024*1024);
+
+        const bool repacked = ggml_repack_tensor(ggml_new_tensor_2d(ctx, GGML_TYPE_Q4_0, 64, 6)) ||
+                              ggml_repack_tensor(ggml_new_tensor_2d(ctx, GGML_TYPE_F16,  64, 8));
+        if (repacked) {
+            printf("%s: unsupported tensor was repacked\n", __func__);
+            ok = false;
+        }
+
+        ggml_free(ctx);
+    }
+
+    return ok ? 0 : 1;
+}
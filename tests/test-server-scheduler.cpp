@@ -0,0 +1,60 @@
+#include "scheduler.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// the steps of the server scheduler: the order in which the slots put their tokens in the batch and the accounting of
+// the token budget, with and without prefill_priority
+
+// the slots draft n_draft tokens when the budget allows it
+static bool test(const char * name, int32_t n_budget, bool prefill_priority, const std::vector<int> & slots_gen, const std::vector<sched_prefill> & slots_prefill,
+        int32_t n_draft, const std::vector<std::string> & steps_exp, int32_t n_left_exp) {
+    std::vector<std::string> steps;
+
+    sched_callbacks cb;
+    cb.add_sampled = [&](int id, int32_t n_draft_max) {
+        const int32_t n = std::min(n_draft, n_draft_max);
+        steps.push_back("gen " + std::to_string(id) + " + " + std::to_string(n));
+        return n;
+    };
+    cb.add_prompt = [&](int id, int32_t n) {
+        steps.push_back("prompt " + std::to_string(id) + " : " + std::to_string(n));
+    };
+
+    const int32_t n_left = sched_step(n_budget, prefill_priority, slots_gen, slots_prefill, cb);
+
+    const bool ok = steps == steps_exp && n_left == n_left_exp;
+
+    printf("%-40s: n_left = %3d (expected %3d), steps:", name, n_left, n_left_exp);
+    for (const auto & s : steps) {
+        printf(" [%s]", s.c_str());
+    }
+    printf(" %s\n", ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    bool ok = true;
+
+    // slot 3 arrived before slot 2
+    const std::vector<sched_prefill> prefill = { { 2, 5, 20 }, { 3, 3, 4 } };
+
+    ok &= test("generating first",                  16, false, { 0, 1 }, prefill, 0, { "gen 0 + 0", "gen 1 + 0", "prompt 3 : 4", "prompt 2 : 10" }, 0);
+    ok &= test("generating first, budget left",     40, false, { 0, 1 }, prefill, 0, { "gen 0 + 0", "gen 1 + 0", "prompt 3 : 4", "prompt 2 : 20" }, 14);
+    ok &= test("generating over the budget",         2, false, { 0, 1, 2 }, prefill, 0, { "gen 0 + 0", "gen 1 + 0", "gen 2 + 0" }, -1);
+    ok &= test("drafts",                             8, false, { 0, 1 }, prefill, 5, { "gen 0 + 5", "gen 1 + 1" }, 0);
+    ok &= test("drafts, then prompts",              20, false, { 0, 1 }, prefill, 5, { "gen 0 + 5", "gen 1 + 5", "prompt 3 : 4", "prompt 2 : 4" }, 0);
+
+    ok &= test("prefill priority",                  16, true,  { 0, 1 }, prefill, 0, { "prompt 3 : 4", "prompt 2 : 12" }, 0);
+    ok &= test("prefill priority, budget left",     30, true,  { 0, 1 }, prefill, 0, { "prompt 3 : 4", "prompt 2 : 20", "gen 0 + 0", "gen 1 + 0" }, 4);
+    ok &= test("prefill priority, some generating", 26, true,  { 0, 1, 4 }, prefill, 0, { "prompt 3 : 4", "prompt 2 : 20", "gen 0 + 0", "gen 1 + 0" }, 0);
+    ok &= test("prefill priority, drafts",          30, true,  { 0, 1 }, prefill, 5, { "prompt 3 : 4", "prompt 2 : 20", "gen 0 + 4", "gen 1 + 0" }, 0);
+
+    // the prompts that arrived at the same time keep the order of their slots
+    ok &= test("same arrival",                       6, false, {}, { { 1, 7, 4 }, { 0, 7, 4 } }, 0, { "prompt 1 : 4", "prompt 0 : 2" }, 0);
+    ok &= test("idle",                              16, false, {}, {}, 0, {}, 16);
+
+    return ok ? 0 : 1;
+}
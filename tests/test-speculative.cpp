@@ -0,0 +1,170 @@
+#include "llama.h"
+#include "common.h"
+#include "speculative.h"
+#include "test-model.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#if defined(_MSC_VER)
+#pragma warning(disable: 4244 4267) // possible loss of data
+#endif
+
+// greedy generation with speculative decoding, the model being its own draft model: the generated tokens must be the
+// ones generated without speculation, and most of the drafted tokens must be accepted
+
+static struct llama_context * new_context(struct llama_model * model) {
+    struct llama_context_params cparams = llama_context_default_params();
+    cparams.seed            = 1;
+    cparams.n_ctx           = 512;
+    cparams.n_batch         = 512;
+    cparams.n_threads       = 2;
+    cparams.n_threads_batch = 2;
+
+    return llama_new_context_with_model(model, cparams);
+}
+
+static struct llama_sampling_params greedy_params() {
+    struct llama_sampling_params sparams;
+    sparams.temp = 0.0f;
+
+    return sparams;
+}
+
+static std::vector<llama_token> generate_ref(struct llama_model * model, const std::vector<llama_token> & prompt, int n_gen) {
+    struct llama_context * ctx = new_context(model);
+    struct llama_sampling_context * ctx_sampling = llama_sampling_init(greedy_params());
+
+    for (llama_token id : prompt) {
+        llama_sampling_accept(ctx_sampling, ctx, id, false);
+    }
+
+    std::vector<llama_token> embd = prompt;
+    std::vector<llama_token> res;
+
+    int n_past = 0;
+
+    while ((int) res.size() < n_gen) {
+        if (llama_decode(ctx, llama_batch_get_one(embd.data(), embd.size(), n_past, 0)) != 0) {
+            fprintf(stderr, "%s: llama_decode failed\n", __func__);
+            exit(1);
+        }
+        n_past += embd.size();
+
+        const llama_token id = llama_sampling_sample(ctx_sampling, ctx, NULL);
+        llama_sampling_accept(ctx_sampling, ctx, id, true);
+
+        res.push_back(id);
+        embd = { id };
+    }
+
+    llama_sampling_free(ctx_sampling);
+    llama_free(ctx);
+
+    return res;
+}
+
+// the loop of the main example: the generated tokens of a step are sampled one by one
+// n_clear > 0: the first time there are tokens left to sample after n_clear tokens, they are dropped (like when main
+// waits for user input)
+static std::vector<llama_token> generate_spec(struct llama_model * model, const std::vector<llama_token> & prompt, int n_gen, int n_draft, int n_clear,
+        int32_t * n_drafted, int32_t * n_accept, int32_t * n_dropped) {
+    struct llama_context * ctx_tgt = new_context(model);
+    struct llama_context * ctx_dft = new_context(model);
+    struct llama_sampling_context * ctx_sampling = llama_sampling_init(greedy_params());
+
+    for (llama_token id : prompt) {
+        llama_sampling_accept(ctx_sampling, ctx_tgt, id, false);
+    }
+
+    struct llama_speculative_params sparams;
+    sparams.n_draft = n_draft;
+    sparams.p_min   = 0.0f; // the probabilities of the random model are low
+
+    struct llama_speculative * spec = llama_speculative_init(ctx_tgt, ctx_dft, sparams);
+
+    std::vector<llama_token> past;
+    std::vector<llama_token> embd = prompt;
+    std::vector<llama_token> res;
+
+    while ((int) res.size() < n_gen) {
+        if (!llama_speculative_eval(spec, ctx_sampling, past, embd, true)) {
+            fprintf(stderr, "%s: llama_speculative_eval failed\n", __func__);
+            exit(1);
+        }
+        past.insert(past.end(), embd.begin(), embd.end());
+
+        const llama_token id = llama_speculative_sample(spec, ctx_sampling);
+        llama_sampling_accept(ctx_sampling, ctx_tgt, id, true);
+
+        res.push_back(id);
+        embd = { id };
+
+        if (n_clear > 0 && (int) res.size() >= n_clear && *n_dropped == 0 && !spec->queue.empty()) {
+            *n_dropped = spec->queue.size();
+            llama_speculative_clear(spec);
+        }
+    }
+
+    *n_drafted = spec->n_drafted;
+    *n_accept  = spec->n_accept;
+
+    llama_speculative_free(spec);
+    llama_sampling_free(ctx_sampling);
+    llama_free(ctx_dft);
+    llama_free(ctx_tgt);
+
+    return res;
+}
+
+static bool test(struct llama_model * model, const std::vector<llama_token> & prompt, const std::vector<llama_token> & ref, int n_draft, int n_clear) {
+    int32_t n_drafted = 0;
+    int32_t n_accept  = 0;
+    int32_t n_dropped = 0;
+
+    const auto res = generate_spec(model, prompt, ref.size(), n_draft, n_clear, &n_drafted, &n_accept, &n_dropped);
+
+    size_t n_same = 0;
+    while (n_same < ref.size() && res[n_same] == ref[n_same]) {
+        n_same++;
+    }
+
+    // the drafts of the model itself are accepted, apart from ties in the logits
+    const bool ok = n_same == ref.size() && n_accept > 0 && 2*n_accept >= n_drafted && (n_clear <= 0 || n_dropped > 0);
+
+    printf("%s: n_draft = %2d, n_clear = %2d: %zu/%zu tokens as without speculation, %d/%d drafted tokens accepted, %d dropped %s\n",
+            __func__, n_draft, n_clear, n_same, ref.size(), n_accept, n_drafted, n_dropped, ok ? "OK" : "FAILED");
+
+    return ok;
+}
+
+int main(int /*argc*/, const char ** /*argv*/) {
+    llama_backend_init(false);
+
+    struct llama_model * model = test_model_load("test-speculative.gguf");
+    if (model == NULL) {
+        fprintf(stderr, "%s: failed to load the model\n", __func__);
+        return 1;
+    }
+
+    srand(4);
+
+    const auto prompt = test_model_tokens(20);
+    const auto ref    = generate_ref(model, prompt, 64);
+
+    bool ok = true;
+
+    ok &= test(model, prompt, ref,  1, -1);
+    ok &= test(model, prompt, ref,  4, -1);
+    ok &= test(model, prompt, ref, 16, -1);
+
+    // the tokens of a step that are not sampled yet are dropped
+    ok &= test(model, prompt, ref, 16, 10);
+
+    llama_free_model(model);
+
+    llama_backend_free();
+
+    return ok ? 0 : 1;
+}